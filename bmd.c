@@ -18,15 +18,20 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
-#include <pwd.h>
 
 #include "bmd.h"
+#include "boot.h"
+#include "fdbroker.h"
 #include "log.h"
 #include "server.h"
+#include "snapshot.h"
+#include "statetab.h"
+#include "timer.h"
+#include "userdb.h"
 #include "vm.h"
 #include "bmd_plugin.h"
 
-extern SLIST_HEAD(vm_list_t, vm_entry) vm_list;
+extern STAILQ_HEAD(vm_list_t, vm_entry) vm_list;
 extern struct vm_conf_head vm_conf_list;
 
 /*
@@ -37,13 +42,22 @@ struct vm_conf_head vm_conf_list = LIST_HEAD_INITIALIZER();
 /*
   List of virtual machines.
  */
-struct vm_list_t vm_list = SLIST_HEAD_INITIALIZER();
-static SLIST_HEAD(, plugin_entry) plugin_list = SLIST_HEAD_INITIALIZER();
+struct vm_list_t vm_list = STAILQ_HEAD_INITIALIZER(vm_list);
+
+static int
+compare_vm_name(struct vm_entry *a, struct vm_entry *b)
+{
+	return strcmp(VM_CONF(a)->name, VM_CONF(b)->name);
+}
+
+RB_HEAD(vm_name_tree, vm_entry);
+RB_GENERATE_STATIC(vm_name_tree, vm_entry, name_entry, compare_vm_name);
 
 /*
-  All Events
-*/
-static LIST_HEAD(, event) event_list = LIST_HEAD_INITIALIZER();
+  Virtual machines in 'vm_list' indexed by the name.
+ */
+static struct vm_name_tree vm_names = RB_INITIALIZER(&vm_names);
+static SLIST_HEAD(, plugin_entry) plugin_list = SLIST_HEAD_INITIALIZER();
 
 /*
   Global event queue
@@ -51,23 +65,26 @@ static LIST_HEAD(, event) event_list = LIST_HEAD_INITIALIZER();
 static int eventq;
 
 /*
-  Global command socket
+  Events removed while a batch is dispatched.
+  Later entries of the batch may point to them, so they are freed after
+  the batch.
  */
-static int cmd_sock;
+static struct event_head dead_events = LIST_HEAD_INITIALIZER();
+static int dispatching = 0;
 
 /*
-  Last Timer Event ID
+  Global command socket
  */
-static int timer_id = 0;
+static int cmd_sock;
 
 /*
   Received SIGTERM flag
  */
 static int sigterm = 0;
 
-static int reload_virtual_machines(void);
 static void stop_virtual_machine(struct vm_entry *);
 static void free_vm_entry(struct vm_entry *);
+static void remove_vm_entry(struct vm_entry *);
 
 // implemented in control.c
 extern int control(int, char *[]);
@@ -83,80 +100,103 @@ kevent_set(struct kevent *kev, int n)
 	return rc;
 }
 
-static int
-kevent_get(struct kevent *kev, int n, struct timespec *timeout)
+static void
+free_event(struct event *ev)
 {
-	int rc;
-	while ((rc = kevent(eventq, NULL, 0 , kev, n, timeout)) < 0)
-		if (errno != EINTR)
-			return -1;
-	return rc;
+	if (dispatching)
+		LIST_INSERT_HEAD(&dead_events, ev, next);
+	else
+		destroy_event(ev);
 }
 
-static bool
-vm_output(struct event *ev, void *data)
+/*
+  Remove 'ev' from the index and free it with its queued changes.
+  No queued change refers a removed event.
+ */
+static void
+remove_event(struct event *ev)
 {
-	struct kevent *k = &ev->kev;
-	struct vm_entry *e = data;
-
-	return  ev->data == e && k->filter == EVFILT_READ && (
-		(int)k->ident == VM_OUTFD(e) || (int)k->ident == VM_ERRFD(e));
+	event_changes_drop(ev);
+	event_index_remove(ev);
+	free_event(ev);
 }
 
-static bool
-vm_output_and_timers(struct event *ev, void *data)
+/*
+  Called for a kevent change that failed.
+  Deletions carry no udata and their errors are ignored, the fd may be
+  already closed.
+ */
+static void
+on_change_error(struct kevent *kev)
 {
-	struct kevent *k = &ev->kev;
-	struct vm_entry *e = data;
+	struct event *ev;
+
+	if ((ev = kev->udata) == NULL)
+		return;
 
-	return ev->data == e && (
-		k->filter == EVFILT_TIMER ||
-		(k->filter == EVFILT_READ &&
-		 ((int)k->ident == VM_OUTFD(e) || (int)k->ident == VM_ERRFD(e)))
-		);
+	/* Removed by a former callback in this batch. */
+	if (ev->owner == NULL)
+		return;
+
+	ERR("failed to register kevent (ident:%lu filter:%d) (%s)\n",
+	    (unsigned long)kev->ident, kev->filter, strerror((int)kev->data));
+	remove_event(ev);
 }
 
+/*
+  The following functions select events from the ones of the same owner.
+ */
 static bool
-sock_buf(struct event *ev, void *data)
+vm_output(struct event *ev, void *data)
 {
-	return (ev->data == data);
+	struct kevent *k = &ev->kev;
+	struct vm_entry *e = data;
+
+	return k->filter == EVFILT_READ && (
+		(int)k->ident == VM_OUTFD(e) || (int)k->ident == VM_ERRFD(e));
 }
 
-/*
- * The 'vm_entry' function should be an alias for 'sock_buf'. But It's hard to
- * be replaced by #define. Because the 'vm_entry' key word is widely used in
- * this source.
- */
 static bool
-vm_entry(struct event *ev, void *data)
+all_events(struct event *ev __unused, void *data __unused)
 {
-	return (ev->data == data);
+	return true;
 }
 
 static void
 stop_waiting_for(bool (*fn)(struct event *, void *), void *data)
 {
-	int i = 0;
 	struct event *ev, *evn;
-	struct kevent kev[5];
+	struct event_head *head;
+	struct kevent kev;
+
+	if ((head = event_index_owner(data)) == NULL)
+		return;
 
-	LIST_FOREACH_SAFE (ev, &event_list, next, evn) {
+	/* 'head' is freed with the last event, don't touch it in the loop. */
+	LIST_FOREACH_SAFE (ev, head, next, evn) {
 		if (!fn(ev, data))
 			continue;
-		kev[i] = ev->kev;
-		kev[i].flags = EV_DELETE;
-		i++;
-		if (i >= (int)nitems(kev)) {
-			if (kevent_set(kev, i) < 0)
-				ERR("failed to remove kevent (%s)\n",
-				    strerror(errno));
-			i = 0;
-		}
-		LIST_REMOVE(ev, next);
-		free(ev);
+		kev = ev->kev;
+		kev.flags = EV_DELETE;
+		kev.udata = NULL;
+		remove_event(ev);
+		event_changes_queue(&kev, 1);
 	}
-	if (i > 0 && kevent_set(kev, i) < 0)
-		ERR("failed to remove kevent (%s)\n", strerror(errno));
+}
+
+/*
+  Add an event to the index.
+  kqueue replaces an event of the same ident & filter by the new one.
+ */
+static int
+index_event(struct event *ev)
+{
+	struct event *old;
+
+	if ((old = event_index_lookup(ev->kev.ident, ev->kev.filter)))
+		remove_event(old);
+
+	return event_index_add(ev);
 }
 
 static int
@@ -165,7 +205,7 @@ register_event0(enum EVENT_TYPE type, struct kevent *kev, event_call_back cb,
 {
 	struct event *ev;
 
-	if ((ev = malloc(sizeof(*ev))) == NULL)
+	if ((ev = create_event()) == NULL)
 		return -1;
 
 	kev->udata = ev;
@@ -174,12 +214,12 @@ register_event0(enum EVENT_TYPE type, struct kevent *kev, event_call_back cb,
 	ev->cb = cb;
 	ev->data = data;
 
-	if (kevent_set(kev, 1) < 0) {
-		free(ev);
+	if (index_event(ev) < 0) {
+		destroy_event(ev);
 		return -1;
 	}
 
-	LIST_INSERT_HEAD(&event_list, ev, next);
+	event_changes_queue(kev, 1);
 	return 0;
 }
 
@@ -193,7 +233,7 @@ register_events(struct kevent *kev, event_call_back *cb, void **data, int n)
 	struct event *ev[n];
 
 	for (i = 0; i < n; i++)
-		ev[i] = malloc(sizeof(struct event));
+		ev[i] = create_event();
 
 	for (i = 0; i < n; i++) {
 		if (ev[i] == NULL)
@@ -205,16 +245,18 @@ register_events(struct kevent *kev, event_call_back *cb, void **data, int n)
 		ev[i]->data = data[i];
 	}
 
-	if (kevent_set(kev, n) < 0)
-		goto err;
-
 	for (i = 0; i < n; i++)
-		LIST_INSERT_HEAD(&event_list, ev[i], next);
+		if (index_event(ev[i]) < 0)
+			goto err2;
 
+	event_changes_queue(kev, n);
 	return 0;
+err2:
+	while (--i >= 0)
+		event_index_remove(ev[i]);
 err:
 	for (i = 0; i < n; i++)
-		free(ev[i]);
+		destroy_event(ev[i]);
 	return -1;
 }
 
@@ -236,12 +278,7 @@ plugin_wait_for_process(pid_t pid, plugin_call_back cb, void *data)
 int
 plugin_set_timer(int second, plugin_call_back cb, void *data)
 {
-	struct kevent kev;
-
-	EV_SET(&kev, ++timer_id, EVFILT_TIMER,
-	       EV_ADD | EV_ONESHOT, NOTE_SECONDS, second, NULL);
-
-	if (register_plugin_event(&kev, cb, data) < 0) {
+	if (add_timer((int64_t)second * 1000, cb, data) < 0) {
 		ERR("failed to plugin set timer (%s)\n", strerror(errno));
 		return -1;
 	}
@@ -249,234 +286,361 @@ plugin_set_timer(int second, plugin_call_back cb, void *data)
 }
 
 static int
-send_fd(int sock, int fd)
+on_read_vm_output(int fd, void *data)
 {
-	int rc;
-	struct msghdr msg;
-	struct cmsghdr *cmsg;
-	struct iovec iov;
-	char result;
-
-	result = fd < 0 ? 0 : 1;
-	memset(&msg, 0, sizeof(msg));
-	iov.iov_base = &result;
-	iov.iov_len = sizeof(result);
-
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-	if (result) {
-		msg.msg_controllen = CMSG_SPACE(sizeof(int));
-		msg.msg_control = calloc(1, msg.msg_controllen);
-		if (msg.msg_control == NULL)
-			return -1;
+	struct vm_entry *vm_ent = data;
+	struct event *ev;
 
-		cmsg = msg.msg_control;
-		cmsg->cmsg_level = SOL_SOCKET;
-		cmsg->cmsg_type = SCM_RIGHTS;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
-		memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	if (write_err_log(fd, VM_PTR(vm_ent)) == 0 &&
+	    (ev = event_index_lookup(fd, EVFILT_READ)) != NULL &&
+	    ev->data == vm_ent) {
+		/*
+		 * No need to remove fd from kqueue.
+		 * It's already closed.
+		 */
+		remove_event(ev);
 	}
-
-	while ((rc = sendmsg(sock, &msg, 0)) < 0)
-		if (errno != EINTR && errno != EAGAIN)
-			break;
-	if (result)
-		free(msg.msg_control);
-	return rc;
+	return 0;
 }
 
 static int
-recv_fd(int sock)
-{
-	int rc, fd;
-	struct msghdr msg;
-	struct cmsghdr *cmsg;
-	struct iovec iov;
-	char result = 0;
-
-	memset(&msg, 0, sizeof(msg));
-	memset(&iov, 0, sizeof(iov));
-	iov.iov_base = &result;
-	iov.iov_len = sizeof(result);
-
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-	msg.msg_controllen = CMSG_SPACE(sizeof(int));
-	msg.msg_control = calloc(1, msg.msg_controllen);
-	if (msg.msg_control == NULL)
-		return -1;
-
-	while ((rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0)
-		if (errno != EINTR && errno != EAGAIN)
-			break;
+wait_for_vm_output(struct vm_entry *vm_ent)
+{
+	int i = 0;
+	struct kevent kev[2];
+	static event_call_back cb[2] = {on_read_vm_output, on_read_vm_output};
+	void *data[2];
 
-	if (rc < 0 || result == 0)
-		goto err;
+	if (VM_OUTFD(vm_ent) != -1) {
+		EV_SET(&kev[i], VM_OUTFD(vm_ent), EVFILT_READ, EV_ADD, 0, 0,
+		       NULL);
+		data[i] = vm_ent;
+		i++;
+	}
+	if (VM_ERRFD(vm_ent) != -1) {
+		EV_SET(&kev[i], VM_ERRFD(vm_ent), EVFILT_READ, EV_ADD, 0, 0,
+		       NULL);
+		data[i] = vm_ent;
+		i++;
+	}
 
-	cmsg = CMSG_FIRSTHDR(&msg);
-	if (cmsg->cmsg_level != SOL_SOCKET ||
-	    cmsg->cmsg_type != SCM_RIGHTS)
-		goto err;
+	if (register_events(kev, cb, data, i) < 0) {
+		ERR("failed to wait vm fds (%s)\n", strerror(errno));
+		return -1;
+	}
 
-	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return 0;
+}
 
-	free(msg.msg_control);
-	return fd;
-err:
-	free(msg.msg_control);
-	return -1;
+static bool
+fd_broker_event(struct event *ev, void *data __unused)
+{
+	return (int)ev->kev.ident == fd_broker_sock();
+}
 
+static void
+close_fd_broker(void)
+{
+	stop_waiting_for(fd_broker_event, NULL);
+	stop_fd_broker();
 }
 
+static int on_send_fd_broker(int, void *);
+
 static int
-send_ack(int sock)
+flush_fd_broker(void)
 {
 	int rc;
-	static const char *buf = "ack";
+	struct kevent kev;
 
-	while ((rc = send(sock, buf, strlen(buf) + 1, 0)) < 0)
-		if (errno != EINTR && errno != EAGAIN)
-			break;
+	if ((rc = send_fd_requests()) <= 0)
+		return rc;
 
-	return rc;
+	/* the broker is busy, send the rest when it gets writable */
+	EV_SET(&kev, fd_broker_sock(), EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0,
+	       0, NULL);
+	if (register_event(&kev, on_send_fd_broker, NULL) < 0)
+		return -1;
+	return 0;
 }
 
 static int
-recv_ack(int sock)
+on_send_fd_broker(int ident __unused, void *data __unused)
 {
-	int rc;
-	char buf[8];
-
-	while ((rc = recv(sock, buf, sizeof(buf), 0)) < 0)
-		if (errno != EINTR && errno != EAGAIN)
-			break;
+	if (flush_fd_broker() < 0) {
+		ERR("failed to send requests to fd broker (%s)\n",
+		    strerror(errno));
+		close_fd_broker();
+		return -1;
+	}
+	return 0;
+}
 
-	return rc;
+static int
+on_recv_fd_broker(int ident __unused, void *data __unused)
+{
+	if (recv_fd_replies() < 0) {
+		ERR("%s\n", "fd broker is closed");
+		close_fd_broker();
+		return -1;
+	}
+	return 0;
 }
 
 static int
-open_err_logfile(struct vm_conf *conf)
+wait_for_fd_broker(void)
 {
-	int fd;
-	pid_t pid;
-	int socks[2];
-	struct stat st;
-	int64_t group;
-	struct passwd *pwd;
+	int sock;
+	struct kevent kev;
 
-	if (socketpair(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socks) < 0)
+	if ((sock = start_fd_broker()) < 0) {
+		ERR("cannot start fd broker (%s)\n", strerror(errno));
 		return -1;
+	}
+	if (event_index_lookup(sock, EVFILT_READ) != NULL)
+		return 0;
 
-	if ((pid = fork()) < 0) {
-		close(socks[0]);
-		close(socks[1]);
+	EV_SET(&kev, sock, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	if (register_event(&kev, on_recv_fd_broker, NULL) < 0) {
+		ERR("failed to wait fd broker (%s)\n", strerror(errno));
 		return -1;
 	}
+	return 0;
+}
 
-	if (pid == 0) {
-		close(socks[0]);
-		if (conf->owner > 0) {
-			if ((group = conf->group) == -1)
-				group = (pwd = getpwuid((uid_t)conf->owner)) ?
-					pwd->pw_gid : GID_NOBODY;
+/*
+  Called back with the err_logfile opened for a starting VM.
+  Its output has been left in the pipes until now.
+ */
+static void
+on_open_err_logfile(int fd, void *data)
+{
+	struct vm_entry *vm_ent = data;
 
-			setgid((gid_t)group);
-			setuid((uid_t)conf->owner);
-		}
+	VM_LOGREQ(vm_ent) = NULL;
+	if (fd < 0)
+		ERR("%s: failed to open %s\n", VM_CONF(vm_ent)->name,
+		    VM_CONF(vm_ent)->err_logfile);
+	VM_LOGFD(vm_ent) = fd;
+	if (wait_for_vm_output(vm_ent) < 0) {
+		ERR("failed to set kevent for vm %s\n", VM_CONF(vm_ent)->name);
+		VM_POWEROFF(vm_ent);
+	}
+}
 
-		while ((fd = open(conf->err_logfile,
-				  O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
-				  0644)) < 0)
-			if (errno != EINTR)
-				break;
+/*
+  Called back with the err_logfile reopened on reload.
+  The old one is used until now.
+ */
+static void
+on_reopen_err_logfile(int fd, void *data)
+{
+	struct vm_entry *vm_ent = data;
 
-		if (fd >= 0 &&
-		    (fstat(fd, &st) < 0 || (! S_ISREG(st.st_mode)))) {
-			close(fd);
-			fd = -1;
-		}
+	VM_LOGREQ(vm_ent) = NULL;
+	if (fd < 0)
+		ERR("%s: failed to open %s\n", VM_CONF(vm_ent)->name,
+		    VM_CONF(vm_ent)->err_logfile);
+	VM_CLOSE(vm_ent, LOGFD);
+	VM_LOGFD(vm_ent) = fd;
+}
 
-		send_fd(socks[1], fd);
-		recv_ack(socks[1]);
-		close(socks[1]);
-		exit(0);
+/*
+  Ask the fd broker to open the err_logfile with the owner's privileges.
+  'cb' is called back when it's opened.
+ */
+static int
+open_err_logfile(struct vm_entry *vm_ent, struct vm_conf *conf,
+    fd_call_back cb)
+{
+	uid_t uid = 0;
+	gid_t gid = 0;
+
+	if (conf->owner > 0) {
+		uid = (uid_t)conf->owner;
+		if (conf->group != -1)
+			gid = (gid_t)conf->group;
+		else if (lookup_user_name(uid, &gid) == NULL)
+			gid = GID_NOBODY;
 	}
 
-	close(socks[1]);
+	cancel_fd_req(VM_LOGREQ(vm_ent));
+	VM_LOGREQ(vm_ent) = NULL;
+	if (wait_for_fd_broker() < 0)
+		return -1;
 
-	fd = recv_fd(socks[0]);
-	send_ack(socks[0]);
-	while (waitpid(pid, NULL, 0) < 0)
-		if (errno != EINTR)
-			break;
+	if ((VM_LOGREQ(vm_ent) = request_open_file(uid, gid, conf->err_logfile,
+		 O_WRONLY | O_APPEND | O_CREAT, 0644, cb, vm_ent)) == NULL) {
+		ERR("%s: failed to open %s (%s)\n", conf->name,
+		    conf->err_logfile, strerror(errno));
+		return -1;
+	}
 
-	close(socks[0]);
-	if (fd < 0)
-		ERR("%s: failed to open %s\n", conf->name, conf->err_logfile);
-	return fd;
+	if (flush_fd_broker() < 0) {
+		ERR("failed to send requests to fd broker (%s)\n",
+		    strerror(errno));
+		close_fd_broker();
+		return -1;
+	}
+	return 0;
 }
 
+/*
+  Start the VM dequeued by the boot scheduler.
+ */
 static int
-on_read_vm_output(int fd, void *data)
+on_boot(void *data)
 {
 	struct vm_entry *vm_ent = data;
-	struct event *ev, *evn;
-	struct kevent *kev;
 
-	if (write_err_log(fd, VM_PTR(vm_ent)) == 0) {
-		LIST_FOREACH_SAFE (ev, &event_list, next, evn) {
-			kev = &ev->kev;
-			if (ev->data != vm_ent || (int)kev->ident != fd ||
-			    kev->filter != EVFILT_READ)
-				continue;
-			/*
-			 * No need to remove fd from kqueue.
-			 * It's already closed.
-			 */
-			LIST_REMOVE(ev, next);
-			free(ev);
-		}
+	if (VM_STATE(vm_ent) != TERMINATE)
+		return 0;
+	if (start_virtual_machine(vm_ent) < 0)
+		return -1;
+	return (VM_STATE(vm_ent) == LOAD) ? 1 : 0;
+}
+
+/*
+  Returns true if the VM is ready for the VMs depending on it.
+ */
+static bool
+is_vm_ready(struct vm_entry *vm_ent)
+{
+	return VM_STATE(vm_ent) == RUN &&
+	    (VM_CONF(vm_ent)->ready_signal == false || VM_READY(vm_ent));
+}
+
+static bool
+depends_satisfied(struct vm_entry *vm_ent)
+{
+	struct depend_conf *dc;
+	struct vm_entry *dep;
+
+	STAILQ_FOREACH (dc, &VM_CONF(vm_ent)->depends, next)
+		if ((dep = lookup_vm_by_name(dc->name)) != NULL &&
+		    ! is_vm_ready(dep))
+			return false;
+	return true;
+}
+
+/*
+  Returns the first dependency of the VM that is not booted by bmd.
+ */
+static struct vm_entry *
+get_manual_depend(struct vm_entry *vm_ent)
+{
+	struct depend_conf *dc;
+	struct vm_entry *dep;
+
+	STAILQ_FOREACH (dc, &VM_CONF(vm_ent)->depends, next)
+		if ((dep = lookup_vm_by_name(dc->name)) != NULL &&
+		    VM_CONF(dep)->boot == NO && ! is_vm_ready(dep))
+			return dep;
+	return NULL;
+}
+
+/*
+  Count the running VMs depending on each VM. The VMs are released by
+  release_depends() when they are terminated.
+ */
+static void
+count_required(void)
+{
+	struct vm_entry *vm_ent, *dep;
+	struct depend_conf *dc;
+
+	STAILQ_FOREACH (vm_ent, &vm_list, next)
+		VM_NREQUIRED(vm_ent) = 0;
+	STAILQ_FOREACH (vm_ent, &vm_list, next) {
+		if (VM_STATE(vm_ent) == TERMINATE)
+			continue;
+		VM_REQUIRING(vm_ent) = true;
+		STAILQ_FOREACH (dc, &VM_CONF(vm_ent)->depends, next)
+			if ((dep = lookup_vm_by_name(dc->name)) != NULL &&
+			    dep != vm_ent)
+				VM_NREQUIRED(dep)++;
 	}
-	return 0;
 }
 
+static void
+release_depends(struct vm_entry *vm_ent)
+{
+	struct vm_entry *dep;
+	struct depend_conf *dc;
+
+	if (! VM_REQUIRING(vm_ent))
+		return;
+	VM_REQUIRING(vm_ent) = false;
+	STAILQ_FOREACH (dc, &VM_CONF(vm_ent)->depends, next)
+		if ((dep = lookup_vm_by_name(dc->name)) != NULL &&
+		    dep != vm_ent)
+			VM_NREQUIRED(dep)--;
+}
+
+/*
+  Queue the VM to boot. It's started by the boot scheduler within
+  boot_concurrency and boot_rate after its dependencies are ready.
+ */
 static int
-wait_for_vm_output(struct vm_entry *vm_ent)
+schedule_boot(struct vm_entry *vm_ent)
 {
-	int i = 0;
-	struct kevent kev[2];
-	static event_call_back cb[2] = {on_read_vm_output, on_read_vm_output};
-	void *data[2];
+	struct vm_entry *dep;
 
-	if (VM_OUTFD(vm_ent) != -1) {
-		EV_SET(&kev[i], VM_OUTFD(vm_ent), EVFILT_READ, EV_ADD, 0, 0,
-		       NULL);
-		data[i] = vm_ent;
-		i++;
-	}
-	if (VM_ERRFD(vm_ent) != -1) {
-		EV_SET(&kev[i], VM_ERRFD(vm_ent), EVFILT_READ, EV_ADD, 0, 0,
-		       NULL);
-		data[i] = vm_ent;
-		i++;
+	if (! depends_satisfied(vm_ent)) {
+		if (VM_WAITING(vm_ent))
+			return 0;
+		if ((dep = get_manual_depend(vm_ent)) != NULL)
+			ERR("vm %s waits for %s that is not booted "
+			    "automatically\n",
+			    VM_CONF(vm_ent)->name, VM_CONF(dep)->name);
+		else
+			INFO("vm %s waits for its dependencies\n",
+			     VM_CONF(vm_ent)->name);
+		VM_WAITING(vm_ent) = true;
+		return 0;
 	}
+	VM_WAITING(vm_ent) = false;
 
-	if (register_events(kev, cb, data, i) < 0) {
-		ERR("failed to wait vm fds (%s)\n", strerror(errno));
+	if (VM_BOOT(vm_ent) == NULL &&
+	    (VM_BOOT(vm_ent) = create_boot_req(vm_ent)) == NULL) {
+		ERR("%s\n", "failed to create boot request");
 		return -1;
 	}
 
-	return 0;
+	return enqueue_boot(VM_BOOT(vm_ent), VM_CONF(vm_ent)->boot_priority);
 }
 
 static void
-free_events(void)
+cancel_boot(struct vm_entry *vm_ent)
 {
-	struct event *ev, *evn;
+	VM_WAITING(vm_ent) = false;
+	dequeue_boot(VM_BOOT(vm_ent));
+}
+
+/*
+  Queue the waiting VMs whose dependencies got ready.
+ */
+static void
+schedule_waiting_vms(void)
+{
+	struct vm_entry *vm_ent;
+
+	STAILQ_FOREACH (vm_ent, &vm_list, next)
+		if (VM_WAITING(vm_ent) && depends_satisfied(vm_ent))
+			schedule_boot(vm_ent);
+}
 
-	LIST_FOREACH_SAFE (ev, &event_list, next, evn)
-		free(ev);
-	LIST_INIT(&event_list);
+/*
+  Readiness signal of the VM configured with ready_signal.
+ */
+void
+set_vm_ready(struct vm_entry *vm_ent)
+{
+	if (VM_READY(vm_ent))
+		return;
+	VM_READY(vm_ent) = true;
+	INFO("vm %s is ready\n", VM_CONF(vm_ent)->name);
+	schedule_waiting_vms();
 }
 
 static int
@@ -487,7 +651,7 @@ on_timer(int ident __unused, void *data)
 	switch (VM_STATE(vm_ent)) {
 	case TERMINATE:
 		/* delayed boot */
-		start_virtual_machine(vm_ent);
+		schedule_boot(vm_ent);
 		break;
 	case LOAD:
 	case STOP:
@@ -506,23 +670,83 @@ on_timer(int ident __unused, void *data)
 }
 
 /*
- * Set event timer.
+ * Set the timer of the VM. A pending one is rescheduled.
  */
 int
 set_timer(struct vm_entry *vm_ent, int second)
 {
-	struct kevent kev;
-
-	EV_SET(&kev, ++timer_id, EVFILT_TIMER,
-	       EV_ADD | EV_ONESHOT, NOTE_SECONDS, second, NULL);
+	if (VM_TIMER(vm_ent) == NULL &&
+	    (VM_TIMER(vm_ent) = create_timer(on_timer, vm_ent)) == NULL) {
+		ERR("%s\n", "failed to create timer");
+		return -1;
+	}
 
-	if (register_event(&kev, on_timer, vm_ent) < 0) {
+	if (schedule_timer(VM_TIMER(vm_ent), (int64_t)second * 1000) < 0) {
 		ERR("failed to set timer (%s)\n", strerror(errno));
 		return -1;
 	}
 	return 0;
 }
 
+/*
+  Ident of the kqueue timer that drives all timers.
+ */
+#define TIMER_IDENT 0
+
+/*
+  Expire time that the kqueue timer is armed for, 0 if not armed.
+ */
+static uint64_t armed_expire = 0;
+
+static int
+on_timer_expire(int ident __unused, void *data __unused)
+{
+	run_timers();
+	return 0;
+}
+
+static bool
+timer_event(struct event *ev, void *data __unused)
+{
+	return ev->kev.filter == EVFILT_TIMER && ev->kev.ident == TIMER_IDENT;
+}
+
+/*
+  Arm the kqueue timer for the first expiring timer.
+  It's changed only if the first timer is changed.
+  The change is submitted with the next harvest.
+ */
+static void
+arm_timer(void)
+{
+	uint64_t expire;
+	int64_t msec;
+	struct kevent kev;
+
+	/* Fired or failed to register. */
+	if (event_index_lookup(TIMER_IDENT, EVFILT_TIMER) == NULL)
+		armed_expire = 0;
+
+	if ((expire = first_timer_expire()) == armed_expire)
+		return;
+
+	if (expire == 0) {
+		stop_waiting_for(timer_event, NULL);
+		armed_expire = 0;
+		return;
+	}
+
+	msec = next_timer_expire();
+	EV_SET(&kev, TIMER_IDENT, EVFILT_TIMER, EV_ADD | EV_ONESHOT,
+	       NOTE_MSECONDS, MAX(msec, 1), NULL);
+
+	if (register_event(&kev, on_timer_expire, NULL) < 0) {
+		ERR("failed to arm timer (%s)\n", strerror(errno));
+		return;
+	}
+	armed_expire = expire;
+}
+
 static char *
 reason_string(int status)
 {
@@ -549,6 +773,7 @@ on_vm_exit(int ident __unused, void *data)
 
 	if (waitpid(VM_PID(vm_ent), &status, 0) < 0)
 		ERR("wait error (%s)\n", strerror(errno));
+	notify_vm_exit(vm_ent, status);
 	switch (VM_STATE(vm_ent)) {
 	case LOAD:
 		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
@@ -563,7 +788,7 @@ on_vm_exit(int ident __unused, void *data)
 		break;
 	case RESTART:
 		stop_virtual_machine(vm_ent);
-		VM_STATE(vm_ent) = TERMINATE;
+		set_vm_state(vm_ent, TERMINATE);
 		set_timer(vm_ent, MAX(VM_CONF(vm_ent)->boot_delay, 3));
 		break;
 	case RUN:
@@ -587,7 +812,7 @@ on_vm_exit(int ident __unused, void *data)
 	case REMOVE:
 		INFO("vm %s is stopped\n", VM_CONF(vm_ent)->name);
 		stop_virtual_machine(vm_ent);
-		SLIST_REMOVE(&vm_list, vm_ent, vm_entry, next);
+		remove_vm_entry(vm_ent);
 		free_vm_entry(vm_ent);
 		break;
 	case TERMINATE:
@@ -613,16 +838,18 @@ wait_for_vm(struct vm_entry *vm_ent)
 	return 0;
 }
 
-static int
+int
 set_sock_buf_wait_flags(struct sock_buf *sb, short recv_f, short send_f)
 {
 	int i = 0;
 	struct event *e, *ev[2] = {NULL, NULL};
+	struct event_head *head;
 	struct kevent kev[2];
 
-	LIST_FOREACH (e, &event_list, next) {
-		if (e->data != sb)
-			continue;
+	if ((head = event_index_owner(sb)) == NULL)
+		return 0;
+
+	LIST_FOREACH (e, head, next) {
 		switch (e->kev.filter) {
 		case EVFILT_READ:
 			ev[0] = e;
@@ -646,11 +873,7 @@ set_sock_buf_wait_flags(struct sock_buf *sb, short recv_f, short send_f)
 	if (i == 0)
 		return 0;
 
-	if (kevent_set(kev, i) < 0) {
-		ERR("failed to change cmd socket event (%s)\n",
-		    strerror(errno));
-		return -1;
-	}
+	event_changes_queue(kev, i);
 
 	if (ev[0])
 		ev[0]->kev.flags =  recv_f;
@@ -666,6 +889,13 @@ on_recv_sock_buf(int ident __unused, void *data)
 {
 	struct sock_buf *sb = data;
 
+	/* subscribers send no more commands, it's closed or broken */
+	if (sb->sub != NULL) {
+		stop_waiting_for(all_events, sb);
+		destroy_sock_buf(sb);
+		return 0;
+	}
+
 	switch (recv_sock_buf(sb)) {
 	case 2:
 		if (recv_command(sb) == 0) {
@@ -673,11 +903,14 @@ on_recv_sock_buf(int ident __unused, void *data)
 			set_sock_buf_wait_flags(sb, EV_DISABLE, EV_ENABLE);
 			break;
 		}
-		/* FALLTHROUGH */
+		/* no response to send */
+		stop_waiting_for(all_events, sb);
+		destroy_sock_buf(sb);
+		break;
 	case 1:
 		break;
 	default:
-		stop_waiting_for(sock_buf, sb);
+		stop_waiting_for(all_events, sb);
 		destroy_sock_buf(sb);
 	}
 	return 0;
@@ -691,18 +924,37 @@ on_send_sock_buf(int ident __unused, void *data)
 	switch (send_sock_buf(sb)) {
 	case 2:
 		clear_send_sock_buf(sb);
-		set_sock_buf_wait_flags(sb,  EV_ENABLE, EV_DISABLE);
+		switch (next_sock_buf_event(sb)) {
+		case 1:
+			break;
+		case 0:
+			set_sock_buf_wait_flags(sb, EV_ENABLE, EV_DISABLE);
+			break;
+		default:
+			stop_waiting_for(all_events, sb);
+			destroy_sock_buf(sb);
+		}
 		/* FALLTHROUGH */
 	case 1:
 		break;
 	default:
-		stop_waiting_for(sock_buf, sb);
+		stop_waiting_for(all_events, sb);
 		destroy_sock_buf(sb);
 		break;
 	}
 	return 0;
 }
 
+static int
+on_sock_buf_timeout(int ident __unused, void *data)
+{
+	struct sock_buf *sb = data;
+
+	stop_waiting_for(all_events, sb);
+	destroy_sock_buf(sb);
+	return 0;
+}
+
 static int
 wait_for_sock_buf(struct sock_buf *sb)
 {
@@ -710,6 +962,12 @@ wait_for_sock_buf(struct sock_buf *sb)
 	static event_call_back cb[2] = {on_recv_sock_buf, on_send_sock_buf};
 	void *data[2] = {sb, sb};
 
+	if ((sb->timer = create_timer(on_sock_buf_timeout, sb)) == NULL ||
+	    schedule_timer(sb->timer, COMMAND_TIMEOUT_SEC * 1000) < 0) {
+		ERR("%s\n", "failed to set socket buffer timer");
+		return -1;
+	}
+
 	EV_SET(&kev[0], sb->fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
 	EV_SET(&kev[1], sb->fd, EVFILT_WRITE, EV_ADD, EV_DISABLE, 0, NULL);
 
@@ -857,11 +1115,52 @@ remove_plugins(void)
 	return 0;
 }
 
+/*
+  Generation of the states and configurations of the VMs.
+  It's bumped by notify_vm_change() on every change.
+ */
+uint64_t vm_generation = 0;
+
+/*
+  Called when the state or the configuration of 'vm_ent' is changed,
+  including its creation and removal.
+ */
+void
+notify_vm_change(struct vm_entry *vm_ent, enum VM_EVENT type)
+{
+	vm_generation++;
+	update_state_table(vm_ent, type, 0);
+	publish_vm_event(vm_ent, type, 0);
+}
+
+/*
+  Called when the process of 'vm_ent' is exited with 'status', before
+  the state is changed.
+ */
+void
+notify_vm_exit(struct vm_entry *vm_ent, int status)
+{
+	update_state_table(vm_ent, VM_EVENT_EXIT, status);
+	publish_vm_event(vm_ent, VM_EVENT_EXIT, status);
+}
+
+/*
+  Change the state of 'vm_ent' and notify it.
+ */
+void
+set_vm_state(struct vm_entry *vm_ent, enum STATE state)
+{
+	VM_STATE(vm_ent) = state;
+	notify_vm_change(vm_ent, VM_EVENT_STATE);
+}
+
 void
 call_plugins(struct vm_entry *vm_ent)
 {
 	struct plugin_data *pd;
 
+	notify_vm_change(vm_ent, VM_EVENT_STATE);
+
 	SLIST_FOREACH (pd, &VM_PLUGIN_DATA(vm_ent), next)
 		if (pd->ent->desc.on_status_change)
 			(pd->ent->desc.on_status_change)(VM_PTR(vm_ent),
@@ -893,7 +1192,10 @@ free_vm_entry(struct vm_entry *vm_ent)
 	  Basically no events are left on this timing.
 	  Delete & free them for safty.
 	*/
-	stop_waiting_for(vm_entry, vm_ent);
+	stop_waiting_for(all_events, vm_ent);
+	destroy_timer(VM_TIMER(vm_ent));
+	destroy_boot_req(VM_BOOT(vm_ent));
+	cancel_fd_req(VM_LOGREQ(vm_ent));
 	free(VM_MAPFILE(vm_ent));
 	free(VM_VARSFILE(vm_ent));
 	free(VM_ASCOMPORT(vm_ent));
@@ -906,9 +1208,10 @@ free_vm_list(void)
 {
 	struct vm_entry *vm_ent, *vmn;
 
-	SLIST_FOREACH_SAFE (vm_ent, &vm_list, next, vmn)
+	STAILQ_FOREACH_SAFE (vm_ent, &vm_list, next, vmn)
 		free_vm_entry(vm_ent);
-	SLIST_INIT(&vm_list);
+	STAILQ_INIT(&vm_list);
+	RB_INIT(&vm_names);
 }
 
 void
@@ -975,7 +1278,7 @@ set_vm_method(struct vm_entry *vm_ent, struct vm_conf_entry *conf_ent)
 }
 
 int
-vm_method_exists(char *name)
+vm_method_exists(const char *name)
 {
 	struct plugin_entry *pl_ent;
 	struct vm_method *m;
@@ -994,11 +1297,17 @@ create_vm_entry(struct vm_conf_entry *conf_ent)
 
 	if ((vm_ent = calloc(1, sizeof(struct vm_entry))) == NULL)
 		return NULL;
+	VM_CONF(vm_ent) = &conf_ent->conf;
 	if (set_vm_method(vm_ent, conf_ent) < 0) {
 		free(vm_ent);
 		return NULL;
 	}
-	VM_CONF(vm_ent) = &conf_ent->conf;
+	if (RB_INSERT(vm_name_tree, &vm_names, vm_ent) != NULL) {
+		ERR("vm %s already exists\n", conf_ent->conf.name);
+		free(vm_ent);
+		return NULL;
+	}
+	/* the initial state is notified by VM_EVENT_CREATE */
 	VM_STATE(vm_ent) = TERMINATE;
 	VM_PID(vm_ent) = -1;
 	VM_INFD(vm_ent) = -1;
@@ -1006,11 +1315,24 @@ create_vm_entry(struct vm_conf_entry *conf_ent)
 	VM_ERRFD(vm_ent) = -1;
 	VM_LOGFD(vm_ent) = -1;
 	STAILQ_INIT(VM_TAPS(vm_ent));
-	SLIST_INSERT_HEAD(&vm_list, vm_ent, next);
+	STAILQ_INSERT_TAIL(&vm_list, vm_ent, next);
+	notify_vm_change(vm_ent, VM_EVENT_CREATE);
 
 	return vm_ent;
 }
 
+/*
+  Remove the VM from 'vm_list' and the name index.
+ */
+static void
+remove_vm_entry(struct vm_entry *vm_ent)
+{
+	release_depends(vm_ent);
+	RB_REMOVE(vm_name_tree, &vm_names, vm_ent);
+	STAILQ_REMOVE(&vm_list, vm_ent, vm_entry, next);
+	notify_vm_change(vm_ent, VM_EVENT_REMOVE);
+}
+
 static int
 nmdm_selector(const struct dirent *e)
 {
@@ -1058,7 +1380,7 @@ assign_comport(struct vm_entry *vm_ent)
 		return (VM_ASCOMPORT(vm_ent) = strdup(conf->comport)) ? 0 : -1;
 
 	/* Get maximum nmdm number of all VMs. */
-	SLIST_FOREACH (e, &vm_list, next) {
+	STAILQ_FOREACH (e, &vm_list, next) {
 		max = MAX(get_nmdm_number(VM_CONF(e)->comport), max);
 		max = MAX(get_nmdm_number(VM_ASCOMPORT(e)), max);
 	}
@@ -1093,6 +1415,8 @@ assign_comport(struct vm_entry *vm_ent)
 static void
 cleanup_virtual_machine(struct vm_entry *vm_ent)
 {
+	cancel_fd_req(VM_LOGREQ(vm_ent));
+	VM_LOGREQ(vm_ent) = NULL;
 	remove_taps(VM_PTR(vm_ent));
 	VM_CLEANUP(vm_ent);
 }
@@ -1103,6 +1427,7 @@ start_virtual_machine(struct vm_entry *vm_ent)
 	struct vm_conf *conf = VM_CONF(vm_ent);
 	char *name = conf->name;
 
+	cancel_boot(vm_ent);
 	if (set_vm_method(vm_ent, VM_CONF_ENT(vm_ent)) < 0) {
 		ERR("failed to set vm method for vm %s\n", name);
 		return -1;
@@ -1128,7 +1453,17 @@ start_virtual_machine(struct vm_entry *vm_ent)
 		return -1;
 	}
 
-	if (wait_for_vm(vm_ent) < 0 || wait_for_vm_output(vm_ent) < 0) {
+	if (conf->err_logfile && VM_LOGFD(vm_ent) == -1 &&
+	    VM_LOGREQ(vm_ent) == NULL)
+		open_err_logfile(vm_ent, conf, on_open_err_logfile);
+
+	/*
+	  While the err_logfile is being opened, the output is left in the
+	  pipes. on_open_err_logfile() starts to wait for it.
+	 */
+	if (wait_for_vm(vm_ent) < 0 ||
+	    ((VM_LOGFD(vm_ent) != -1 || VM_LOGREQ(vm_ent) == NULL) &&
+	     wait_for_vm_output(vm_ent) < 0)) {
 		ERR("failed to set kevent for vm %s\n", name);
 		/*
 		 * Force to kill bhyve.
@@ -1140,8 +1475,14 @@ start_virtual_machine(struct vm_entry *vm_ent)
 		return -1;
 	}
 
-	if (VM_STATE(vm_ent) == RUN)
+	if (VM_STATE(vm_ent) == RUN) {
+		/* loader timeout or boot delay is no longer needed */
+		cancel_timer(VM_TIMER(vm_ent));
+		boot_finished(VM_BOOT(vm_ent));
 		INFO("start vm %s\n", name);
+		if (! conf->ready_signal)
+			schedule_waiting_vms();
+	}
 
 	call_plugins(vm_ent);
 	if (VM_STATE(vm_ent) == LOAD && conf->loader_timeout > 0 &&
@@ -1150,9 +1491,6 @@ start_virtual_machine(struct vm_entry *vm_ent)
 		return -1;
 	}
 
-	if (conf->err_logfile && VM_LOGFD(vm_ent) == -1)
-		VM_LOGFD(vm_ent) = open_err_logfile(conf);
-
 	return 0;
 }
 
@@ -1161,12 +1499,15 @@ on_sigterm(int ident __unused, void *data __unused)
 {
 	INFO("%s\n", "stopping daemon");
 	sigterm++;
+	stop_boot_queue();
 	return 0;
 }
 
 static int
 on_sighup(int ident __unused, void *data __unused)
 {
+	if (sigterm)
+		return 0;
 	INFO("%s\n", "reload config file");
 	reload_virtual_machines();
 	return 0;
@@ -1188,6 +1529,9 @@ start_virtual_machines(void)
 	if (register_events(sigev, cb, data, 3) < 0)
 		return -1;
 
+	set_boot_call_back(on_boot);
+	set_boot_limits(gl_conf->boot_concurrency, gl_conf->boot_rate);
+
 	LIST_FOREACH (conf_ent, &vm_conf_list, next) {
 		if ((vm_ent = create_vm_entry(conf_ent)) == NULL)
 			return -1;
@@ -1199,7 +1543,7 @@ start_virtual_machines(void)
 				    VM_CONF(vm_ent)->name);
 			continue;
 		}
-		start_virtual_machine(vm_ent);
+		schedule_boot(vm_ent);
 	}
 
 	return 0;
@@ -1208,7 +1552,10 @@ start_virtual_machines(void)
 static void
 stop_virtual_machine(struct vm_entry *vm_ent)
 {
-	stop_waiting_for(vm_output_and_timers, vm_ent);
+	stop_waiting_for(vm_output, vm_ent);
+	cancel_timer(VM_TIMER(vm_ent));
+	boot_finished(VM_BOOT(vm_ent));
+	VM_READY(vm_ent) = false;
 	cleanup_virtual_machine(vm_ent);
 	call_plugins(vm_ent);
 }
@@ -1216,12 +1563,12 @@ stop_virtual_machine(struct vm_entry *vm_ent)
 struct vm_entry *
 lookup_vm_by_name(const char *name)
 {
-	struct vm_entry *vm_ent;
+	struct vm_conf conf;
+	struct vm_entry key;
 
-	SLIST_FOREACH (vm_ent, &vm_list, next)
-		if (strcmp(VM_CONF(vm_ent)->name, name) == 0)
-			return vm_ent;
-	return NULL;
+	conf.name = (char *)name;
+	VM_CONF(&key) = &conf;
+	return RB_FIND(vm_name_tree, &vm_names, &key);
 }
 
 static void
@@ -1237,7 +1584,43 @@ copy_plugin_data(struct vm_conf_entry *dst, struct vm_conf_entry *src)
 						       db->pl_conf);
 }
 
-static int
+/*
+  Returns true if the changes from 'a' to 'b' need to restart the vm.
+  The others are applied by replacing the vm_conf of the running vm.
+  bmd reads them only when it starts or stops the vm.
+ */
+static bool
+need_restart(struct vm_conf_entry *a, struct vm_conf_entry *b)
+{
+	if (a->conf.install != b->conf.install)
+		return true;
+	/* plugin data is copied by on_reload_config */
+	return ! conf_hash_equal(&a->conf.restart_hash,
+				 &b->conf.restart_hash);
+}
+
+static void
+restart_on_change(struct vm_entry *vm_ent, struct vm_conf *conf)
+{
+	switch (VM_STATE(vm_ent)) {
+	case TERMINATE:
+		set_timer(vm_ent, MAX(conf->boot_delay, 1));
+		break;
+	case LOAD:
+	case RUN:
+		INFO("reboot vm %s\n", conf->name);
+		VM_ACPI_POWEROFF(vm_ent);
+		set_timer(vm_ent, conf->stop_timeout);
+		set_vm_state(vm_ent, RESTART);
+		break;
+	case STOP:
+		set_vm_state(vm_ent, RESTART);
+	default:
+		break;
+	}
+}
+
+int
 reload_virtual_machines(void)
 {
 	struct vm_conf *conf;
@@ -1245,11 +1628,12 @@ reload_virtual_machines(void)
 	struct vm_entry *vm_ent, *vmn;
 	struct vm_conf_head new_list = LIST_HEAD_INITIALIZER();
 
-	if (load_config_file(&new_list, false) < 0)
+	if (load_config_file(&new_list, false, &vm_conf_list) < 0)
 		return -1;
+	set_boot_limits(gl_conf->boot_concurrency, gl_conf->boot_rate);
 
 	/* make sure new_conf is NULL */
-	SLIST_FOREACH (vm_ent, &vm_list, next)
+	STAILQ_FOREACH (vm_ent, &vm_list, next)
 		VM_NEWCONF(vm_ent) = NULL;
 
 	LIST_FOREACH (conf_ent, &new_list, next) {
@@ -1267,35 +1651,35 @@ reload_virtual_machines(void)
 					    conf->name);
 				continue;
 			}
-			start_virtual_machine(vm_ent);
+			schedule_boot(vm_ent);
 			continue;
 		}
 		if (VM_LOGFD(vm_ent) != -1 &&
 		    VM_CONF(vm_ent)->err_logfile != NULL) {
-			VM_CLOSE(vm_ent, LOGFD);
-			VM_LOGFD(vm_ent) = open_err_logfile(conf);
+			if (conf->err_logfile == NULL ||
+			    open_err_logfile(vm_ent, conf,
+					     on_reopen_err_logfile) < 0)
+				VM_CLOSE(vm_ent, LOGFD);
+		} else if (conf->err_logfile != NULL &&
+			   VM_LOGREQ(vm_ent) == NULL &&
+			   (VM_STATE(vm_ent) == LOAD ||
+			    VM_STATE(vm_ent) == RUN)) {
+			/* err_logfile is added to the running vm */
+			open_err_logfile(vm_ent, conf, on_reopen_err_logfile);
 		}
-		copy_plugin_data(conf_ent, VM_CONF_ENT(vm_ent));
+		/* reused by load_config_file, nothing is changed */
+		if (conf_ent != VM_CONF_ENT(vm_ent))
+			copy_plugin_data(conf_ent, VM_CONF_ENT(vm_ent));
 		VM_NEWCONF(vm_ent) = conf;
 		if (conf->boot != NO && conf->reboot_on_change &&
 		    compare_vm_conf_entry(conf_ent, VM_CONF_ENT(vm_ent)) != 0) {
-			switch (VM_STATE(vm_ent)) {
-			case TERMINATE:
-				set_timer(vm_ent, MAX(conf->boot_delay, 1));
-				break;
-			case LOAD:
-			case RUN:
-				INFO("reboot vm %s\n", conf->name);
-				VM_ACPI_POWEROFF(vm_ent);
-				set_timer(vm_ent, conf->stop_timeout);
-				VM_STATE(vm_ent) = RESTART;
-				break;
-			case STOP:
-				VM_STATE(vm_ent) = RESTART;
-			default:
-				break;
+			log_vm_conf_diff(VM_CONF_ENT(vm_ent), conf_ent);
+			if (need_restart(VM_CONF_ENT(vm_ent), conf_ent)) {
+				restart_on_change(vm_ent, conf);
+				continue;
 			}
-			continue;
+			INFO("vm %s: changes are applied without reboot\n",
+			     conf->name);
 		}
 		if (VM_NEWCONF(vm_ent)->boot == VM_CONF(vm_ent)->boot)
 			continue;
@@ -1306,17 +1690,20 @@ reload_virtual_machines(void)
 				INFO("acpi power off vm %s\n", conf->name);
 				VM_ACPI_POWEROFF(vm_ent);
 				set_timer(vm_ent, conf->stop_timeout);
-				VM_STATE(vm_ent) = STOP;
+				set_vm_state(vm_ent, STOP);
 			} else if (VM_STATE(vm_ent) == RESTART)
-				VM_STATE(vm_ent) = STOP;
+				set_vm_state(vm_ent, STOP);
+			else if (VM_STATE(vm_ent) == TERMINATE)
+				cancel_boot(vm_ent);
 			break;
 		case ALWAYS:
 		case YES:
 			if (VM_STATE(vm_ent) == TERMINATE) {
 				VM_CONF(vm_ent) = conf;
-				start_virtual_machine(vm_ent);
+				notify_vm_change(vm_ent, VM_EVENT_RELOAD);
+				schedule_boot(vm_ent);
 			} else if (VM_STATE(vm_ent) == STOP)
-				VM_STATE(vm_ent) = RESTART;
+				set_vm_state(vm_ent, RESTART);
 			break;
 		case ONESHOT:
 			// do nothing
@@ -1324,7 +1711,7 @@ reload_virtual_machines(void)
 		}
 	}
 
-	SLIST_FOREACH_SAFE (vm_ent, &vm_list, next, vmn)
+	STAILQ_FOREACH_SAFE (vm_ent, &vm_list, next, vmn)
 		if (VM_NEWCONF(vm_ent) == NULL) {
 			switch (VM_STATE(vm_ent)) {
 			case LOAD:
@@ -1337,19 +1724,22 @@ reload_virtual_machines(void)
 			case STOP:
 			case REMOVE:
 			case RESTART:
-				VM_STATE(vm_ent) = REMOVE;
+				set_vm_state(vm_ent, REMOVE);
 				/* remove vm_conf_entry from the list
 				   to keep it until actually freed. */
 				LIST_REMOVE(VM_CONF_ENT(vm_ent), next);
 				break;
 			default:
-				SLIST_REMOVE(&vm_list, vm_ent, vm_entry,
-					     next);
+				remove_vm_entry(vm_ent);
 				LIST_REMOVE(VM_CONF_ENT(vm_ent), next);
 				free_vm_entry(vm_ent);
 			}
 		} else {
-			VM_CONF(vm_ent) = VM_NEWCONF(vm_ent);
+			/* the state is changed only with the config */
+			if (VM_CONF(vm_ent) != VM_NEWCONF(vm_ent)) {
+				VM_CONF(vm_ent) = VM_NEWCONF(vm_ent);
+				notify_vm_change(vm_ent, VM_EVENT_RELOAD);
+			}
 			VM_NEWCONF(vm_ent) = NULL;
 		}
 
@@ -1359,79 +1749,119 @@ reload_virtual_machines(void)
 
 	LIST_CONCAT(&vm_conf_list, &new_list, vm_conf_entry, next);
 
+	/* dependencies may be changed or removed */
+	schedule_waiting_vms();
+
 	return 0;
 }
 
+/*
+  Dispatch a batch of harvested events.
+  Returns the number of dispatched process exit events.
+ */
+static int
+dispatch_events(struct kevent *kev, int n)
+{
+	int i, nexit = 0;
+	struct event *event, *evn;
+
+	dispatching++;
+	for (i = 0; i < n; i++) {
+		if (kev[i].flags & EV_ERROR) {
+			on_change_error(&kev[i]);
+			continue;
+		}
+		if ((event = kev[i].udata) == NULL) {
+			ERR("recieved unexpcted event! (%d)", kev[i].filter);
+			continue;
+		}
+		/* Removed by a former callback in this batch. */
+		if (event->owner == NULL)
+			continue;
+		if (event->type == EVENT && event->kev.filter == EVFILT_PROC)
+			nexit++;
+		if (event->cb && (*event->cb)(kev[i].ident, event->data) < 0)
+			ERR("%s\n", "callback failed");
+		if ((event->kev.flags & EV_ONESHOT) && event->owner != NULL)
+			remove_event(event);
+	}
+	dispatching--;
+
+	LIST_FOREACH_SAFE (event, &dead_events, next, evn)
+		destroy_event(event);
+	LIST_INIT(&dead_events);
+
+	return nexit;
+}
+
 static int
 event_loop(void)
 {
-	struct kevent ev;
-	struct event *event;
-	int n, do_remove;
-	struct timespec *to, timeout;
+	struct kevent ev[EVENT_BATCH_SIZE];
+	int n;
 
 	if (wait_for_cmd_sock(cmd_sock) < 0)
 		return -1;
 
 	while (sigterm == 0) {
-		to = calc_timeout(COMMAND_TIMEOUT_SEC, &timeout);
-		if ((n = kevent_get(&ev, 1, to)) < 0) {
+		run_boot_queue();
+		arm_timer();
+		if ((n = harvest_events(ev, nitems(ev), NULL)) < 0) {
 			ERR("kevent failure (%s)\n", strerror(errno));
 			return -1;
 		}
-		if (n == 0) {
-			close_timeout_sock_buf(COMMAND_TIMEOUT_SEC);
-			continue;
-		}
-		if (ev.udata == NULL) {
-			ERR("recieved unexpcted event! (%d)", ev.filter);
-			continue;
-		}
-		event = ev.udata;
-		do_remove = (event->kev.flags & EV_ONESHOT) ? 1 : 0;
-		if (event->cb && (*event->cb)(ev.ident, event->data) < 0)
-			ERR("%s\n", "callback failed");
-		if (do_remove) {
-			LIST_REMOVE(event, next);
-			free(event);
-		}
+		dispatch_events(ev, n);
 	}
 
 	return 0;
 }
 
+/*
+  Power off the running VMs that no running VM depends on.
+  Returns the number of VMs not terminated yet.
+ */
 static int
-stop_virtual_machines(void)
+stop_vm_wave(void)
 {
-	struct kevent ev;
-	struct event *event;
 	struct vm_entry *vm_ent;
-	int do_remove, count = 0;
+	int count = 0;
 
-	SLIST_FOREACH (vm_ent, &vm_list, next) {
-		if (VM_STATE(vm_ent) == LOAD || VM_STATE(vm_ent) == RUN) {
-			count++;
-			VM_ACPI_POWEROFF(vm_ent);
-			set_timer(vm_ent, VM_CONF(vm_ent)->stop_timeout);
-		}
+	STAILQ_FOREACH (vm_ent, &vm_list, next)
+		if (VM_STATE(vm_ent) == TERMINATE)
+			release_depends(vm_ent);
+
+	STAILQ_FOREACH (vm_ent, &vm_list, next) {
+		if (VM_STATE(vm_ent) == TERMINATE)
+			continue;
+		count++;
+		if ((VM_STATE(vm_ent) != LOAD && VM_STATE(vm_ent) != RUN) ||
+		    VM_NREQUIRED(vm_ent) > 0)
+			continue;
+		VM_ACPI_POWEROFF(vm_ent);
+		set_timer(vm_ent, VM_CONF(vm_ent)->stop_timeout);
+		set_vm_state(vm_ent, STOP);
 	}
+	return count;
+}
 
+/*
+  Stop VMs in the reverse order of the dependencies.
+  The next wave starts every time a VM exits.
+ */
+static int
+stop_virtual_machines(void)
+{
+	struct kevent ev[EVENT_BATCH_SIZE];
+	int n, count;
+
+	count_required();
+	count = stop_vm_wave();
 	while (count > 0) {
-		if (kevent_get(&ev, 1, NULL) < 0)
+		arm_timer();
+		if ((n = harvest_events(ev, nitems(ev), NULL)) < 0)
 			return -1;
-		if (ev.udata == NULL)
-			continue;
-		event = ev.udata;
-		if (event->type == EVENT &&
-		    event->kev.filter == EVFILT_PROC)
-			count--;
-		do_remove = (event->kev.flags & EV_ONESHOT) ? 1 : 0;
-		if (event->cb && (*event->cb)(ev.ident, event->data) < 0)
-			ERR("%s\n", "callback failed");
-		if (do_remove) {
-			LIST_REMOVE(event, next);
-			free(event);
-		}
+		if (dispatch_events(ev, n) > 0)
+			count = stop_vm_wave();
 	}
 #if __FreeBSD_version < 1400059
 	// waiting for vm memory is actually freed in the kernel.
@@ -1539,7 +1969,13 @@ main(int argc, char *argv[])
 	    0)
 		WARN("%s\n", "cannot protect from OOM killer");
 
-	if (load_config_file(&vm_conf_list, true) < 0)
+	/* fork the fd broker while the daemon is small */
+	if (start_fd_broker() < 0)
+		WARN("cannot start fd broker (%s)\n", strerror(errno));
+
+	/* only the daemon writes the config snapshot */
+	set_config_snapshot(NULL, true);
+	if (load_config_file(&vm_conf_list, true, NULL) < 0)
 		return 1;
 
 #if __FreeBSD_version >= 1400088 || \
@@ -1551,6 +1987,7 @@ main(int argc, char *argv[])
 		ERR("%s\n", "cannot open kqueue");
 		return 1;
 	}
+	event_changes_init(eventq, on_change_error);
 
 	if ((cmd_sock = create_command_server(gl_conf)) < 0) {
 		ERR("cannot bind %s\n", gl_conf->cmd_sock_path);
@@ -1563,6 +2000,10 @@ main(int argc, char *argv[])
 		fclose(fp);
 	}
 
+	if (init_state_table(STATE_TABLE_DIR) < 0)
+		ERR("cannot publish state table in %s (%s)\n",
+		    STATE_TABLE_DIR, strerror(errno));
+
 	INFO("%s\n", "start daemon");
 
 	if (start_virtual_machines() < 0)
@@ -1575,11 +2016,19 @@ main(int argc, char *argv[])
 
 	stop_virtual_machines();
 	free_vm_list();
+	stop_fd_broker();
 	close(eventq);
-	free_events();
+	free_event_index();
+	free_boot_queue();
+	free_subscribers();
+	free_timers();
 	remove_plugins();
 	free_id_list();
+	free_userdb();
+	free_res_caches();
+	free_state_table();
 	free_global_vars();
+	free_var_names();
 	free_gl_conf();
 	INFO("%s\n", "quit daemon");
 	LOG_CLOSE();
@@ -1627,6 +2076,7 @@ direct_run(const char *name, bool install, bool single)
 		ERR("%s\n", "cannot open kqueue");
 		return 1;
 	}
+	event_changes_init(eventq, on_change_error);
 
 	conf_ent = lookup_vm_conf(name);
 	if (conf_ent == NULL) {
@@ -1669,7 +2119,7 @@ direct_run(const char *name, bool install, bool single)
 	call_plugins(vm_ent);
 
 wait:
-	if (kevent_get(&ev, 1, NULL) < 0) {
+	if (harvest_events(&ev, 1, NULL) < 0) {
 		ERR("kevent failure (%s)\n", strerror(errno));
 		VM_POWEROFF(vm_ent);
 		goto err;
@@ -1716,12 +2166,37 @@ err:
 	return 1;
 }
 
+/*
+  Hash the plugin data as configured, before plugins copy their states on
+  reload.
+ */
+void
+hash_plugin_data(struct vm_conf_entry *conf_ent)
+{
+	struct conf_hash h = CONF_HASH_INIT;
+	struct plugin_data *pd;
+
+	SLIST_FOREACH (pd, &conf_ent->pl_data, next) {
+		hash128_bytes(&h, pd->ent->desc.name,
+		    strlen(pd->ent->desc.name) + 1);
+		hash_nvlist(&h, pd->pl_conf);
+	}
+	conf_ent->pl_hash = h;
+}
+
 int
 compare_vm_conf_entry(struct vm_conf_entry *a, struct vm_conf_entry *b)
 {
 	int rc;
 	struct plugin_data *pa, *pb;
 
+	/* 'install' is not in the hash. */
+	if (a->conf.install != b->conf.install)
+		return a->conf.install - b->conf.install;
+	if (conf_hash_equal(&a->conf.hash, &b->conf.hash) &&
+	    conf_hash_equal(&a->pl_hash, &b->pl_hash))
+		return 0;
+
 	if ((rc = compare_vm_conf(&a->conf, &b->conf)) != 0)
 		return rc;
 
@@ -1733,3 +2208,53 @@ compare_vm_conf_entry(struct vm_conf_entry *a, struct vm_conf_entry *b)
 
 	return 0;
 }
+
+/*
+  Returns the fields changed from 'a' to 'b' including plugin data.
+ */
+nvlist_t *
+diff_vm_conf_entry(struct vm_conf_entry *a, struct vm_conf_entry *b)
+{
+	nvlist_t *diff;
+	struct plugin_data *pa, *pb;
+	char key[64];
+
+	if ((diff = diff_vm_conf(&a->conf, &b->conf)) == NULL)
+		return NULL;
+
+	for (pa = SLIST_FIRST(&a->pl_data), pb = SLIST_FIRST(&b->pl_data);
+	     pa != NULL && pb != NULL;
+	     pa = SLIST_NEXT(pa, next), pb = SLIST_NEXT(pb, next))
+		if (compare_nvlist(pa->pl_conf, pb->pl_conf) != 0) {
+			snprintf(key, sizeof(key), "plugin:%s",
+			    pa->ent->desc.name);
+			diff_nvlist(diff, key, pa->pl_conf, pb->pl_conf);
+		}
+
+	return diff;
+}
+
+/*
+  Log each changed field of the vm configuration.
+ */
+void
+log_vm_conf_diff(struct vm_conf_entry *a, struct vm_conf_entry *b)
+{
+	nvlist_t *diff;
+	const nvlist_t *p;
+	const char *k;
+	int type;
+	void *cookie = NULL;
+
+	if ((diff = diff_vm_conf_entry(a, b)) == NULL)
+		return;
+	while ((k = nvlist_next(diff, &type, &cookie)) != NULL) {
+		p = nvlist_get_nvlist(diff, k);
+		INFO("vm %s: %s: %s -> %s\n", b->conf.name, k,
+		    nvlist_exists_string(p, "old") ?
+			nvlist_get_string(p, "old") : "(null)",
+		    nvlist_exists_string(p, "new") ?
+			nvlist_get_string(p, "new") : "(null)");
+	}
+	nvlist_destroy(diff);
+}
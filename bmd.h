@@ -2,6 +2,7 @@
 #define _BMD_H_
 
 #include <sys/queue.h>
+#include <sys/tree.h>
 #include <sys/nv.h>
 #include <sys/event.h>
 #include <sys/ucred.h>
@@ -22,6 +23,9 @@
 #define COMMAND_TIMEOUT_SEC 30
 
 struct global_conf;
+struct timer;
+struct boot_req;
+struct fd_req;
 
 /*
   Entry of plugins.
@@ -50,6 +54,7 @@ struct plugin_data {
 struct vm_conf_entry {
 	struct vm_conf conf;
 	SLIST_HEAD(plugin_data_head, plugin_data) pl_data;
+	struct conf_hash pl_hash;
 	LIST_ENTRY(vm_conf_entry) next;
 };
 
@@ -78,6 +83,15 @@ enum EVENT_TYPE { EVENT, PLUGIN };
 #define VM_OUTFD(v)         ((v)->vm.outfd)
 #define VM_ERRFD(v)         ((v)->vm.errfd)
 #define VM_LOGFD(v)         ((v)->vm.logfd)
+#define VM_LOGREQ(v)        ((v)->logreq)
+#define VM_TIMER(v)         ((v)->timer)
+#define VM_BOOT(v)          ((v)->boot)
+#define VM_WAITING(v)       ((v)->waiting)
+#define VM_READY(v)         ((v)->ready)
+#define VM_SHARD(v)         ((v)->shard)
+#define VM_SLOT(v)          ((v)->slot)
+#define VM_NREQUIRED(v)     ((v)->nrequired)
+#define VM_REQUIRING(v)     ((v)->requiring)
 #define VM_CLOSE(v, fd)                    \
 	do {                               \
 		if (VM_##fd(v) != -1) {    \
@@ -93,28 +107,47 @@ enum EVENT_TYPE { EVENT, PLUGIN };
 struct vm_entry {
 	struct vm vm;
 	struct vm_conf *new_conf;
-	SLIST_ENTRY(vm_entry) next;
+	STAILQ_ENTRY(vm_entry) next;
+	RB_ENTRY(vm_entry) name_entry;
 	struct vm_method *method;
 	nvlist_t *pl_conf;
+	struct timer *timer;
+	struct boot_req *boot;
+	struct fd_req *logreq;
+	struct state_shard *shard;
+	uint32_t slot;
+	int nrequired;
+	bool requiring;
+	bool waiting;
+	bool ready;
 };
 
+/*
+  Maximum number of events harvested by one kevent call.
+ */
+#define EVENT_BATCH_SIZE 64
+
 /*
    Event Structure.
+   'next' links the events of the same owner ('data').
  */
 typedef int (*event_call_back)(int ident, void *data);
+struct event_owner;
 struct event {
 	enum EVENT_TYPE type;
 	struct kevent kev;
 	void *data;
 	event_call_back cb;
 	LIST_ENTRY(event) next;
+	RB_ENTRY(event) kev_entry;
+	struct event_owner *owner;
 };
+LIST_HEAD(event_head, event);
 
 /*
   Socker buffer.
  */
 struct sock_buf {
-	LIST_ENTRY(sock_buf) next;
 	int fd;
 	int read_state;
 	size_t buf_size;
@@ -127,8 +160,9 @@ struct sock_buf {
 	size_t res_size;
 	size_t res_bytes;
 	char *res_buf;
-	time_t event_time;
+	struct timer *timer;
 	struct xucred peer;
+	struct subscriber *sub;
 };
 
 LIST_HEAD(vm_conf_head, vm_conf_entry);
@@ -136,26 +170,67 @@ LIST_HEAD(vm_conf_head, vm_conf_entry);
 int init_gl_conf(void);
 void free_gl_conf(void);
 int merge_global_conf(struct global_conf *);
+void reload_global_conf(struct global_conf *);
 void free_global_conf(struct global_conf *);
 
 int remove_plugins(void);
 void call_plugins(struct vm_entry *);
+
+/*
+  Kinds of the changes of VMs notified to the subscribers.
+ */
+enum VM_EVENT {
+	VM_EVENT_CREATE, // vm_entry is created
+	VM_EVENT_STATE,	 // state is changed
+	VM_EVENT_RELOAD, // configuration is replaced
+	VM_EVENT_REMOVE, // vm_entry is removed
+	VM_EVENT_EXIT,	 // process is exited
+};
+void notify_vm_change(struct vm_entry *, enum VM_EVENT);
+void notify_vm_exit(struct vm_entry *, int);
+void set_vm_state(struct vm_entry *, enum STATE);
+void publish_vm_event(struct vm_entry *, enum VM_EVENT, int);
+int set_sock_buf_wait_flags(struct sock_buf *, short, short);
+const char *get_state_string(int);
 int call_plugin_parser(struct plugin_data_head *,
 		       const char *, const char *);
 int load_plugins(const char *);
-int vm_method_exists(char *);
+int vm_method_exists(const char *);
 
 int create_plugin_data(struct plugin_data_head *);
 void free_plugin_data(struct plugin_data_head *);
 void free_vm_conf_entry(struct vm_conf_entry *);
 struct vm_entry *lookup_vm_by_name(const char *);
+int reload_virtual_machines(void);
 int set_timer(struct vm_entry *, int);
 int start_virtual_machine(struct vm_entry *);
+void set_vm_ready(struct vm_entry *);
 
 int direct_run(const char *, bool, bool);
 
-int load_config_file(struct vm_conf_head *, bool);
+struct event *create_event(void);
+void destroy_event(struct event *);
+int event_index_add(struct event *);
+void event_index_remove(struct event *);
+struct event *event_index_lookup(uintptr_t, short);
+struct event_head *event_index_owner(void *);
+void free_event_index(void);
+void event_changes_init(int, void (*)(struct kevent *));
+int event_changes_flush(void);
+void event_changes_queue(struct kevent *, int);
+void event_changes_drop(struct event *);
+int harvest_events(struct kevent *, int, struct timespec *);
+
+int load_config_file(struct vm_conf_head *, bool, struct vm_conf_head *);
+int lookup_config_snapshot(const char *, struct vm_conf_entry **);
+struct vm_conf_entry *load_vm_conf_entry(const char *);
+void parser_stats(nvlist_t *);
+void set_parser_workers(int);
 int compare_vm_conf_entry(struct vm_conf_entry *, struct vm_conf_entry *);
+void hash_plugin_data(struct vm_conf_entry *);
+nvlist_t *diff_vm_conf_entry(struct vm_conf_entry *, struct vm_conf_entry *);
+void log_vm_conf_diff(struct vm_conf_entry *, struct vm_conf_entry *);
 
 extern struct global_conf *gl_conf;
+extern uint64_t vm_generation;
 #endif
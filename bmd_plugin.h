@@ -108,6 +108,7 @@ enum BOOT get_boot(struct vm_conf *);
 enum HOSTBRIDGE_TYPE get_hostbridge(struct vm_conf *);
 char *get_backend(struct vm_conf *);
 int get_boot_delay(struct vm_conf *);
+int get_boot_priority(struct vm_conf *);
 char *get_comport(struct vm_conf *);
 bool is_reboot_on_change(struct vm_conf *);
 bool is_single_user(struct vm_conf *);
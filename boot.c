@@ -0,0 +1,240 @@
+#include <sys/param.h>
+#include <sys/tree.h>
+#include <sys/nv.h>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "boot.h"
+#include "slab.h"
+#include "timer.h"
+
+#define CMP(a,b)    ((a) < (b) ? -1 : ((a) == (b) ? 0 : 1))
+
+RB_HEAD(boot_queue, boot_req);
+
+static int compare_boot_req(struct boot_req *, struct boot_req *);
+RB_GENERATE_STATIC(boot_queue, boot_req, entry, compare_boot_req);
+
+static struct slab boot_req_slab =
+	SLAB_INITIALIZER("boot_req", sizeof(struct boot_req), 64);
+
+/*
+  Pending boot requests.
+ */
+static struct boot_queue boot_queue = RB_INITIALIZER(&boot_queue);
+
+static boot_call_back boot_cb = NULL;
+
+/*
+  Maximum number of loading objects and starts per second.
+  0 means unlimited.
+ */
+static int max_loading = 0;
+static int boot_rate = 0;
+
+static int nqueued = 0, nloading = 0;
+static uint64_t boot_seq = 0, nstarted = 0, nthrottled = 0;
+
+/*
+  Start time of the last boot and the timer to wait for the next one.
+ */
+static uint64_t last_boot = 0;
+static struct timer *rate_timer = NULL;
+
+/*
+  Set by stop_boot_queue() on shutdown, nothing is started after that.
+ */
+static bool boot_stopped = false;
+
+static uint64_t
+now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+compare_boot_req(struct boot_req *a, struct boot_req *b)
+{
+	if (a->priority != b->priority)
+		return CMP(b->priority, a->priority);
+	return CMP(a->seq, b->seq);
+}
+
+void
+set_boot_call_back(boot_call_back cb)
+{
+	boot_cb = cb;
+}
+
+void
+set_boot_limits(int concurrency, int rate)
+{
+	max_loading = MAX(concurrency, 0);
+	boot_rate = MAX(rate, 0);
+}
+
+struct boot_req *
+create_boot_req(void *data)
+{
+	struct boot_req *req;
+
+	if ((req = slab_alloc(&boot_req_slab)) == NULL)
+		return NULL;
+	req->seq = 0;
+	req->priority = 0;
+	req->queued = false;
+	req->loading = false;
+	req->data = data;
+	return req;
+}
+
+void
+destroy_boot_req(struct boot_req *req)
+{
+	if (req == NULL)
+		return;
+	dequeue_boot(req);
+	boot_finished(req);
+	slab_free(&boot_req_slab, req);
+}
+
+/*
+  Queue the request with 'priority'. A queued one is kept in its place.
+  The booting starts on the next run_boot_queue().
+ */
+int
+enqueue_boot(struct boot_req *req, int priority)
+{
+	if (req->queued)
+		return 0;
+	req->seq = ++boot_seq;
+	req->priority = priority;
+	req->queued = true;
+	RB_INSERT(boot_queue, &boot_queue, req);
+	nqueued++;
+	return 0;
+}
+
+void
+dequeue_boot(struct boot_req *req)
+{
+	if (req == NULL || ! req->queued)
+		return;
+	RB_REMOVE(boot_queue, &boot_queue, req);
+	req->queued = false;
+	nqueued--;
+}
+
+/*
+  The object of 'req' is no longer loading. Its slot is released.
+ */
+void
+boot_finished(struct boot_req *req)
+{
+	if (req == NULL || ! req->loading)
+		return;
+	req->loading = false;
+	nloading--;
+}
+
+static int
+on_rate_timer(int ident __unused, void *data __unused)
+{
+	run_boot_queue();
+	return 0;
+}
+
+/*
+  Returns milliseconds to wait for the next boot by the rate limit.
+ */
+static int64_t
+rate_wait(void)
+{
+	uint64_t now, next;
+
+	if (boot_rate == 0)
+		return 0;
+	now = now_msec();
+	next = last_boot + 1000 / boot_rate;
+	if (last_boot > 0 && now < next)
+		return next - now;
+	last_boot = now;
+	return 0;
+}
+
+/*
+  Start the queued requests within the limits.
+ */
+void
+run_boot_queue(void)
+{
+	int64_t msec;
+	struct boot_req *req;
+
+	if (boot_stopped)
+		return;
+	while ((req = RB_MIN(boot_queue, &boot_queue)) != NULL) {
+		if (max_loading > 0 && nloading >= max_loading) {
+			nthrottled++;
+			break;
+		}
+		if ((msec = rate_wait()) > 0) {
+			if (rate_timer == NULL &&
+			    (rate_timer = create_timer(on_rate_timer, NULL)) ==
+				NULL)
+				break;
+			if (rate_timer->index == 0)
+				schedule_timer(rate_timer, msec);
+			nthrottled++;
+			break;
+		}
+		dequeue_boot(req);
+		nstarted++;
+		if ((*boot_cb)(req->data) > 0) {
+			req->loading = true;
+			nloading++;
+		}
+	}
+}
+
+/*
+  Stop starting the queued requests. The requests stay in the queue
+  until they are destroyed.
+ */
+void
+stop_boot_queue(void)
+{
+	boot_stopped = true;
+	destroy_timer(rate_timer);
+	rate_timer = NULL;
+}
+
+/*
+  Add scheduler counters to 'nvl'.
+ */
+void
+boot_stats(nvlist_t *nvl)
+{
+	nvlist_t *p;
+
+	p = nvlist_create(0);
+	nvlist_add_number(p, "queued", nqueued);
+	nvlist_add_number(p, "loading", nloading);
+	nvlist_add_number(p, "started", nstarted);
+	nvlist_add_number(p, "throttled", nthrottled);
+	nvlist_move_nvlist(nvl, "boot", p);
+}
+
+void
+free_boot_queue(void)
+{
+	destroy_timer(rate_timer);
+	rate_timer = NULL;
+	RB_INIT(&boot_queue);
+	nqueued = nloading = 0;
+	slab_destroy(&boot_req_slab);
+}
@@ -0,0 +1,42 @@
+#ifndef _BOOT_H_
+#define _BOOT_H_
+
+#include <sys/tree.h>
+#include <sys/nv.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+  Start the booting object of 'data'.
+  Returns 1 if it is loading, 0 if it has booted, -1 on failure.
+ */
+typedef int (*boot_call_back)(void *data);
+
+/*
+  Boot request of the pending queue.
+  The queue is ordered by the higher 'priority' and then 'seq'.
+  'loading' is true while the object holds a loading slot.
+ */
+struct boot_req {
+	RB_ENTRY(boot_req) entry;
+	uint64_t seq;
+	int priority;
+	bool queued;
+	bool loading;
+	void *data;
+};
+
+/* Implemented in boot.c */
+void set_boot_call_back(boot_call_back);
+void set_boot_limits(int, int);
+struct boot_req *create_boot_req(void *);
+void destroy_boot_req(struct boot_req *);
+int enqueue_boot(struct boot_req *, int);
+void dequeue_boot(struct boot_req *);
+void boot_finished(struct boot_req *);
+void run_boot_queue(void);
+void stop_boot_queue(void);
+void boot_stats(nvlist_t *);
+void free_boot_queue(void);
+
+#endif
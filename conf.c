@@ -11,18 +11,82 @@
 #define CMP_RETURN(a,b)  if ((a) != (b)) return (a) < (b) ? -1 : 1
 
 struct id_entry {
-	SLIST_ENTRY(id_entry) next;
+	RB_ENTRY(id_entry) by_name;
+	RB_ENTRY(id_entry) by_id;
+	unsigned int id;
+	char *name;
+	char buf[0];
+};
+
+static int
+compare_id_name(struct id_entry *a, struct id_entry *b)
+{
+	return strcmp(a->name, b->name);
+}
+
+static int
+compare_id(struct id_entry *a, struct id_entry *b)
+{
+	return CMP(a->id, b->id);
+}
+
+RB_HEAD(id_name_tree, id_entry);
+RB_HEAD(id_tree, id_entry);
+RB_GENERATE_STATIC(id_name_tree, id_entry, by_name, compare_id_name);
+RB_GENERATE_STATIC(id_tree, id_entry, by_id, compare_id);
+
+/*
+  Identifiers indexed by name and by number.
+ */
+static struct id_name_tree id_names = RB_INITIALIZER(&id_names);
+static struct id_tree ids = RB_INITIALIZER(&ids);
+
+/*
+  Last generation number of vm_conf.
+ */
+static uint64_t conf_generation = 0;
+
+/*
+  Interned variable name. 'id' is the slot of the variable in a vartree.
+ */
+struct var_sym {
+	struct var_sym *next;
 	unsigned int id;
 	char name[0];
 };
 
 /*
-  List of identfiers.
+  Memory chunk of variable values. All chunks of a vartree are freed
+  together with it.
+ */
+struct var_chunk {
+	struct var_chunk *next;
+	size_t size;
+	size_t used;
+	char data[0];
+};
+
+/*
+  Variables of a scope. The values are indexed by the symbol id.
+ */
+struct vartree {
+	char **vals;
+	unsigned int nvals;
+	struct var_chunk *chunks;
+};
+
+#define VAR_SYM_BUCKETS_MIN	64
+#define VAR_CHUNK_SIZE		256
+
+/*
+  Hash table of the interned variable names and the array of them by id.
+  Both are grown together, 'var_syms' has 'var_sym_nbuckets' elements.
  */
-static SLIST_HEAD(, id_entry) id_list = SLIST_HEAD_INITIALIZER();
+static struct var_sym **var_sym_buckets = NULL;
+static struct var_sym **var_syms = NULL;
+static unsigned int var_sym_nbuckets = 0;
+static unsigned int nvar_syms = 0;
 
-static int compare_variable_key(struct conf_var *, struct conf_var *);
-RB_GENERATE_STATIC(vartree, conf_var, entry, compare_variable_key);
 struct vartree *global_vars = NULL;
 
 void
@@ -30,27 +94,64 @@ free_id_list(void)
 {
 	struct id_entry *e, *t;
 
-	SLIST_FOREACH_SAFE (e, &id_list, next, t)
+	RB_FOREACH_SAFE (e, id_name_tree, &id_names, t) {
+		RB_REMOVE(id_name_tree, &id_names, e);
 		free(e);
-	SLIST_INIT(&id_list);
+	}
+	RB_INIT(&ids);
 }
 
+static unsigned int lastid = 0;
+
 static int
-get_id(const char *name, unsigned int *id)
+add_id(const char *name, unsigned int id)
 {
-	static unsigned int lastid = 0;
 	struct id_entry *e;
 
-	SLIST_FOREACH (e, &id_list, next)
-		if (strcmp(e->name, name) == 0) {
-			*id = e->id;
-			return 0;
-		}
 	if ((e = malloc(sizeof(*e) + strlen(name) + 1)) == NULL)
 		return -1;
-	strcpy(e->name, name);
-	*id = e->id = lastid++;
-	SLIST_INSERT_HEAD(&id_list, e, next);
+	e->name = strcpy(e->buf, name);
+	e->id = id;
+	RB_INSERT(id_name_tree, &id_names, e);
+	RB_INSERT(id_tree, &ids, e);
+	return 0;
+}
+
+static int
+get_id(const char *name, unsigned int *id)
+{
+	struct id_entry *e, key;
+
+	key.name = (char *)name;
+	if ((e = RB_FIND(id_name_tree, &id_names, &key)) != NULL) {
+		*id = e->id;
+		return 0;
+	}
+	if (add_id(name, lastid) < 0)
+		return -1;
+	*id = lastid++;
+	return 0;
+}
+
+/*
+  Register the identifier of 'name' that is assigned before, e.g. by the
+  daemon which wrote the config snapshot.
+ */
+int
+register_id(const char *name, unsigned int id)
+{
+	struct id_entry *e, key;
+
+	key.name = (char *)name;
+	if ((e = RB_FIND(id_name_tree, &id_names, &key)) != NULL)
+		return (e->id == id) ? 0 : -1;
+	key.id = id;
+	if (RB_FIND(id_tree, &ids, &key) != NULL)
+		return -1;
+	if (add_id(name, id) < 0)
+		return -1;
+	if (lastid <= id)
+		lastid = id + 1;
 	return 0;
 }
 
@@ -63,6 +164,15 @@ free_passthru_conf(struct passthru_conf *c)
 	free(c);
 }
 
+void
+free_depend_conf(struct depend_conf *c)
+{
+	if (c == NULL)
+		return;
+	free(c->name);
+	free(c);
+}
+
 void
 free_disk_conf(struct disk_conf *c)
 {
@@ -130,6 +240,16 @@ clear_passthru_conf(struct vm_conf *vc)
 	STAILQ_INIT(&vc->passthrues);
 }
 
+void
+clear_depend_conf(struct vm_conf *vc)
+{
+	struct depend_conf *dc, *dn;
+	STAILQ_FOREACH_SAFE (dc, &vc->depends, next, dn)
+		free_depend_conf(dc);
+	STAILQ_INIT(&vc->depends);
+	vc->ndepends = 0;
+}
+
 void
 clear_disk_conf(struct vm_conf *vc)
 {
@@ -175,25 +295,24 @@ clear_bhyve_env(struct vm_conf *vc)
 	STAILQ_INIT(&vc->bhyve_envs);
 }
 
-static void
-free_var(struct conf_var *c)
+struct vartree *
+create_vartree(void)
 {
-	if (c == NULL)
-		return;
-	free(c->key);
-	free(c->val);
-	free(c);
+	return calloc(1, sizeof(struct vartree));
 }
 
 void
 free_vartree(struct vartree *vt)
 {
-	struct conf_var *v, *vn;
+	struct var_chunk *c, *cn;
 
-	RB_FOREACH_SAFE (v, vartree, vt, vn) {
-		RB_REMOVE(vartree, vt, v);
-		free_var(v);
+	if (vt == NULL)
+		return;
+	for (c = vt->chunks; c != NULL; c = cn) {
+		cn = c->next;
+		free(c);
 	}
+	free(vt->vals);
 	free(vt);
 }
 
@@ -219,6 +338,7 @@ free_vm_conf(struct vm_conf *vc)
 	free(vc->grub_run_partition);
 	free_fbuf(vc->fbuf);
 	clear_passthru_conf(vc);
+	clear_depend_conf(vc);
 	clear_disk_conf(vc);
 	clear_iso_conf(vc);
 	clear_net_conf(vc);
@@ -252,6 +372,29 @@ err:
 	return -1;
 }
 
+int
+add_depend_conf(struct vm_conf *conf, const char *name)
+{
+	struct depend_conf *p;
+	char *n;
+	if (conf == NULL)
+		return 0;
+
+	p = malloc(sizeof(struct depend_conf));
+	n = strdup(name);
+	if (p == NULL || n == NULL)
+		goto err;
+	p->name = n;
+
+	STAILQ_INSERT_TAIL(&conf->depends, p, next);
+	conf->ndepends++;
+	return 0;
+err:
+	free(n);
+	free(p);
+	return -1;
+}
+
 struct passthru_conf *
 get_passthru_conf(struct vm_conf *conf)
 {
@@ -802,7 +945,7 @@ get_hostbridge(struct vm_conf *conf)
 }
 
 int
-set_backend(struct vm_conf *conf, char *backend)
+set_backend(struct vm_conf *conf, const char *backend)
 {
 	if (conf == NULL)
 		return 0;
@@ -846,6 +989,22 @@ get_boot_delay(struct vm_conf *conf)
 	return conf->boot_delay;
 }
 
+int
+set_boot_priority(struct vm_conf *conf, int priority)
+{
+	if (conf == NULL)
+		return 0;
+
+	conf->boot_priority = priority;
+	return 0;
+}
+
+int
+get_boot_priority(struct vm_conf *conf)
+{
+	return conf->boot_priority;
+}
+
 int
 set_reboot_on_change(struct vm_conf *conf, bool enable)
 {
@@ -855,6 +1014,15 @@ set_reboot_on_change(struct vm_conf *conf, bool enable)
 	return 0;
 }
 
+int
+set_ready_signal(struct vm_conf *conf, bool enable)
+{
+	if (conf == NULL)
+		return 0;
+	conf->ready_signal = enable;
+	return 0;
+}
+
 bool
 is_reboot_on_change(struct vm_conf *conf)
 {
@@ -1181,12 +1349,11 @@ create_vm_conf(const char *vm_name)
 	fbuf = create_fbuf();
 	name = strdup(vm_name);
 	backend = strdup("bhyve");
-	local = malloc(sizeof(*local));
+	local = create_vartree();
 	if (ret == NULL || fbuf == NULL || name == NULL || backend == NULL ||
 	    local == NULL)
 		goto err;
 
-	RB_INIT(local);
 	ret->vars.local = local;
 	ret->vars.args = NULL;
 	if (set_var0(local, "NAME", name) < 0)
@@ -1200,6 +1367,7 @@ create_vm_conf(const char *vm_name)
 	} else
 		ERR("failed to allocate \"ID\" number! (%s)\n",
 		    strerror(errno));
+	ret->generation = ++conf_generation;
 	ret->hostbridge = INTEL;
 	ret->fbuf = fbuf;
 	ret->name = name;
@@ -1209,6 +1377,8 @@ create_vm_conf(const char *vm_name)
 	ret->backend = backend;
 	ret->group = -1;
 
+	STAILQ_INIT(&ret->passthrues);
+	STAILQ_INIT(&ret->depends);
 	STAILQ_INIT(&ret->disks);
 	STAILQ_INIT(&ret->isoes);
 	STAILQ_INIT(&ret->nets);
@@ -1234,6 +1404,7 @@ finalize_vm_conf(struct vm_conf *conf)
 	if (conf->fbuf->enable < 0)
 		conf->fbuf->enable = false;
 
+	hash_vm_conf(conf);
 	return 0;
 }
 
@@ -1245,6 +1416,7 @@ dump_vm_conf(struct vm_conf *conf, FILE *fp)
 	struct iso_conf *ic;
 	struct net_conf *nc;
 	struct passthru_conf *pc;
+	struct depend_conf *de;
 	struct bhyveload_env *be;
 	struct bhyve_env *ev;
 	struct fbuf *fb;
@@ -1265,12 +1437,14 @@ dump_vm_conf(struct vm_conf *conf, FILE *fp)
 	fprintf(fp, fmt, "wired_memory", bool_str[conf->wired_memory]);
 	fprintf(fp, fmt, "utctime", bool_str[conf->utctime]);
 	fprintf(fp, fmt, "reboot_on_change", bool_str[conf->reboot_on_change]);
+	fprintf(fp, fmt, "ready_signal", bool_str[conf->ready_signal]);
 	fprintf(fp, fmt, "single_user", bool_str[conf->single_user]);
 	fprintf(fp, fmt, "install", bool_str[conf->install]);
 	fprintf(fp, fmt, "comport", conf->comport);
 	fprintf(fp, fmt, "debug_port", conf->debug_port);
 	fprintf(fp, fmt, "boot", btype[conf->boot]);
 	fprintf(fp, dfmt, "boot_delay", conf->boot_delay);
+	fprintf(fp, dfmt, "boot_priority", conf->boot_priority);
 	fprintf(fp, dfmt, "loader_timeout", conf->loader_timeout);
 	fprintf(fp, dfmt, "stop_timeout", conf->stop_timeout);
 	fprintf(fp, fmt, "loader", conf->loader);
@@ -1297,6 +1471,13 @@ dump_vm_conf(struct vm_conf *conf, FILE *fp)
 		fprintf(fp, "\n");
 	}
 
+	if (!STAILQ_EMPTY(&conf->depends)) {
+		fprintf(fp, "%18s =" , "depends_on");
+		STAILQ_FOREACH (de, &conf->depends, next)
+			fprintf(fp, " %s", de->name);
+		fprintf(fp, "\n");
+	}
+
 	i = 0;
 	STAILQ_FOREACH (dc, &conf->disks, next) {
 		snprintf(buf, sizeof(buf), "disk%d", i++);
@@ -1422,6 +1603,7 @@ compare_vm_conf(const struct vm_conf *a, const struct vm_conf *b)
 	struct bhyve_env *ea, *eb;
 
 	CMP_NUM(boot_delay);
+	CMP_NUM(boot_priority);
 	CMP_NUM(loader_timeout);
 	CMP_NUM(stop_timeout);
 	CMP_NUM(hostbridge);
@@ -1449,6 +1631,10 @@ compare_vm_conf(const struct vm_conf *a, const struct vm_conf *b)
 	CMP_NUM(wired_memory);
 	CMP_NUM(utctime);
 	CMP_NUM(reboot_on_change);
+	/*
+	 * We don't need to compare depends and ready_signal.
+	 * They only order the booting and don't change the running vm.
+	 */
 	CMP_NUM(single_user);
 	CMP_NUM(install);
 	CMP_NUM(ndisks);
@@ -1520,69 +1706,366 @@ compare_vm_conf(const struct vm_conf *a, const struct vm_conf *b)
 	return 0;
 }
 
-static int
-compare_variable_key(struct conf_var *a, struct conf_var *b)
+static void
+add_diff(nvlist_t *diff, const char *field, const char *a, const char *b)
 {
-	if (a == NULL && b == NULL)
-		return 0;
-	if (a == NULL)
-		return -1;
-	if (b == NULL)
-		return 1;
-	return compare_string(a->key, b->key);
+	nvlist_t *p;
+
+	if (compare_string(a, b) == 0)
+		return;
+	p = nvlist_create(0);
+	if (a != NULL)
+		nvlist_add_string(p, "old", a);
+	if (b != NULL)
+		nvlist_add_string(p, "new", b);
+	nvlist_move_nvlist(diff, field, p);
+}
+
+static void
+add_diff_num(nvlist_t *diff, const char *field, int64_t a, int64_t b)
+{
+	char sa[24], sb[24];
+
+	if (a == b)
+		return;
+	snprintf(sa, sizeof(sa), "%jd", (intmax_t)a);
+	snprintf(sb, sizeof(sb), "%jd", (intmax_t)b);
+	add_diff(diff, field, sa, sb);
+}
+
+/*
+  Write the list items separated by spaces. The result is compared
+  instead of each item.
+ */
+#define FORMAT_LIST(str, head, var, fmt, ...)                          \
+	do {                                                           \
+		size_t len;                                            \
+		FILE *fp = open_memstream(&(str), &len);               \
+		if (fp == NULL)                                        \
+			break;                                         \
+		STAILQ_FOREACH (var, head, next)                       \
+			fprintf(fp, "%s" fmt,                          \
+			    var == STAILQ_FIRST(head) ? "" : " ",      \
+			    __VA_ARGS__);                              \
+		fclose(fp);                                            \
+	} while (0)
+
+#define DIFF_LIST(field, list, var, fmt, ...)                          \
+	do {                                                           \
+		char *sa = NULL, *sb = NULL;                           \
+		const struct vm_conf *c = a;                           \
+		FORMAT_LIST(sa, &c->list, var, fmt, __VA_ARGS__);      \
+		c = b;                                                 \
+		FORMAT_LIST(sb, &c->list, var, fmt, __VA_ARGS__);      \
+		add_diff(diff, field, sa, sb);                         \
+		free(sa);                                              \
+		free(sb);                                              \
+	} while (0)
+
+/*
+  Returns the fields changed from 'a' to 'b'. Each of them has "old" and
+  "new" values as strings, or lacks one of them if it's null.
+ */
+nvlist_t *
+diff_vm_conf(const struct vm_conf *a, const struct vm_conf *b)
+{
+	nvlist_t *diff;
+	struct passthru_conf *pc;
+	struct disk_conf *dc;
+	struct iso_conf *ic;
+	struct net_conf *nc;
+	struct bhyveload_env *be;
+	struct bhyve_env *ev;
+	char ra[24], rb[24];
+
+	if ((diff = nvlist_create(0)) == NULL)
+		return NULL;
+
+#define DIFF_NUM(field, t) add_diff_num(diff, field, a->t, b->t)
+#define DIFF_STR(field, t) add_diff(diff, field, a->t, b->t)
+	DIFF_STR("name", name);
+	DIFF_NUM("owner", owner);
+	DIFF_NUM("group", group);
+	DIFF_STR("ncpu", ncpu);
+	DIFF_STR("memory", memory);
+	DIFF_NUM("wired_memory", wired_memory);
+	DIFF_NUM("utctime", utctime);
+	DIFF_NUM("reboot_on_change", reboot_on_change);
+	DIFF_NUM("single_user", single_user);
+	DIFF_NUM("install", install);
+	DIFF_STR("comport", comport);
+	DIFF_STR("debug_port", debug_port);
+	DIFF_NUM("boot", boot);
+	DIFF_NUM("boot_delay", boot_delay);
+	DIFF_NUM("boot_priority", boot_priority);
+	DIFF_NUM("loader_timeout", loader_timeout);
+	DIFF_NUM("stop_timeout", stop_timeout);
+	DIFF_STR("loader", loader);
+	DIFF_STR("bhyveload_loader", bhyveload_loader);
+	DIFF_STR("loadcmd", loadcmd);
+	DIFF_STR("installcmd", installcmd);
+	DIFF_STR("err_logfile", err_logfile);
+	DIFF_STR("grub_run_partition", grub_run_partition);
+	DIFF_NUM("hostbridge", hostbridge);
+	DIFF_STR("keymap", keymap);
+	DIFF_NUM("graphics", fbuf->enable);
+	DIFF_STR("graphics_listen", fbuf->ipaddr);
+	DIFF_NUM("graphics_port", fbuf->port);
+	if (a->fbuf->width != b->fbuf->width ||
+	    a->fbuf->height != b->fbuf->height) {
+		snprintf(ra, sizeof(ra), "%dx%d", a->fbuf->width,
+		    a->fbuf->height);
+		snprintf(rb, sizeof(rb), "%dx%d", b->fbuf->width,
+		    b->fbuf->height);
+		add_diff(diff, "graphics_res", ra, rb);
+	}
+	DIFF_STR("graphics_vga", fbuf->vgaconf);
+	DIFF_NUM("graphics_wait", fbuf->wait);
+	DIFF_STR("graphics_password", fbuf->password);
+	DIFF_NUM("xhci_mouse", mouse);
+#undef DIFF_STR
+#undef DIFF_NUM
+
+	DIFF_LIST("passthru", passthrues, pc, "%s", pc->devid);
+	DIFF_LIST("disk", disks, dc, "%s:%s", dc->type, dc->path);
+	DIFF_LIST("iso", isoes, ic, "%s:%s", ic->type, ic->path);
+	DIFF_LIST("network", nets, nc, "%s:%s", nc->type,
+	    nc->bridge ? nc->bridge : "");
+	DIFF_LIST("bhyveload_env", bhyveload_envs, be, "%s", be->env);
+	DIFF_LIST("bhyve_env", bhyve_envs, ev, "%s", ev->env);
+
+	return diff;
+}
+#undef DIFF_LIST
+#undef FORMAT_LIST
+
+/*
+  Format the value of 'key' in 'nvl' as a string, NULL if it doesn't
+  exist. Arrays are separated by spaces.
+ */
+static char *
+format_nvlist_value(const nvlist_t *nvl, const char *key)
+{
+	char *str = NULL;
+	size_t i, n, len;
+	const char *const *sa;
+	const uint64_t *na;
+	const bool *ba;
+	FILE *fp;
+
+	if (nvl == NULL || ! nvlist_exists(nvl, key) ||
+	    (fp = open_memstream(&str, &len)) == NULL)
+		return NULL;
+	if (nvlist_exists_string(nvl, key))
+		fputs(nvlist_get_string(nvl, key), fp);
+	else if (nvlist_exists_number(nvl, key))
+		fprintf(fp, "%ju", (uintmax_t)nvlist_get_number(nvl, key));
+	else if (nvlist_exists_bool(nvl, key))
+		fputs(nvlist_get_bool(nvl, key) ? "true" : "false", fp);
+	else if (nvlist_exists_string_array(nvl, key)) {
+		sa = nvlist_get_string_array(nvl, key, &n);
+		for (i = 0; i < n; i++)
+			fprintf(fp, "%s%s", i ? " " : "", sa[i]);
+	} else if (nvlist_exists_number_array(nvl, key)) {
+		na = nvlist_get_number_array(nvl, key, &n);
+		for (i = 0; i < n; i++)
+			fprintf(fp, "%s%ju", i ? " " : "", (uintmax_t)na[i]);
+	} else if (nvlist_exists_bool_array(nvl, key)) {
+		ba = nvlist_get_bool_array(nvl, key, &n);
+		for (i = 0; i < n; i++)
+			fprintf(fp, "%s%s", i ? " " : "",
+			    ba[i] ? "true" : "false");
+	} else
+		fputs("(not printable)", fp);
+	fclose(fp);
+	return str;
+}
+
+static void
+diff_nvlist_value(nvlist_t *diff, const char *prefix, const nvlist_t *a,
+    const nvlist_t *b, const char *key)
+{
+	char *sa, *sb, field[128];
+
+	snprintf(field, sizeof(field), "%s.%s", prefix, key);
+	if (a != NULL && b != NULL && nvlist_exists_nvlist(a, key) &&
+	    nvlist_exists_nvlist(b, key)) {
+		diff_nvlist(diff, field, nvlist_get_nvlist(a, key),
+		    nvlist_get_nvlist(b, key));
+		return;
+	}
+	sa = format_nvlist_value(a, key);
+	sb = format_nvlist_value(b, key);
+	add_diff(diff, field, sa, sb);
+	free(sa);
+	free(sb);
+}
+
+/*
+  Add the values changed from 'a' to 'b' to 'diff'. The fields are named
+  "<prefix>.<key>", nested nvlists are compared key by key.
+ */
+void
+diff_nvlist(nvlist_t *diff, const char *prefix, const nvlist_t *a,
+    const nvlist_t *b)
+{
+	const char *k;
+	int type;
+	void *cookie;
+
+	cookie = NULL;
+	while ((k = nvlist_next(a, &type, &cookie)) != NULL)
+		diff_nvlist_value(diff, prefix, a, b, k);
+	/* the keys only in 'b' */
+	cookie = NULL;
+	while ((k = nvlist_next(b, &type, &cookie)) != NULL)
+		if (! nvlist_exists(a, k))
+			diff_nvlist_value(diff, prefix, a, b, k);
 }
 
 static int
-del_var(struct vartree *vars, const char *k)
+grow_var_syms(void)
 {
-	struct conf_var key, *n;
+	struct var_sym **b, **v, *sym;
+	unsigned int i, n;
+	uint64_t h;
 
-	if (k == NULL)
+	n = MAX(var_sym_nbuckets * 2, VAR_SYM_BUCKETS_MIN);
+	if ((b = calloc(n, sizeof(*b))) == NULL)
 		return -1;
- 	key = (struct conf_var){.key = strdup(k), .val = NULL};
-	if (key.key == NULL)
+	if ((v = realloc(var_syms, n * sizeof(*v))) == NULL) {
+		free(b);
 		return -1;
+	}
+	for (i = 0; i < nvar_syms; i++) {
+		sym = v[i];
+		h = hash_bytes(HASH_INIT, sym->name, strlen(sym->name));
+		sym->next = b[h & (n - 1)];
+		b[h & (n - 1)] = sym;
+	}
+	free(var_sym_buckets);
+	var_sym_buckets = b;
+	var_syms = v;
+	var_sym_nbuckets = n;
+	return 0;
+}
+
+/*
+  Returns the interned symbol of variable 'name'. If it's not interned yet,
+  intern it if 'create' is true, otherwise returns NULL.
+ */
+static struct var_sym *
+intern_var(const char *name, bool create)
+{
+	struct var_sym *sym;
+	size_t len = strlen(name);
+	uint64_t h = hash_bytes(HASH_INIT, name, len);
+
+	if (var_sym_nbuckets > 0)
+		for (sym = var_sym_buckets[h & (var_sym_nbuckets - 1)];
+		     sym != NULL; sym = sym->next)
+			if (strcmp(sym->name, name) == 0)
+				return sym;
+	if (! create)
+		return NULL;
+
+	if (nvar_syms == var_sym_nbuckets && grow_var_syms() < 0)
+		return NULL;
+	if ((sym = malloc(sizeof(*sym) + len + 1)) == NULL)
+		return NULL;
+	memcpy(sym->name, name, len + 1);
+	sym->id = nvar_syms;
+	sym->next = var_sym_buckets[h & (var_sym_nbuckets - 1)];
+	var_sym_buckets[h & (var_sym_nbuckets - 1)] = sym;
+	var_syms[nvar_syms++] = sym;
+	return sym;
+}
+
+void
+free_var_names(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nvar_syms; i++)
+		free(var_syms[i]);
+	free(var_syms);
+	free(var_sym_buckets);
+	var_syms = var_sym_buckets = NULL;
+	var_sym_nbuckets = nvar_syms = 0;
+}
 
-	n = RB_REMOVE(vartree, vars, &key);
-	if (n == NULL)
+static inline char *
+get_slot(struct vartree *vars, const struct var_sym *sym)
+{
+	return (vars != NULL && sym->id < vars->nvals) ? vars->vals[sym->id] :
+							 NULL;
+}
+
+/*
+  Copy 's' to the chunks of 'vars'. A large value gets its own chunk
+  so that the current chunk can be filled up.
+ */
+static char *
+vartree_strdup(struct vartree *vars, const char *s)
+{
+	struct var_chunk *c = vars->chunks;
+	size_t len = strlen(s) + 1, size;
+	char *p;
+
+	if (c == NULL || c->size - c->used < len) {
+		size = MAX(len, VAR_CHUNK_SIZE);
+		if ((c = malloc(sizeof(*c) + size)) == NULL)
+			return NULL;
+		c->size = size;
+		c->used = 0;
+		if (len > VAR_CHUNK_SIZE / 2 && vars->chunks != NULL) {
+			c->next = vars->chunks->next;
+			vars->chunks->next = c;
+		} else {
+			c->next = vars->chunks;
+			vars->chunks = c;
+		}
+	}
+	p = c->data + c->used;
+	memcpy(p, s, len);
+	c->used += len;
+	return p;
+}
+
+static int
+del_var(struct vartree *vars, const char *k)
+{
+	struct var_sym *sym;
+
+	if (k == NULL || (sym = intern_var(k, false)) == NULL ||
+	    get_slot(vars, sym) == NULL)
 		return -1;
-	free(n->key);
-	free(n->val);
-	free(n);
+	vars->vals[sym->id] = NULL;
 	return 0;
 }
 
 int
 set_var0(struct vartree *vars, const char *k, const char *v)
 {
-	struct conf_var *n, key;
-	char *nv;
+	struct var_sym *sym;
+	unsigned int n;
+	char **nv, *p;
 
-	if (k == NULL || v == NULL)
+	if (k == NULL || v == NULL || (sym = intern_var(k, true)) == NULL)
 		return -1;
 
- 	key = (struct conf_var){.key = strdup(k), .val = NULL};
-	if (key.key == NULL)
-		return -1;
-
-	if ((n = RB_FIND(vartree, vars, &key))) {
-		if ((nv = strdup(v)) == NULL)
+	if (sym->id >= vars->nvals) {
+		n = roundup2(sym->id + 1, 8);
+		if ((nv = realloc(vars->vals, n * sizeof(*nv))) == NULL)
 			return -1;
-		free(key.key);
-		free(n->val);
-		n->val = nv;
-	} else {
-		n = malloc(sizeof(*n));
-		key.val = strdup(v);
-		if (n == NULL || key.val == NULL) {
-			free(key.key);
-			free(key.val);
-			free(n);
-			return -1;
-		}
-		memcpy(n, &key, sizeof(*n));
-		RB_INSERT(vartree, vars, n);
+		memset(&nv[vars->nvals], 0, (n - vars->nvals) * sizeof(*nv));
+		vars->vals = nv;
+		vars->nvals = n;
 	}
+	/* The old value is left in the chunk until the vartree is freed. */
+	if ((p = vartree_strdup(vars, v)) == NULL)
+		return -1;
+	vars->vals[sym->id] = p;
 	return 0;
 }
 
@@ -1603,9 +2086,8 @@ init_global_vars(void)
 {
 	struct vartree *gv;
 
-	if ((gv = malloc(sizeof(*gv))) == NULL)
+	if ((gv = create_vartree()) == NULL)
 		return -1;
-	RB_INIT(gv);
 	if (set_var0(gv, "LOCALBASE", LOCALBASE) < 0)
 		ERR("%s\n", "failed to set \"LOCALBASE\" variable!");
 	global_vars = gv;
@@ -1631,32 +2113,326 @@ free_global_vars(void)
 	global_vars = NULL;
 }
 
+/*
+  FNV-1a hash. Start with HASH_INIT.
+ */
+uint64_t
+hash_bytes(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *c = p;
+
+	while (len-- > 0)
+		h = (h ^ *c++) * 0x100000001b3ULL;
+	return h;
+}
+
+static int
+compare_var_sym(const void *a, const void *b)
+{
+	struct var_sym *const *x = a, *const *y = b;
+	return strcmp((*x)->name, (*y)->name);
+}
+
+/*
+  Call 'cb' for each variable in the order of keys. Stop if 'cb' fails.
+ */
+int
+walk_vartree(struct vartree *vars,
+    int (*cb)(const char *, const char *, void *), void *data)
+{
+	struct var_sym **syms;
+	unsigned int i, n = 0;
+	int rc = 0;
+
+	if (vars == NULL || vars->nvals == 0)
+		return 0;
+	if ((syms = malloc(vars->nvals * sizeof(*syms))) == NULL)
+		return -1;
+	for (i = 0; i < vars->nvals; i++)
+		if (vars->vals[i] != NULL)
+			syms[n++] = var_syms[i];
+	qsort(syms, n, sizeof(*syms), compare_var_sym);
+	for (i = 0; i < n; i++)
+		if ((*cb)(syms[i]->name, vars->vals[syms[i]->id], data) < 0) {
+			rc = -1;
+			break;
+		}
+	free(syms);
+	return rc;
+}
+
+/*
+  The variables are hashed in the order of the symbol id. It's stable
+  while the process is running.
+ */
+uint64_t
+hash_vartree(struct vartree *vars)
+{
+	unsigned int i;
+	uint64_t h = HASH_INIT;
+
+	if (vars == NULL)
+		return h;
+	for (i = 0; i < vars->nvals; i++) {
+		if (vars->vals[i] == NULL)
+			continue;
+		h = hash_bytes(h, var_syms[i]->name,
+		    strlen(var_syms[i]->name) + 1);
+		h = hash_bytes(h, vars->vals[i], strlen(vars->vals[i]) + 1);
+	}
+	return h;
+}
+
+/*
+  128-bit FNV-1a hash. The prime 2^88 + 0x13b is multiplied by 32-bit
+  halves not to depend on a 128-bit integer type.
+ */
+void
+hash128_bytes(struct conf_hash *h, const void *p, size_t len)
+{
+	const unsigned char *c = p;
+	uint64_t t0, t1, lo;
+
+	while (len-- > 0) {
+		h->lo ^= *c++;
+		t0 = (h->lo & 0xffffffff) * 0x13b;
+		t1 = (h->lo >> 32) * 0x13b;
+		lo = t0 + (t1 << 32);
+		h->hi = h->hi * 0x13b + (t1 >> 32) + (lo < t0) + (h->lo << 24);
+		h->lo = lo;
+	}
+}
+
+static void
+hash_num(struct conf_hash *h, int64_t n)
+{
+	hash128_bytes(h, &n, sizeof(n));
+}
+
+static void
+hash_str(struct conf_hash *h, const char *s)
+{
+	uint64_t len = s ? strlen(s) : UINT64_MAX;
+
+	hash128_bytes(h, &len, sizeof(len));
+	if (s != NULL)
+		hash128_bytes(h, s, len);
+}
+
+bool
+conf_hash_equal(const struct conf_hash *a, const struct conf_hash *b)
+{
+	/* zero is not computed yet */
+	return a->hi == b->hi && a->lo == b->lo && (a->hi | a->lo) != 0;
+}
+
+/*
+  Hash the same fields as compare_vm_conf() except 'install' that is
+  changed while the vm is running. 'restart_hash' leaves out the fields
+  that bmd applies to the running vm without restarting it.
+ */
+void
+hash_vm_conf(struct vm_conf *conf)
+{
+	struct conf_hash h[2] = { CONF_HASH_INIT, CONF_HASH_INIT };
+	struct passthru_conf *pc;
+	struct disk_conf *dc;
+	struct iso_conf *ic;
+	struct net_conf *nc;
+	struct bhyveload_env *be;
+	struct bhyve_env *ev;
+	int i;
+
+	/* h[0] is of all fields, h[1] is of the fields to restart. */
+#define HOT_NUM(t) hash_num(&h[0], conf->t)
+#define HOT_STR(t) hash_str(&h[0], conf->t)
+#define HASH_NUM(t) for (i = 0; i < 2; i++) hash_num(&h[i], conf->t)
+#define HASH_STR(t) ITEM_STR(conf->t)
+#define ITEM_STR(s) for (i = 0; i < 2; i++) hash_str(&h[i], s)
+	HOT_NUM(boot_delay);
+	HOT_NUM(boot_priority);
+	HOT_NUM(loader_timeout);
+	HOT_NUM(stop_timeout);
+	HASH_NUM(hostbridge);
+	HOT_NUM(owner);
+	HOT_NUM(group);
+	HASH_STR(debug_port);
+	HASH_STR(ncpu);
+	HASH_STR(memory);
+	HASH_STR(name);
+	HASH_STR(comport);
+	HOT_NUM(boot);
+	HASH_STR(loader);
+	HASH_STR(loadcmd);
+	HASH_STR(installcmd);
+	HOT_STR(err_logfile);
+	HASH_STR(grub_run_partition);
+	HASH_STR(bhyveload_loader);
+	HASH_STR(keymap);
+	HASH_NUM(fbuf->enable);
+	HASH_STR(fbuf->ipaddr);
+	HASH_NUM(fbuf->port);
+	HASH_NUM(fbuf->width);
+	HASH_NUM(fbuf->height);
+	HASH_STR(fbuf->vgaconf);
+	HASH_NUM(fbuf->wait);
+	HASH_STR(fbuf->password);
+	HASH_NUM(mouse);
+	HASH_NUM(wired_memory);
+	HASH_NUM(utctime);
+	HOT_NUM(reboot_on_change);
+	HASH_NUM(single_user);
+	HASH_NUM(ndisks);
+	HASH_NUM(nisoes);
+	HASH_NUM(nnets);
+	HASH_NUM(npassthrues);
+	HASH_NUM(nbhyveload_envs);
+	HASH_NUM(nbhyve_envs);
+
+	STAILQ_FOREACH (pc, &conf->passthrues, next)
+		ITEM_STR(pc->devid);
+	STAILQ_FOREACH (dc, &conf->disks, next) {
+		ITEM_STR(dc->type);
+		ITEM_STR(dc->path);
+	}
+	STAILQ_FOREACH (ic, &conf->isoes, next) {
+		ITEM_STR(ic->type);
+		ITEM_STR(ic->path);
+	}
+	STAILQ_FOREACH (nc, &conf->nets, next) {
+		ITEM_STR(nc->type);
+		ITEM_STR(nc->bridge);
+	}
+	STAILQ_FOREACH (be, &conf->bhyveload_envs, next)
+		ITEM_STR(be->env);
+	STAILQ_FOREACH (ev, &conf->bhyve_envs, next)
+		ITEM_STR(ev->env);
+#undef ITEM_STR
+#undef HASH_STR
+#undef HASH_NUM
+#undef HOT_STR
+#undef HOT_NUM
+
+	conf->hash = h[0];
+	conf->restart_hash = h[1];
+}
+
+static void
+hash_nvlist_value(struct conf_hash *h, const nvlist_t *nvl, const char *k,
+    int type)
+{
+	size_t i, n;
+	const void *p;
+	const bool *ba;
+	const uint64_t *na;
+	const char *const *sa;
+	const nvlist_t *const *la;
+	const int *da;
+
+	switch (type) {
+	case NV_TYPE_BOOL:
+		hash_num(h, nvlist_get_bool(nvl, k));
+		break;
+	case NV_TYPE_NUMBER:
+		hash_num(h, nvlist_get_number(nvl, k));
+		break;
+	case NV_TYPE_STRING:
+		hash_str(h, nvlist_get_string(nvl, k));
+		break;
+	case NV_TYPE_NVLIST:
+		hash_nvlist(h, nvlist_get_nvlist(nvl, k));
+		break;
+	case NV_TYPE_DESCRIPTOR:
+		hash_num(h, nvlist_get_descriptor(nvl, k));
+		break;
+	case NV_TYPE_BINARY:
+		p = nvlist_get_binary(nvl, k, &n);
+		hash_num(h, n);
+		hash128_bytes(h, p, n);
+		break;
+	case NV_TYPE_BOOL_ARRAY:
+		ba = nvlist_get_bool_array(nvl, k, &n);
+		for (i = 0; i < n; i++)
+			hash_num(h, ba[i]);
+		break;
+	case NV_TYPE_NUMBER_ARRAY:
+		na = nvlist_get_number_array(nvl, k, &n);
+		for (i = 0; i < n; i++)
+			hash_num(h, na[i]);
+		break;
+	case NV_TYPE_STRING_ARRAY:
+		sa = nvlist_get_string_array(nvl, k, &n);
+		for (i = 0; i < n; i++)
+			hash_str(h, sa[i]);
+		break;
+	case NV_TYPE_NVLIST_ARRAY:
+		la = nvlist_get_nvlist_array(nvl, k, &n);
+		for (i = 0; i < n; i++)
+			hash_nvlist(h, la[i]);
+		break;
+	case NV_TYPE_DESCRIPTOR_ARRAY:
+		da = nvlist_get_descriptor_array(nvl, k, &n);
+		for (i = 0; i < n; i++)
+			hash_num(h, da[i]);
+		break;
+	default:
+		return;
+	}
+}
+
+/*
+  Hash 'nvl' regardless of the order of the keys as compare_nvlist() does.
+ */
+void
+hash_nvlist(struct conf_hash *h, const nvlist_t *nvl)
+{
+	struct conf_hash e, sum = { 0, 0 };
+	const char *k;
+	int type;
+	void *cookie = NULL;
+
+	if (nvl == NULL || nvlist_error(nvl)) {
+		hash_num(h, -1);
+		return;
+	}
+	while ((k = nvlist_next(nvl, &type, &cookie)) != NULL) {
+		e = (struct conf_hash)CONF_HASH_INIT;
+		hash_str(&e, k);
+		hash_num(&e, type);
+		hash_nvlist_value(&e, nvl, k, type);
+		sum.lo += e.lo;
+		sum.hi += e.hi + (sum.lo < e.lo);
+	}
+	hash128_bytes(h, &sum, sizeof(sum));
+}
+
 char *
 get_var0(struct vartree *vars, char *k)
 {
-	struct conf_var *r, key = {.key = k, .val = NULL};
+	struct var_sym *sym;
 
-	if (vars == NULL)
+	if (vars == NULL || (sym = intern_var(k, false)) == NULL)
 		return NULL;
-
-	if ((r = RB_FIND(vartree, vars, &key)) != NULL)
-		return r->val;
-	return NULL;
+	return get_slot(vars, sym);
 }
 
 char *
 get_var(struct variables *vars, char *k)
 {
+	struct var_sym *sym;
 	char *ret;
 
+	if ((sym = intern_var(k, false)) == NULL)
+		return NULL;
 	/*
 	 * Lookup local variables first. This pretends for users
 	 * that global variables are re-writable in vm and
-	 * template section.
+	 * template section. The global ones are shared by all VMs
+	 * and a local assignment only shadows them.
 	 */
-	if ((ret = get_var0(vars->args, k)) == NULL &&
-	    (ret = get_var0(vars->local, k)) == NULL &&
-	    (ret = get_var0(vars->global, k)) == NULL)
+	if ((ret = get_slot(vars->args, sym)) == NULL &&
+	    (ret = get_slot(vars->local, sym)) == NULL &&
+	    (ret = get_slot(vars->global, sym)) == NULL)
 		return NULL;
 
 	return ret;
@@ -18,6 +18,8 @@ struct global_conf {
 	char *cmd_sock_path;
 	char *unix_domain_socket_mode;
 	int nmdm_offset;
+	int boot_concurrency;
+	int boot_rate;
 	int foreground;
 };
 
@@ -26,6 +28,11 @@ struct passthru_conf {
 	char *devid;
 };
 
+struct depend_conf {
+	STAILQ_ENTRY(depend_conf) next;
+	char *name;
+};
+
 struct disk_conf {
 	STAILQ_ENTRY(disk_conf) next;
 	char *type;
@@ -66,12 +73,10 @@ struct bhyve_env {
 	char env[0];
 };
 
-struct conf_var {
-	RB_ENTRY(conf_var) entry;
-	char *key, *val;
-};
-
-RB_HEAD(vartree, conf_var);
+/*
+  Variables of a scope, implemented in conf.c.
+ */
+struct vartree;
 extern struct vartree *global_vars;
 
 struct variables {
@@ -85,13 +90,27 @@ _Static_assert(sizeof(int64_t) > sizeof(uid_t),
     "uid_t must be shorter than int64_t");
 _Static_assert(sizeof(int64_t) > sizeof(gid_t),
     "gid_t must be shorter than int64_t");
+/*
+  128-bit content hash of a configuration.
+ */
+struct conf_hash {
+	uint64_t hi;
+	uint64_t lo;
+};
+
+#define CONF_HASH_INIT { 0x6c62272e07bb0142ULL, 0x62b821756295c58dULL }
+
 struct vm_conf {
 	struct variables vars;
+	uint64_t generation;
+	struct conf_hash hash;
+	struct conf_hash restart_hash;
 	struct fbuf *fbuf;
 	STAILQ_HEAD(, disk_conf) disks;
 	STAILQ_HEAD(, iso_conf) isoes;
 	STAILQ_HEAD(, net_conf) nets;
 	STAILQ_HEAD(, passthru_conf) passthrues;
+	STAILQ_HEAD(, depend_conf) depends;
 	char *keymap;
 	char *backend;
 	char *debug_port;
@@ -112,13 +131,16 @@ struct vm_conf {
 	int nisoes;
 	int nnets;
 	int npassthrues;
+	int ndepends;
 	int boot_delay;
+	int boot_priority;
 	int loader_timeout;
 	int stop_timeout;
 	bool mouse;
 	bool wired_memory;
 	bool utctime;
 	bool reboot_on_change;
+	bool ready_signal;
 	bool single_user;
 	bool install;
 	char *bhyveload_loader;
@@ -128,8 +150,10 @@ struct vm_conf {
 	STAILQ_HEAD(, bhyve_env) bhyve_envs;
 };
 
+struct vm_args;
 struct vm {
 	struct vm_conf *conf;
+	struct vm_args *args;
 	enum STATE state;
 	pid_t pid;
 	STAILQ_HEAD(, net_conf) taps;
@@ -146,8 +170,10 @@ struct vm {
 #define ARRAY_FOREACH(p, a) \
 	for (p = &a[0]; p < &a[nitems(a)]; p++)
 
+struct vartree *create_vartree(void);
 void free_vartree(struct vartree *);
 void free_passthru_conf(struct passthru_conf *);
+void free_depend_conf(struct depend_conf *);
 void free_disk_conf(struct disk_conf *);
 void free_iso_conf(struct iso_conf *);
 void free_net_conf(struct net_conf *);
@@ -156,6 +182,7 @@ void free_bhyveload_env(struct bhyveload_env *);
 void free_bhyve_env(struct bhyve_env *);
 void free_fbuf(struct fbuf *);
 void clear_passthru_conf(struct vm_conf *);
+void clear_depend_conf(struct vm_conf *);
 void clear_disk_conf(struct vm_conf *);
 void clear_iso_conf(struct vm_conf *);
 void clear_net_conf(struct vm_conf *);
@@ -163,6 +190,7 @@ void clear_bhyveload_env(struct vm_conf *);
 void clear_bhyve_env(struct vm_conf *);
 
 int add_passthru_conf(struct vm_conf *, const char *);
+int add_depend_conf(struct vm_conf *, const char *);
 int add_disk_conf(struct vm_conf *, const char *, const char *);
 int add_iso_conf(struct vm_conf *, const char *, const char *);
 int add_net_conf(struct vm_conf *, const char *, const char *);
@@ -185,10 +213,12 @@ int set_owner(struct vm_conf *, uid_t);
 int set_group(struct vm_conf *, gid_t);
 int set_boot(struct vm_conf *, enum BOOT);
 int set_hostbridge(struct vm_conf *, enum HOSTBRIDGE_TYPE);
-int set_backend(struct vm_conf *, char *);
+int set_backend(struct vm_conf *, const char *);
 int set_boot_delay(struct vm_conf *, int);
+int set_boot_priority(struct vm_conf *, int);
 int set_comport(struct vm_conf *, const char *);
 int set_reboot_on_change(struct vm_conf *, bool);
+int set_ready_signal(struct vm_conf *, bool);
 int set_single_user(struct vm_conf *, bool);
 int set_install(struct vm_conf *, bool);
 int set_fbuf_enable(struct fbuf *, bool);
@@ -215,6 +245,9 @@ int compare_iso_conf(const struct iso_conf *, const struct iso_conf *);
 int compare_net_conf(const struct net_conf *, const struct net_conf *);
 int compare_vm_conf(const struct vm_conf *, const struct vm_conf *);
 int compare_nvlist(const nvlist_t *, const nvlist_t *);
+nvlist_t *diff_vm_conf(const struct vm_conf *, const struct vm_conf *);
+void diff_nvlist(nvlist_t *, const char *, const nvlist_t *,
+    const nvlist_t *);
 
 int set_var0(struct vartree *, const char *, const char *);
 int set_var(struct variables *, const char *, const char *);
@@ -223,8 +256,20 @@ char *get_var(struct variables *, char *);
 int init_global_vars(void);
 void set_global_vars(struct vartree *);
 void free_global_vars(void);
+void free_var_names(void);
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+uint64_t hash_bytes(uint64_t, const void *, size_t);
+uint64_t hash_vartree(struct vartree *);
+int walk_vartree(struct vartree *,
+    int (*)(const char *, const char *, void *), void *);
+void hash128_bytes(struct conf_hash *, const void *, size_t);
+void hash_vm_conf(struct vm_conf *);
+void hash_nvlist(struct conf_hash *, const nvlist_t *);
+bool conf_hash_equal(const struct conf_hash *, const struct conf_hash *);
 
 void free_id_list(void);
+int register_id(const char *, unsigned int);
 
 int set_string(char **, const char *);
 
@@ -33,6 +33,8 @@
 #include <sys/jail.h>
 #include <sys/queue.h>
 #include <sys/time.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "y.tab.h"
@@ -50,6 +52,34 @@ struct cfexpr {
 	struct cfexpr		*left, *right;
 };
 
+/*
+  Arithmetic expression compiled to RPN. The literal numbers are converted
+  and the subexpressions without variables are folded to constants.
+ */
+enum CF_OP {
+	OP_NUM,		/* push 'num' */
+	OP_VAR,		/* push the value of variable 'name' */
+	OP_BAD,		/* invalid number 'name' or unknown operator */
+	OP_NEG,
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_MOD,
+};
+
+struct cfcode {
+	enum CF_OP		op;
+	long			num;
+	char			*name;
+};
+
+struct cfprog {
+	int			ncodes;
+	int			depth;
+	struct cfcode		code[0];
+};
+
 STAILQ_HEAD(cftokens, cftoken);
 
 struct cftoken {
@@ -58,6 +88,7 @@ struct cftoken {
 	char 			*s;
 	size_t			len;
 	struct cfexpr		*expr;
+	struct cfprog		*prog;
 	char 			*filename;
 	int 			lineno;
 };
@@ -105,16 +136,36 @@ struct cfsection {
 	int			duplicate;
 	uid_t                   owner;
 	char                    *filename;
+	uint64_t		serial;
 };
 
 STAILQ_HEAD(cffiles, cffile);
 
+/*
+  'dev', 'ino' and 'ctime' are stat of the file when it's included.
+ */
 struct cffile {
 	char *filename;
 	int line;
+	dev_t dev;
+	ino_t ino;
+	struct timespec ctime;
 	STAILQ_ENTRY(cffile) next;
 };
 
+STAILQ_HEAD(cfincludes, cfinclude);
+
+/*
+  Directory globbed by .include macro.
+ */
+struct cfinclude {
+	STAILQ_ENTRY(cfinclude) next;
+	char *dirname;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+};
+
 enum mpool_error {
 	MPERR_NONE,
 	MPERR_ALLOC,
@@ -133,14 +184,32 @@ struct mpool {
 	char data[0];
 };
 
-#define DEFAULT_MMAP_SIZE  (PAGE_SIZE * 64)
-
+/*
+  A pool is reserved for a file at once and sized by the file size
+  and the last usage. The load pool keeps the list of all files.
+  The pools of the cached files are trimmed to the used pages and
+  their total is limited by MPOOL_CACHE_MAX.
+ */
+#define MPOOL_MIN_SIZE    (PAGE_SIZE * 64)
+#define MPOOL_MAX_SIZE    ((size_t)1 << 30)
+#define MPOOL_LOAD_SIZE   ((size_t)64 << 20)
+#define MPOOL_CACHE_MAX   ((size_t)256 << 20)
+#define MPOOL_FILE_RATIO  64
+
+/*
+  A file is parsed into its own context.
+  'vardep' is set if any .include macro refers variables.
+  'nocache' is set if the parse result can't be reused.
+ */
 struct parser_context {
 	struct cfsections cfglobals;
 	struct cfsections cftemplates;
 	struct cfsections cfvms;
 	struct cffiles    cffiles;
+	struct cfincludes cfincludes;
 	struct cffile    *cur_file;
+	bool		  vardep;
+	bool		  nocache;
 };
 
 extern int yydebug;
@@ -150,7 +219,7 @@ extern int yynerrs;
 extern YYSTYPE yyval;
 extern FILE *yyin;
 extern int lineno;
-extern struct parser_context *pctxt, *pctxt_snapshot;
+extern struct parser_context *pctxt;
 
 int yyparse(void);
 void yyerror(const char *);
@@ -165,6 +234,7 @@ uid_t peek_fileowner(void);
 
 void *mpool_alloc(size_t);
 #define objalloc(t)    mpool_alloc(sizeof(struct t))
+struct cfprog *compile_expr(struct cfexpr *);
 
 void free_cfexpr(struct cfexpr *);
 void free_cftoken(struct cftoken *);
@@ -346,18 +346,36 @@ tokens	:
 		ct->s = NULL;
 		ct->len = 0;
 		ct->expr = $3;
+		if ((ct->prog = compile_expr($3)) == NULL)
+			goto yyabort;
 		STAILQ_INSERT_TAIL($$, ct, next);
 	}
 	| tokens STR
 	{
 		struct cftoken *ct;
+		size_t len;
+		char *s;
 		$$ = $1;
-		if ($2 == NULL || (ct = create_token(CF_STR)) == NULL)
-			goto yyabort;
-		ct->s = $2;
-		ct->len = strlen($2);
-		ct->expr = NULL;
-		STAILQ_INSERT_TAIL($$, ct, next);
+		if ($2 == NULL)
+			goto yyabort;
+		/* Join adjacent strings, a constant value is a single token. */
+		ct = STAILQ_LAST($$, cftoken, next);
+		if (ct != NULL && ct->type == CF_STR) {
+			len = strlen($2);
+			if ((s = mpool_alloc(ct->len + len + 1)) == NULL)
+				goto yyabort;
+			memcpy(s, ct->s, ct->len);
+			memcpy(&s[ct->len], $2, len + 1);
+			ct->s = s;
+			ct->len += len;
+		} else {
+			if ((ct = create_token(CF_STR)) == NULL)
+				goto yyabort;
+			ct->s = $2;
+			ct->len = strlen($2);
+			ct->expr = NULL;
+			STAILQ_INSERT_TAIL($$, ct, next);
+		}
 	}
 	| tokens VAR
 	{
@@ -504,7 +522,6 @@ static struct cfsection *
 add_section(enum SECTION sec, char *name)
 {
 	static struct cfsections *section;
-	static const char *sec_names[] = { "global", "template", "vm" };
 	struct cfsection *v;
 
 	switch (sec) {
@@ -519,15 +536,7 @@ add_section(enum SECTION sec, char *name)
 		break;
 	}
 
-	if (name != NULL && sec != SECTION_GLOBAL)
-		STAILQ_FOREACH (v, section, next)
-			if (strcmp(v->name, name) == 0) {
-				ERR("%s: %s '%s' already exists.",
-				    peek_filename(), sec_names[sec], name);
-				v->duplicate++;
-				break;
-			}
-
+	/* Duplicated names are checked after all files are parsed. */
 	if ((v = objalloc(cfsection)) == NULL)
 		return NULL;
 	memset(v, 0, sizeof(*v));
@@ -549,6 +558,7 @@ create_token(enum CF_TYPE t)
 		return NULL;
 
 	tk->type = t;
+	tk->prog = NULL;
 	tk->filename = peek_filename();
 	tk->lineno = lineno;
 	return tk;
@@ -1,12 +1,17 @@
+#include <sys/param.h>
 #include <sys/queue.h>
 #include <sys/event.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/poll.h>
 #include <netinet/in.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
@@ -16,6 +21,8 @@
 #include "server.h"
 #include "bmd.h"
 #include "inspect.h"
+#include "statetab.h"
+#include "userdb.h"
 
 int control(int, char *[]);
 struct vm_conf_entry *lookup_vm_conf(const char *);
@@ -30,13 +37,23 @@ usage(int argc __unused, char *argv[])
 	    "  shutdown <name>      : ACPI shutdown VM\n"
 	    "  poweroff <name>      : poweroff VM\n"
 	    "  reset <name>         : reset VM\n"
+	    "  ready <name>         : notify VM is ready\n"
 	    "  console <name>       : connect to com port\n"
 	    "  showcomport <name>   : show comport\n"
 	    "  showvgaport <name>   : show vgaport\n"
 	    "  showconfig [<name>]  : show VM config\n"
+	    "  diffconfig <name>    : show changes from running VM config\n"
 	    "  inspect <name>       : inspect and print installcmd & loadcmd\n"
 	    "  run [-i] [-s] <name> : directly run with serial console\n"
-	    "  list                 : list VM name & status\n",
+	    "  list [-mr] [-F fields] [-S field] [-s state] [-u owner] [-n name]\n"
+	    "       [-l loader] [-b backend] [-p count]\n"
+	    "                       : list VM name & status\n"
+	    "  stats                : show internal counters of bmd\n"
+	    "  batch                : run \"<subcommand> [<name>]\" lines from stdin\n"
+	    "  watch [-n name] [-u owner]\n"
+	    "                       : print events of VMs\n"
+	    "  wait [-t timeout] <name> <state>\n"
+	    "                       : wait for VM to get to state\n",
 	    argv[0]);
 	return 1;
 }
@@ -47,7 +64,16 @@ lookup_vm_conf(const char *name)
 	struct vm_conf_entry *conf_ent, *cen, *ret = NULL;
 	struct vm_conf_head list = LIST_HEAD_INITIALIZER();
 
-	if (load_config_file(&list, false) < 0) {
+	/* Build only the VM if the config snapshot is fresh. */
+	switch (lookup_config_snapshot(name, &ret)) {
+	case 1:
+		LIST_NEXT(ret, next) = NULL;
+		return ret;
+	case 0:
+		return NULL;
+	}
+
+	if (load_config_file(&list, false, NULL) < 0) {
 		printf("failed to load VM config files\n");
 		return NULL;
 	}
@@ -111,14 +137,6 @@ do_inspect(char *name)
 	return 0;
 }
 
-static int
-compare_by_name(const void *a, const void *b)
-{
-#define GETNAME(v) nvlist_get_string(*((nvlist_t *const *)v), "name")
-	return strcmp(GETNAME(a), GETNAME(b));
-#undef GETNAME
-}
-
 static int
 recv_size(int sock, uint32_t *sz, int *fd)
 {
@@ -172,98 +190,758 @@ ret:
 	return rc;
 }
 
+/*
+  Receive a message from the connected socket 's'.
+ */
 static nvlist_t *
-send_recv(nvlist_t *cmd)
+recv_res(int s)
 {
-	int s, fd, rc;
-	nvlist_t *res = NULL;
+	int fd;
+	nvlist_t *res;
 	uint32_t sz;
 
-	if ((s = connect_to_server(gl_conf)) < 0) {
-		printf("cannot connect to %s\n", gl_conf->cmd_sock_path);
+	if (recv_size(s, &sz, &fd) < 0) {
+		printf("server doen't return the size of message\n");
+		return NULL;
+	}
+
+	if ((res = nvlist_recv(s, 0)) == NULL) {
+		printf("server returns null\n");
 		return NULL;
 	}
 
+	if (fd != -1)
+		nvlist_add_number(res, FD_KEY, fd);
+	return res;
+}
+
+/*
+  Send 'cmd' over the connected socket 's'.
+ */
+static int
+send_req(int s, nvlist_t *cmd)
+{
+	int rc;
+	uint32_t sz;
+
 	sz = htonl(nvlist_size(cmd));
 	while ((rc = send(s, &sz, sizeof(sz), 0)) < 0)
 		if (errno != EINTR)
 			break;
-	if (rc <= 0) {
+	if (rc <= 0 || nvlist_send(s, cmd) < 0) {
 		printf("cannot send to bmd\n");
-		goto end;
-	}
-	if (nvlist_send(s, cmd) < 0) {
-		printf("cannot send to bmd\n");
-		goto end;
+		return -1;
 	}
+	return 0;
+}
 
-	if (recv_size(s, &sz, &fd) < 0) {
-		printf("server doen't return the size of message\n");
-		goto end;
+/*
+  Send 'cmd' and receive the response over the connected socket 's'.
+ */
+static nvlist_t *
+send_recv0(int s, nvlist_t *cmd)
+{
+	if (send_req(s, cmd) < 0)
+		return NULL;
+	return recv_res(s);
+}
+
+static void
+load_global_conf(void)
+{
+	if (load_config_file(NULL, 1, NULL) < 0)
+		fprintf(stderr, "failed to load %s. use default value\n",
+			gl_conf->config_file);
+}
+
+static int
+connect_to_bmd(void)
+{
+	int s;
+
+	if ((s = connect_to_server(gl_conf)) < 0)
+		printf("cannot connect to %s\n", gl_conf->cmd_sock_path);
+	return s;
+}
+
+static nvlist_t *
+send_recv(nvlist_t *cmd)
+{
+	int s;
+	nvlist_t *res;
+
+	if ((s = connect_to_bmd()) < 0)
+		return NULL;
+	res = send_recv0(s, cmd);
+	close(s);
+	return res;
+}
+
+/*
+  Columns of the list subcommand.
+ */
+static const struct {
+	const char *name;
+	int width;
+} list_columns[] = {
+	{ "name", 20 },
+	{ "ncpu", 5 },
+	{ "memory", 7 },
+	{ "loader", 10 },
+	{ "backend", 10 },
+	{ "state", 12 },
+	{ "owner", 12 },
+	{ "pid", 8 },
+	{ "boots", 6 },
+	{ "comport", 14 },
+};
+
+#define LIST_PAGE_SIZE	500
+
+static int
+get_list_column(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < nitems(list_columns); i++)
+		if (strcmp(list_columns[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+static void
+print_list_row(const char *const *fields, size_t nfields, const nvlist_t *p)
+{
+	size_t i;
+	const char *v;
+	int c;
+
+	for (i = 0; i < nfields; i++) {
+		c = get_list_column(fields[i]);
+		v = (p == NULL) ? fields[i] :
+		    nvlist_exists_string(p, fields[i]) ?
+		    nvlist_get_string(p, fields[i]) : "-";
+		printf("%*s", list_columns[c].width, v);
 	}
+	printf("\n");
+}
 
-	if ((res = nvlist_recv(s, 0)) == NULL) {
-		printf("server returns null\n");
+static int
+compare_list_nvlist(const void *a, const void *b)
+{
+	return strcmp(nvlist_get_string(*(nvlist_t *const *)a, "name"),
+	    nvlist_get_string(*(nvlist_t *const *)b, "name"));
+}
+
+/*
+  Add the used entries of the state table 't' that match the filters of
+  'cmd' to 'rows'. 't' is closed.
+ */
+static int
+read_state_rows(struct state_table *t, const nvlist_t *cmd,
+    nvlist_t ***rows, size_t *nrows)
+{
+	struct state_table_entry e;
+	uint32_t i, n;
+	uid_t uid;
+	nvlist_t *p, **r;
+	const char *state, *owner;
+	char buf[32];
+
+	if (t == NULL)
+		return -1;
+	if (nvlist_exists_string(cmd, "owner") &&
+	    lookup_user(nvlist_get_string(cmd, "owner"), &uid, NULL) < 0)
 		goto end;
+	n = state_table_size(t);
+	for (i = 0; i < n; i++) {
+		if (read_state_entry(t, i, &e) <= 0)
+			continue;
+		state = get_state_string(e.state);
+		if ((nvlist_exists_string(cmd, "state") &&
+			strcasecmp(nvlist_get_string(cmd, "state"), state) != 0) ||
+		    (nvlist_exists_string(cmd, "owner") && e.owner != uid) ||
+		    (nvlist_exists_string(cmd, "name") &&
+			fnmatch(nvlist_get_string(cmd, "name"), e.name, 0) != 0))
+			continue;
+		if (*nrows % 64 == 0) {
+			if ((r = realloc(*rows, (*nrows + 64) * sizeof(*r))) ==
+			    NULL)
+				break;
+			*rows = r;
+		}
+		p = nvlist_create(0);
+		nvlist_add_string(p, "name", e.name);
+		nvlist_add_string(p, "state", state);
+		if ((owner = lookup_user_name(e.owner, NULL)) == NULL)
+			owner = "nobody";
+		nvlist_add_string(p, "owner", owner);
+		snprintf(buf, sizeof(buf), "%d", e.pid);
+		nvlist_add_string(p, "pid", buf);
+		snprintf(buf, sizeof(buf), "%ju", (uintmax_t)e.nboots);
+		nvlist_add_string(p, "boots", buf);
+		if (e.comport[0] != '\0')
+			nvlist_add_string(p, "comport", e.comport);
+		(*rows)[(*nrows)++] = p;
 	}
+end:
+	close_state_table(t);
+	return 0;
+}
 
-	if (fd != -1)
-		nvlist_add_number(res, FD_KEY, fd);
+/*
+  Get the descriptor of the state table of the user from bmd, the file
+  itself is readable only by root. '*tp' is NULL if the user has no VMs.
+ */
+static int
+get_state_table(struct state_table **tp)
+{
+	nvlist_t *cmd, *res;
+	const char *reason;
+	int ret = -1;
 
+	*tp = NULL;
+	cmd = nvlist_create(0);
+	nvlist_add_string(cmd, "command", "statetab");
+	if ((res = send_recv(cmd)) == NULL)
+		goto end;
+	if (nvlist_get_bool(res, "error")) {
+		reason = nvlist_get_string(res, "reason");
+		if (strcmp(reason, "no state table") == 0)
+			ret = 0;
+		else
+			printf("%s\n", reason);
+		goto end;
+	}
+	if (!nvlist_exists_number(res, FD_KEY) ||
+	    (*tp = fdopen_state_table(nvlist_take_number(res, FD_KEY))) ==
+	    NULL) {
+		printf("cannot read the state table\n");
+		goto end;
+	}
+	ret = 0;
 end:
-	close(s);
-	return res;
+	nvlist_destroy(cmd);
+	nvlist_destroy(res);
+	return ret;
 }
 
+/*
+  List the VMs from the state table published by bmd. Root reads the
+  tables of all owners.
+ */
 static int
-do_list(void)
+list_state_table(const nvlist_t *cmd, const char *const *fields,
+    size_t nfields, bool reverse)
 {
+	DIR *d;
+	struct dirent *de;
+	struct state_table *t;
+	nvlist_t **rows = NULL;
+	size_t i, nrows = 0;
+	char path[MAXPATHLEN];
 	int ret = 0;
-	nvlist_t **l, *cmd, *res = NULL;
-	size_t i, count;
-	const static char *fmt = "%20s%5s%7s%10s%12s%12s\n";
+
+	if (getuid() == 0) {
+		if ((d = opendir(STATE_TABLE_DIR)) == NULL) {
+			printf("cannot open %s\n", STATE_TABLE_DIR);
+			return 1;
+		}
+		while ((de = readdir(d)) != NULL) {
+			if (strncmp(de->d_name, STATE_TABLE_PREFIX,
+				sizeof(STATE_TABLE_PREFIX) - 1) != 0)
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", STATE_TABLE_DIR,
+			    de->d_name);
+			read_state_rows(open_state_table(path), cmd, &rows,
+			    &nrows);
+		}
+		closedir(d);
+	} else {
+		load_global_conf();
+		if (get_state_table(&t) < 0)
+			ret = 1;
+		else
+			read_state_rows(t, cmd, &rows, &nrows);
+	}
+
+	qsort(rows, nrows, sizeof(*rows), compare_list_nvlist);
+	for (i = 0; i < nrows; i++)
+		print_list_row(fields, nfields,
+		    rows[reverse ? nrows - i - 1 : i]);
+	for (i = 0; i < nrows; i++)
+		nvlist_destroy(rows[i]);
+	free(rows);
+	return ret;
+}
+
+/*
+  The VMs are fetched by pages of LIST_PAGE_SIZE or 'page' VMs.
+ */
+static int
+do_list(int argc, char *argv[])
+{
+	int c, s = -1, ret = 0;
+	nvlist_t *cmd, *req, *res = NULL, *cursor = NULL;
+	size_t i, count, nfields = 0;
+	char *fields[nitems(list_columns)], *dashes[nitems(list_columns)];
+	char *fstr = NULL, *f;
 	const nvlist_t *const *list;
+	long page = LIST_PAGE_SIZE;
+	bool reverse = false, statetab = false;
 
 	cmd = nvlist_create(0);
 	nvlist_add_string(cmd, "command", "list");
 
+	while ((c = getopt(argc, argv, "b:F:l:mn:p:rS:s:u:")) != -1) {
+		switch (c) {
+		case 'b':
+			nvlist_add_string(cmd, "backend", optarg);
+			break;
+		case 'F':
+			fstr = optarg;
+			break;
+		case 'l':
+			nvlist_add_string(cmd, "loader", optarg);
+			break;
+		case 'm':
+			statetab = true;
+			break;
+		case 'n':
+			nvlist_add_string(cmd, "name", optarg);
+			break;
+		case 'p':
+			if ((page = strtol(optarg, NULL, 10)) <= 0)
+				goto usage;
+			break;
+		case 'r':
+			nvlist_add_bool(cmd, "reverse", true);
+			reverse = true;
+			break;
+		case 'S':
+			nvlist_add_string(cmd, "sort", optarg);
+			break;
+		case 's':
+			nvlist_add_string(cmd, "state", optarg);
+			break;
+		case 'u':
+			nvlist_add_string(cmd, "owner", optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	/* the state table has no configurations */
+	if (statetab && (nvlist_exists(cmd, "backend") ||
+		nvlist_exists(cmd, "loader") || nvlist_exists(cmd, "sort")))
+		goto usage;
+
+	if (fstr == NULL && statetab) {
+		fields[nfields++] = "name";
+		fields[nfields++] = "pid";
+		fields[nfields++] = "boots";
+		fields[nfields++] = "state";
+		fields[nfields++] = "owner";
+	} else if (fstr == NULL) {
+		fields[nfields++] = "name";
+		fields[nfields++] = "ncpu";
+		fields[nfields++] = "memory";
+		fields[nfields++] = "loader";
+		fields[nfields++] = "state";
+		fields[nfields++] = "owner";
+	} else {
+		while ((f = strsep(&fstr, ",")) != NULL) {
+			if (get_list_column(f) < 0 || nfields >= nitems(fields)) {
+				printf("unknown field %s\n", f);
+				ret = 1;
+				goto end;
+			}
+			fields[nfields++] = f;
+		}
+		nvlist_add_string_array(cmd, "fields",
+		    (const char *const *)fields, nfields);
+	}
+	nvlist_add_number(cmd, "limit", page);
+
+	for (i = 0; i < nfields; i++) {
+		count = list_columns[get_list_column(fields[i])].width - 1;
+		if ((dashes[i] = malloc(count + 1)) == NULL)
+			break;
+		memset(dashes[i], '-', count);
+		dashes[i][count] = '\0';
+	}
+	print_list_row((const char *const *)fields, nfields, NULL);
+	print_list_row((const char *const *)dashes, i, NULL);
+	while (i > 0)
+		free(dashes[--i]);
+
+	if (statetab) {
+		ret = list_state_table(cmd, (const char *const *)fields,
+		    nfields, reverse);
+		goto end;
+	}
+
+	load_global_conf();
+	if ((s = connect_to_bmd()) < 0) {
+		ret = 1;
+		goto end;
+	}
+	do {
+		req = nvlist_clone(cmd);
+		if (cursor != NULL)
+			nvlist_move_nvlist(req, "cursor", cursor);
+		cursor = NULL;
+		nvlist_destroy(res);
+		res = send_recv0(s, req);
+		nvlist_destroy(req);
+		if (res == NULL) {
+			ret = 1;
+			goto end;
+		}
+		if (nvlist_get_bool(res, "error")) {
+			printf("%s\n", nvlist_get_string(res, "reason"));
+			ret = 1;
+			goto end;
+		}
+		if (!nvlist_exists(res, "vm_list"))
+			break;
+		list = nvlist_get_nvlist_array(res, "vm_list", &count);
+		for (i = 0; i < count; i++)
+			print_list_row((const char *const *)fields, nfields,
+			    list[i]);
+		if (nvlist_exists_nvlist(res, "next"))
+			cursor = nvlist_take_nvlist(res, "next");
+	} while (cursor != NULL);
+
+end:
+	if (s >= 0)
+		close(s);
+	nvlist_destroy(cmd);
+	nvlist_destroy(res);
+	free_global_vars();
+	free_gl_conf();
+	return ret;
+usage:
+	nvlist_destroy(cmd);
+	return usage(argc, argv - 1);
+}
+
+static int
+do_stats(void)
+{
+	int type, ret = 0;
+	nvlist_t *cmd, *res = NULL;
+	const nvlist_t *p;
+	const char *name, *key;
+	void *cookie = NULL, *c;
+
+	cmd = nvlist_create(0);
+	nvlist_add_string(cmd, "command", "stats");
+
 	if ((res = send_recv(cmd)) == NULL) {
 		ret = 1;
 		goto end;
 	}
 
 	if (nvlist_get_bool(res, "error")) {
+		ret = 1;
 		printf("%s\n", nvlist_get_string(res, "reason"));
 		goto end;
 	}
 
-	printf(fmt, "name", "ncpu", "memory", "loader", "state", "owner");
-	printf(fmt, "-------------------",
-	       "----", "------", "---------", "-----------", "----------");
+	while ((name = nvlist_next(res, &type, &cookie)) != NULL) {
+		if (type != NV_TYPE_NVLIST)
+			continue;
+		printf("%-16s", name);
+		p = nvlist_get_nvlist(res, name);
+		c = NULL;
+		while ((key = nvlist_next(p, &type, &c)) != NULL)
+			if (type == NV_TYPE_NUMBER)
+				printf(" %s=%ju", key,
+				       (uintmax_t)nvlist_get_number(p, key));
+		printf("\n");
+	}
+
+end:
+	nvlist_destroy(cmd);
+	nvlist_destroy(res);
+	free_global_vars();
+	free_gl_conf();
+	return ret;
+}
+
+/*
+  Max number of the commands waiting for the responses. bmd doesn't read
+  the next command until the response is sent, the responses must fit in
+  the socket buffer not to block both ends.
+ */
+#define BATCH_WAIT_MAX	32
+
+/*
+  Size of the buffer for the lines from stdin.
+ */
+#define BATCH_LINE_MAX	4096
+
+/*
+  Returns the command of the "<command> [<name>]" line, NULL if the line
+  is empty or a comment.
+ */
+static nvlist_t *
+parse_batch_line(char *p)
+{
+	char *command, *name;
+	nvlist_t *cmd;
+
+	while ((command = strsep(&p, " \t\n")) != NULL && *command == '\0')
+		;
+	if (command == NULL || *command == '#')
+		return NULL;
+	while ((name = strsep(&p, " \t\n")) != NULL && *name == '\0')
+		;
+	cmd = nvlist_create(0);
+	nvlist_add_string(cmd, "command", command);
+	if (name != NULL)
+		nvlist_add_string(cmd, "name", name);
+	return cmd;
+}
+
+/*
+  Print the response 'res' if the command 'cmd' failed.
+  Returns 1 if it failed, otherwise 0.
+ */
+static int
+print_batch_result(const nvlist_t *cmd, nvlist_t *res)
+{
+	const char *name;
+
+	if (nvlist_exists_number(res, FD_KEY))
+		close(nvlist_take_number(res, FD_KEY));
+	if (!nvlist_get_bool(res, "error"))
+		return 0;
+	name = nvlist_exists_string(cmd, "name") ?
+	    nvlist_get_string(cmd, "name") : "";
+	printf("%s %s: %s\n", nvlist_get_string(cmd, "command"), name,
+	    nvlist_get_string(res, "reason"));
+	return 1;
+}
 
-	if (!nvlist_exists(res, "vm_list"))
+/*
+  Read "<command> [<name>]" lines from stdin and send them over one
+  connection as they are read. The responses are read as they arrive,
+  bmd runs the commands without waiting for the VMs, so they boot or stop
+  in parallel.
+ */
+static int
+do_batch(void)
+{
+	int s, ret = 0;
+	bool eof = false;
+	size_t n, len = 0, head = 0, nwait = 0;
+	ssize_t rc;
+	char buf[BATCH_LINE_MAX + 1], *eol;
+	nvlist_t *waiting[BATCH_WAIT_MAX], *cmd, *res;
+	struct pollfd fds[2];
+
+	if ((s = connect_to_bmd()) < 0) {
+		ret = 1;
 		goto end;
+	}
+
+	while (!eof || len > 0 || nwait > 0) {
+		/* A line over the buffer is cut. */
+		while (nwait < BATCH_WAIT_MAX && len > 0 &&
+		    ((eol = memchr(buf, '\n', len)) != NULL || eof ||
+		     len == BATCH_LINE_MAX)) {
+			n = (eol != NULL) ? eol - buf : len;
+			buf[n] = '\0';
+			cmd = parse_batch_line(buf);
+			n = MIN(n + 1, len);
+			memmove(buf, buf + n, len - n);
+			len -= n;
+			if (cmd == NULL)
+				continue;
+			if (send_req(s, cmd) < 0) {
+				nvlist_destroy(cmd);
+				ret = 1;
+				goto end;
+			}
+			waiting[(head + nwait++) % BATCH_WAIT_MAX] = cmd;
+		}
+
+		fds[0].fd = (eof || len == BATCH_LINE_MAX) ? -1 : STDIN_FILENO;
+		fds[0].events = POLLIN;
+		fds[1].fd = (nwait > 0) ? s : -1;
+		fds[1].events = POLLIN;
+		if (fds[0].fd < 0 && fds[1].fd < 0)
+			continue;
+		while ((rc = poll(fds, nitems(fds), INFTIM)) < 0)
+			if (errno != EINTR) {
+				ret = 1;
+				goto end;
+			}
+
+		if (fds[1].revents != 0) {
+			if ((res = recv_res(s)) == NULL) {
+				ret = 1;
+				goto end;
+			}
+			cmd = waiting[head];
+			head = (head + 1) % BATCH_WAIT_MAX;
+			nwait--;
+			ret |= print_batch_result(cmd, res);
+			nvlist_destroy(cmd);
+			nvlist_destroy(res);
+		}
+		if (fds[0].revents != 0) {
+			while ((rc = read(STDIN_FILENO, buf + len,
+			    BATCH_LINE_MAX - len)) < 0 && errno == EINTR)
+				;
+			if (rc <= 0)
+				eof = true;
+			else
+				len += rc;
+		}
+	}
+
+end:
+	for (; nwait > 0; nwait--) {
+		nvlist_destroy(waiting[head]);
+		head = (head + 1) % BATCH_WAIT_MAX;
+	}
+	if (s >= 0)
+		close(s);
+	free_global_vars();
+	free_gl_conf();
+	return ret;
+}
+
+static void
+print_event(const nvlist_t *ev)
+{
+	const char *keys[] = { "name", "state", "owner" };
+	const char *nums[] = { "status", "signal", "count" };
+	size_t i;
+
+	printf("%-8s", nvlist_get_string(ev, "event"));
+	for (i = 0; i < nitems(keys); i++)
+		if (nvlist_exists_string(ev, keys[i]))
+			printf(" %s", nvlist_get_string(ev, keys[i]));
+	for (i = 0; i < nitems(nums); i++)
+		if (nvlist_exists_number(ev, nums[i]))
+			printf(" %s=%ju", nums[i],
+			    (uintmax_t)nvlist_get_number(ev, nums[i]));
+	printf("\n");
+	fflush(stdout);
+}
+
+/*
+  Print the events of the VMs until bmd closes the connection.
+ */
+static int
+do_watch(int argc, char *argv[])
+{
+	int c, s = -1, ret = 0;
+	nvlist_t *cmd, *res = NULL;
 
-	list = nvlist_get_nvlist_array(res, "vm_list", &count);
-	if ((l = malloc(sizeof(nvlist_t *) * count)) == NULL) {
-		fprintf(stderr, "failed to allocate memory\n");
+	cmd = nvlist_create(0);
+	nvlist_add_string(cmd, "command", "watch");
+
+	while ((c = getopt(argc, argv, "n:u:")) != -1) {
+		switch (c) {
+		case 'n':
+			nvlist_add_string(cmd, "name", optarg);
+			break;
+		case 'u':
+			nvlist_add_string(cmd, "owner", optarg);
+			break;
+		default:
+			nvlist_destroy(cmd);
+			return usage(argc, argv - 1);
+		}
+	}
+
+	if ((s = connect_to_bmd()) < 0 || (res = send_recv0(s, cmd)) == NULL) {
+		ret = 1;
+		goto end;
+	}
+	if (nvlist_get_bool(res, "error")) {
+		printf("%s\n", nvlist_get_string(res, "reason"));
 		ret = 1;
 		goto end;
 	}
-	memcpy(l, list, sizeof(nvlist_t *) * count);
-	qsort(l, count, sizeof(nvlist_t *), compare_by_name);
-	for (i = 0; i < count; i++) {
-		printf(fmt,
-		       nvlist_get_string(l[i], "name"),
-		       nvlist_get_string(l[i], "ncpu"),
-		       nvlist_get_string(l[i], "memory"),
-		       nvlist_get_string(l[i], "loader"),
-		       nvlist_get_string(l[i], "state"),
-		       nvlist_get_string(l[i], "owner"));
+	nvlist_destroy(res);
+	while ((res = recv_res(s)) != NULL) {
+		print_event(res);
+		nvlist_destroy(res);
+	}
+
+end:
+	if (s >= 0)
+		close(s);
+	nvlist_destroy(cmd);
+	nvlist_destroy(res);
+	free_global_vars();
+	free_gl_conf();
+	return ret;
+}
+
+/*
+  Wait until the VM gets to 'state'. 'timeout' is in seconds, 0 waits
+  forever.
+ */
+static int
+do_wait(int argc, char *argv[])
+{
+	int c, s = -1, ret = 1;
+	long timeout = 0;
+	nvlist_t *cmd, *res = NULL;
+	const char *event;
+
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			if ((timeout = strtol(optarg, NULL, 10)) < 0)
+				return usage(argc, argv - 1);
+			break;
+		default:
+			return usage(argc, argv - 1);
+		}
+	}
+	if (argc - optind != 2)
+		return usage(argc, argv - 1);
+
+	cmd = nvlist_create(0);
+	nvlist_add_string(cmd, "command", "wait");
+	nvlist_add_string(cmd, "name", argv[optind]);
+	nvlist_add_string(cmd, "state", argv[optind + 1]);
+	nvlist_add_number(cmd, "timeout", timeout);
+
+	if ((s = connect_to_bmd()) < 0 || (res = send_recv0(s, cmd)) == NULL)
+		goto end;
+	if (nvlist_get_bool(res, "error")) {
+		printf("%s\n", nvlist_get_string(res, "reason"));
+		goto end;
+	}
+	if (strcasecmp(nvlist_get_string(res, "state"),
+		argv[optind + 1]) == 0) {
+		ret = 0;
+		goto end;
 	}
-	free(l);
+	nvlist_destroy(res);
+	if ((res = recv_res(s)) == NULL)
+		goto end;
+	event = nvlist_get_string(res, "event");
+	if (strcmp(event, "state") == 0)
+		ret = 0;
+	else if (strcmp(event, "remove") == 0)
+		printf("%s is removed\n", argv[optind]);
+	else
+		printf("%s\n", event);
 
 end:
+	if (s >= 0)
+		close(s);
 	nvlist_destroy(cmd);
 	nvlist_destroy(res);
 	free_global_vars();
@@ -363,6 +1041,48 @@ end:
 	return ret;
 }
 
+static int
+do_diffconfig(const char *name)
+{
+	int type, ret = 0;
+	nvlist_t *cmd, *res = NULL;
+	const nvlist_t *diff, *p;
+	const char *key;
+	void *cookie = NULL;
+
+	cmd = nvlist_create(0);
+	nvlist_add_string(cmd, "command", "diffconfig");
+	nvlist_add_string(cmd, "name", name);
+
+	if ((res = send_recv(cmd)) == NULL) {
+		ret = 1;
+		goto end;
+	}
+
+	if (nvlist_get_bool(res, "error")) {
+		ret = 1;
+		printf("%s\n", nvlist_get_string(res, "reason"));
+		goto end;
+	}
+
+	diff = nvlist_get_nvlist(res, "diff");
+	while ((key = nvlist_next(diff, &type, &cookie)) != NULL) {
+		p = nvlist_get_nvlist(diff, key);
+		printf("%18s : %s -> %s\n", key,
+		       nvlist_exists_string(p, "old") ?
+			       nvlist_get_string(p, "old") : "(null)",
+		       nvlist_exists_string(p, "new") ?
+			       nvlist_get_string(p, "new") : "(null)");
+	}
+
+end:
+	nvlist_destroy(cmd);
+	nvlist_destroy(res);
+	free_global_vars();
+	free_gl_conf();
+	return ret;
+}
+
 static int
 do_showconfig(const char *name)
 {
@@ -372,7 +1092,7 @@ do_showconfig(const char *name)
 
 	LOG_OPEN_PERROR();
 
-	if (load_config_file(&list, false) < 0) {
+	if (load_config_file(&list, false, NULL) < 0) {
 		printf("failed to load VM config files\n");
 		return 1;
 	}
@@ -411,12 +1131,23 @@ control(int argc, char *argv[])
 		argc += 2;
 	}
 
-	if (load_config_file(NULL, 1) < 0)
-		fprintf(stderr, "failed to load %s. use default value\n",
-			gl_conf->config_file);
-
+	/* list reads the config file only if it asks bmd */
 	if (strcmp(argv[1], "list") == 0)
-		return do_list();
+		return do_list(argc - 1, argv + 1);
+
+	load_global_conf();
+
+	if (strcmp(argv[1], "stats") == 0)
+		return do_stats();
+
+	if (strcmp(argv[1], "batch") == 0)
+		return do_batch();
+
+	if (strcmp(argv[1], "watch") == 0)
+		return do_watch(argc - 1, argv + 1);
+
+	if (strcmp(argv[1], "wait") == 0)
+		return do_wait(argc - 1, argv + 1);
 
 	if (strcmp(argv[1], "showconfig") == 0)
 		return do_showconfig(argv[2]);
@@ -427,6 +1158,8 @@ control(int argc, char *argv[])
 	if (argc == 3) {
 		if (strcmp(argv[1], "inspect") == 0)
 			return do_inspect(argv[2]);
+		if (strcmp(argv[1], "diffconfig") == 0)
+			return do_diffconfig(argv[2]);
 		if (strcmp(argv[1], "console") == 0)
 			return do_boot_console(argv[2], 0, true, false);
 		if (strcmp(argv[1], "showcomport") == 0)
@@ -479,6 +1212,7 @@ control(int argc, char *argv[])
 	}
 
 	if (argc == 3 && (strcmp(argv[1], "reset") == 0 ||
+			  strcmp(argv[1], "ready") == 0 ||
 			  strcmp(argv[1], "poweroff") == 0 ||
 			  strcmp(argv[1], "stop") == 0 ||
 			  strcmp(argv[1], "shutdown") == 0)) {
@@ -0,0 +1,242 @@
+#include <sys/param.h>
+#include <sys/event.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bmd.h"
+#include "log.h"
+#include "slab.h"
+
+#define CMP(a,b)    ((a) < (b) ? -1 : ((a) == (b) ? 0 : 1))
+
+/*
+  Events of the same owner ('data' of struct event).
+ */
+struct event_owner {
+	RB_ENTRY(event_owner) entry;
+	void *data;
+	struct event_head events;
+};
+
+RB_HEAD(event_owner_tree, event_owner);
+RB_HEAD(event_kev_tree, event);
+
+static int compare_event_owner(struct event_owner *, struct event_owner *);
+static int compare_event_kev(struct event *, struct event *);
+RB_GENERATE_STATIC(event_owner_tree, event_owner, entry, compare_event_owner);
+RB_GENERATE_STATIC(event_kev_tree, event, kev_entry, compare_event_kev);
+
+static struct slab event_slab =
+	SLAB_INITIALIZER("event", sizeof(struct event), 64);
+static struct slab event_owner_slab =
+	SLAB_INITIALIZER("event_owner", sizeof(struct event_owner), 64);
+
+/*
+  All events indexed by the owner.
+ */
+static struct event_owner_tree event_owners =
+	RB_INITIALIZER(&event_owners);
+
+/*
+  All events indexed by the kevent identifier (ident & filter).
+ */
+static struct event_kev_tree event_kevs = RB_INITIALIZER(&event_kevs);
+
+/*
+  Kevent changes waiting for the next harvest of 'changes_kq'.
+  'change_error' is called for each change that failed.
+ */
+static int changes_kq = -1;
+static struct kevent changes[EVENT_BATCH_SIZE];
+static int nchanges = 0;
+static void (*change_error)(struct kevent *) = NULL;
+
+struct event *
+create_event(void)
+{
+	return slab_alloc(&event_slab);
+}
+
+void
+destroy_event(struct event *ev)
+{
+	slab_free(&event_slab, ev);
+}
+
+static int
+compare_event_owner(struct event_owner *a, struct event_owner *b)
+{
+	return CMP((uintptr_t)a->data, (uintptr_t)b->data);
+}
+
+static int
+compare_event_kev(struct event *a, struct event *b)
+{
+	if (a->kev.filter != b->kev.filter)
+		return CMP(a->kev.filter, b->kev.filter);
+	return CMP(a->kev.ident, b->kev.ident);
+}
+
+/*
+  Add an event to the index.
+  The event must not share its ident & filter with an indexed one.
+ */
+int
+event_index_add(struct event *ev)
+{
+	struct event_owner *o, key;
+
+	key.data = ev->data;
+	if ((o = RB_FIND(event_owner_tree, &event_owners, &key)) == NULL) {
+		if ((o = slab_alloc(&event_owner_slab)) == NULL)
+			return -1;
+		o->data = ev->data;
+		LIST_INIT(&o->events);
+		RB_INSERT(event_owner_tree, &event_owners, o);
+	}
+
+	ev->owner = o;
+	LIST_INSERT_HEAD(&o->events, ev, next);
+	RB_INSERT(event_kev_tree, &event_kevs, ev);
+	return 0;
+}
+
+/*
+  Remove an event from the index.
+  The owner entry is freed with its last event.
+ */
+void
+event_index_remove(struct event *ev)
+{
+	struct event_owner *o = ev->owner;
+
+	RB_REMOVE(event_kev_tree, &event_kevs, ev);
+	LIST_REMOVE(ev, next);
+	ev->owner = NULL;
+	if (LIST_EMPTY(&o->events)) {
+		RB_REMOVE(event_owner_tree, &event_owners, o);
+		slab_free(&event_owner_slab, o);
+	}
+}
+
+struct event *
+event_index_lookup(uintptr_t ident, short filter)
+{
+	struct event key;
+
+	key.kev.ident = ident;
+	key.kev.filter = filter;
+	return RB_FIND(event_kev_tree, &event_kevs, &key);
+}
+
+/*
+  Returns the list of events owned by 'data' or NULL if there is none.
+  Removing the last event from the list frees the list itself.
+ */
+struct event_head *
+event_index_owner(void *data)
+{
+	struct event_owner *o, key;
+
+	key.data = data;
+	if ((o = RB_FIND(event_owner_tree, &event_owners, &key)) == NULL)
+		return NULL;
+	return &o->events;
+}
+
+void
+event_changes_init(int kq, void (*on_error)(struct kevent *))
+{
+	changes_kq = kq;
+	change_error = on_error;
+	nchanges = 0;
+}
+
+/*
+  Submit the queued changes without harvesting any events.
+ */
+int
+event_changes_flush(void)
+{
+	int i, n;
+	struct kevent res[EVENT_BATCH_SIZE];
+
+	if (nchanges == 0)
+		return 0;
+
+	for (i = 0; i < nchanges; i++)
+		changes[i].flags |= EV_RECEIPT;
+
+	while ((n = kevent(changes_kq, changes, nchanges, res, nchanges,
+		    NULL)) < 0)
+		if (errno != EINTR)
+			break;
+	nchanges = 0;
+	if (n < 0) {
+		ERR("failed to change kevent (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < n; i++)
+		if ((res[i].flags & EV_ERROR) && res[i].data != 0 &&
+		    change_error != NULL)
+			(*change_error)(&res[i]);
+	return 0;
+}
+
+void
+event_changes_queue(struct kevent *kev, int n)
+{
+	while (n-- > 0) {
+		if (nchanges >= EVENT_BATCH_SIZE)
+			event_changes_flush();
+		changes[nchanges++] = *kev++;
+	}
+}
+
+/*
+  Drop the queued changes of 'ev'. Deletions carry no udata and stay
+  queued.
+ */
+void
+event_changes_drop(struct event *ev)
+{
+	int i, n = 0;
+
+	for (i = 0; i < nchanges; i++)
+		if (changes[i].udata != ev)
+			changes[n++] = changes[i];
+	nchanges = n;
+}
+
+/*
+  Harvest events. The queued changes are submitted with this call.
+ */
+int
+harvest_events(struct kevent *kev, int n, struct timespec *timeout)
+{
+	int rc;
+
+	/* Make room for the errors of the changes. */
+	if (nchanges > n)
+		event_changes_flush();
+
+	rc = kevent(changes_kq, changes, nchanges, kev, n, timeout);
+	nchanges = 0;
+	while (rc < 0 && errno == EINTR)
+		rc = kevent(changes_kq, NULL, 0, kev, n, timeout);
+	return rc;
+}
+
+void
+free_event_index(void)
+{
+	RB_INIT(&event_owners);
+	RB_INIT(&event_kevs);
+	slab_destroy(&event_slab);
+	slab_destroy(&event_owner_slab);
+}
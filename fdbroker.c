@@ -0,0 +1,424 @@
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fdbroker.h"
+#include "slab.h"
+
+/*
+  Request message to the fd broker.
+  Only the used part of 'path' is sent.
+ */
+struct fd_msg {
+	uid_t uid;
+	gid_t gid;
+	int flags;
+	mode_t mode;
+	char path[MAXPATHLEN];
+};
+
+static struct slab fd_req_slab =
+	SLAB_INITIALIZER("fd_req", sizeof(struct fd_req), 32);
+
+/*
+  Requests waiting for the replies in the order of sending.
+  The broker replies to them in the same order.
+ */
+static STAILQ_HEAD(, fd_req) fd_reqs = STAILQ_HEAD_INITIALIZER(fd_reqs);
+
+static pid_t broker_pid = -1;
+static int broker_sock = -1;
+
+static uint64_t nrequests = 0, nopened = 0, nfailed = 0, nstarted = 0;
+static int npending = 0;
+
+/*
+  Send 'fd' with a result byte, 0 if 'fd' is -1.
+  Also called in the fd broker and the parser workers.
+ */
+int
+send_fd(int sock, int fd)
+{
+	int rc;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char result;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf;
+
+	result = fd < 0 ? 0 : 1;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &result;
+	iov.iov_len = sizeof(result);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (result) {
+		memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+		msg.msg_control = cmsgbuf.buf;
+		msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	}
+
+	while ((rc = sendmsg(sock, &msg, 0)) < 0)
+		if (errno != EINTR)
+			break;
+	return rc;
+}
+
+/*
+  Receive a reply. '*fdp' is set to the received fd, -1 if the broker
+  failed to open the file.
+  Returns 1 on success, 0 on EOF, -1 on error.
+ */
+int
+recv_fd(int sock, int *fdp)
+{
+	int rc, fd;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char result = 0;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf;
+
+	*fdp = -1;
+	memset(&msg, 0, sizeof(msg));
+	memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+	iov.iov_base = &result;
+	iov.iov_len = sizeof(result);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+	while ((rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0)
+		if (errno != EINTR)
+			return -1;
+
+	if (rc == 0)
+		return 0;
+	if (result == 0)
+		return 1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS)
+		return 1;
+
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	*fdp = fd;
+	return 1;
+}
+
+/*
+  Open a regular file with the credentials in 'm'.
+  The broker switches only the effective IDs and restores them after that.
+ */
+static int
+open_as(const struct fd_msg *m, gid_t *groups, int ngroups)
+{
+	int fd = -1;
+	struct stat st;
+
+	if (m->uid != 0 &&
+	    (setgroups(1, &m->gid) < 0 || setegid(m->gid) < 0 ||
+	     seteuid(m->uid) < 0))
+		goto restore;
+
+	while ((fd = open(m->path, m->flags | O_CLOEXEC, m->mode)) < 0)
+		if (errno != EINTR)
+			break;
+
+	if (fd >= 0 && (fstat(fd, &st) < 0 || (! S_ISREG(st.st_mode)))) {
+		close(fd);
+		fd = -1;
+	}
+
+restore:
+	/* Never serve the next request with the wrong credentials. */
+	if (seteuid(0) < 0 || setegid(0) < 0 || setgroups(ngroups, groups) < 0)
+		_exit(1);
+	return fd;
+}
+
+static void
+broker_main(int sock)
+{
+	int fd, ngroups;
+	ssize_t n;
+	struct fd_msg m;
+	gid_t groups[NGROUPS_MAX];
+
+	if ((ngroups = getgroups(nitems(groups), groups)) < 0)
+		_exit(1);
+
+	for (;;) {
+		while ((n = recv(sock, &m, sizeof(m) - 1, 0)) < 0)
+			if (errno != EINTR)
+				_exit(1);
+		if (n == 0)
+			_exit(0);
+		if (n <= (ssize_t)offsetof(struct fd_msg, path)) {
+			send_fd(sock, -1);
+			continue;
+		}
+		((char *)&m)[n] = '\0';
+		fd = open_as(&m, groups, ngroups);
+		if (send_fd(sock, fd) < 0)
+			_exit(1);
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+/*
+  Fork the fd broker. It stays privileged and opens files on behalf of the
+  VM owners. Returns the socket to the broker.
+ */
+int
+start_fd_broker(void)
+{
+	int socks[2];
+	pid_t pid;
+	sigset_t mask;
+
+	if (broker_sock >= 0)
+		return broker_sock;
+
+	if (socketpair(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) < 0)
+		return -1;
+
+	if ((pid = fork()) < 0) {
+		close(socks[0]);
+		close(socks[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		if (socks[1] != 3 && dup2(socks[1], 3) < 0)
+			_exit(1);
+		closefrom(4);
+		setproctitle("fd broker");
+		broker_main(3);
+		_exit(0);
+	}
+
+	close(socks[1]);
+	if (fcntl(socks[0], F_SETFL, O_NONBLOCK) < 0) {
+		close(socks[0]);
+		kill(pid, SIGTERM);
+		while (waitpid(pid, NULL, 0) < 0)
+			if (errno != EINTR)
+				break;
+		return -1;
+	}
+
+	broker_pid = pid;
+	broker_sock = socks[0];
+	nstarted++;
+	return broker_sock;
+}
+
+static void
+free_fd_req(struct fd_req *req)
+{
+	free(req->path);
+	slab_free(&fd_req_slab, req);
+	npending--;
+}
+
+/*
+  Stop the broker. The pending requests are called back with -1.
+ */
+void
+stop_fd_broker(void)
+{
+	struct fd_req *req, *rn;
+	STAILQ_HEAD(, fd_req) head = STAILQ_HEAD_INITIALIZER(head);
+
+	if (broker_sock >= 0) {
+		close(broker_sock);
+		broker_sock = -1;
+	}
+	if (broker_pid > 0) {
+		while (waitpid(broker_pid, NULL, 0) < 0)
+			if (errno != EINTR)
+				break;
+		broker_pid = -1;
+	}
+
+	/* A callback may send a new request. */
+	STAILQ_CONCAT(&head, &fd_reqs);
+	STAILQ_FOREACH_SAFE (req, &head, next, rn) {
+		if (req->cb != NULL) {
+			nfailed++;
+			(*req->cb)(-1, req->data);
+		}
+		free_fd_req(req);
+	}
+}
+
+int
+fd_broker_sock(void)
+{
+	return broker_sock;
+}
+
+/*
+  Queue a request to open 'path' with 'uid' and 'gid'.
+  The result is called back after the reply is received.
+ */
+struct fd_req *
+request_open_file(uid_t uid, gid_t gid, const char *path, int flags,
+    mode_t mode, fd_call_back cb, void *data)
+{
+	struct fd_req *req;
+
+	if (strlen(path) >= MAXPATHLEN) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	if ((req = slab_alloc(&fd_req_slab)) == NULL)
+		return NULL;
+	if ((req->path = strdup(path)) == NULL) {
+		slab_free(&fd_req_slab, req);
+		return NULL;
+	}
+	req->uid = uid;
+	req->gid = gid;
+	req->flags = flags;
+	req->mode = mode;
+	req->sent = false;
+	req->cb = cb;
+	req->data = data;
+	STAILQ_INSERT_TAIL(&fd_reqs, req, next);
+	npending++;
+	nrequests++;
+	return req;
+}
+
+/*
+  The callback is never called. The opened fd is closed on the reply.
+ */
+void
+cancel_fd_req(struct fd_req *req)
+{
+	if (req == NULL)
+		return;
+	if (! req->sent) {
+		STAILQ_REMOVE(&fd_reqs, req, fd_req, next);
+		free_fd_req(req);
+		return;
+	}
+	req->cb = NULL;
+}
+
+/*
+  Send the queued requests to the broker.
+  Returns 1 if the socket is full, 0 if all of them are sent, -1 on error.
+ */
+int
+send_fd_requests(void)
+{
+	ssize_t n;
+	struct fd_req *req;
+	struct fd_msg m;
+
+	if (broker_sock < 0)
+		return -1;
+
+	STAILQ_FOREACH (req, &fd_reqs, next) {
+		if (req->sent)
+			continue;
+		m.uid = req->uid;
+		m.gid = req->gid;
+		m.flags = req->flags;
+		m.mode = req->mode;
+		strlcpy(m.path, req->path, sizeof(m.path));
+		while ((n = send(broker_sock, &m,
+				 offsetof(struct fd_msg, path) +
+				     strlen(m.path) + 1,
+				 0)) < 0)
+			if (errno != EINTR)
+				break;
+		if (n < 0)
+			return (errno == EAGAIN) ? 1 : -1;
+		req->sent = true;
+	}
+	return 0;
+}
+
+/*
+  Receive the replies and call back the requests.
+  Returns -1 if the broker is closed or broken.
+ */
+int
+recv_fd_replies(void)
+{
+	int rc, fd;
+	struct fd_req *req;
+
+	for (;;) {
+		if ((rc = recv_fd(broker_sock, &fd)) < 0)
+			return (errno == EAGAIN) ? 0 : -1;
+		if (rc == 0)
+			return -1;
+		if ((req = STAILQ_FIRST(&fd_reqs)) == NULL || ! req->sent) {
+			if (fd >= 0)
+				close(fd);
+			errno = EPROTO;
+			return -1;
+		}
+		STAILQ_REMOVE_HEAD(&fd_reqs, next);
+		if (fd >= 0)
+			nopened++;
+		else
+			nfailed++;
+		if (req->cb != NULL)
+			(*req->cb)(fd, req->data);
+		else if (fd >= 0)
+			close(fd);
+		free_fd_req(req);
+	}
+}
+
+/*
+  Add broker counters to 'nvl'.
+ */
+void
+fd_broker_stats(nvlist_t *nvl)
+{
+	nvlist_t *p;
+
+	p = nvlist_create(0);
+	nvlist_add_number(p, "started", nstarted);
+	nvlist_add_number(p, "requests", nrequests);
+	nvlist_add_number(p, "opened", nopened);
+	nvlist_add_number(p, "failed", nfailed);
+	nvlist_add_number(p, "pending", npending);
+	nvlist_move_nvlist(nvl, "fd_broker", p);
+}
@@ -0,0 +1,44 @@
+#ifndef _FDBROKER_H_
+#define _FDBROKER_H_
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/nv.h>
+#include <stdbool.h>
+
+/*
+  Called with the opened fd, -1 on failure.
+ */
+typedef void (*fd_call_back)(int fd, void *data);
+
+/*
+  Request to open a file by the fd broker.
+  'sent' is true after the request is written to the broker.
+  'cb' is NULL if the request is canceled.
+ */
+struct fd_req {
+	STAILQ_ENTRY(fd_req) next;
+	uid_t uid;
+	gid_t gid;
+	int flags;
+	mode_t mode;
+	char *path;
+	bool sent;
+	fd_call_back cb;
+	void *data;
+};
+
+/* Implemented in fdbroker.c */
+int send_fd(int, int);
+int recv_fd(int, int *);
+int start_fd_broker(void);
+void stop_fd_broker(void);
+int fd_broker_sock(void);
+struct fd_req *request_open_file(uid_t, gid_t, const char *, int, mode_t,
+    fd_call_back, void *);
+void cancel_fd_req(struct fd_req *);
+int send_fd_requests(void);
+int recv_fd_replies(void);
+void fd_broker_stats(nvlist_t *);
+
+#endif
@@ -21,6 +21,8 @@ static struct global_conf gl_conf0 = {
 	.cmd_sock_path = gl0_cmd_sock_path,
 	.unix_domain_socket_mode = NULL,
 	.nmdm_offset = DEFAULT_NMDM_OFFSET,
+	.boot_concurrency = 0,
+	.boot_rate = 0,
 	.foreground = 0
 };
 
@@ -64,6 +66,8 @@ init_gl_conf(void)
 	COPY_ATTR_STRING(cmd_sock_path);
 	COPY_ATTR_STRING(unix_domain_socket_mode);
 	COPY_ATTR_INT(nmdm_offset);
+	COPY_ATTR_INT(boot_concurrency);
+	COPY_ATTR_INT(boot_rate);
 	COPY_ATTR_INT(foreground);
 #undef COPY_ATTR_STRING
 #undef COPY_ATTR_INT
@@ -89,6 +93,9 @@ merge_global_conf(struct global_conf *gc)
 #define REPLACE_INT(attr)  \
 	if (gc->attr != 0)			\
 		gl_conf->attr = gc->attr;
+#define REPLACE_LIMIT(attr)  \
+	if (gc->attr >= 0)			\
+		gl_conf->attr = gc->attr;
 
 	REPLACE_STR(config_file);
 	REPLACE_STR(pid_path);
@@ -97,9 +104,27 @@ merge_global_conf(struct global_conf *gc)
 	REPLACE_STR(cmd_sock_path);
 	REPLACE_STR(unix_domain_socket_mode);
 	REPLACE_INT(nmdm_offset);
+	REPLACE_LIMIT(boot_concurrency);
+	REPLACE_LIMIT(boot_rate);
+#undef REPLACE_LIMIT
 #undef REPLACE_INT
 #undef REPLACE_STR
 
 	free(gc);
 	return 0;
 }
+
+/*
+  Apply the values of 'gc' that can be changed by reloading the config
+  file. The ones not set in the file go back to the default.
+ */
+void
+reload_global_conf(struct global_conf *gc)
+{
+#define RELOAD_LIMIT(attr)  \
+	gl_conf->attr = (gc->attr >= 0) ? gc->attr : gl_conf0.attr;
+
+	RELOAD_LIMIT(boot_concurrency);
+	RELOAD_LIMIT(boot_rate);
+#undef RELOAD_LIMIT
+}
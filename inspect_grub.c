@@ -18,11 +18,10 @@
 
 #include "conf.h"
 #include "inspect.h"
+#include "launcher.h"
 #include "log.h"
 #include "vm.h"
 
-extern char **split_args(char *);
-
 struct proc_pipe {
 	pid_t pid;
 	char *vm_name;
@@ -276,49 +275,27 @@ pp_free(struct proc_pipe *pp)
 static int
 spawn_grub(struct proc_pipe *pp)
 {
+	int rc;
 	pid_t pid;
 	int pfd[2];
+	struct spawn_args sa = SPAWN_ARGS_INITIALIZER;
 
 	if (pipe2(pfd, O_CLOEXEC | O_NONBLOCK) < 0)
 		return -1;
 
-	if ((pid = fork()) < 0)
+	spawn_args_setenv(&sa, "TERM=xterm");
+	spawn_args_add(&sa, LOCALBASE"/sbin/grub-bhyve");
+	spawn_args_add(&sa, "-n");
+	spawn_args_add(&sa, "-e");
+	spawn_args_add(&sa, "-m");
+	spawn_args_add(&sa, pp->mapfile);
+	spawn_args_add(&sa, pp->vm_name);
+
+	rc = spawn_process(&sa, pfd[1], pfd[1], pfd[1], &pid);
+	spawn_args_clear(&sa);
+	if (rc < 0) {
+		ERR("cannot spawn grub-bhyve (%s)\n", strerror(errno));
 		goto err;
-	if (pid == 0) {
-		char **argv;
-		FILE *fp;
-		char *bp;
-		size_t len;
-
-		close(pfd[0]);
-		setenv("TERM", "xterm", 1);
-
-		fp = open_memstream(&bp, &len);
-		if (fp == NULL) {
-			ERR("cannot open memstrem (%s)\n", strerror(errno));
-			exit(1);
-		}
-		flockfile(fp);
-		fprintf(fp,
-		    "grub-bhyve\n"
-		    "-n\n"
-		    "-e\n"
-		    "-m\n"
-		    "%s\n"
-		    "%s\n", pp->mapfile, pp->vm_name);
-		funlockfile(fp);
-		fclose(fp);
-		argv = split_args(bp);
-		if (argv == NULL) {
-			ERR("malloc: %s\n", strerror(errno));
-			exit(1);
-		}
-		dup2(pfd[1], 0);
-		dup2(pfd[1], 1);
-		dup2(pfd[1], 2);
-
-		execv(LOCALBASE"/sbin/grub-bhyve", argv);
-		exit(1);
 	}
 	pp->pid = pid;
 	pp->fd = pfd[0];
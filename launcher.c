@@ -0,0 +1,200 @@
+#include <sys/types.h>
+
+#include <errno.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "launcher.h"
+
+extern char **environ;
+
+/*
+  Append 'str' to the NULL terminated vector.
+ */
+static int
+vec_add(char ***vec, size_t *len, size_t *size, char *str)
+{
+	size_t sz;
+	char **v;
+
+	if (*len + 2 > *size) {
+		sz = *size ? *size * 2 : 16;
+		if ((v = realloc(*vec, sz * sizeof(char *))) == NULL)
+			return -1;
+		*vec = v;
+		*size = sz;
+	}
+	(*vec)[(*len)++] = str;
+	(*vec)[*len] = NULL;
+	return 0;
+}
+
+static void
+vec_free(char **vec, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		free(vec[i]);
+	free(vec);
+}
+
+int
+spawn_args_add(struct spawn_args *sa, const char *str)
+{
+	char *p;
+
+	if ((p = strdup(str)) == NULL)
+		goto err;
+	if (vec_add(&sa->argv, &sa->argc, &sa->argv_size, p) < 0) {
+		free(p);
+		goto err;
+	}
+	return 0;
+err:
+	sa->error = true;
+	return -1;
+}
+
+int
+spawn_args_addf(struct spawn_args *sa, const char *fmt, ...)
+{
+	va_list ap;
+	char *p;
+	int rc;
+
+	va_start(ap, fmt);
+	rc = vasprintf(&p, fmt, ap);
+	va_end(ap);
+	if (rc < 0)
+		goto err;
+	if (vec_add(&sa->argv, &sa->argc, &sa->argv_size, p) < 0) {
+		free(p);
+		goto err;
+	}
+	return 0;
+err:
+	sa->error = true;
+	return -1;
+}
+
+/*
+  Set "name=value" to the environment.
+  The environment of the parent is copied at the first call.
+ */
+int
+spawn_args_setenv(struct spawn_args *sa, const char *env)
+{
+	size_t i, len;
+	char **e, *p;
+
+	if ((p = strchr(env, '=')) == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	len = p - env + 1;
+
+	if (sa->envp == NULL)
+		for (e = environ; *e != NULL; e++) {
+			if ((p = strdup(*e)) == NULL)
+				goto err;
+			if (vec_add(&sa->envp, &sa->envc, &sa->envp_size, p) <
+			    0) {
+				free(p);
+				goto err;
+			}
+		}
+
+	if ((p = strdup(env)) == NULL)
+		goto err;
+
+	for (i = 0; i < sa->envc; i++)
+		if (strncmp(sa->envp[i], env, len) == 0) {
+			free(sa->envp[i]);
+			sa->envp[i] = p;
+			return 0;
+		}
+
+	if (vec_add(&sa->envp, &sa->envc, &sa->envp_size, p) < 0) {
+		free(p);
+		goto err;
+	}
+	return 0;
+err:
+	sa->error = true;
+	return -1;
+}
+
+/*
+  Returns the arguments joined by spaces. It must be freed by the caller.
+ */
+char *
+spawn_args_join(const struct spawn_args *sa)
+{
+	size_t i, len = 1;
+	char *buf, *p;
+
+	for (i = 0; i < sa->argc; i++)
+		len += strlen(sa->argv[i]) + 1;
+	if ((p = buf = malloc(len)) == NULL)
+		return NULL;
+	*p = '\0';
+	for (i = 0; i < sa->argc; i++)
+		p = stpcpy(stpcpy(p, (i > 0) ? " " : ""), sa->argv[i]);
+	return buf;
+}
+
+void
+spawn_args_clear(struct spawn_args *sa)
+{
+	vec_free(sa->argv, sa->argc);
+	vec_free(sa->envp, sa->envc);
+	memset(sa, 0, sizeof(*sa));
+}
+
+/*
+  Spawn argv[0] of 'sa' without copying the address space of this process.
+  'in', 'out' and 'err' are duplicated to the standard descriptors
+  of the child if they are not -1. They should be close-on-exec.
+ */
+int
+spawn_process(const struct spawn_args *sa, int in, int out, int err,
+    pid_t *pid)
+{
+	int i, rc;
+	const int fds[3] = { in, out, err };
+	posix_spawn_file_actions_t fa;
+
+	if (sa->error) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (sa->argc == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((rc = posix_spawn_file_actions_init(&fa)) != 0) {
+		errno = rc;
+		return -1;
+	}
+
+	for (i = 0; i < 3; i++)
+		if (fds[i] >= 0 &&
+		    (rc = posix_spawn_file_actions_adddup2(&fa, fds[i], i)) !=
+			0)
+			goto end;
+
+	rc = posix_spawn(pid, sa->argv[0], &fa, NULL, sa->argv,
+			 sa->envp ? sa->envp : environ);
+end:
+	posix_spawn_file_actions_destroy(&fa);
+	if (rc != 0) {
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef _LAUNCHER_H_
+#define _LAUNCHER_H_
+
+#include <sys/types.h>
+#include <stdarg.h>
+#include <stdbool.h>
+
+/*
+  Argument vector and environment of a spawned process.
+  They are built in the parent process. The strings are owned by this.
+  'envp' is NULL to inherit the environment of the parent.
+  'error' is set if any of additions failed.
+ */
+struct spawn_args {
+	char **argv;
+	size_t argc;
+	size_t argv_size;
+	char **envp;
+	size_t envc;
+	size_t envp_size;
+	bool error;
+};
+
+#define SPAWN_ARGS_INITIALIZER { NULL, 0, 0, NULL, 0, 0, false }
+
+/* Implemented in launcher.c */
+int spawn_args_add(struct spawn_args *, const char *);
+int spawn_args_addf(struct spawn_args *, const char *, ...)
+	__attribute__((format(printf, 2, 3)));
+int spawn_args_setenv(struct spawn_args *, const char *);
+char *spawn_args_join(const struct spawn_args *);
+void spawn_args_clear(struct spawn_args *);
+int spawn_process(const struct spawn_args *, int, int, int, pid_t *);
+
+#endif
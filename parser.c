@@ -1,13 +1,14 @@
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <glob.h>
-#include <grp.h>
 #include <libgen.h>
-#include <pwd.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -15,66 +16,125 @@
 #include "bmd.h"
 #include "conf.h"
 #include "confparse.h"
+#include "fdbroker.h"
 #include "log.h"
 #include "server.h"
+#include "snapshot.h"
+#include "userdb.h"
 
-struct parser_context *pctxt, *pctxt_snapshot;
+struct parser_context *pctxt;
 
 static struct cfsection *lookup_template(const char *name);
 static int vm_conf_set_params(struct vm_conf *conf, struct cfsection *vm);
-
-static struct mpools mpools;
-
+struct apply_variant;
+static void replay_apply(struct vm_conf *conf, struct apply_variant *av);
+
+/*
+  Memory pool of the current parse. A file is parsed into its own pool
+  to keep the result in the parse cache.
+ */
+static struct mpools *mpools;
+static struct mpools load_mpools = STAILQ_HEAD_INITIALIZER(load_mpools);
+
+/*
+  Create a pool of 'size' bytes in a shared memory object. The whole size is
+  reserved at once and the pages are committed when they are touched.
+  Returns the object to map it in a parser worker, -1 on failure.
+ */
 static int
-mpool_expand(void)
+mpool_create(struct mpools *mp, size_t size)
 {
+	int fd;
 	struct mpool *m;
 
-	m = mmap(NULL, DEFAULT_MMAP_SIZE, PROT_READ | PROT_WRITE,
-	    MAP_SHARED | MAP_ANON, -1, 0);
-	if (m == NULL)
+	STAILQ_INIT(mp);
+	size = roundup2(size, PAGE_SIZE);
+	if ((fd = shm_open(SHM_ANON, O_RDWR | O_CLOEXEC, 0600)) < 0)
 		return -1;
-	m->end = (void *)((uintptr_t)m + DEFAULT_MMAP_SIZE);
+	if (ftruncate(fd, size) < 0 ||
+	    (m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ==
+		MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	m->end = (void *)((uintptr_t)m + size);
 	m->used = m->last_used = m->data;
 	m->error_number = MPERR_NONE;
+	STAILQ_INSERT_TAIL(mp, m, next);
+	return fd;
+}
+
+static int
+mpool_init(struct mpools *mp, size_t size)
+{
+	int fd;
 
-	STAILQ_INSERT_TAIL(&mpools, m, next);
+	if ((fd = mpool_create(mp, size)) < 0)
+		return -1;
+	close(fd);
 	return 0;
 }
 
-static int
-mpool_init(void)
+/*
+  Estimate the pool size to parse a file of 'fsize' bytes.
+  'used' is the bytes used by the last parse of the file, 0 if unknown.
+ */
+static size_t
+mpool_estimate(off_t fsize, size_t used)
 {
-	STAILQ_INIT(&mpools);
-	return mpool_expand();
+	size_t sz;
+
+	sz = MAX((size_t)fsize * MPOOL_FILE_RATIO, used * 4);
+	return MIN(MAX(sz, MPOOL_MIN_SIZE), MPOOL_MAX_SIZE);
 }
 
-static void
-mpool_destroy(void)
+static size_t
+mpool_used(struct mpools *mp)
 {
-	struct mpool *m, *mn;
-	STAILQ_FOREACH_SAFE (m, &mpools, next, mn)
-		munmap(m, (uintptr_t)m->end - (uintptr_t)m);
-	STAILQ_INIT(&mpools);
+	size_t sz = 0;
+	struct mpool *m;
+
+	STAILQ_FOREACH (m, mp, next)
+		sz += (uintptr_t)m->used - (uintptr_t)m->data;
+	return sz;
 }
 
-static void
-mpool_snapshot(void)
+static size_t
+mpool_size(struct mpools *mp)
 {
+	size_t sz = 0;
 	struct mpool *m;
-	STAILQ_FOREACH (m, &mpools, next) {
-		m->last_used = m->used;
-		m->error_number = MPERR_NONE;
-	}
+
+	STAILQ_FOREACH (m, mp, next)
+		sz += (uintptr_t)m->end - (uintptr_t)m;
+	return sz;
 }
 
+/*
+  Unmap the pages of the pool that are not used.
+ */
 static void
-mpool_rollback(void)
+mpool_trim(struct mpools *mp)
 {
 	struct mpool *m;
+	uintptr_t end;
+
+	STAILQ_FOREACH (m, mp, next) {
+		end = roundup2((uintptr_t)m->used, PAGE_SIZE);
+		if (end < (uintptr_t)m->end) {
+			munmap((void *)end, (uintptr_t)m->end - end);
+			m->end = (void *)end;
+		}
+	}
+}
 
-	STAILQ_FOREACH (m, &mpools, next)
-		m->used = m->last_used;
+static void
+mpool_destroy(struct mpools *mp)
+{
+	struct mpool *m, *mn;
+	STAILQ_FOREACH_SAFE (m, mp, next, mn)
+		munmap(m, (uintptr_t)m->end - (uintptr_t)m);
+	STAILQ_INIT(mp);
 }
 
 static enum mpool_error
@@ -83,7 +143,7 @@ mpool_get_error(void)
 	enum mpool_error e = MPERR_NONE;
 	struct mpool *m;
 
-	STAILQ_FOREACH (m, &mpools, next)
+	STAILQ_FOREACH (m, mpools, next)
 		if (e < m->error_number)
 			e = m->error_number;
 	return e;
@@ -97,18 +157,15 @@ mpool_alloc(size_t sz)
 
 	sz = roundup2(sz, 8);
 
-	/* There is no way to allocate memory over this size. */
-	if (sz > DEFAULT_MMAP_SIZE - sizeof(struct mpool)) {
-		STAILQ_FIRST(&mpools)->error_number = MPERR_FATAL;
-		return NULL;
-	}
-
-	STAILQ_FOREACH (m, &mpools, next)
+	STAILQ_FOREACH (m, mpools, next)
 		if ((uintptr_t)m->used + sz <= (uintptr_t)m->end)
 			break;
 
 	if (m == NULL) {
-		STAILQ_FIRST(&mpools)->error_number = MPERR_ALLOC;
+		/* There is no way to allocate memory over this size. */
+		STAILQ_FIRST(mpools)->error_number =
+		    mpool_size(mpools) >= MPOOL_MAX_SIZE ? MPERR_FATAL :
+							   MPERR_ALLOC;
 		return NULL;
 	}
 
@@ -128,8 +185,155 @@ mpool_strdup(const char *p)
 	return ret;
 }
 
+/*
+  Parse result of a config file. It's reused while the file and the files
+  and directories included by it are unchanged.
+ */
+struct cfcache {
+	RB_ENTRY(cfcache) entry;
+	char *filename;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	uid_t uid;
+	gid_t gid;
+	struct timespec mtime;
+	uint64_t hash;
+	uint64_t varhash;
+	size_t poolused;
+	struct mpools mpools;
+	struct parser_context *ctxt;
+	bool used;
+};
+
+RB_HEAD(cfcache_tree, cfcache);
+
+static int
+compare_cfcache(struct cfcache *a, struct cfcache *b)
+{
+	return strcmp(a->filename, b->filename);
+}
+
+RB_GENERATE_STATIC(cfcache_tree, cfcache, entry, compare_cfcache);
+
+static struct cfcache_tree cfcaches = RB_INITIALIZER(&cfcaches);
+
+/*
+  Template looked up while building a VM. 'serial' is 0 if not found.
+ */
+struct template_dep {
+	char *name;
+	uint64_t serial;
+};
+
+/*
+  Inputs of a vm_conf. The vm_conf is reused on reload if the VM section,
+  the templates and the environment are the same.
+  'serial' is 0 if the vm_conf can't be reused.
+ */
+struct vm_build {
+	RB_ENTRY(vm_build) entry;
+	char *name;
+	uint64_t generation;
+	uint64_t serial;
+	uint64_t envhash;
+	bool install;
+	bool reused;
+	struct template_dep *deps;
+	size_t ndeps;
+	size_t deps_size;
+};
+
+RB_HEAD(vm_build_tree, vm_build);
+
+static int
+compare_vm_build(struct vm_build *a, struct vm_build *b)
+{
+	return strcmp(a->name, b->name);
+}
+
+RB_GENERATE_STATIC(vm_build_tree, vm_build, entry, compare_vm_build);
+
+static struct vm_build_tree vm_builds = RB_INITIALIZER(&vm_builds);
+
+/*
+  Build of the current VM, NULL if not recorded.
+ */
+static struct vm_build *recording = NULL;
+
+/*
+  Last serial number of sections.
+ */
+static uint64_t section_serial = 0;
+
+/*
+  Counters of the last load.
+ */
+static int nfiles_parsed = 0, nfiles_reused = 0;
+static int npools = 0, npool_retries = 0;
+static size_t pool_used = 0, pool_size = 0;
+static int nvms_built = 0, nvms_reused = 0;
+static bool snapshot_used = false;
+
+/*
+  Hash of the snapshot that the current VMs are loaded from, 0 if they
+  are built by parsing. Nothing is recorded in 'vm_builds' and the file
+  caches while it's set.
+ */
+static uint64_t builds_snapshot = 0;
+
+/*
+  Set while load_vm_conf_entry parses the config files. The running
+  configuration, the recorded builds and the snapshot are kept.
+ */
+static bool load_isolated = false;
+
+static void
+add_template_dep(struct vm_build *vb, const char *name, uint64_t serial)
+{
+	size_t sz;
+	struct template_dep *d;
+
+	if (vb->ndeps >= vb->deps_size) {
+		sz = vb->deps_size ? vb->deps_size * 2 : 4;
+		if ((d = realloc(vb->deps, sz * sizeof(*d))) == NULL)
+			goto err;
+		vb->deps = d;
+		vb->deps_size = sz;
+	}
+	if ((vb->deps[vb->ndeps].name = strdup(name)) == NULL)
+		goto err;
+	vb->deps[vb->ndeps++].serial = serial;
+	return;
+err:
+	vb->serial = 0;
+}
+
+static void
+free_vm_build(struct vm_build *vb)
+{
+	size_t i;
+
+	for (i = 0; i < vb->ndeps; i++)
+		free(vb->deps[i].name);
+	free(vb->deps);
+	free(vb->name);
+	free(vb);
+}
+
+static void
+free_vm_builds(struct vm_build_tree *tree)
+{
+	struct vm_build *vb, *vbn;
+
+	RB_FOREACH_SAFE (vb, vm_build_tree, tree, vbn) {
+		RB_REMOVE(vm_build_tree, tree, vb);
+		free_vm_build(vb);
+	}
+}
+
 static int
-parse_int(int *val, char *value)
+parse_int(int *val, const char *value)
 {
 	long n;
 	char *p;
@@ -141,61 +345,394 @@ parse_int(int *val, char *value)
 	return 0;
 }
 
-static char *token_to_string(struct variables *vars, struct cftokens *tokens);
+/*
+  Templates applied by VM sections are cached during a load. A cache entry
+  is keyed by the template and the resolved arguments, and has variants of
+  the variables referred by the template. A variant records the expanded
+  values to replay them without expanding the tokens again.
+ */
+enum APPLY_OP {
+	APPLY_VAR,
+	APPLY_CLEAR,
+	APPLY_PARSE,
+};
+
+struct apply_op {
+	enum APPLY_OP type;
+	struct cfsection *sc;
+	struct cfparam *pr;
+	struct cftoken *tk;
+	struct parser_entry *parser;
+	char *val;
+};
+
+/*
+  Variable referred by the template. 'val' is NULL if it's undefined.
+ */
+struct apply_var {
+	char *name;
+	char *val;
+};
+
+struct apply_variant {
+	SLIST_ENTRY(apply_variant) next;
+	struct apply_var *vars;
+	size_t nvars, vars_size;
+	struct apply_op *ops;
+	size_t nops, ops_size;
+	struct cfsection **tmpls;
+	size_t ntmpls, tmpls_size;
+	bool failed;
+};
+
+#define APPLY_VARIANTS_MAX	8
+
+struct apply_cache {
+	RB_ENTRY(apply_cache) entry;
+	struct cfsection *tp;
+	char **args;
+	int nargs;
+	int nvariants;
+	SLIST_HEAD(, apply_variant) variants;
+};
+
+RB_HEAD(apply_cache_tree, apply_cache);
+
+static int
+compare_apply_cache(struct apply_cache *a, struct apply_cache *b)
+{
+	int i, rc;
+
+	if (a->tp != b->tp)
+		return (uintptr_t)a->tp < (uintptr_t)b->tp ? -1 : 1;
+	if (a->nargs != b->nargs)
+		return a->nargs - b->nargs;
+	for (i = 0; i < a->nargs; i++)
+		if ((rc = strcmp(a->args[i], b->args[i])) != 0)
+			return rc;
+	return 0;
+}
+
+RB_GENERATE_STATIC(apply_cache_tree, apply_cache, entry, compare_apply_cache);
+
+static struct apply_cache_tree apply_caches =
+	RB_INITIALIZER(&apply_caches);
+
+/*
+  Variant being recorded, NULL if not recording.
+ */
+static struct apply_variant *apply_rec = NULL;
+
+static int napply_hits = 0, napply_misses = 0;
+
+/*
+  Make room for one more element of 'size' bytes in the array '*p'.
+ */
+static int
+apply_reserve(void **p, size_t n, size_t *cap, size_t size)
+{
+	size_t c;
+	void *np;
+
+	if (n < *cap)
+		return 0;
+	c = *cap ? *cap * 2 : 8;
+	if ((np = realloc(*p, c * size)) == NULL)
+		return -1;
+	*p = np;
+	*cap = c;
+	return 0;
+}
+
+static void
+free_apply_variant(struct apply_variant *av)
+{
+	size_t i;
+
+	for (i = 0; i < av->nvars; i++) {
+		free(av->vars[i].name);
+		free(av->vars[i].val);
+	}
+	for (i = 0; i < av->nops; i++)
+		free(av->ops[i].val);
+	free(av->vars);
+	free(av->ops);
+	free(av->tmpls);
+	free(av);
+}
+
+static void
+free_args(char **args, int nargs)
+{
+	int i;
+
+	for (i = 0; i < nargs; i++)
+		free(args[i]);
+	free(args);
+}
+
+static void
+free_apply_caches(void)
+{
+	struct apply_cache *ac, *acn;
+	struct apply_variant *av, *avn;
+
+	RB_FOREACH_SAFE (ac, apply_cache_tree, &apply_caches, acn) {
+		RB_REMOVE(apply_cache_tree, &apply_caches, ac);
+		SLIST_FOREACH_SAFE (av, &ac->variants, next, avn)
+			free_apply_variant(av);
+		free_args(ac->args, ac->nargs);
+		free(ac);
+	}
+}
+
+/*
+  Returns the cache entry of 'tp' and 'args'. It's created if not found.
+  The entry owns 'args' only if it's created.
+ */
+static struct apply_cache *
+get_apply_cache(struct cfsection *tp, char **args, int nargs)
+{
+	struct apply_cache *ac, key;
+
+	key.tp = tp;
+	key.args = args;
+	key.nargs = nargs;
+	if ((ac = RB_FIND(apply_cache_tree, &apply_caches, &key)) != NULL)
+		return ac;
+	if ((ac = calloc(1, sizeof(*ac))) == NULL)
+		return NULL;
+	ac->tp = tp;
+	ac->args = args;
+	ac->nargs = nargs;
+	SLIST_INIT(&ac->variants);
+	RB_INSERT(apply_cache_tree, &apply_caches, ac);
+	return ac;
+}
+
+/*
+  Returns the variant that refers the same variables as 'vars'.
+ */
+static struct apply_variant *
+find_apply_variant(struct apply_cache *ac, struct variables *vars)
+{
+	struct apply_variant *av;
+	char *val;
+	size_t i;
+
+	SLIST_FOREACH (av, &ac->variants, next) {
+		for (i = 0; i < av->ntmpls; i++)
+			if (av->tmpls[i]->applied)
+				break;
+		if (i < av->ntmpls)
+			continue;
+		for (i = 0; i < av->nvars; i++) {
+			val = get_var(vars, av->vars[i].name);
+			if ((val == NULL) != (av->vars[i].val == NULL) ||
+			    (val != NULL && strcmp(val, av->vars[i].val) != 0))
+				break;
+		}
+		if (i == av->nvars)
+			return av;
+	}
+	return NULL;
+}
+
+static void
+record_apply_op(enum APPLY_OP type, struct cfsection *sc, struct cfparam *pr,
+    struct cftoken *tk, struct parser_entry *parser, const char *val)
+{
+	struct apply_variant *av = apply_rec;
+	struct apply_op *op;
+
+	if (av == NULL || av->failed)
+		return;
+	if (apply_reserve((void **)&av->ops, av->nops, &av->ops_size,
+		sizeof(*op)) < 0)
+		goto err;
+	op = &av->ops[av->nops];
+	op->type = type;
+	op->sc = sc;
+	op->pr = pr;
+	op->tk = tk;
+	op->parser = parser;
+	op->val = NULL;
+	if (val != NULL && (op->val = strdup(val)) == NULL)
+		goto err;
+	av->nops++;
+	return;
+err:
+	av->failed = true;
+}
+
+/*
+  Record the reference of variable 'name' unless the template has set it.
+ */
+static void
+record_apply_var(const char *name, const char *val)
+{
+	struct apply_variant *av = apply_rec;
+	struct apply_var *v;
+	size_t i;
+
+	if (av == NULL || av->failed)
+		return;
+	for (i = 0; i < av->nops; i++)
+		if (av->ops[i].type == APPLY_VAR &&
+		    strcmp(av->ops[i].pr->key->s, name) == 0)
+			return;
+	for (i = 0; i < av->nvars; i++)
+		if (strcmp(av->vars[i].name, name) == 0)
+			return;
+	if (apply_reserve((void **)&av->vars, av->nvars, &av->vars_size,
+		sizeof(*v)) < 0)
+		goto err;
+	v = &av->vars[av->nvars];
+	v->val = NULL;
+	if ((v->name = strdup(name)) == NULL ||
+	    (val != NULL && (v->val = strdup(val)) == NULL)) {
+		free(v->name);
+		goto err;
+	}
+	av->nvars++;
+	return;
+err:
+	av->failed = true;
+}
+
+static void
+record_apply_template(struct cfsection *tp)
+{
+	struct apply_variant *av = apply_rec;
+
+	if (av == NULL || av->failed)
+		return;
+	if (apply_reserve((void **)&av->tmpls, av->ntmpls, &av->tmpls_size,
+		sizeof(*av->tmpls)) < 0) {
+		av->failed = true;
+		return;
+	}
+	av->tmpls[av->ntmpls++] = tp;
+}
+
+static void
+record_apply_failure(void)
+{
+	if (apply_rec != NULL)
+		apply_rec->failed = true;
+}
+
+/*
+  get_var() that records the reference while recording a variant.
+  Template arguments are not recorded, they are a part of the cache key
+  or expanded from the recorded references.
+ */
+static char *
+read_var(struct variables *vars, char *name)
+{
+	char *val = get_var(vars, name);
+
+	if (vars->args == NULL || get_var0(vars->args, name) == NULL)
+		record_apply_var(name, val);
+	return val;
+}
+
+static const char *token_to_string(struct variables *vars,
+    struct cftokens *tokens);
 
 static int
 parse_apply(struct vm_conf *conf, struct cfvalue *vl)
 {
-	int rc;
+	int rc, i, nargs = 0;
 	struct cfsection *tp;
-	char *val, *argval;
+	const char *val, *argval;
 	struct vartree *args, *old_args;
 	struct cfargdef *def;
 	struct cfarg *arg;
+	struct apply_cache *ac = NULL;
+	struct apply_variant *av;
+	char **argv;
 
 	val = token_to_string(&conf->vars, &vl->tokens);
-	if (val == NULL)
+	if (val == NULL) {
+		record_apply_failure();
 		return -1;
+	}
 
 	tp = lookup_template(val);
 	if (tp == NULL) {
 		ERR("%s: unknown template %s\n", conf->name, val);
-		free(val);
+		record_apply_failure();
 		return -1;
 	}
 	if (tp->applied) {
 		ERR("%s: template %s is already applied\n", conf->name, val);
-		free(val);
+		record_apply_failure();
 		return 0;
 	}
-	free(val);
+	record_apply_template(tp);
 
-	if ((args = malloc(sizeof(*args))) == NULL)
+	STAILQ_FOREACH (def, &tp->argdefs, next)
+		nargs++;
+	if ((args = create_vartree()) == NULL)
 		return -1;
-	RB_INIT(args);
+	argv = (apply_rec == NULL) ? calloc(nargs + 1, sizeof(*argv)) : NULL;
 
+	i = 0;
 	arg = STAILQ_FIRST(&vl->args);
 	STAILQ_FOREACH (def, &tp->argdefs, next) {
 		argval = token_to_string(&conf->vars,
 		    arg ? &arg->tokens : &def->tokens);
+		if (argval == NULL)
+			record_apply_failure();
 		if (set_var0(args, def->name, argval ? argval : "") < 0)
 			ERR("failed to set \"%s\" argument! (%s)\n", def->name,
 			    strerror(errno));
-		free(argval);
+		if (argv != NULL && (argval == NULL ||
+			(argv[i++] = strdup(argval)) == NULL)) {
+			free_args(argv, nargs);
+			argv = NULL;
+		}
 		arg = arg ? STAILQ_NEXT(arg, next) : NULL;
 	}
 
 	tp->applied++;
 	old_args = conf->vars.args;
 	conf->vars.args = args;
-	rc = vm_conf_set_params(conf, tp);
+	/* Only the templates applied by VM sections are cached. */
+	if (argv != NULL &&
+	    ((ac = get_apply_cache(tp, argv, nargs)) == NULL ||
+		ac->args != argv))
+		free_args(argv, nargs);
+
+	if (ac != NULL && (av = find_apply_variant(ac, &conf->vars)) != NULL) {
+		replay_apply(conf, av);
+		napply_hits++;
+		rc = 0;
+	} else if (ac != NULL && ac->nvariants < APPLY_VARIANTS_MAX &&
+		   (av = calloc(1, sizeof(*av))) != NULL) {
+		apply_rec = av;
+		rc = vm_conf_set_params(conf, tp);
+		apply_rec = NULL;
+		napply_misses++;
+		if (av->failed) {
+			free_apply_variant(av);
+		} else {
+			SLIST_INSERT_HEAD(&ac->variants, av, next);
+			ac->nvariants++;
+		}
+	} else {
+		if (ac != NULL)
+			napply_misses++;
+		rc = vm_conf_set_params(conf, tp);
+	}
 	conf->vars.args = old_args;
 	free_vartree(args);
 	return rc;
 }
 
 static int
-parse_name(struct vm_conf *conf, char *val)
+parse_name(struct vm_conf *conf, const char *val)
 {
 	if (set_var(&conf->vars, "NAME", val) < 0)
 		ERR("failed to set \"NAME\" variable! (%s)\n", strerror(errno));
@@ -204,7 +741,7 @@ parse_name(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_ncpu(struct vm_conf *conf, char *val)
+parse_ncpu(struct vm_conf *conf, const char *val)
 {
 	int n;
 
@@ -216,7 +753,7 @@ parse_ncpu(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_memory(struct vm_conf *conf, char *val)
+parse_memory(struct vm_conf *conf, const char *val)
 {
 	char *p;
 
@@ -244,9 +781,9 @@ parse_memory(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_passthru(struct vm_conf *conf, char *val)
+parse_passthru(struct vm_conf *conf, const char *val)
 {
-	char *p;
+	const char *p;
 	for (p = val; *p != '\0'; p++)
 		if (*p != '/' && (*p < '0' || *p > '9'))
 			return -1;
@@ -255,7 +792,16 @@ parse_passthru(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_disk(struct vm_conf *conf, char *val)
+parse_depends_on(struct vm_conf *conf, const char *val)
+{
+	if (*val == '\0')
+		return -1;
+
+	return add_depend_conf(conf, val);
+}
+
+static int
+parse_disk(struct vm_conf *conf, const char *val)
 {
 	size_t n;
 	const char *const *p;
@@ -271,7 +817,7 @@ parse_disk(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_iso(struct vm_conf *conf, char *val)
+parse_iso(struct vm_conf *conf, const char *val)
 {
 	size_t n;
 	const char *const *p;
@@ -287,7 +833,7 @@ parse_iso(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_net(struct vm_conf *conf, char *val)
+parse_net(struct vm_conf *conf, const char *val)
 {
 	size_t n;
 	const char *const *p;
@@ -303,28 +849,28 @@ parse_net(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_loadcmd(struct vm_conf *conf, char *val)
+parse_loadcmd(struct vm_conf *conf, const char *val)
 {
 	set_loadcmd(conf, val);
 	return 0;
 }
 
 static int
-parse_installcmd(struct vm_conf *conf, char *val)
+parse_installcmd(struct vm_conf *conf, const char *val)
 {
 	set_installcmd(conf, val);
 	return 0;
 }
 
 static int
-parse_err_logfile(struct vm_conf *conf, char *val)
+parse_err_logfile(struct vm_conf *conf, const char *val)
 {
 	set_err_logfile(conf, val);
 	return 0;
 }
 
 static int
-parse_loader(struct vm_conf *conf, char *val)
+parse_loader(struct vm_conf *conf, const char *val)
 {
 	const char *const *p;
 	static const char *const values[] = { "uefi", "csm", "bhyveload",
@@ -337,7 +883,7 @@ parse_loader(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_bhyveload_env(struct vm_conf *conf, char *val)
+parse_bhyveload_env(struct vm_conf *conf, const char *val)
 {
 	if (strchr(val, '=') == NULL)
 		return -1;
@@ -345,13 +891,13 @@ parse_bhyveload_env(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_bhyveload_loader(struct vm_conf *conf, char *val)
+parse_bhyveload_loader(struct vm_conf *conf, const char *val)
 {
 	return set_bhyveload_loader(conf, val);
 }
 
 static int
-parse_bhyve_env(struct vm_conf *conf, char *val)
+parse_bhyve_env(struct vm_conf *conf, const char *val)
 {
 	if (strchr(val, '=') == NULL)
 		return -1;
@@ -359,7 +905,7 @@ parse_bhyve_env(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_loader_timeout(struct vm_conf *conf, char *val)
+parse_loader_timeout(struct vm_conf *conf, const char *val)
 {
 	int timeout;
 
@@ -370,7 +916,7 @@ parse_loader_timeout(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_stop_timeout(struct vm_conf *conf, char *val)
+parse_stop_timeout(struct vm_conf *conf, const char *val)
 {
 	int timeout;
 
@@ -381,47 +927,24 @@ parse_stop_timeout(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_grub_run_partition(struct vm_conf *conf, char *val)
+parse_grub_run_partition(struct vm_conf *conf, const char *val)
 {
 	return set_grub_run_partition(conf, val);
 }
 
 static int
-parse_debug_port(struct vm_conf *conf, char *val)
+parse_debug_port(struct vm_conf *conf, const char *val)
 {
 	return set_debug_port(conf, val);
 }
 
 static int
-is_in_group(char *user, gid_t base, gid_t target)
-{
-	gid_t *grlist = NULL;
-	int i, ngroups;
-
-	ngroups = sysconf(_SC_NGROUPS_MAX) + 1;
-	if ((grlist = malloc(sizeof(gid_t) * ngroups)) == NULL ||
-	    getgrouplist(user, base, grlist, &ngroups) < 0)
-		goto err;
-
-	for (i = 0; i < ngroups; i++)
-		if (grlist[i] == target)
-			break;
-	if (i == ngroups)
-		goto err;
-
-	free(grlist);
-	return 0;
-err:
-	free(grlist);
-	return -1;
-}
-
-static int
-parse_owner(struct vm_conf *conf, char *val)
+parse_owner(struct vm_conf *conf, const char *val)
 {
-	char *user, *group, *val2 = NULL;
-	struct passwd *pwd;
-	struct group *grp;
+	const char *user;
+	char *group, *val2 = NULL;
+	uid_t uid;
+	gid_t gid;
 
 	if (strchr(val, ':') != NULL) {
 		if ((val2 = strdup(val)) == NULL)
@@ -434,31 +957,30 @@ parse_owner(struct vm_conf *conf, char *val)
 		group = NULL;
 	}
 
-	if ((pwd = getpwnam(user)) == NULL)
+	if (lookup_user(user, &uid, NULL) < 0)
 		goto err;
 
-	if (get_owner(conf) != 0 && get_owner(conf) != pwd->pw_uid) {
+	if (get_owner(conf) != 0 && get_owner(conf) != uid) {
 		ERR("%s\n", "Changing owner is not allowed.");
 		goto err;
 	}
 
 	if (group != NULL) {
-		if ((grp = getgrnam(group)) == NULL)
+		if (lookup_group(group, &gid) < 0)
 			goto err;
-		if (get_owner(conf) != 0 &&
-		    is_in_group(pwd->pw_name, pwd->pw_gid, grp->gr_gid) < 0) {
+		if (get_owner(conf) != 0 && is_in_group(user, gid) < 0) {
 			ERR("%s is not a member of %s group.\n", user, group);
 			goto err;
 		}
 	}
 
-	set_owner(conf, pwd->pw_uid);
+	set_owner(conf, uid);
 	if (set_var(&conf->vars, "OWNER", user) < 0)
 		ERR("failed to set \"OWNER\" variable! (%s)\n",
 		    strerror(errno));
 
 	if (group != NULL) {
-		set_group(conf, grp->gr_gid);
+		set_group(conf, gid);
 		if (set_var(&conf->vars, "GROUP", group) < 0)
 			ERR("failed to set \"GROUP\" variable! (%s)\n",
 			    strerror(errno));
@@ -472,7 +994,7 @@ err:
 }
 
 static int
-parse_boot(struct vm_conf *conf, char *val)
+parse_boot(struct vm_conf *conf, const char *val)
 {
 	const char *const *p;
 	static const char *const values[] = { "yes", "true", "oneshot",
@@ -487,7 +1009,7 @@ parse_boot(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_hostbridge(struct vm_conf *conf, char *val)
+parse_hostbridge(struct vm_conf *conf, const char *val)
 {
 	const char *const *p;
 	static const char *const values[] = { "none", "standard", "intel",
@@ -505,7 +1027,7 @@ parse_hostbridge(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_backend(struct vm_conf *conf, char *val)
+parse_backend(struct vm_conf *conf, const char *val)
 {
 	if (vm_method_exists(val) < 0)
 		return -1;
@@ -514,13 +1036,13 @@ parse_backend(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_keymap(struct vm_conf *conf, char *val)
+parse_keymap(struct vm_conf *conf, const char *val)
 {
 	return set_keymap(conf, val);
 }
 
 static int
-parse_boot_delay(struct vm_conf *conf, char *val)
+parse_boot_delay(struct vm_conf *conf, const char *val)
 {
 	int delay;
 
@@ -531,7 +1053,18 @@ parse_boot_delay(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_comport(struct vm_conf *conf, char *val)
+parse_boot_priority(struct vm_conf *conf, const char *val)
+{
+	int priority;
+
+	if (parse_int(&priority, val) < 0)
+		return -1;
+
+	return set_boot_priority(conf, priority);
+}
+
+static int
+parse_comport(struct vm_conf *conf, const char *val)
 {
 	return set_comport(conf, val);
 }
@@ -544,25 +1077,31 @@ parse_boolean(const char *value)
 }
 
 static int
-parse_reboot_on_change(struct vm_conf *conf, char *val)
+parse_reboot_on_change(struct vm_conf *conf, const char *val)
 {
 	return set_reboot_on_change(conf, parse_boolean(val));
 }
 
 static int
-parse_install(struct vm_conf *conf, char *val)
+parse_ready_signal(struct vm_conf *conf, const char *val)
+{
+	return set_ready_signal(conf, parse_boolean(val));
+}
+
+static int
+parse_install(struct vm_conf *conf, const char *val)
 {
 	return set_install(conf, parse_boolean(val));
 }
 
 static int
-parse_graphics(struct vm_conf *conf, char *val)
+parse_graphics(struct vm_conf *conf, const char *val)
 {
 	return set_fbuf_enable(conf->fbuf, parse_boolean(val));
 }
 
 static int
-parse_graphics_port(struct vm_conf *conf, char *val)
+parse_graphics_port(struct vm_conf *conf, const char *val)
 {
 	int port;
 
@@ -573,65 +1112,65 @@ parse_graphics_port(struct vm_conf *conf, char *val)
 }
 
 static int
-parse_graphics_listen(struct vm_conf *conf, char *val)
+parse_graphics_listen(struct vm_conf *conf, const char *val)
 {
 	return set_fbuf_ipaddr(conf->fbuf, val);
 }
 
 static int
-parse_graphics_res(struct vm_conf *conf, char *val)
+parse_graphics_res(struct vm_conf *conf, const char *val)
 {
 	char *p;
 	int width, height;
 
-	if ((p = strchr(val, 'x')) == NULL)
+	/* 'val' may be a token of the config and must not be modified. */
+	width = strtol(val, &p, 10);
+	if (*p != 'x')
 		return -1;
-
-	*p = '\0';
-
-	if (parse_int(&width, val) < 0 || parse_int(&height, p + 1) < 0)
+	height = strtol(p + 1, &p, 10);
+	if (*p != '\0')
 		return -1;
 
 	return set_fbuf_res(conf->fbuf, width, height);
 }
 
 static int
-parse_graphics_vga(struct vm_conf *conf, char *val)
+parse_graphics_vga(struct vm_conf *conf, const char *val)
 {
 	return set_fbuf_vgaconf(conf->fbuf, val);
 }
 
 static int
-parse_graphics_wait(struct vm_conf *conf, char *val)
+parse_graphics_wait(struct vm_conf *conf, const char *val)
 {
 	return set_fbuf_wait(conf->fbuf, parse_boolean(val));
 }
 
 static int
-parse_graphics_password(struct vm_conf *conf, char *val)
+parse_graphics_password(struct vm_conf *conf, const char *val)
 {
 	return set_fbuf_password(conf->fbuf, val);
 }
 
 static int
-parse_xhci_mouse(struct vm_conf *conf, char *val)
+parse_xhci_mouse(struct vm_conf *conf, const char *val)
 {
 	return set_mouse(conf, parse_boolean(val));
 }
 
 static int
-parse_wired_memory(struct vm_conf *conf, char *val)
+parse_wired_memory(struct vm_conf *conf, const char *val)
 {
 	return set_wired_memory(conf, parse_boolean(val));
 }
 
 static int
-parse_utctime(struct vm_conf *conf, char *val)
+parse_utctime(struct vm_conf *conf, const char *val)
 {
 	return set_utctime(conf, parse_boolean(val));
 }
 
-typedef int (*pfunc)(struct vm_conf *conf, char *val);
+typedef int (*pfunc)(struct vm_conf *conf, const char *val);
 typedef void (*cfunc)(struct vm_conf *conf);
 
 struct parser_entry {
@@ -648,8 +1187,10 @@ static struct parser_entry parser_list[] = {
 	{ "bhyveload_loader", &parse_bhyveload_loader, NULL },
 	{ "boot", &parse_boot, NULL },
 	{ "boot_delay", &parse_boot_delay, NULL },
+	{ "boot_priority", &parse_boot_priority, NULL },
 	{ "comport", &parse_comport, NULL },
 	{ "debug_port", &parse_debug_port, NULL },
+	{ "depends_on", &parse_depends_on, &clear_depend_conf },
 	{ "disk", &parse_disk, &clear_disk_conf },
 	{ "err_logfile", &parse_err_logfile, NULL },
 	{ "graphics", &parse_graphics, NULL },
@@ -674,6 +1215,7 @@ static struct parser_entry parser_list[] = {
 	{ "network", &parse_net, &clear_net_conf },
 	{ "owner", &parse_owner, NULL },
 	{ "passthru", &parse_passthru, &clear_passthru_conf },
+	{ "ready_signal", &parse_ready_signal, NULL },
 	{ "reboot_on_change", &parse_reboot_on_change, NULL },
 	{ "stop_timeout", &parse_stop_timeout, NULL },
 	{ "utctime", &parse_utctime, NULL },
@@ -724,128 +1266,296 @@ lookup_template(const char *name)
 
 	STAILQ_FOREACH (tp, &pctxt->cftemplates, next)
 		if (strcmp(tp->name, name) == 0)
-			return tp;
-	return NULL;
+			break;
+	if (recording != NULL)
+		add_template_dep(recording, name, tp ? tp->serial : 0);
+	return tp;
 }
 
 static int
-calc_expr(struct variables *vars, struct cfexpr *ex, long *v, char *fn, int ln)
+count_expr(struct cfexpr *ex)
 {
-	char *p, *val;
-	long n, left, right;
+	return ex == NULL ? 0 :
+			    1 + count_expr(ex->left) + count_expr(ex->right);
+}
 
-	switch (ex->type) {
-	case CF_NUM:
-		n = strtol(ex->val, &p, 0);
-		if (*p != '\0') {
-			ERR("%s line %d: %s is not a number\n", fn, ln,
-			    ex->val);
-			return -1;
-		}
-		*v = n;
+/*
+  Returns the result of 'op' in 'v', -1 if it cannot be calculated.
+ */
+static int
+apply_op(enum CF_OP op, long left, long right, long *v)
+{
+	switch (op) {
+	case OP_NEG:
+		*v = -1 * left;
 		return 0;
-	case CF_VAR:
-		if (vars == NULL) {
-			*v = 0;
-			return 0;
-		}
-		if ((val = get_var(vars, ex->val)) == NULL) {
-			ERR("%s line %d: ${%s} is undefined\n", fn, ln,
-			    ex->val);
-			return -1;
-		}
-		n = strtol(val, &p, 0);
-		if (*p != '\0') {
-			ERR("%s line %d: ${%s} is not a number\n", fn, ln,
-			    ex->val);
-			return -1;
-		}
-		*v = n;
+	case OP_ADD:
+		*v = left + right;
 		return 0;
-	case CF_EXPR:
-		if (calc_expr(vars, ex->left, &left, fn, ln) < 0)
+	case OP_SUB:
+		*v = left - right;
+		return 0;
+	case OP_MUL:
+		*v = left * right;
+		return 0;
+	case OP_DIV:
+		if (right == 0)
 			return -1;
-		if (ex->op == '~') {
-			*v = -1 * left;
-			return 0;
-		}
-		if (calc_expr(vars, ex->right, &right, fn, ln) < 0)
+		*v = left / right;
+		return 0;
+	case OP_MOD:
+		if (right == 0)
 			return -1;
-		switch (ex->op) {
-		case '+':
-			*v = left + right;
-			return 0;
-		case '-':
-			*v = left - right;
-			return 0;
-		case '*':
-			*v = left * right;
-			return 0;
-		case '/':
-			if (right == 0) {
-				ERR("%s line %d: divided by zero\n", fn, ln);
-				return -1;
-			}
-			*v = left / right;
-			return 0;
-		case '%':
-			*v = left % right;
-			return 0;
-		}
-		break;
+		*v = left % right;
+		return 0;
 	default:
+		return -1;
+	}
+}
+
+/*
+  Append the code of 'ex' to 'prog' and fold it if the operands are
+  constants. 'sp' is the stack depth while running the code.
+ */
+static void
+emit_expr(struct cfprog *prog, struct cfexpr *ex, int *sp)
+{
+	struct cfcode *c;
+	char *p;
+	long v;
+	int n;
+
+	switch (ex->type) {
+	case CF_NUM:
+		c = &prog->code[prog->ncodes++];
+		c->num = strtol(ex->val, &p, 0);
+		c->op = (*p == '\0') ? OP_NUM : OP_BAD;
+		c->name = ex->val;
+		break;
+	case CF_VAR:
+		c = &prog->code[prog->ncodes++];
+		c->op = OP_VAR;
+		c->num = 0;
+		c->name = ex->val;
+		break;
+	case CF_EXPR:
+		emit_expr(prog, ex->left, sp);
+		if (ex->op != '~')
+			emit_expr(prog, ex->right, sp);
+		c = &prog->code[prog->ncodes++];
+		c->num = 0;
+		c->name = NULL;
+		switch (ex->op) {
+		case '~':
+			c->op = OP_NEG;
+			break;
+		case '+':
+			c->op = OP_ADD;
+			break;
+		case '-':
+			c->op = OP_SUB;
+			break;
+		case '*':
+			c->op = OP_MUL;
+			break;
+		case '/':
+			c->op = OP_DIV;
+			break;
+		case '%':
+			c->op = OP_MOD;
+			break;
+		default:
+			c->op = OP_BAD;
+			break;
+		}
+		if (c->op == OP_NEG || c->op == OP_BAD) {
+			n = 1;
+		} else {
+			n = 2;
+			(*sp)--;
+		}
+		/* Errors are left to be reported on the expansion. */
+		if (prog->ncodes > n && c->op != OP_BAD &&
+		    c[-1].op == OP_NUM && (n == 1 || c[-2].op == OP_NUM) &&
+		    apply_op(c->op, c[-n].num, c[-1].num, &v) == 0) {
+			prog->ncodes -= n;
+			c[-n].num = v;
+			c[-n].name = NULL;
+		}
+		return;
+	default:
+		c = &prog->code[prog->ncodes++];
+		c->op = OP_BAD;
+		c->num = 0;
+		c->name = NULL;
 		break;
 	}
+	if (++(*sp) > prog->depth)
+		prog->depth = *sp;
+}
 
-	ERR("%s line %d: unknown operator\n", fn, ln);
-	return -1;
+/*
+  Compile the expression into the memory pool of the parser.
+ */
+struct cfprog *
+compile_expr(struct cfexpr *ex)
+{
+	struct cfprog *prog;
+	int n = count_expr(ex), sp = 0;
+
+	if (n == 0 || (prog = mpool_alloc(sizeof(*prog) +
+			   n * sizeof(struct cfcode))) == NULL)
+		return NULL;
+	prog->ncodes = 0;
+	prog->depth = 0;
+	emit_expr(prog, ex, &sp);
+	return prog;
 }
 
-static char *
-token_to_string(struct variables *vars, struct cftokens *tokens)
+static int
+calc_expr(struct variables *vars, struct cfprog *prog, long *v, char *fn,
+    int ln)
 {
-	FILE *fp;
-	char *str, *val;
+	struct cfcode *c;
+	long stack[prog->depth], n;
+	int sp = 0;
+	char *p, *val;
+
+	for (c = prog->code; c < &prog->code[prog->ncodes]; c++) {
+		switch (c->op) {
+		case OP_NUM:
+			stack[sp++] = c->num;
+			continue;
+		case OP_VAR:
+			if (vars == NULL) {
+				stack[sp++] = 0;
+				continue;
+			}
+			if ((val = read_var(vars, c->name)) == NULL) {
+				ERR("%s line %d: ${%s} is undefined\n", fn, ln,
+				    c->name);
+				return -1;
+			}
+			n = strtol(val, &p, 0);
+			if (*p != '\0') {
+				ERR("%s line %d: ${%s} is not a number\n", fn,
+				    ln, c->name);
+				return -1;
+			}
+			stack[sp++] = n;
+			continue;
+		case OP_BAD:
+			if (c->name != NULL)
+				ERR("%s line %d: %s is not a number\n", fn, ln,
+				    c->name);
+			else
+				ERR("%s line %d: unknown operator\n", fn, ln);
+			return -1;
+		case OP_NEG:
+			apply_op(c->op, stack[sp - 1], 0, &stack[sp - 1]);
+			continue;
+		default:
+			sp--;
+			if (apply_op(c->op, stack[sp - 1], stack[sp],
+				&stack[sp - 1]) < 0) {
+				ERR("%s line %d: divided by zero\n", fn, ln);
+				return -1;
+			}
+			continue;
+		}
+	}
+
+	*v = stack[0];
+	return 0;
+}
+
+/*
+  Buffer of token_to_string(), reused while loading the config.
+ */
+static struct {
+	char *buf;
 	size_t len;
+	size_t size;
+} expand_buf;
+
+static int
+expand_append(const char *s, size_t len)
+{
+	size_t size;
+	char *p;
+
+	if (expand_buf.len + len >= expand_buf.size) {
+		size = MAX(expand_buf.size * 2,
+		    roundup2(expand_buf.len + len + 1, 64));
+		if ((p = realloc(expand_buf.buf, size)) == NULL)
+			return -1;
+		expand_buf.buf = p;
+		expand_buf.size = size;
+	}
+	memcpy(&expand_buf.buf[expand_buf.len], s, len);
+	expand_buf.len += len;
+	expand_buf.buf[expand_buf.len] = '\0';
+	return 0;
+}
+
+static void
+free_expand_buf(void)
+{
+	free(expand_buf.buf);
+	expand_buf.buf = NULL;
+	expand_buf.len = expand_buf.size = 0;
+}
+
+/*
+  Expand the tokens to a string. A constant value, which the grammar makes
+  a single string token, is returned as is. Otherwise the string is valid
+  until the next call. In either case, it must not be modified or freed.
+ */
+static const char *
+token_to_string(struct variables *vars, struct cftokens *tokens)
+{
+	char *val, num[24];
 	struct cftoken *tk;
-	long num;
+	long n;
+	int rc = 0;
 
-	if ((fp = open_memstream(&str, &len)) == NULL)
-		return NULL;
+	if ((tk = STAILQ_FIRST(tokens)) == NULL)
+		return "";
+	if (tk->type == CF_STR && STAILQ_NEXT(tk, next) == NULL)
+		return tk->s;
 
+	expand_buf.len = 0;
 	STAILQ_FOREACH (tk, tokens, next) {
 		switch (tk->type) {
 		case CF_STR:
-			fwrite(tk->s, 1, tk->len, fp);
+			rc = expand_append(tk->s, tk->len);
 			break;
 		case CF_VAR:
 			if (vars == NULL)
 				continue;
-			if ((val = get_var(vars, tk->s)) == NULL) {
+			if ((val = read_var(vars, tk->s)) == NULL) {
 				ERR("%s line %d: ${%s} is undefined",
 				    tk->filename, tk->lineno, tk->s);
-				goto err;
+				return NULL;
 			}
-			fwrite(val, 1, strlen(val), fp);
+			rc = expand_append(val, strlen(val));
 			break;
 		case CF_EXPR:
-			if (calc_expr(vars, tk->expr, &num, tk->filename,
+			if (calc_expr(vars, tk->prog, &n, tk->filename,
 				tk->lineno) < 0)
-				goto err;
-			fprintf(fp, "%ld", num);
+				return NULL;
+			rc = expand_append(num,
+			    snprintf(num, sizeof(num), "%ld", n));
 			break;
 		case CF_NUM:
 			/* Unused */
 			break;
 		}
+		if (rc < 0)
+			return NULL;
 	}
 
-	fclose(fp);
-	return str;
-err:
-	fclose(fp);
-	free(str);
-	return NULL;
+	return expand_append("", 0) < 0 ? NULL : expand_buf.buf;
 }
 
 int
@@ -853,7 +1563,7 @@ apply_global_vars(struct cfsection *sc)
 {
 	struct cfparam *pr;
 	struct cfvalue *vl;
-	char *val;
+	const char *val;
 	struct variables vars;
 
 	vars.global = global_vars;
@@ -869,8 +1579,6 @@ apply_global_vars(struct cfsection *sc)
 			if (set_var(&vars, pr->key->s, val) < 0)
 				ERR("failed to set \"%s\" variable! (%s)\n",
 				    pr->key->s, strerror(errno));
-
-			free(val);
 		}
 
 	return 0;
@@ -882,7 +1590,9 @@ gl_conf_set_params(struct global_conf *gc, struct variables *vars,
 {
 	struct cfparam *pr;
 	struct cfvalue *vl;
-	char *key, *val, **t, *p, *nmdm_offset_s = NULL;
+	const char *val;
+	char *key, **t, *p, *nmdm_offset_s = NULL;
+	char *boot_concurrency_s = NULL, *boot_rate_s = NULL;
 
 	STAILQ_FOREACH (pr, &sc->params, next) {
 		key = pr->key->s;
@@ -894,11 +1604,17 @@ gl_conf_set_params(struct global_conf *gc, struct variables *vars,
 			if (set_var(vars, key, val) < 0)
 				ERR("failed to set \"%s\" variable! (%s)\n",
 				    key, strerror(errno));
-
-			free(val);
 			continue;
 		}
 		switch (key[0]) {
+		case 'b':
+			if (strcmp(key, "boot_concurrency") == 0)
+				t = &boot_concurrency_s;
+			else if (strcmp(key, "boot_rate") == 0)
+				t = &boot_rate_s;
+			else
+				goto unknown;
+			break;
 		case 'c':
 			if (strcmp(key, "cmd_socket_mode") == 0)
 				t = &gc->unix_domain_socket_mode;
@@ -932,13 +1648,10 @@ gl_conf_set_params(struct global_conf *gc, struct variables *vars,
 		}
 
 		STAILQ_FOREACH (vl, &pr->vals, next) {
-			val = token_to_string(vars, &vl->tokens);
-			if (val == NULL)
+			if (*t != NULL ||
+			    (val = token_to_string(vars, &vl->tokens)) == NULL)
 				continue;
-			if (*t == NULL)
-				*t = val;
-			else
-				free(val);
+			*t = strdup(val);
 		}
 		continue;
 
@@ -953,9 +1666,85 @@ gl_conf_set_params(struct global_conf *gc, struct variables *vars,
 		free(nmdm_offset_s);
 	}
 
+	if (boot_concurrency_s) {
+		gc->boot_concurrency = strtol(boot_concurrency_s, &p, 0);
+		if (*p != '\0' || gc->boot_concurrency < 0)
+			gc->boot_concurrency = 0;
+		free(boot_concurrency_s);
+	}
+
+	if (boot_rate_s) {
+		gc->boot_rate = strtol(boot_rate_s, &p, 0);
+		if (*p != '\0' || gc->boot_rate < 0)
+			gc->boot_rate = 0;
+		free(boot_rate_s);
+	}
+
 	return 0;
 }
 
+static void
+set_param(struct vm_conf *conf, struct cfsection *sc, struct cfparam *pr,
+    struct cftoken *tk, struct parser_entry *parser, const char *val)
+{
+	struct vm_conf_entry *conf_ent = (struct vm_conf_entry *)conf;
+	char *key = pr->key->s;
+	int rc;
+
+	tk = tk ? tk : pr->key;
+	if (parser) {
+		if ((*parser->parse)(conf, val) < 0)
+			ERR("%s line %d: vm %s: invalid value: %s = %s\n",
+			    tk->filename, tk->lineno, sc->name, key, val);
+		return;
+	}
+	rc = call_plugin_parser(&conf_ent->pl_data, key, val);
+	if (rc > 0)
+		ERR("%s line %d: %s: unknown key %s\n", pr->key->filename,
+		    pr->key->lineno, sc->name, key);
+	else if (rc < 0)
+		ERR("%s line %d: %s: invalid value: %s = %s\n", tk->filename,
+		    tk->lineno, sc->name, key, val);
+}
+
+static void
+set_param_var(struct vm_conf *conf, char *key, const char *val)
+{
+	if (set_var(&conf->vars, key, val) < 0)
+		ERR("failed to set \"%s\" variable! (%s)\n", key,
+		    strerror(errno));
+}
+
+/*
+  Apply the recorded settings of a template to 'conf'.
+ */
+static void
+replay_apply(struct vm_conf *conf, struct apply_variant *av)
+{
+	struct apply_op *op;
+	size_t i;
+
+	for (i = 0; i < av->ntmpls; i++) {
+		av->tmpls[i]->applied++;
+		if (recording != NULL)
+			add_template_dep(recording, av->tmpls[i]->name,
+			    av->tmpls[i]->serial);
+	}
+	for (op = av->ops; op < &av->ops[av->nops]; op++)
+		switch (op->type) {
+		case APPLY_VAR:
+			set_param_var(conf, op->pr->key->s, op->val);
+			break;
+		case APPLY_CLEAR:
+			(*op->parser->clear)(conf);
+			break;
+		case APPLY_PARSE:
+			set_param(conf, op->sc, op->pr, op->tk, op->parser,
+			    op->val);
+			break;
+		}
+}
+
 static int
 vm_conf_set_params(struct vm_conf *conf, struct cfsection *sc)
 {
@@ -963,21 +1752,20 @@ vm_conf_set_params(struct vm_conf *conf, struct cfsection *sc)
 	struct cfvalue *vl;
 	struct cftoken *tk;
 	struct parser_entry *parser;
-	struct vm_conf_entry *conf_ent = (struct vm_conf_entry *)conf;
-	char *key, *val;
-	int rc;
+	const char *val;
+	char *key;
 
 	STAILQ_FOREACH (pr, &sc->params, next) {
 		key = pr->key->s;
 		if (pr->key->type == CF_VAR) {
 			vl = STAILQ_FIRST(&pr->vals);
 			val = token_to_string(&conf->vars, &vl->tokens);
-			if (val == NULL)
+			if (val == NULL) {
+				record_apply_failure();
 				continue;
-			if (set_var(&conf->vars, key, val) < 0)
-				ERR("failed to set \"%s\" variable! (%s)\n",
-				    key, strerror(errno));
-			free(val);
+			}
+			set_param_var(conf, key, val);
+			record_apply_op(APPLY_VAR, sc, pr, NULL, NULL, val);
 			continue;
 		}
 		if (strcasecmp(key, ".apply") == 0) {
@@ -988,36 +1776,19 @@ vm_conf_set_params(struct vm_conf *conf, struct cfsection *sc)
 		parser = bsearch(key, parser_list,
 		    sizeof(parser_list) / sizeof(parser_list[0]),
 		    sizeof(parser_list[0]), compare_parser_entry);
-		if (parser && parser->clear != NULL && pr->operator== 0)
+		if (parser && parser->clear != NULL && pr->operator== 0) {
 			(*parser->clear)(conf);
+			record_apply_op(APPLY_CLEAR, sc, pr, NULL, parser, NULL);
+		}
 		STAILQ_FOREACH (vl, &pr->vals, next) {
 			val = token_to_string(&conf->vars, &vl->tokens);
-			if (val == NULL)
+			if (val == NULL) {
+				record_apply_failure();
 				continue;
-			if (parser) {
-				if ((*parser->parse)(conf, val) < 0) {
-					tk = STAILQ_FIRST(&vl->tokens);
-					tk = tk ? tk : pr->key;
-					ERR("%s line %d: vm %s: invalid value: %s = %s\n",
-					    tk->filename, tk->lineno, sc->name,
-					    key, val);
-				}
-			} else {
-				rc = call_plugin_parser(&conf_ent->pl_data, key,
-				    val);
-				if (rc > 0) {
-					ERR("%s line %d: %s: unknown key %s\n",
-					    pr->key->filename, pr->key->lineno,
-					    sc->name, key);
-				} else if (rc < 0) {
-					tk = STAILQ_FIRST(&vl->tokens);
-					tk = tk ? tk : pr->key;
-					ERR("%s line %d: %s: invalid value: %s = %s\n",
-					    tk->filename, tk->lineno, sc->name,
-					    key, val);
-				}
 			}
-			free(val);
+			tk = STAILQ_FIRST(&vl->tokens);
+			set_param(conf, sc, pr, tk, parser, val);
+			record_apply_op(APPLY_PARSE, sc, pr, tk, parser, val);
 		}
 	}
 
@@ -1041,6 +1812,7 @@ free_cftoken(struct cftoken *tk)
 	if (tk == NULL)
 		return;
 	free_cfexpr(tk->expr);
+	free(tk->prog);
 	free(tk->s);
 	free(tk);
 }
@@ -1160,21 +1932,28 @@ static int
 push_file(char *fn)
 {
 	struct cffile *file;
+	struct stat st;
 	char *rpath, *path;
 
 	if (fn == NULL || (path = realpath(fn, NULL)) == NULL)
 		return 0;
 
-	if (strncmp(path, "/dev", 4) == 0 || access(path, R_OK) < 0) {
+	if (strncmp(path, "/dev", 4) == 0 || access(path, R_OK) < 0 ||
+	    stat(path, &st) < 0) {
 		ERR("%s: access denied\n", path);
 		goto err;
 	}
 
+	/*
+	  The files included by the other files are checked on merging
+	  the parse results.
+	 */
+	if (pctxt->cur_file != NULL &&
+	    strcmp(pctxt->cur_file->filename, path) == 0)
+		goto dup;
 	STAILQ_FOREACH (file, &pctxt->cffiles, next)
-		if (strcmp(file->filename, path) == 0) {
-			ERR("%s is already included\n", path);
-			goto err;
-		}
+		if (strcmp(file->filename, path) == 0)
+			goto dup;
 
 	/* No need to free 'rpath', because it's allocated from mpool.  */
 	rpath = mpool_strdup(path);
@@ -1185,14 +1964,49 @@ push_file(char *fn)
 
 	file->filename = rpath;
 	file->line = 0;
+	file->dev = st.st_dev;
+	file->ino = st.st_ino;
+	file->ctime = st.st_ctim;
 	STAILQ_INSERT_TAIL(&pctxt->cffiles, file, next);
 	INFO("load config %s\n", rpath);
 	return 0;
+dup:
+	ERR("%s is already included\n", path);
 err:
 	free(path);
 	return -1;
 }
 
+/*
+  Record the directory of the .include pattern 'path'. The cached parse
+  result is discarded if the directory is changed.
+ */
+static void
+add_include_dir(const char *path)
+{
+	struct cfinclude *inc;
+	struct stat st;
+	char *dir, *p;
+
+	if ((p = strdup(path)) == NULL) {
+		pctxt->nocache = true;
+		return;
+	}
+	dir = dirname(p);
+	if (strpbrk(dir, "*?[") != NULL || stat(dir, &st) < 0 ||
+	    (inc = objalloc(cfinclude)) == NULL ||
+	    (inc->dirname = mpool_strdup(dir)) == NULL) {
+		pctxt->nocache = true;
+		free(p);
+		return;
+	}
+	inc->dev = st.st_dev;
+	inc->ino = st.st_ino;
+	inc->mtime = st.st_mtim;
+	STAILQ_INSERT_TAIL(&pctxt->cfincludes, inc, next);
+	free(p);
+}
+
 uid_t
 peek_fileowner(void)
 {
@@ -1214,7 +2028,8 @@ peek_filename(void)
 void
 glob_path(struct cftokens *ts)
 {
-	struct cftoken *tk;
+	struct cftoken *tk, *t;
+	const char *val;
 	char *path, *conf, *dir, *npath;
 	struct variables vars;
 	glob_t g;
@@ -1227,7 +2042,12 @@ glob_path(struct cftokens *ts)
 	if ((tk = STAILQ_FIRST(ts)) == NULL)
 		return;
 
-	if ((path = token_to_string(&vars, ts)) == NULL)
+	STAILQ_FOREACH (t, ts, next)
+		if (t->type != CF_STR)
+			pctxt->vardep = true;
+
+	if ((val = token_to_string(&vars, ts)) == NULL ||
+	    (path = strdup(val)) == NULL)
 		return;
 
 	if (path[0] != '/' && (conf = strdup(tk->filename)) != NULL) {
@@ -1239,6 +2059,7 @@ glob_path(struct cftokens *ts)
 		free(conf);
 	}
 
+	add_include_dir(path);
 	if (glob(path, 0, NULL, &g) < 0) {
 		ERR("failed to glob %s\n", path);
 		goto ret;
@@ -1261,140 +2082,1269 @@ clear_applied(void)
 		sc->applied = 0;
 }
 
+struct section_order {
+	struct cfsection *sc;
+	int order;
+};
+
 static int
-check_duplicate(void)
+compare_section_order(const void *a, const void *b)
 {
-	struct cfsection *sc;
+	const struct section_order *x = a, *y = b;
+	int rc;
 
-	STAILQ_FOREACH (sc, &pctxt->cftemplates, next)
-		if (sc->duplicate)
-			return -1;
-	return 0;
+	if ((rc = strcmp(x->sc->name, y->sc->name)) != 0)
+		return rc;
+	return x->order - y->order;
 }
 
-#define END_UP(var, type) STAILQ_NEXT(STAILQ_LAST(var, type, next), next) = NULL
-
+/*
+  Returns the number of sections of the same name as the former ones.
+  They are marked 'duplicate' and the VM sections are not built.
+ */
 static int
-parse(struct cffile *file)
+check_duplicate0(struct cfsections *head, const char *type, bool vm)
 {
-	FILE *fp;
-	struct stat st;
-	int rc, status;
-	pid_t pid;
+	struct cfsection *sc;
+	struct section_order *s;
+	int i, n = 0, dup = 0;
 
-retry:
-	mpool_snapshot();
-	*pctxt_snapshot = *pctxt;
-	pctxt->cur_file = file;
-	if ((pid = fork()) < 0)
+	STAILQ_FOREACH (sc, head, next) {
+		sc->duplicate = 0;
+		n++;
+	}
+	if (n < 2)
+		return 0;
+	if ((s = malloc(n * sizeof(*s))) == NULL)
 		return -1;
-	if (pid == 0) {
-		if (stat(file->filename, &st) < 0 || (!S_ISREG(st.st_mode))) {
-			ERR("%s is not a file\n", file->filename);
-			exit(0);
-		}
-		/*
-		  Give up the root privilege to parse the configuration.
-		  If this process doesn't have root privilege,
-		  setgid(2) and setuid(2) will fail. Keep the user privilege.
-		*/
-		setgid(st.st_gid);
-		setuid(st.st_uid);
-		if ((fp = fopen(file->filename, "r")) == NULL) {
-			ERR("failed to open %s\n", file->filename);
-			exit(0);
+	i = 0;
+	STAILQ_FOREACH (sc, head, next) {
+		s[i].sc = sc;
+		s[i].order = i;
+		i++;
+	}
+	qsort(s, n, sizeof(*s), compare_section_order);
+	for (i = 1; i < n; i++)
+		if (strcmp(s[i - 1].sc->name, s[i].sc->name) == 0) {
+			ERR("%s: %s '%s' already exists.%s\n",
+			    s[i].sc->filename, type, s[i].sc->name,
+			    vm ? " ignored." : "");
+			s[i].sc->duplicate = 1;
+			dup++;
 		}
-		yyin = fp;
-		lineno = 1;
-		rc = (yyparse() || yynerrs) ? 1 : 0;
-		fclose(fp);
-		yylex_destroy();
-		exit(rc);
-	} else
-		waitpid(pid, &status, 0);
+	free(s);
+	return dup;
+}
 
-	if (!WIFEXITED(status))
-		return -1;
-	if (WEXITSTATUS(status) != 0) {
-		switch (mpool_get_error()) {
-		case MPERR_NONE:
-		case MPERR_FATAL:
+static int
+check_duplicate(void)
+{
+	check_duplicate0(&pctxt->cfvms, "vm", true);
+	return check_duplicate0(&pctxt->cftemplates, "template", false) != 0 ?
+	    -1 : 0;
+}
+
+static int
+compare_conf_name(const void *a, const void *b)
+{
+	struct vm_conf *const *x = a, *const *y = b;
+	return strcmp((*x)->name, (*y)->name);
+}
+
+/*
+  Returns an array of the vm_confs in 'list' sorted by name.
+  The number of them is stored to 'np', 0 if failed.
+ */
+static struct vm_conf **
+sort_conf_list(struct vm_conf_head *list, int *np)
+{
+	struct vm_conf_entry *conf_ent;
+	struct vm_conf **confs;
+	int i, n = 0;
+
+	*np = 0;
+	LIST_FOREACH (conf_ent, list, next)
+		n++;
+	if (n == 0 || (confs = malloc(n * sizeof(*confs))) == NULL)
+		return NULL;
+
+	i = 0;
+	LIST_FOREACH (conf_ent, list, next)
+		confs[i++] = &conf_ent->conf;
+	qsort(confs, n, sizeof(*confs), compare_conf_name);
+	*np = n;
+	return confs;
+}
+
+/*
+  Returns the index of VM 'name' in 'confs' sorted by name or -1.
+ */
+static int
+find_conf(struct vm_conf **confs, int n, const char *name)
+{
+	struct vm_conf key, *kp = &key, **p;
+
+	key.name = (char *)name;
+	p = bsearch(&kp, confs, n, sizeof(*confs), compare_conf_name);
+	return p ? p - confs : -1;
+}
+
+/*
+  Depth first search of the dependencies.
+  'mark' is 1 while visiting the VM and 2 after visited.
+ */
+static int
+visit_depends(struct vm_conf **confs, char *mark, int n, int i)
+{
+	struct depend_conf *dc;
+	int j;
+
+	mark[i] = 1;
+	STAILQ_FOREACH (dc, &confs[i]->depends, next) {
+		if ((j = find_conf(confs, n, dc->name)) < 0) {
+			ERR("vm %s: unknown dependency %s is ignored\n",
+			    confs[i]->name, dc->name);
+			continue;
+		}
+		if (mark[j] == 1) {
+			ERR("vm %s: cyclic dependency on %s\n",
+			    confs[i]->name, dc->name);
 			return -1;
-		case MPERR_ALLOC:
-			mpool_rollback();
-			*pctxt = *pctxt_snapshot;
-			END_UP(&pctxt->cfglobals, cfsection);
-			END_UP(&pctxt->cftemplates, cfsection);
-			END_UP(&pctxt->cfvms, cfsection);
-			END_UP(&pctxt->cffiles, cffile);
-			if (mpool_expand() < 0)
-				return -1;
-			goto retry;
 		}
+		if (mark[j] == 0 && visit_depends(confs, mark, n, j) < 0)
+			return -1;
 	}
+	mark[i] = 2;
 	return 0;
 }
-#undef END_UP
 
-int
-load_config_file(struct vm_conf_head *list, bool update_gl_conf)
+/*
+  Check that the dependencies of VMs have no cycle.
+ */
+static int
+check_depends(struct vm_conf_head *list)
 {
-	struct cfsection *sc;
-	struct vm_conf *conf;
-	struct vm_conf_entry *conf_ent;
-	struct cffile *inf;
-	struct global_conf *global_conf;
-	struct vartree *gv;
-	struct variables vars;
-	struct plugin_data_head head;
-	struct passwd *pw;
-
-	if (mpool_init() < 0) {
-		ERR("%s\n", "failed to initialize memory pool.");
-		return -1;
-	}
+	struct vm_conf **confs;
+	char *mark;
+	int i, n, rc = 0;
 
-	pctxt = objalloc(parser_context);
-	pctxt_snapshot = objalloc(parser_context);
+	if ((confs = sort_conf_list(list, &n)) == NULL)
+		return LIST_EMPTY(list) ? 0 : -1;
 
-	if (pctxt == NULL || pctxt_snapshot == NULL) {
-		mpool_destroy();
-		ERR("%s\n", "failed to allocate parser context.");
+	if ((mark = calloc(n, sizeof(*mark))) == NULL) {
+		free(confs);
 		return -1;
 	}
 
-	STAILQ_INIT(&pctxt->cfglobals);
-	STAILQ_INIT(&pctxt->cftemplates);
-	STAILQ_INIT(&pctxt->cfvms);
-	STAILQ_INIT(&pctxt->cffiles);
-	pctxt->cur_file = NULL;
+	for (i = 0; i < n && rc == 0; i++)
+		if (mark[i] == 0 && ! STAILQ_EMPTY(&confs[i]->depends))
+			rc = visit_depends(confs, mark, n, i);
 
-	gv = malloc(sizeof(*gv));
-	global_conf = calloc(1, sizeof(*global_conf));
-	if (global_conf == NULL || gv == NULL)
-		goto err;
-	RB_INIT(gv);
-	vars.local = NULL;
-	vars.global = gv;
-	vars.args = NULL;
+	free(confs);
+	free(mark);
+	return rc;
+}
 
-	if (set_var0(gv, "LOCALBASE", LOCALBASE) < 0)
-		ERR("%s\n", "failed to set \"LOCALBASE\" variable!");
+#define END_UP(var, type) STAILQ_NEXT(STAILQ_LAST(var, type, next), next) = NULL
 
-	if (push_file(gl_conf->config_file) < 0)
-		goto err;
+/*
+  Append the sections of a file to the whole configuration.
+  'src' is kept for the next load.
+ */
+static void
+link_sections(struct cfsections *dst, struct cfsections *src)
+{
+	struct cfsections tmp;
 
-	STAILQ_FOREACH (inf, &pctxt->cffiles, next)
-		if (parse(inf) < 0)
-			goto err;
+	if (STAILQ_EMPTY(src))
+		return;
+	END_UP(src, cfsection);
+	tmp = *src;
+	STAILQ_CONCAT(dst, &tmp);
+}
 
-	if (check_duplicate() != 0)
-		goto err;
+static int
+hash_file(const char *fn, uint64_t *hash)
+{
+	int fd;
+	ssize_t n;
+	struct stat st;
+	uint64_t h = HASH_INIT;
+	char buf[16 * 1024];
 
-	STAILQ_FOREACH (sc, &pctxt->cfglobals, next)
-		if (sc->owner == 0)
-			gl_conf_set_params(global_conf, &vars, sc);
-		else
+	while ((fd = open(fn, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		if (errno != EINTR)
+			return -1;
+	if (fstat(fd, &st) < 0 || ! S_ISREG(st.st_mode))
+		goto err;
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			goto err;
+		}
+		h = hash_bytes(h, buf, n);
+	}
+	close(fd);
+	*hash = h;
+	return 0;
+err:
+	close(fd);
+	return -1;
+}
+
+static bool
+timespec_equal(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/*
+  Returns true if the cached parse result of the file 'st' is valid.
+ */
+static bool
+is_cache_valid(struct cfcache *c, struct stat *st)
+{
+	struct parser_context *ctxt = c->ctxt;
+	struct cffile *file;
+	struct cfinclude *inc;
+	struct stat s;
+	uint64_t hash;
+
+	if (ctxt->nocache || c->dev != st->st_dev || c->ino != st->st_ino ||
+	    c->size != st->st_size || c->uid != st->st_uid ||
+	    c->gid != st->st_gid)
+		return false;
+
+	/* .include macro is expanded by the global variables */
+	if (ctxt->vardep && c->varhash != hash_vartree(global_vars))
+		return false;
+
+	if (! timespec_equal(&c->mtime, &st->st_mtim)) {
+		if (hash_file(c->filename, &hash) < 0 || hash != c->hash)
+			return false;
+		c->mtime = st->st_mtim;
+	}
+
+	/* A file may be added to or removed from the included directory. */
+	STAILQ_FOREACH (inc, &ctxt->cfincludes, next)
+		if (stat(inc->dirname, &s) < 0 || s.st_dev != inc->dev ||
+		    s.st_ino != inc->ino ||
+		    ! timespec_equal(&s.st_mtim, &inc->mtime))
+			return false;
+
+	/* The permission of the included file may be changed. */
+	STAILQ_FOREACH (file, &ctxt->cffiles, next)
+		if (stat(file->filename, &s) < 0 || s.st_dev != file->dev ||
+		    s.st_ino != file->ino ||
+		    ! timespec_equal(&s.st_ctim, &file->ctime))
+			return false;
+
+	return true;
+}
+
+static void
+free_cfcache(struct cfcache *c)
+{
+	mpool_destroy(&c->mpools);
+	free(c->filename);
+	free(c);
+}
+
+/*
+  Remove the parse results of the files that are not included any more
+  and the ones over MPOOL_CACHE_MAX bytes in total.
+ */
+static void
+expire_cfcaches(void)
+{
+	struct cfcache *c, *cn;
+	size_t size, total = 0;
+
+	RB_FOREACH_SAFE (c, cfcache_tree, &cfcaches, cn) {
+		size = mpool_size(&c->mpools);
+		if (c->used && total + size <= MPOOL_CACHE_MAX) {
+			c->used = false;
+			total += size;
+			continue;
+		}
+		RB_REMOVE(cfcache_tree, &cfcaches, c);
+		free_cfcache(c);
+	}
+}
+
+static struct parser_context *
+create_file_context(struct cffile *file)
+{
+	struct parser_context *ctxt;
+	struct cffile *f;
+
+	if ((ctxt = objalloc(parser_context)) == NULL ||
+	    (f = objalloc(cffile)) == NULL ||
+	    (f->filename = mpool_strdup(file->filename)) == NULL)
+		return NULL;
+
+	f->line = 0;
+	STAILQ_INIT(&ctxt->cfglobals);
+	STAILQ_INIT(&ctxt->cftemplates);
+	STAILQ_INIT(&ctxt->cfvms);
+	STAILQ_INIT(&ctxt->cffiles);
+	STAILQ_INIT(&ctxt->cfincludes);
+	ctxt->cur_file = f;
+	ctxt->vardep = false;
+	ctxt->nocache = false;
+	return ctxt;
+}
+
+static void
+number_sections(struct cfsections *head)
+{
+	struct cfsection *sc;
+
+	STAILQ_FOREACH (sc, head, next)
+		sc->serial = ++section_serial;
+}
+
+/*
+  A file to be parsed or merged. Jobs are merged in the order of 'cffiles'.
+ */
+struct parse_job {
+	STAILQ_ENTRY(parse_job) next;
+	struct cffile *file;
+	struct cfcache *cache;
+	struct stat st;
+	size_t poolsize;
+	int shmfd;
+	bool retried;
+	enum { JOB_WAIT, JOB_RUN, JOB_DONE } state;
+};
+
+STAILQ_HEAD(parse_jobs, parse_job);
+
+/*
+  Parser worker. It runs with the privilege of the file owner and parses
+  the files of the owner one by one until the load is finished.
+  'job' is NULL if the worker is idle.
+ */
+struct parser_worker {
+	LIST_ENTRY(parser_worker) next;
+	pid_t pid;
+	int sock;
+	uid_t uid;
+	gid_t gid;
+	struct parse_job *job;
+};
+
+LIST_HEAD(parser_workers, parser_worker);
+
+/*
+  Request to a parser worker. The shared memory object of the pool is
+  passed before it and mapped at the same address as the daemon.
+ */
+struct parse_req {
+	struct mpools mpools;
+	size_t size;
+	struct parser_context *ctxt;
+};
+
+enum parse_result { PARSE_OK, PARSE_ERROR, PARSE_NOMAP };
+
+static struct parser_workers parser_workers =
+	LIST_HEAD_INITIALIZER(parser_workers);
+static int nparser_workers = 0;
+static int max_parser_workers = 0;
+static int nworkers_started = 0;
+
+/*
+  Set the maximum number of parser workers. 0 means the number of CPUs.
+ */
+void
+set_parser_workers(int n)
+{
+	max_parser_workers = n;
+}
+
+static int
+get_max_parser_workers(void)
+{
+	long n;
+
+	if (max_parser_workers > 0)
+		return max_parser_workers;
+	return ((n = sysconf(_SC_NPROCESSORS_ONLN)) > 0) ? n : 1;
+}
+
+/*
+  Parse the file of 'pctxt' into 'mpools'.
+ */
+static enum parse_result
+parse_current_file(void)
+{
+	FILE *fp;
+	int rc;
+
+	if ((fp = fopen(pctxt->cur_file->filename, "r")) == NULL) {
+		ERR("failed to open %s\n", pctxt->cur_file->filename);
+		return PARSE_OK;
+	}
+	yyin = fp;
+	lineno = 1;
+	rc = (yyparse() || yynerrs) ? PARSE_ERROR : PARSE_OK;
+	fclose(fp);
+	yylex_destroy();
+	return rc;
+}
+
+static void
+parser_worker_main(int sock)
+{
+	int fd;
+	char res;
+	ssize_t n;
+	void *addr;
+	struct parse_req req;
+
+	for (;;) {
+		if (recv_fd(sock, &fd) <= 0)
+			_exit(0);
+		while ((n = recv(sock, &req, sizeof(req), 0)) < 0)
+			if (errno != EINTR)
+				_exit(1);
+		if (n != sizeof(req))
+			_exit(n == 0 ? 0 : 1);
+		/* The pool has pointers to itself. */
+		addr = STAILQ_FIRST(&req.mpools);
+		if (fd < 0 ||
+		    mmap(addr, req.size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED | MAP_EXCL, fd, 0) == MAP_FAILED)
+			res = PARSE_NOMAP;
+		else {
+			mpools = &req.mpools;
+			pctxt = req.ctxt;
+			res = parse_current_file();
+			munmap(addr, req.size);
+		}
+		if (fd >= 0)
+			close(fd);
+		if (send(sock, &res, sizeof(res), 0) < 0)
+			_exit(1);
+	}
+}
+
+static struct parser_worker *
+start_parser_worker(uid_t uid, gid_t gid)
+{
+	int socks[2];
+	pid_t pid;
+	struct parser_worker *w, *wn;
+
+	if ((w = malloc(sizeof(*w))) == NULL)
+		return NULL;
+	if (socketpair(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) < 0) {
+		free(w);
+		return NULL;
+	}
+	if ((pid = fork()) < 0) {
+		close(socks[0]);
+		close(socks[1]);
+		free(w);
+		return NULL;
+	}
+	if (pid == 0) {
+		close(socks[0]);
+		LIST_FOREACH_SAFE (w, &parser_workers, next, wn)
+			close(w->sock);
+		/*
+		  Give up the root privilege to parse the configuration.
+		  If this process doesn't have root privilege,
+		  setgid(2) and setuid(2) will fail. Keep the user privilege.
+		*/
+		setgid(gid);
+		setuid(uid);
+		parser_worker_main(socks[1]);
+		_exit(0);
+	}
+	close(socks[1]);
+	w->pid = pid;
+	w->sock = socks[0];
+	w->uid = uid;
+	w->gid = gid;
+	w->job = NULL;
+	LIST_INSERT_HEAD(&parser_workers, w, next);
+	nparser_workers++;
+	nworkers_started++;
+	return w;
+}
+
+static void
+stop_parser_worker(struct parser_worker *w)
+{
+	LIST_REMOVE(w, next);
+	close(w->sock);
+	while (waitpid(w->pid, NULL, 0) < 0)
+		if (errno != EINTR)
+			break;
+	nparser_workers--;
+	free(w);
+}
+
+static void
+stop_parser_workers(void)
+{
+	struct parser_worker *w, *wn;
+
+	LIST_FOREACH_SAFE (w, &parser_workers, next, wn)
+		stop_parser_worker(w);
+}
+
+/*
+  Find an idle worker for the owner of the file. Another owner's idle
+  worker is replaced if the number of workers reaches the limit.
+ */
+static struct parser_worker *
+get_parser_worker(uid_t uid, gid_t gid)
+{
+	struct parser_worker *w, *idle = NULL;
+
+	LIST_FOREACH (w, &parser_workers, next) {
+		if (w->job != NULL)
+			continue;
+		if (w->uid == uid && w->gid == gid)
+			return w;
+		idle = w;
+	}
+	if (nparser_workers >= get_max_parser_workers()) {
+		if (idle == NULL)
+			return NULL;
+		stop_parser_worker(idle);
+	}
+	return start_parser_worker(uid, gid);
+}
+
+static void
+free_parse_job(struct parse_job *job)
+{
+	if (job->shmfd >= 0)
+		close(job->shmfd);
+	if (job->cache != NULL && job->state != JOB_DONE)
+		free_cfcache(job->cache);
+	free(job);
+}
+
+/*
+  Create a job for 'file'. The job is done at once if the cached parse
+  result is valid. Returns NULL if the file is not a regular file.
+ */
+static struct parse_job *
+create_parse_job(struct cffile *file, int *error)
+{
+	struct parse_job *job;
+	struct cfcache *c, key;
+
+	*error = 0;
+	if ((job = calloc(1, sizeof(*job))) == NULL)
+		goto err;
+	job->file = file;
+	job->shmfd = -1;
+	if (stat(file->filename, &job->st) < 0) {
+		ERR("%s is not a file\n", file->filename);
+		add_config_source_missing(file->filename);
+		free(job);
+		return NULL;
+	}
+	add_config_source(file->filename, &job->st);
+	if (! S_ISREG(job->st.st_mode)) {
+		ERR("%s is not a file\n", file->filename);
+		free(job);
+		return NULL;
+	}
+
+	key.filename = file->filename;
+	if ((c = RB_FIND(cfcache_tree, &cfcaches, &key)) != NULL &&
+	    is_cache_valid(c, &job->st)) {
+		nfiles_reused++;
+		job->cache = c;
+		job->state = JOB_DONE;
+		return job;
+	}
+
+	/* The last usage is a good hint of the pool size. */
+	job->poolsize = mpool_estimate(job->st.st_size, c ? c->poolused : 0);
+	if (c != NULL) {
+		RB_REMOVE(cfcache_tree, &cfcaches, c);
+		free_cfcache(c);
+	}
+	if ((c = calloc(1, sizeof(*c))) == NULL ||
+	    (c->filename = strdup(file->filename)) == NULL) {
+		free(c);
+		goto err;
+	}
+	STAILQ_INIT(&c->mpools);
+	c->dev = job->st.st_dev;
+	c->ino = job->st.st_ino;
+	c->size = job->st.st_size;
+	c->uid = job->st.st_uid;
+	c->gid = job->st.st_gid;
+	c->mtime = job->st.st_mtim;
+	c->varhash = hash_vartree(global_vars);
+	job->cache = c;
+	job->state = JOB_WAIT;
+	if (hash_file(c->filename, &c->hash) < 0)
+		goto err;
+	return job;
+err:
+	if (job != NULL)
+		free_parse_job(job);
+	*error = -1;
+	return NULL;
+}
+
+/*
+  Allocate the pool and the context of the job in the shared memory.
+ */
+static int
+prepare_parse_job(struct parse_job *job)
+{
+	struct cfcache *c = job->cache;
+
+	mpools = &c->mpools;
+	if ((job->shmfd = mpool_create(mpools, job->poolsize)) < 0 ||
+	    (c->ctxt = create_file_context(job->file)) == NULL) {
+		mpool_destroy(mpools);
+		mpools = &load_mpools;
+		return -1;
+	}
+	mpools = &load_mpools;
+	return 0;
+}
+
+/*
+  Parse the job in a child process. It's used if no worker can map the pool.
+ */
+static enum parse_result
+fork_parse_job(struct parse_job *job)
+{
+	pid_t pid;
+	int status;
+
+	if ((pid = fork()) < 0)
+		return PARSE_ERROR;
+	if (pid == 0) {
+		setgid(job->st.st_gid);
+		setuid(job->st.st_uid);
+		mpools = &job->cache->mpools;
+		pctxt = job->cache->ctxt;
+		exit(parse_current_file());
+	}
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return PARSE_ERROR;
+	if (!WIFEXITED(status))
+		return PARSE_ERROR;
+	return WEXITSTATUS(status) == 0 ? PARSE_OK : PARSE_ERROR;
+}
+
+/*
+  Check the result of the job. The job is waiting again if the pool
+  was too small. Returns -1 on error.
+ */
+static int
+finish_parse_job(struct parse_job *job, enum parse_result res)
+{
+	struct cfcache *c = job->cache;
+	struct parser_context *ctxt = c->ctxt;
+
+	if (res == PARSE_NOMAP)
+		res = fork_parse_job(job);
+
+	close(job->shmfd);
+	job->shmfd = -1;
+	mpools = &c->mpools;
+	switch (mpool_get_error()) {
+	case MPERR_NONE:
+		if (res != PARSE_OK)
+			goto err;
+		break;
+	case MPERR_FATAL:
+		goto err;
+	case MPERR_ALLOC:
+		/* The estimation was too small, it's rare. Retry only once. */
+		if (job->retried) {
+			ERR("%s: %zu bytes memory pool is too small\n",
+			    c->filename, job->poolsize);
+			goto err;
+		}
+		mpool_destroy(mpools);
+		mpools = &load_mpools;
+		c->ctxt = NULL;
+		job->poolsize = MIN(job->poolsize * 4, MPOOL_MAX_SIZE);
+		job->retried = true;
+		npool_retries++;
+		INFO("%s: retry with %zu bytes memory pool\n", c->filename,
+		    job->poolsize);
+		job->state = JOB_WAIT;
+		return 0;
+	}
+	c->poolused = mpool_used(mpools);
+	pool_used += c->poolused;
+	pool_size += mpool_size(mpools);
+	npools++;
+	mpool_trim(mpools);
+	mpools = &load_mpools;
+
+	number_sections(&ctxt->cfglobals);
+	number_sections(&ctxt->cftemplates);
+	number_sections(&ctxt->cfvms);
+	RB_INSERT(cfcache_tree, &cfcaches, c);
+	nfiles_parsed++;
+	job->state = JOB_DONE;
+	return 0;
+err:
+	mpool_destroy(mpools);
+	mpools = &load_mpools;
+	c->ctxt = NULL;
+	return -1;
+}
+
+/*
+  Send the waiting jobs to the workers as many as possible.
+ */
+static int
+start_parse_jobs(struct parse_jobs *jobs)
+{
+	struct parse_job *job;
+	struct parser_worker *w;
+	struct parse_req req;
+	ssize_t n;
+
+	STAILQ_FOREACH (job, jobs, next) {
+		if (job->state != JOB_WAIT)
+			continue;
+		if ((w = get_parser_worker(job->st.st_uid, job->st.st_gid)) ==
+		    NULL) {
+			/* wait for a running job if any */
+			LIST_FOREACH (w, &parser_workers, next)
+				if (w->job != NULL)
+					return 0;
+			if (prepare_parse_job(job) < 0 ||
+			    finish_parse_job(job, fork_parse_job(job)) < 0)
+				return -1;
+			continue;
+		}
+		if (prepare_parse_job(job) < 0)
+			return -1;
+		req.mpools = job->cache->mpools;
+		req.ctxt = job->cache->ctxt;
+		req.size = mpool_size(&job->cache->mpools);
+		if (send_fd(w->sock, job->shmfd) < 0)
+			goto fail;
+		while ((n = send(w->sock, &req, sizeof(req), 0)) < 0)
+			if (errno != EINTR)
+				goto fail;
+		w->job = job;
+		job->state = JOB_RUN;
+		continue;
+	fail:
+		stop_parser_worker(w);
+		if (finish_parse_job(job, fork_parse_job(job)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+nrunning_jobs(void)
+{
+	int n = 0;
+	struct parser_worker *w;
+
+	LIST_FOREACH (w, &parser_workers, next)
+		if (w->job != NULL)
+			n++;
+	return n;
+}
+
+/*
+  Wait for the replies of the running jobs.
+ */
+static int
+wait_parse_jobs(void)
+{
+	struct parser_worker *w, *wn;
+	struct pollfd pfd[nparser_workers];
+	struct parse_job *job;
+	int i = 0, n;
+	char res;
+
+	LIST_FOREACH (w, &parser_workers, next) {
+		pfd[i].fd = w->job ? w->sock : -1;
+		pfd[i].events = POLLIN;
+		pfd[i].revents = 0;
+		i++;
+	}
+	while ((n = poll(pfd, i, -1)) < 0)
+		if (errno != EINTR)
+			return -1;
+
+	i = 0;
+	LIST_FOREACH_SAFE (w, &parser_workers, next, wn) {
+		if (pfd[i++].revents == 0)
+			continue;
+		job = w->job;
+		w->job = NULL;
+		while ((n = recv(w->sock, &res, sizeof(res), 0)) < 0)
+			if (errno != EINTR)
+				break;
+		if (n != sizeof(res)) {
+			ERR("parser worker %d is terminated\n", w->pid);
+			stop_parser_worker(w);
+			res = PARSE_ERROR;
+		}
+		if (finish_parse_job(job, res) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+  Append the parse result of the job to the configuration.
+ */
+static int
+merge_parse_job(struct parse_job *job)
+{
+	struct cfcache *c = job->cache;
+	struct cffile *inc, *f, *p;
+	struct cfinclude *dir;
+
+	c->used = true;
+	STAILQ_FOREACH (dir, &c->ctxt->cfincludes, next)
+		add_config_source_dir(dir->dirname, dir->dev, dir->ino,
+		    &dir->mtime);
+	link_sections(&pctxt->cfglobals, &c->ctxt->cfglobals);
+	link_sections(&pctxt->cftemplates, &c->ctxt->cftemplates);
+	link_sections(&pctxt->cfvms, &c->ctxt->cfvms);
+
+	STAILQ_FOREACH (inc, &c->ctxt->cffiles, next) {
+		STAILQ_FOREACH (p, &pctxt->cffiles, next)
+			if (strcmp(p->filename, inc->filename) == 0)
+				break;
+		if (p != NULL) {
+			ERR("%s is already included\n", inc->filename);
+			continue;
+		}
+		if ((f = objalloc(cffile)) == NULL)
+			return -1;
+		*f = *inc;
+		STAILQ_INSERT_TAIL(&pctxt->cffiles, f, next);
+	}
+	return 0;
+}
+
+/*
+  Parse all files of the configuration by the parser workers.
+  The files are parsed concurrently and merged in the order of inclusion,
+  the files included by a file follow the files already known.
+ */
+#define NEXT_FILE(f) ((f) ? STAILQ_NEXT(f, next) : STAILQ_FIRST(&pctxt->cffiles))
+
+static int
+parse_files(void)
+{
+	struct parse_jobs jobs = STAILQ_HEAD_INITIALIZER(jobs);
+	struct parse_job *job;
+	struct cffile *last = NULL, *file;
+	int error, rc = -1;
+
+	for (;;) {
+		while ((file = NEXT_FILE(last)) != NULL) {
+			last = file;
+			if ((job = create_parse_job(file, &error)) != NULL)
+				STAILQ_INSERT_TAIL(&jobs, job, next);
+			else if (error < 0)
+				goto ret;
+		}
+		if (start_parse_jobs(&jobs) < 0)
+			goto ret;
+		while ((job = STAILQ_FIRST(&jobs)) != NULL &&
+		       job->state == JOB_DONE) {
+			STAILQ_REMOVE_HEAD(&jobs, next);
+			error = merge_parse_job(job);
+			free_parse_job(job);
+			if (error < 0)
+				goto ret;
+		}
+		if (STAILQ_EMPTY(&jobs) && NEXT_FILE(last) == NULL)
+			break;
+		if (nrunning_jobs() > 0 && wait_parse_jobs() < 0)
+			goto ret;
+	}
+	rc = 0;
+ret:
+	stop_parser_workers();
+	while ((job = STAILQ_FIRST(&jobs)) != NULL) {
+		STAILQ_REMOVE_HEAD(&jobs, next);
+		free_parse_job(job);
+	}
+	return rc;
+}
+#undef NEXT_FILE
+#undef END_UP
+
+/*
+  Hash of the global variables and the user database.
+  VMs refer them by variables, owner and group.
+ */
+static const char *userdbs[] = { "/etc/pwd.db", "/etc/group" };
+
+static uint64_t
+env_hash(struct vartree *gv)
+{
+	uint64_t h = hash_vartree(gv);
+	struct stat st;
+	size_t i;
+
+	for (i = 0; i < nitems(userdbs); i++)
+		if (stat(userdbs[i], &st) == 0)
+			h = hash_bytes(h, &st.st_mtim, sizeof(st.st_mtim));
+	return h;
+}
+
+/*
+  Record the plugin directory and the user database to the sources of
+  the config snapshot. They also change the result.
+ */
+static void
+add_env_sources(const char *plugin_dir)
+{
+	struct stat st;
+	size_t i;
+
+	if (stat(plugin_dir, &st) == 0)
+		add_config_source(plugin_dir, &st);
+	else
+		add_config_source_missing(plugin_dir);
+	for (i = 0; i < nitems(userdbs); i++)
+		if (stat(userdbs[i], &st) == 0)
+			add_config_source(userdbs[i], &st);
+		else
+			add_config_source_missing(userdbs[i]);
+}
+
+/*
+  Returns the vm_conf_entry in 'prev' if it's built from the same inputs.
+  'prev' is the array of 'nprev' vm_confs sorted by name.
+ */
+static struct vm_conf_entry *
+lookup_reusable_conf(struct vm_conf **prev, int nprev, struct cfsection *sc,
+    uint64_t envhash, struct vm_build **vbp)
+{
+	struct vm_build *vb, key;
+	struct cfsection *tp;
+	size_t i;
+	int j;
+
+	key.name = sc->name;
+	if ((vb = RB_FIND(vm_build_tree, &vm_builds, &key)) == NULL ||
+	    vb->serial == 0 || vb->serial != sc->serial ||
+	    vb->envhash != envhash)
+		return NULL;
+
+	recording = NULL;
+	for (i = 0; i < vb->ndeps; i++) {
+		tp = lookup_template(vb->deps[i].name);
+		if (vb->deps[i].serial != (tp ? tp->serial : 0))
+			return NULL;
+	}
+
+	if ((j = find_conf(prev, nprev, sc->name)) < 0 ||
+	    prev[j]->generation != vb->generation)
+		return NULL;
+	*vbp = vb;
+	return (struct vm_conf_entry *)prev[j];
+}
+
+static struct vm_build *
+create_vm_build(struct cfsection *sc, uint64_t envhash)
+{
+	struct vm_build *vb;
+
+	if ((vb = calloc(1, sizeof(*vb))) == NULL)
+		return NULL;
+	if ((vb->name = strdup(sc->name)) == NULL) {
+		free(vb);
+		return NULL;
+	}
+	vb->serial = sc->serial;
+	vb->envhash = envhash;
+	return vb;
+}
+
+/*
+  Put back the reused vm_conf_entries to 'prev' and free the others.
+ */
+static void
+discard_conf_list(struct vm_conf_head *list, struct vm_conf_head *prev,
+    struct vm_build_tree *builds)
+{
+	struct vm_conf_entry *conf_ent, *cen;
+	struct vm_build *vb, key;
+
+	LIST_FOREACH_SAFE (conf_ent, list, next, cen) {
+		LIST_REMOVE(conf_ent, next);
+		key.name = conf_ent->conf.name;
+		if (prev != NULL &&
+		    (vb = RB_FIND(vm_build_tree, builds, &key)) != NULL &&
+		    vb->reused && vb->generation == conf_ent->conf.generation) {
+			conf_ent->conf.vars.global = global_vars;
+			LIST_INSERT_HEAD(prev, conf_ent, next);
+		} else
+			free_vm_conf_entry(conf_ent);
+	}
+}
+
+/*
+  Add the counters of the last load to 'nvl'.
+ */
+void
+parser_stats(nvlist_t *nvl)
+{
+	nvlist_t *p;
+
+	p = nvlist_create(0);
+	nvlist_add_number(p, "files_parsed", nfiles_parsed);
+	nvlist_add_number(p, "files_reused", nfiles_reused);
+	nvlist_add_number(p, "vms_built", nvms_built);
+	nvlist_add_number(p, "vms_reused", nvms_reused);
+	nvlist_add_number(p, "apply_hits", napply_hits);
+	nvlist_add_number(p, "apply_misses", napply_misses);
+	nvlist_add_number(p, "workers_started", nworkers_started);
+	nvlist_add_number(p, "pools", npools);
+	nvlist_add_number(p, "pool_retries", npool_retries);
+	nvlist_add_number(p, "pool_used", pool_used);
+	nvlist_add_number(p, "pool_size", pool_size);
+	nvlist_add_bool(p, "snapshot", snapshot_used);
+	nvlist_move_nvlist(nvl, "config", p);
+}
+
+/*
+  Load the configuration from the config snapshot without parsing.
+  Returns -1 if the snapshot is missing, stale or broken.
+ */
+static int
+load_config_snapshot(struct vm_conf_head *list, bool update_gl_conf)
+{
+	struct config_snapshot *snap;
+	struct global_conf *global_conf;
+	struct vartree *gv;
+
+	if ((snap = open_config_snapshot(gl_conf->config_file)) == NULL)
+		return -1;
+	if (snapshot_get_globals(snap, &global_conf, &gv) < 0)
+		goto err;
+	if (list != NULL) {
+		load_plugins(global_conf->plugin_dir ?
+			global_conf->plugin_dir : gl_conf->plugin_dir);
+		if (snapshot_get_vms(snap, list, gv) < 0) {
+			discard_conf_list(list, NULL, NULL);
+			free_global_conf(global_conf);
+			free_vartree(gv);
+			goto err;
+		}
+	}
+	if (list != NULL)
+		builds_snapshot = snap->hash;
+	close_config_snapshot(snap);
+
+	snapshot_used = true;
+	set_global_vars(gv);
+	if (update_gl_conf)
+		merge_global_conf(global_conf);
+	else
+		free_global_conf(global_conf);
+	return 0;
+err:
+	close_config_snapshot(snap);
+	return -1;
+}
+
+/*
+  Move all of 'prev' to 'list' if the snapshot that 'prev' is loaded
+  from is still fresh. A fresh snapshot written after that doesn't
+  tell 'prev' is up to date. Returns -1 if the config files must be
+  parsed.
+ */
+static int
+reuse_config_snapshot(struct vm_conf_head *list, struct vm_conf_head *prev)
+{
+	struct config_snapshot *snap;
+	struct vm_conf_entry *conf_ent;
+	bool same;
+
+	if ((snap = open_config_snapshot(gl_conf->config_file)) == NULL)
+		return -1;
+	same = (snap->hash == builds_snapshot);
+	close_config_snapshot(snap);
+	if (! same)
+		return -1;
+
+	LIST_FOREACH (conf_ent, prev, next)
+		nvms_reused++;
+	LIST_CONCAT(list, prev, vm_conf_entry, next);
+	snapshot_used = true;
+	INFO("reload: %d vms reused from the snapshot\n", nvms_reused);
+	return 0;
+}
+
+/*
+  Build only the vm_conf_entry of 'name' from the config snapshot.
+  Returns 1 if found, 0 if not found, -1 if the snapshot is not usable.
+ */
+int
+lookup_config_snapshot(const char *name, struct vm_conf_entry **conf_entp)
+{
+	struct config_snapshot *snap;
+	struct global_conf *global_conf;
+	struct vartree *gv;
+	int rc;
+
+	if ((snap = open_config_snapshot(gl_conf->config_file)) == NULL)
+		return -1;
+	if (snapshot_get_globals(snap, &global_conf, &gv) < 0) {
+		close_config_snapshot(snap);
+		return -1;
+	}
+	load_plugins(global_conf->plugin_dir ? global_conf->plugin_dir :
+					       gl_conf->plugin_dir);
+	free_global_conf(global_conf);
+	set_global_vars(gv);
+	rc = snapshot_lookup_vm(snap, name, gv, conf_entp);
+	close_config_snapshot(snap);
+	return rc;
+}
+
+/*
+  Build the vm_conf_entry of 'name' from the config files without
+  changing the running configuration. The global variables, the recorded
+  builds and the snapshot are kept, the entry refers 'global_vars'.
+  Returns NULL if it's not found or on error.
+ */
+struct vm_conf_entry *
+load_vm_conf_entry(const char *name)
+{
+	struct config_snapshot *snap;
+	struct vm_conf_entry *conf_ent, *cen, *ret = NULL;
+	struct vm_conf_head list = LIST_HEAD_INITIALIZER();
+	int rc;
+
+	/* Build only the VM if the snapshot is fresh. */
+	if ((snap = open_config_snapshot(gl_conf->config_file)) != NULL) {
+		rc = snapshot_lookup_vm(snap, name, global_vars, &ret);
+		close_config_snapshot(snap);
+		if (rc >= 0)
+			return ret;
+	}
+
+	load_isolated = true;
+	rc = load_config_file(&list, false, NULL);
+	load_isolated = false;
+	if (rc < 0)
+		return NULL;
+
+	LIST_FOREACH_SAFE (conf_ent, &list, next, cen)
+		if (strcmp(conf_ent->conf.name, name) == 0)
+			ret = conf_ent;
+		else
+			free_vm_conf_entry(conf_ent);
+	return ret;
+}
+
+/*
+  Load the configuration into 'list'.
+  If 'prev' is given, the vm_conf_entries built from the unchanged sections
+  are moved from 'prev' instead of building them again.
+ */
+int
+load_config_file(struct vm_conf_head *list, bool update_gl_conf,
+    struct vm_conf_head *prev)
+{
+	struct cfsection *sc;
+	struct vm_conf *conf;
+	struct vm_conf_entry *conf_ent, *last = NULL;
+	struct global_conf *global_conf;
+	struct vartree *gv;
+	struct variables vars;
+	struct plugin_data_head head;
+	const char *user;
+	struct vm_build *vb;
+	struct vm_build_tree builds = RB_INITIALIZER(&builds);
+	struct vm_conf **prev_confs = NULL;
+	uint64_t envhash;
+	int nprev = 0;
+
+	nfiles_parsed = nfiles_reused = nvms_built = nvms_reused = 0;
+	nworkers_started = npools = npool_retries = 0;
+	napply_hits = napply_misses = 0;
+	pool_used = pool_size = 0;
+	snapshot_used = false;
+
+	/* No need to parse if nothing is changed since the last save. */
+	if (prev == NULL && ! load_isolated &&
+	    load_config_snapshot(list, update_gl_conf) == 0)
+		return 0;
+	/* Nothing is recorded for the reuse, use the snapshot instead. */
+	if (prev != NULL && builds_snapshot != 0 &&
+	    reuse_config_snapshot(list, prev) == 0)
+		return 0;
+	clear_config_sources();
+
+	mpools = &load_mpools;
+	if (mpool_init(mpools, MPOOL_LOAD_SIZE) < 0) {
+		ERR("%s\n", "failed to initialize memory pool.");
+		return -1;
+	}
+
+	pctxt = objalloc(parser_context);
+
+	if (pctxt == NULL) {
+		mpool_destroy(mpools);
+		ERR("%s\n", "failed to allocate parser context.");
+		return -1;
+	}
+
+	STAILQ_INIT(&pctxt->cfglobals);
+	STAILQ_INIT(&pctxt->cftemplates);
+	STAILQ_INIT(&pctxt->cfvms);
+	STAILQ_INIT(&pctxt->cffiles);
+	STAILQ_INIT(&pctxt->cfincludes);
+	pctxt->cur_file = NULL;
+
+	gv = create_vartree();
+	global_conf = calloc(1, sizeof(*global_conf));
+	if (global_conf == NULL || gv == NULL)
+		goto err;
+	/* -1 is not set, 0 is unlimited */
+	global_conf->boot_concurrency = -1;
+	global_conf->boot_rate = -1;
+	vars.local = NULL;
+	vars.global = gv;
+	vars.args = NULL;
+
+	if (set_var0(gv, "LOCALBASE", LOCALBASE) < 0)
+		ERR("%s\n", "failed to set \"LOCALBASE\" variable!");
+
+	if (push_file(gl_conf->config_file) < 0)
+		goto err;
+
+	if (parse_files() < 0)
+		goto err;
+
+	if (check_duplicate() != 0)
+		goto err;
+
+	STAILQ_FOREACH (sc, &pctxt->cfglobals, next)
+		if (sc->owner == 0)
+			gl_conf_set_params(global_conf, &vars, sc);
+		else
 			ERR("%s: global section is not allowed.\n",
 			    sc->filename);
 
@@ -1403,8 +3353,33 @@ load_config_file(struct vm_conf_head *list, bool update_gl_conf)
 
 	load_plugins(global_conf->plugin_dir ? global_conf->plugin_dir :
 					       gl_conf->plugin_dir);
+	add_env_sources(global_conf->plugin_dir ? global_conf->plugin_dir :
+						  gl_conf->plugin_dir);
 
+	envhash = env_hash(gv);
+	if (prev != NULL)
+		prev_confs = sort_conf_list(prev, &nprev);
 	STAILQ_FOREACH (sc, &pctxt->cfvms, next) {
+		if (sc->duplicate)
+			continue;
+		if (prev != NULL &&
+		    (conf_ent = lookup_reusable_conf(prev_confs, nprev, sc,
+			 envhash, &vb)) != NULL) {
+			RB_REMOVE(vm_build_tree, &vm_builds, vb);
+			vb->reused = true;
+			RB_INSERT(vm_build_tree, &builds, vb);
+			LIST_REMOVE(conf_ent, next);
+			conf = &conf_ent->conf;
+			conf->vars.global = gv;
+			conf->install = vb->install;
+			if (last == NULL)
+				LIST_INSERT_HEAD(list, conf_ent, next);
+			else
+				LIST_INSERT_AFTER(last, conf_ent, next);
+			last = conf_ent;
+			nvms_reused++;
+			continue;
+		}
 		if (create_plugin_data(&head) < 0)
 			continue;
 		if ((conf = create_vm_conf(sc->name)) == NULL) {
@@ -1413,8 +3388,8 @@ load_config_file(struct vm_conf_head *list, bool update_gl_conf)
 		}
 		conf->vars.global = gv;
 		conf->owner = sc->owner;
-		if ((pw = getpwuid(conf->owner)) == NULL ||
-		    set_var(&conf->vars, "OWNER", pw->pw_name) < 0)
+		if ((user = lookup_user_name(conf->owner, NULL)) == NULL ||
+		    set_var(&conf->vars, "OWNER", user) < 0)
 			ERR("failed to set \"OWNER\" variable! (%s)\n",
 			    strerror(errno));
 		if (set_var(&conf->vars, "GROUP", "") < 0)
@@ -1428,29 +3403,82 @@ load_config_file(struct vm_conf_head *list, bool update_gl_conf)
 		conf_ent->pl_data = head;
 		conf = &conf_ent->conf;
 		clear_applied();
+		recording = create_vm_build(sc, envhash);
 		if (vm_conf_set_params(conf, sc) < 0 ||
 		    finalize_vm_conf(conf) < 0 || check_conf(conf) < 0) {
+			if (recording != NULL)
+				free_vm_build(recording);
+			recording = NULL;
 			free_plugin_data(&head);
 			free_vm_conf(conf);
 			continue;
 		}
-		LIST_INSERT_HEAD(list, conf_ent, next);
+		hash_plugin_data(conf_ent);
+		if ((vb = recording) != NULL) {
+			recording = NULL;
+			vb->generation = conf->generation;
+			vb->install = conf->install;
+			if (RB_INSERT(vm_build_tree, &builds, vb) != NULL)
+				free_vm_build(vb);
+		}
+		if (last == NULL)
+			LIST_INSERT_HEAD(list, conf_ent, next);
+		else
+			LIST_INSERT_AFTER(last, conf_ent, next);
+		last = conf_ent;
+		nvms_built++;
+	}
+	free(prev_confs);
+
+	if (check_depends(list) < 0) {
+		discard_conf_list(list, prev, &builds);
+		goto err;
 	}
 
+	if (load_isolated) {
+		free_vm_builds(&builds);
+		LIST_FOREACH (conf_ent, list, next)
+			conf_ent->conf.vars.global = global_vars;
+		free_global_conf(global_conf);
+		free_vartree(gv);
+		goto cleanup;
+	}
+	free_vm_builds(&vm_builds);
+	vm_builds = builds;
+	RB_INIT(&builds);
+	builds_snapshot = 0;
+	if (prev != NULL)
+		INFO("reload: %d files parsed, %d reused; "
+		     "%d vms built, %d reused\n",
+		     nfiles_parsed, nfiles_reused, nvms_built, nvms_reused);
+
+	save_config_snapshot(gl_conf->config_file, list, global_conf, gv);
+
 set_global:
 	set_global_vars(gv);
 	if (update_gl_conf)
 		merge_global_conf(global_conf);
-	else
+	else {
+		if (prev != NULL)
+			reload_global_conf(global_conf);
 		free_global_conf(global_conf);
+	}
 
-	mpool_destroy();
+cleanup:
+	expire_cfcaches();
+	free_apply_caches();
+	free_expand_buf();
+	mpool_destroy(mpools);
 
 	return 0;
 err:
 	ERR("%s\n", "failed to parse config file");
-	mpool_destroy();
+	free_vm_builds(&builds);
+	expire_cfcaches();
+	free_apply_caches();
+	free_expand_buf();
+	mpool_destroy(mpools);
 	free(global_conf);
-	free(gv);
+	free_vartree(gv);
 	return -1;
 }
@@ -1,13 +1,18 @@
+#include <sys/param.h>
+#include <sys/event.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/ucred.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 
 #include <netinet/in.h>
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <netdb.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -15,17 +20,49 @@
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
-#include <pwd.h>
 
 #include "bmd.h"
+#include "boot.h"
+#include "fdbroker.h"
 #include "log.h"
 #include "server.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "statetab.h"
+#include "timer.h"
+#include "userdb.h"
 #include "vm.h"
 
 extern struct vm_conf_head vm_conf_list;
-extern SLIST_HEAD(, vm_entry) vm_list;
+extern STAILQ_HEAD(, vm_entry) vm_list;
 
-static LIST_HEAD(, sock_buf) sock_list = LIST_HEAD_INITIALIZER();
+static struct slab sock_buf_slab =
+	SLAB_INITIALIZER("sock_buf", sizeof(struct sock_buf), 16);
+
+/*
+  Packed response of a command that only reads the VMs. It's shared by the
+  requests of the same content from the same credential, until the VMs or
+  the user database are changed.
+ */
+struct res_cache {
+	TAILQ_ENTRY(res_cache) next;
+	uid_t uid;
+	short ngroups;
+	gid_t groups[XU_NGROUPS];
+	size_t req_size;
+	char *req;
+	size_t res_size;
+	char *res;
+};
+
+#define RES_CACHE_MAX	16
+
+static TAILQ_HEAD(res_cache_head, res_cache) res_caches = TAILQ_HEAD_INITIALIZER(res_caches);
+static int nres_caches = 0;
+static uint64_t res_cache_vm_gen = 0, res_cache_db_gen = 0;
+static uint64_t nres_hits = 0, nres_misses = 0;
+
+static void free_subscriber(struct subscriber *);
 
 struct sock_buf *
 create_sock_buf(int fd)
@@ -33,17 +70,16 @@ create_sock_buf(int fd)
 	struct sock_buf *r;
 	socklen_t sz;
 
-	if ((r = calloc(1, sizeof(*r))) == NULL)
+	if ((r = slab_alloc(&sock_buf_slab)) == NULL)
 		return NULL;
+	memset(r, 0, sizeof(*r));
 	r->fd = fd;
-	time(&r->event_time);
 
 	sz = sizeof(r->peer);
 	if  (getsockopt(fd, SOL_LOCAL, LOCAL_PEERCRED, &r->peer, &sz) < 0)
 		r->peer.cr_uid = UID_NOBODY;
 
 	r->res_fd = -1;
-	LIST_INSERT_HEAD(&sock_list, r, next);
 	return r;
 }
 
@@ -52,53 +88,31 @@ destroy_sock_buf(struct sock_buf *p)
 {
 	if (p == NULL)
 		return;
-	LIST_REMOVE(p, next);
+	if (p->sub != NULL)
+		free_subscriber(p->sub);
+	destroy_timer(p->timer);
 	close(p->fd);
 	if (p->res_fd != -1)
 		close(p->res_fd);
-	free(p->buf);
+	slab_buf_free(p->buf, p->buf_size);
 	free(p->res_buf);
-	free(p);
-}
-
-struct timespec *
-calc_timeout(int timeout, struct timespec *ts)
-{
-	struct sock_buf *p;
-	long t;
-	time_t s;
-
-	if (LIST_EMPTY(&sock_list) || ts == NULL)
-		return NULL;
-
-	s = LIST_FIRST(&sock_list)->event_time;
-	LIST_FOREACH (p, &sock_list, next)
-		if (p->event_time < s)
-			s = p->event_time;
-
-	if ((t = s + timeout - time(NULL)) < 0)
-		return NULL;
-
-	ts->tv_sec = t;
-	ts->tv_nsec = 0;
-	return ts;
+	slab_free(&sock_buf_slab, p);
 }
 
-void
-close_timeout_sock_buf(int timeout)
+/*
+  Postpone the expiry of the idle connection. Subscribers don't expire.
+ */
+static void
+touch_sock_buf(struct sock_buf *p)
 {
-	struct sock_buf *p, *n;
-	time_t now = time(NULL);
-
-	LIST_FOREACH_SAFE (p, &sock_list, next, n)
-		if (p->event_time + timeout <= now)
-			destroy_sock_buf(p);
+	if (p->timer && p->sub == NULL)
+		schedule_timer(p->timer, COMMAND_TIMEOUT_SEC * 1000);
 }
 
 void
 clear_sock_buf(struct sock_buf *p)
 {
-	free(p->buf);
+	slab_buf_free(p->buf, p->buf_size);
 	p->buf = NULL;
 	p->read_state = 0;
 	p->buf_size = 0;
@@ -186,7 +200,7 @@ retry:
 		rc = 0;
 		goto ret;
 	}
-	time(&p->event_time);
+	touch_sock_buf(p);
 	p->sent_size += n;
 	rc = (p->sent_size == p->res_bytes + sizeof(size_buf)) ? 2 : 1;
 ret:
@@ -250,7 +264,7 @@ retry:
 	if (start == buf)
 		return -1;
 
-	time(&sb->event_time);
+	touch_sock_buf(sb);
 	nread += n;
 	if (sb->read_state == 0) {
 		sb->read_size = nread;
@@ -260,7 +274,7 @@ retry:
 			sb->buf_size = ntohl(*((int32_t *)(void *)sb->size));
 			if (sb->buf_size > 1024 * 1024)
 				return -1;
-			if ((sb->buf = malloc(sb->buf_size)) == NULL)
+			if ((sb->buf = slab_buf_alloc(sb->buf_size)) == NULL)
 				return -1;
 		}
 	} else {
@@ -363,34 +377,38 @@ accept_command_socket(int s0)
 	return s;
 }
 
+/*
+  Load the config files and returns the vm_conf_entry of 'name'.
+  The running configuration and the snapshot are not changed.
+ */
+static struct vm_conf_entry *
+load_vm_conf(const char *name)
+{
+	struct vm_conf_entry *ret;
+
+	if ((ret = load_vm_conf_entry(name)) == NULL)
+		ERR("failed to load vm %s from config files\n", name);
+	return ret;
+}
+
 static int
 search_and_replace_vm_conf(struct vm_entry *vm_ent)
 {
 	char *name = VM_CONF(vm_ent)->name;
-	struct vm_conf_entry *conf_ent, *cen, *ret = NULL;
-	struct vm_conf_head list = LIST_HEAD_INITIALIZER();
+	struct vm_conf_entry *ret;
 
-	if (load_config_file(&list, false) < 0) {
-		ERR("%s\n", "failed to load VM config files");
-		return -1;
-	}
-
-	LIST_FOREACH_SAFE (conf_ent, &list, next, cen)
-		if (strcmp(conf_ent->conf.name, name) == 0)
-			ret = conf_ent;
-		else
-			free_vm_conf_entry(conf_ent);
-
-	if (ret == NULL) {
+	if ((ret = load_vm_conf(name)) == NULL) {
 		INFO("%s\n", "discard the last loaded configurations\n");
 		return -1;
 	}
 
 	if (compare_vm_conf_entry(ret, VM_CONF_ENT(vm_ent)) != 0) {
+		log_vm_conf_diff(VM_CONF_ENT(vm_ent), ret);
 		LIST_REMOVE(VM_CONF_ENT(vm_ent), next);
 		LIST_INSERT_HEAD(&vm_conf_list, ret, next);
 		free_vm_conf_entry(VM_CONF_ENT(vm_ent));
 		VM_CONF(vm_ent) = &ret->conf;
+		notify_vm_change(vm_ent, VM_EVENT_RELOAD);
 		INFO("changes are found. update %s configuration\n", name);
 	} else {
 		free_vm_conf_entry(ret);
@@ -651,61 +669,323 @@ ret:
 	return res;
 }
 
+/*
+  Fields of the list command.
+ */
+enum LIST_FIELD {
+	LIST_NAME,
+	LIST_NCPU,
+	LIST_MEMORY,
+	LIST_LOADER,
+	LIST_BACKEND,
+	LIST_STATE,
+	LIST_OWNER,
+	LIST_NFIELDS,
+};
+
+static const char *list_fields[] = { "name", "ncpu", "memory", "loader",
+	"backend", "state", "owner" };
+
+#define LIST_DEFAULT_FIELDS						\
+	((1 << LIST_NAME) | (1 << LIST_NCPU) | (1 << LIST_MEMORY) |	\
+	 (1 << LIST_LOADER) | (1 << LIST_STATE) | (1 << LIST_OWNER))
+
+static const char *state_string[] = { "STOP", "LOAD", "RUN", "TERMINATING",
+	"TERMINATING", "REBOOTING" };
+
+const char *
+get_state_string(int state)
+{
+	if (state < 0 || (size_t)state >= nitems(state_string))
+		return "UNKNOWN";
+	return state_string[state];
+}
+
+static int
+get_state_index(const char *state)
+{
+	size_t i;
+
+	for (i = 0; i < nitems(state_string); i++)
+		if (strcasecmp(state_string[i], state) == 0)
+			return i;
+	return -1;
+}
+
+/*
+  Values of the fields of a VM to filter and sort.
+ */
+struct list_row {
+	struct vm_entry *vm_ent;
+	const char *vals[LIST_NFIELDS];
+	char owner[MAXLOGNAME];
+};
+
+/*
+  Sort order of the list command, used by compare_list_row.
+ */
+static int list_sort_field = LIST_NAME;
+static bool list_sort_reverse = false;
+
+static int
+get_list_field(const char *name)
+{
+	int i;
+
+	for (i = 0; i < LIST_NFIELDS; i++)
+		if (strcasecmp(list_fields[i], name) == 0)
+			return i;
+	return -1;
+}
+
+/*
+  Parse a number with an optional K, M, G or T suffix.
+ */
+static int
+parse_size(const char *s, uint64_t *v)
+{
+	char *p;
+	int shift;
+
+	if (!isdigit((unsigned char)*s))
+		return -1;
+	errno = 0;
+	*v = strtoull(s, &p, 10);
+	if (errno != 0)
+		return -1;
+	switch (tolower((unsigned char)*p)) {
+	case '\0':
+		return 0;
+	case 'k':
+		shift = 10;
+		break;
+	case 'm':
+		shift = 20;
+		break;
+	case 'g':
+		shift = 30;
+		break;
+	case 't':
+		shift = 40;
+		break;
+	default:
+		return -1;
+	}
+	if (p[1] != '\0')
+		return -1;
+	*v <<= shift;
+	return 0;
+}
+
+/*
+  Compare the values of the sort field and the names. The ncpu and memory
+  fields are compared by their values, a value that is not a number is
+  sorted after the numbers. Other fields are compared as strings.
+ */
+static int
+compare_list_key(const char *ka, const char *na, const char *kb,
+    const char *nb)
+{
+	uint64_t a, b;
+	int ea, eb, rc;
+
+	if (list_sort_field == LIST_NCPU || list_sort_field == LIST_MEMORY) {
+		ea = parse_size(ka, &a);
+		eb = parse_size(kb, &b);
+		if (ea == 0 && eb == 0)
+			rc = (a < b) ? -1 : (a > b);
+		else if (ea == 0 || eb == 0)
+			rc = (ea == 0) ? -1 : 1;
+		else
+			rc = strcmp(ka, kb);
+	} else
+		rc = strcmp(ka, kb);
+	if (rc == 0)
+		rc = strcmp(na, nb);
+	return list_sort_reverse ? -rc : rc;
+}
+
+static int
+compare_list_row(const void *a, const void *b)
+{
+	const struct list_row *ra = a, *rb = b;
+
+	return compare_list_key(ra->vals[list_sort_field],
+	    ra->vals[LIST_NAME], rb->vals[list_sort_field],
+	    rb->vals[LIST_NAME]);
+}
+
+static void
+set_list_row(struct list_row *row, struct vm_entry *vm_ent)
+{
+	struct vm_conf *conf = VM_CONF(vm_ent);
+	const char *owner;
+
+	if ((owner = lookup_user_name(conf->owner, NULL)) == NULL)
+		owner = "nobody";
+	strlcpy(row->owner, owner, sizeof(row->owner));
+	row->vm_ent = vm_ent;
+	row->vals[LIST_NAME] = conf->name;
+	row->vals[LIST_NCPU] = conf->ncpu;
+	row->vals[LIST_MEMORY] = conf->memory;
+	row->vals[LIST_LOADER] = conf->loader ? conf->loader : conf->backend;
+	row->vals[LIST_BACKEND] = conf->backend;
+	row->vals[LIST_STATE] = state_string[VM_STATE(vm_ent)];
+	row->vals[LIST_OWNER] = row->owner;
+}
+
+/*
+  List the VMs. The request can have the following optional keys.
+    state, owner, loader, backend : select the VMs of the value
+    name : select the VMs whose names match the glob pattern
+    fields : string array of the fields to return
+    sort : field to sort by, "name" by default
+    reverse : sort in the descending order
+    limit : max number of the VMs to return
+    cursor : "next" of the previous response to return the following VMs
+  "total" of the response is the number of the selected VMs.
+ */
 static nvlist_t *
-list_command(int s __unused, const nvlist_t *nv __unused, struct xucred *ucred)
+list_command(int s __unused, const nvlist_t *nv, struct xucred *ucred)
 {
-	size_t i, count = 0;
-	const char *reason;
+	size_t i, j, n, nrows = 0, nfields, limit = 0;
+	const char *reason, *state = NULL, *owner = NULL, *name = NULL;
+	const char *loader = NULL, *backend = NULL, *ckey = NULL, *cname;
+	const char *const *fields;
+	const nvlist_t *cursor;
 	nvlist_t *res, *p;
 	nvlist_t **list = NULL;
+	struct list_row *rows = NULL, *row;
 	struct vm_entry *vm_ent;
 	bool error = false;
-	struct passwd *pwd;
-	const static char *state_string[] = { "STOP", "LOAD", "RUN",
-		"TERMINATING", "TERMINATING", "REBOOTING" };
+	unsigned int mask = LIST_DEFAULT_FIELDS;
+	uid_t uid = 0;
+	int f;
 
 	res = nvlist_create(0);
 
-	SLIST_FOREACH (vm_ent, &vm_list, next) {
-		if (check_owner(vm_ent, ucred) != 0)
+	list_sort_field = LIST_NAME;
+	list_sort_reverse = nvlist_exists_bool(nv, "reverse") &&
+	    nvlist_get_bool(nv, "reverse");
+	if (nvlist_exists_string(nv, "sort") &&
+	    (list_sort_field = get_list_field(nvlist_get_string(nv,
+		 "sort"))) < 0) {
+		error = true;
+		reason = "unknown sort field";
+		goto ret;
+	}
+	if (nvlist_exists_string_array(nv, "fields")) {
+		fields = nvlist_get_string_array(nv, "fields", &nfields);
+		for (mask = 0, i = 0; i < nfields; i++) {
+			if ((f = get_list_field(fields[i])) < 0) {
+				error = true;
+				reason = "unknown field";
+				goto ret;
+			}
+			mask |= 1 << f;
+		}
+	}
+	if (nvlist_exists_string(nv, "state"))
+		state = nvlist_get_string(nv, "state");
+	if (nvlist_exists_string(nv, "owner")) {
+		owner = nvlist_get_string(nv, "owner");
+		if (lookup_user(owner, &uid, NULL) < 0) {
+			error = true;
+			reason = "unknown owner";
+			goto ret;
+		}
+	}
+	if (nvlist_exists_string(nv, "name"))
+		name = nvlist_get_string(nv, "name");
+	if (nvlist_exists_string(nv, "loader"))
+		loader = nvlist_get_string(nv, "loader");
+	if (nvlist_exists_string(nv, "backend"))
+		backend = nvlist_get_string(nv, "backend");
+	if (nvlist_exists_number(nv, "limit"))
+		limit = nvlist_get_number(nv, "limit");
+	if (nvlist_exists_nvlist(nv, "cursor")) {
+		cursor = nvlist_get_nvlist(nv, "cursor");
+		if (!nvlist_exists_string(cursor, "key") ||
+		    !nvlist_exists_string(cursor, "name")) {
+			error = true;
+			reason = "invalid cursor";
+			goto ret;
+		}
+		ckey = nvlist_get_string(cursor, "key");
+		cname = nvlist_get_string(cursor, "name");
+	}
+
+	STAILQ_FOREACH (vm_ent, &vm_list, next) {
+		if (check_owner(vm_ent, ucred) != 0 ||
+		    (owner != NULL && VM_CONF(vm_ent)->owner != uid) ||
+		    (name != NULL &&
+			fnmatch(name, VM_CONF(vm_ent)->name, 0) != 0))
+			continue;
+		if (nrows % 64 == 0) {
+			row = realloc(rows, (nrows + 64) * sizeof(*rows));
+			if (row == NULL) {
+				error = true;
+				reason = "cannot allocate memory";
+				goto ret;
+			}
+			rows = row;
+		}
+		row = &rows[nrows];
+		set_list_row(row, vm_ent);
+		if ((state != NULL &&
+			strcasecmp(state, row->vals[LIST_STATE]) != 0) ||
+		    (loader != NULL &&
+			strcmp(loader, row->vals[LIST_LOADER]) != 0) ||
+		    (backend != NULL &&
+			strcmp(backend, row->vals[LIST_BACKEND]) != 0))
 			continue;
-		count++;
+		nrows++;
 	}
 
-	if (count == 0)
+	qsort(rows, nrows, sizeof(*rows), compare_list_row);
+
+	/* skip the VMs returned by the previous requests */
+	i = 0;
+	if (ckey != NULL)
+		while (i < nrows &&
+		    compare_list_key(rows[i].vals[list_sort_field],
+			rows[i].vals[LIST_NAME], ckey, cname) <= 0)
+			i++;
+	n = nrows - i;
+	if (limit > 0 && n > limit)
+		n = limit;
+	if (n == 0)
 		goto ret;
 
-	if ((list = malloc(count * sizeof(nvlist_t *))) == NULL) {
+	if ((list = malloc(n * sizeof(nvlist_t *))) == NULL) {
 		error = true;
 		reason = "cannot allocate memory";
 		goto ret;
 	}
-
-	i = 0;
-	SLIST_FOREACH (vm_ent, &vm_list, next) {
-		if (check_owner(vm_ent, ucred) != 0)
-			continue;
+	for (j = 0; j < n; j++) {
+		row = &rows[i + j];
 		p = nvlist_create(0);
-		nvlist_add_string(p, "name", VM_CONF(vm_ent)->name);
-		nvlist_add_string(p, "ncpu", VM_CONF(vm_ent)->ncpu);
-		nvlist_add_string(p, "memory", VM_CONF(vm_ent)->memory);
-		nvlist_add_string(p, "loader",
-				  VM_CONF(vm_ent)->loader ?
-				  VM_CONF(vm_ent)->loader :
-				  VM_CONF(vm_ent)->backend);
-		nvlist_add_string(p, "state", state_string[VM_STATE(vm_ent)]);
-		if ((pwd = getpwuid(VM_CONF(vm_ent)->owner)) == NULL)
-			nvlist_add_string(p, "owner", "nobody");
-		else
-			nvlist_add_string(p, "owner", pwd->pw_name);
-		list[i++] = p;
+		for (f = 0; f < LIST_NFIELDS; f++)
+			if (mask & (1 << f))
+				nvlist_add_string(p, list_fields[f],
+				    row->vals[f]);
+		list[j] = p;
 	}
+	nvlist_move_nvlist_array(res, "vm_list", list, n);
 
-	nvlist_move_nvlist_array(res, "vm_list", list, count);
+	if (i + n < nrows) {
+		p = nvlist_create(0);
+		nvlist_add_string(p, "key", row->vals[list_sort_field]);
+		nvlist_add_string(p, "name", row->vals[LIST_NAME]);
+		nvlist_move_nvlist(res, "next", p);
+	}
 ret:
+	free(rows);
 	nvlist_add_bool(res, "error", error);
 	if (error)
 		nvlist_add_string(res, "reason", reason);
+	else
+		nvlist_add_number(res, "total", nrows);
 	return res;
 }
 
@@ -736,7 +1016,7 @@ vm_down_command(int s __unused, const nvlist_t *nv __unused, int how,
 		INFO("stop vm %s\n", conf->name);
 		VM_ACPI_POWEROFF(vm_ent);
 		set_timer(vm_ent, conf->stop_timeout);
-		VM_STATE(vm_ent) = STOP;
+		set_vm_state(vm_ent, STOP);
 		break;
 	case 1:
 		INFO("reset vm %s\n", conf->name);
@@ -745,7 +1025,7 @@ vm_down_command(int s __unused, const nvlist_t *nv __unused, int how,
 	case 2:
 		INFO("poweroff vm %s\n", conf->name);
 		VM_POWEROFF(vm_ent);
-		VM_STATE(vm_ent) = STOP;
+		set_vm_state(vm_ent, STOP);
 		break;
 	default:
 		error = true;
@@ -760,6 +1040,38 @@ ret:
 	return res;
 }
 
+static nvlist_t *
+ready_command(int s __unused, const nvlist_t *nv, struct xucred *ucred)
+{
+	const char *name, *reason;
+	struct vm_entry *vm_ent;
+	nvlist_t *res;
+	bool error = false;
+
+	if ((name = nvlist_get_string(nv, "name")) == NULL ||
+	    (vm_ent = lookup_vm_by_name(name)) == NULL ||
+	    (check_owner(vm_ent, ucred) != 0)) {
+		error = true;
+		reason = "VM not found";
+		goto ret;
+	}
+
+	if (VM_STATE(vm_ent) != RUN) {
+		error = true;
+		reason = "not running";
+		goto ret;
+	}
+
+	set_vm_ready(vm_ent);
+
+ret:
+	res = nvlist_create(0);
+	nvlist_add_bool(res, "error", error);
+	if (error)
+		nvlist_add_string(res, "reason", reason);
+	return res;
+}
+
 static nvlist_t *
 shutdown_command(int s, const nvlist_t *nv,  struct xucred *ucred)
 {
@@ -778,23 +1090,520 @@ poweroff_command(int s, const nvlist_t *nv,  struct xucred *ucred)
 	return vm_down_command(s, nv, 2, ucred);
 }
 
+struct sub_event {
+	STAILQ_ENTRY(sub_event) next;
+	size_t size;
+	void *buf;
+};
+
+/*
+  Connection receiving the VM events by the watch or wait command.
+  'name' is a glob pattern for watch and a VM name for wait.
+  'state' is the target state of wait, NULL for watch.
+  'done' is set to close the connection after sending the queue.
+ */
+struct subscriber {
+	LIST_ENTRY(subscriber) next;
+	struct sock_buf *sb;
+	STAILQ_HEAD(, sub_event) queue;
+	int nqueued;
+	uint64_t lost;
+	char *name;
+	bool has_owner;
+	uid_t owner;
+	const char *state;
+	struct timer *timer;
+	bool done;
+};
+
+static LIST_HEAD(, subscriber) subscribers = LIST_HEAD_INITIALIZER();
+static uint64_t nsubscribers = 0, nevents = 0, nevents_lost = 0;
+
+static const char *vm_event_string[] = { "create", "state", "reload",
+	"remove", "exit" };
+
+static void
+free_subscriber(struct subscriber *sub)
+{
+	struct sub_event *ev, *evn;
+
+	LIST_REMOVE(sub, next);
+	nsubscribers--;
+	STAILQ_FOREACH_SAFE (ev, &sub->queue, next, evn) {
+		free(ev->buf);
+		free(ev);
+	}
+	destroy_timer(sub->timer);
+	sub->sb->sub = NULL;
+	free(sub->name);
+	free(sub);
+}
+
+void
+free_subscribers(void)
+{
+	struct subscriber *sub, *sn;
+
+	LIST_FOREACH_SAFE (sub, &subscribers, next, sn)
+		free_subscriber(sub);
+}
+
+/*
+  Move the next queued event to the send buffer of 'sb'.
+  Returns 1 if moved, 0 if nothing to send and -1 if the connection
+  should be closed.
+ */
+int
+next_sock_buf_event(struct sock_buf *sb)
+{
+	struct subscriber *sub = sb->sub;
+	struct sub_event *ev;
+
+	if (sub == NULL)
+		return 0;
+	if ((ev = STAILQ_FIRST(&sub->queue)) == NULL)
+		return sub->done ? -1 : 0;
+	STAILQ_REMOVE_HEAD(&sub->queue, next);
+	sub->nqueued--;
+	sb->res_buf = ev->buf;
+	sb->res_size = ev->size;
+	sb->res_bytes = 0;
+	sb->sent_size = 0;
+	free(ev);
+	return 1;
+}
+
+static int
+push_event(struct subscriber *sub, const void *buf, size_t size)
+{
+	struct sub_event *ev;
+
+	if ((ev = malloc(sizeof(*ev))) == NULL)
+		return -1;
+	if ((ev->buf = malloc(size)) == NULL) {
+		free(ev);
+		return -1;
+	}
+	memcpy(ev->buf, buf, size);
+	ev->size = size;
+	STAILQ_INSERT_TAIL(&sub->queue, ev, next);
+	sub->nqueued++;
+	return 0;
+}
+
+/*
+  Queue the packed event to 'sub' and start sending if it's idle.
+ */
+static void
+queue_event(struct subscriber *sub, const void *buf, size_t size)
+{
+	nvlist_t *nv;
+	void *lost;
+	size_t lost_size;
+
+	if (sub->nqueued >= SUBSCRIBER_QUEUE_MAX) {
+		sub->lost++;
+		nevents_lost++;
+		return;
+	}
+	if (sub->lost > 0) {
+		nv = nvlist_create(0);
+		nvlist_add_string(nv, "event", "lost");
+		nvlist_add_number(nv, "count", sub->lost);
+		if ((lost = nvlist_pack(nv, &lost_size)) != NULL &&
+		    push_event(sub, lost, lost_size) == 0)
+			sub->lost = 0;
+		free(lost);
+		nvlist_destroy(nv);
+	}
+	if (push_event(sub, buf, size) < 0) {
+		sub->lost++;
+		nevents_lost++;
+		return;
+	}
+	nevents++;
+	if (sub->sb->res_buf == NULL && next_sock_buf_event(sub->sb) == 1)
+		set_sock_buf_wait_flags(sub->sb, EV_DISABLE, EV_ENABLE);
+}
+
+static bool
+match_subscriber(struct subscriber *sub, struct vm_entry *vm_ent,
+    enum VM_EVENT type)
+{
+	const char *name = VM_CONF(vm_ent)->name;
+
+	if (check_owner(vm_ent, &sub->sb->peer) != 0 ||
+	    (sub->has_owner && VM_CONF(vm_ent)->owner != sub->owner))
+		return false;
+	if (sub->state == NULL)
+		return sub->name == NULL || fnmatch(sub->name, name, 0) == 0;
+	return strcmp(sub->name, name) == 0 && type != VM_EVENT_EXIT &&
+	    (type == VM_EVENT_REMOVE ||
+		strcasecmp(sub->state, state_string[VM_STATE(vm_ent)]) == 0);
+}
+
+/*
+  Send the event of 'vm_ent' to the subscribers. 'status' is the exit
+  status of VM_EVENT_EXIT.
+ */
+void
+publish_vm_event(struct vm_entry *vm_ent, enum VM_EVENT type, int status)
+{
+	struct subscriber *sub;
+	const char *owner;
+	nvlist_t *nv = NULL;
+	void *buf = NULL;
+	size_t size;
+
+	LIST_FOREACH (sub, &subscribers, next) {
+		if (sub->done || !match_subscriber(sub, vm_ent, type))
+			continue;
+		if (buf == NULL) {
+			nv = nvlist_create(0);
+			nvlist_add_string(nv, "event", vm_event_string[type]);
+			nvlist_add_string(nv, "name", VM_CONF(vm_ent)->name);
+			nvlist_add_string(nv, "state",
+			    state_string[VM_STATE(vm_ent)]);
+			if ((owner = lookup_user_name(VM_CONF(vm_ent)->owner,
+				 NULL)) == NULL)
+				owner = "nobody";
+			nvlist_add_string(nv, "owner", owner);
+			nvlist_add_number(nv, "generation", vm_generation);
+			if (type == VM_EVENT_EXIT && WIFEXITED(status))
+				nvlist_add_number(nv, "status",
+				    WEXITSTATUS(status));
+			if (type == VM_EVENT_EXIT && WIFSIGNALED(status))
+				nvlist_add_number(nv, "signal",
+				    WTERMSIG(status));
+			if ((buf = nvlist_pack(nv, &size)) == NULL)
+				break;
+		}
+		queue_event(sub, buf, size);
+		if (sub->state != NULL)
+			sub->done = true;
+	}
+	free(buf);
+	nvlist_destroy(nv);
+}
+
+static int
+on_wait_timeout(int ident __unused, void *data)
+{
+	struct subscriber *sub = data;
+	nvlist_t *nv;
+	void *buf;
+	size_t size;
+
+	if (sub->done)
+		return 0;
+	nv = nvlist_create(0);
+	nvlist_add_string(nv, "event", "timeout");
+	nvlist_add_string(nv, "name", sub->name);
+	if ((buf = nvlist_pack(nv, &size)) != NULL)
+		queue_event(sub, buf, size);
+	sub->done = true;
+	/* close it now if the event couldn't be queued */
+	if (sub->sb->res_buf == NULL)
+		set_sock_buf_wait_flags(sub->sb, EV_DISABLE, EV_ENABLE);
+	free(buf);
+	nvlist_destroy(nv);
+	return 0;
+}
+
+/*
+  Subscribe the events for the watch or wait request 'nv' from 'sb'.
+  Nothing is subscribed if the VM is already in the state to wait.
+ */
+static int
+add_subscriber(struct sock_buf *sb, const nvlist_t *nv, bool wait)
+{
+	struct subscriber *sub;
+	struct vm_entry *vm_ent;
+	const char *state = NULL;
+	int64_t timeout = 0;
+
+	if (wait) {
+		vm_ent = lookup_vm_by_name(nvlist_get_string(nv, "name"));
+		state = nvlist_get_string(nv, "state");
+		if (vm_ent == NULL ||
+		    strcasecmp(state, state_string[VM_STATE(vm_ent)]) == 0)
+			return 0;
+		if (nvlist_exists_number(nv, "timeout"))
+			timeout = nvlist_get_number(nv, "timeout");
+	}
+
+	if ((sub = calloc(1, sizeof(*sub))) == NULL)
+		return -1;
+	STAILQ_INIT(&sub->queue);
+	sub->sb = sb;
+	if (nvlist_exists_string(nv, "name") &&
+	    (sub->name = strdup(nvlist_get_string(nv, "name"))) == NULL)
+		goto err;
+	if (nvlist_exists_string(nv, "owner")) {
+		if (lookup_user(nvlist_get_string(nv, "owner"), &sub->owner,
+			NULL) < 0)
+			goto err;
+		sub->has_owner = true;
+	}
+	if (timeout > 0 &&
+	    ((sub->timer = create_timer(on_wait_timeout, sub)) == NULL ||
+		schedule_timer(sub->timer, timeout * 1000) < 0))
+		goto err;
+
+	/* the state pointed by the request is freed after this call */
+	if (state != NULL)
+		sub->state = state_string[get_state_index(state)];
+	LIST_INSERT_HEAD(&subscribers, sub, next);
+	nsubscribers++;
+	sb->sub = sub;
+	cancel_timer(sb->timer);
+	return 0;
+err:
+	destroy_timer(sub->timer);
+	free(sub->name);
+	free(sub);
+	return -1;
+}
+
+/*
+  Stream the events of the VMs. The request can have the following
+  optional keys.
+    name : select the VMs whose names match the glob pattern
+    owner : select the VMs of the owner
+  Each event has "event", "name", "state", "owner" and "generation".
+  "event" is one of "create", "state", "reload", "remove" or "exit".
+  "exit" events have "status" or "signal" of the process.
+ */
+static nvlist_t *
+watch_command(int s __unused, const nvlist_t *nv, struct xucred *ucred __unused)
+{
+	nvlist_t *res;
+	const char *reason;
+	bool error = false;
+
+	res = nvlist_create(0);
+	if (nvlist_exists_string(nv, "owner") &&
+	    lookup_user(nvlist_get_string(nv, "owner"), NULL, NULL) < 0) {
+		error = true;
+		reason = "unknown owner";
+	}
+	nvlist_add_bool(res, "error", error);
+	if (error)
+		nvlist_add_string(res, "reason", reason);
+	return res;
+}
+
+/*
+  Wait until VM "name" gets to "state" for "timeout" seconds. "state" of
+  the response is the current one. If it's not the waited one, a "state"
+  or "remove" event of the VM, or a "timeout" event follows.
+ */
+static nvlist_t *
+wait_command(int s __unused, const nvlist_t *nv, struct xucred *ucred)
+{
+	const char *name, *state, *reason;
+	struct vm_entry *vm_ent;
+	nvlist_t *res;
+	bool error = false;
+
+	res = nvlist_create(0);
+
+	if (!nvlist_exists_string(nv, "name") ||
+	    (name = nvlist_get_string(nv, "name")) == NULL ||
+	    (vm_ent = lookup_vm_by_name(name)) == NULL ||
+	    (check_owner(vm_ent, ucred) != 0)) {
+		error = true;
+		reason = "VM not found";
+		goto ret;
+	}
+	if (!nvlist_exists_string(nv, "state") ||
+	    (state = nvlist_get_string(nv, "state")) == NULL ||
+	    get_state_index(state) < 0) {
+		error = true;
+		reason = "unknown state";
+		goto ret;
+	}
+	nvlist_add_string(res, "state", state_string[VM_STATE(vm_ent)]);
+ret:
+	nvlist_add_bool(res, "error", error);
+	if (error)
+		nvlist_add_string(res, "reason", reason);
+	return res;
+}
+
+/*
+  Pass a read-only descriptor of the state table of the peer. The files
+  are owned by root so that the owner can't truncate them under bmd.
+  The state table doesn't exist until the peer owns a VM.
+ */
+static nvlist_t *
+statetab_command(int s __unused, const nvlist_t *nv __unused,
+    struct xucred *ucred)
+{
+	const char *reason;
+	nvlist_t *res;
+	int fd;
+	bool error = false;
+
+	res = nvlist_create(0);
+	if ((fd = open_state_shard(ucred->cr_uid)) < 0) {
+		error = true;
+		reason = (errno == ENOENT) ? "no state table" :
+		    "cannot open state table";
+	} else
+		nvlist_add_number(res, FD_KEY, fd);
+
+	nvlist_add_bool(res, "error", error);
+	if (error)
+		nvlist_add_string(res, "reason", reason);
+	return res;
+}
+
+static nvlist_t *
+stats_command(int s __unused, const nvlist_t *nv __unused,
+    struct xucred *ucred __unused)
+{
+	nvlist_t *res, *p;
+
+	res = nvlist_create(0);
+	slab_stats(res);
+	boot_stats(res);
+	fd_broker_stats(res);
+	parser_stats(res);
+	userdb_stats(res);
+	state_table_stats(res);
+	p = nvlist_create(0);
+	nvlist_add_number(p, "hits", nres_hits);
+	nvlist_add_number(p, "misses", nres_misses);
+	nvlist_add_number(p, "entries", nres_caches);
+	nvlist_move_nvlist(res, "res_cache", p);
+	p = nvlist_create(0);
+	nvlist_add_number(p, "subscribers", nsubscribers);
+	nvlist_add_number(p, "events", nevents);
+	nvlist_add_number(p, "lost", nevents_lost);
+	nvlist_move_nvlist(res, "watch", p);
+	nvlist_add_bool(res, "error", false);
+	return res;
+}
+
+/*
+  Process loading the config files for diffconfig, -1 if none.
+  Only one runs at a time.
+ */
+static pid_t diffconfig_pid = -1;
+
+static int
+on_diffconfig_exit(int ident, void *data __unused)
+{
+	while (waitpid(ident, NULL, 0) < 0)
+		if (errno != EINTR)
+			break;
+	diffconfig_pid = -1;
+	return 0;
+}
+
+/*
+  Load the config files and send the diff of 'vm_ent' to 's'. It runs in
+  a child process, the config files are loaded into its own copy of the
+  memory. The running configuration and the snapshot are not changed.
+ */
+static void
+diffconfig_main(int s, struct vm_entry *vm_ent)
+{
+	struct vm_conf_entry *conf_ent;
+	nvlist_t *res, *diff = NULL;
+
+	set_config_snapshot(NULL, false);
+	res = nvlist_create(0);
+	if ((conf_ent = load_vm_conf(VM_CONF(vm_ent)->name)) == NULL)
+		nvlist_add_string(res, "reason", "VM not found in config files");
+	else if ((diff = diff_vm_conf_entry(VM_CONF_ENT(vm_ent), conf_ent)) ==
+	    NULL)
+		nvlist_add_string(res, "reason", "cannot allocate memory");
+	else
+		nvlist_move_nvlist(res, "diff", diff);
+	nvlist_add_bool(res, "error", diff == NULL);
+	nvlist_send(s, res);
+	_exit(0);
+}
+
+/*
+  Show the fields that differ between the running configuration and the
+  config files. The response is sent by the child process, NULL is
+  returned to close the connection.
+ */
+static nvlist_t *
+diffconfig_command(int s, const nvlist_t *nv, struct xucred *ucred)
+{
+	const char *name, *reason;
+	struct vm_entry *vm_ent;
+	nvlist_t *res;
+	pid_t pid;
+
+	res = nvlist_create(0);
+
+	if ((name = nvlist_get_string(nv, "name")) == NULL ||
+	    (vm_ent = lookup_vm_by_name(name)) == NULL ||
+	    (check_owner(vm_ent, ucred) != 0)) {
+		reason = "VM not found";
+		goto err;
+	}
+
+	if (diffconfig_pid != -1) {
+		reason = "busy, try again later";
+		goto err;
+	}
+
+	if ((pid = fork()) < 0) {
+		reason = "cannot fork";
+		goto err;
+	}
+	if (pid == 0)
+		diffconfig_main(s, vm_ent);
+	if (plugin_wait_for_process(pid, on_diffconfig_exit, NULL) == 0)
+		diffconfig_pid = pid;
+	nvlist_destroy(res);
+	return NULL;
+err:
+	nvlist_add_bool(res, "error", true);
+	nvlist_add_string(res, "reason", reason);
+	return res;
+}
+
 typedef nvlist_t *(*cfunc)(int s, const nvlist_t *nv, struct xucred *ucred);
 
+/*
+  'cache' is true if the response depends only on the request, the
+  credential and the VMs.
+  'stream' is true if the connection subscribes the VM events after the
+  response.
+ */
 struct command_entry {
 	const char *name;
 	cfunc func;
+	bool cache;
+	bool stream;
 };
 
+static nvlist_t *batch_command(int, const nvlist_t *, struct xucred *);
+
 /* must be sorted by name */
 static struct command_entry command_list[] = {
-	{ "boot", &boot_command },
-	{ "install", &install_command },
-	{ "list", &list_command },
-	{ "poweroff", &poweroff_command },
-	{ "reset", &reset_command },
-	{ "showcomport", &showcomport_command },
-	{ "showvgaport", &showvgaport_command },
-	{ "shutdown", &shutdown_command },
+	{ "batch", &batch_command, false, false },
+	{ "boot", &boot_command, false, false },
+	{ "diffconfig", &diffconfig_command, false, false },
+	{ "install", &install_command, false, false },
+	{ "list", &list_command, true, false },
+	{ "poweroff", &poweroff_command, false, false },
+	{ "ready", &ready_command, false, false },
+	{ "reset", &reset_command, false, false },
+	{ "showcomport", &showcomport_command, false, false },
+	{ "showvgaport", &showvgaport_command, false, false },
+	{ "shutdown", &shutdown_command, false, false },
+	{ "statetab", &statetab_command, false, false },
+	{ "stats", &stats_command, false, false },
+	{ "wait", &wait_command, false, true },
+	{ "watch", &watch_command, false, true },
 };
 
 static int
@@ -805,17 +1614,161 @@ compare_command_entry(const void *a, const void *b)
 	return strcasecmp(name, ent->name);
 }
 
-static cfunc
-get_command_function(const char *name)
+static struct command_entry *
+get_command_entry(const char *name)
 {
-
-	struct command_entry *p;
-
-	p = bsearch(name, command_list,
+	return bsearch(name, command_list,
 	    sizeof(command_list) / sizeof(command_list[0]),
 	    sizeof(command_list[0]), compare_command_entry);
+}
+
+/*
+  Max number of the sub-commands in a batch command.
+ */
+#define BATCH_MAX	1024
+
+/*
+  Run the nvlist array "commands" in order and return their responses in
+  the nvlist array "results". File descriptors can't be passed to the
+  sub-commands, those in the responses are closed.
+ */
+static nvlist_t *
+batch_command(int s, const nvlist_t *nv, struct xucred *ucred)
+{
+	size_t i, count;
+	const char *cmd, *reason;
+	const nvlist_t *const *cmds;
+	nvlist_t *res, *r, **list;
+	struct command_entry *ent;
+	bool error = false;
+
+	res = nvlist_create(0);
+
+	if (!nvlist_exists_nvlist_array(nv, "commands")) {
+		error = true;
+		reason = "no commands";
+		goto ret;
+	}
+	cmds = nvlist_get_nvlist_array(nv, "commands", &count);
+	if (count > BATCH_MAX) {
+		error = true;
+		reason = "too many commands";
+		goto ret;
+	}
+	if (count == 0)
+		goto ret;
+	if ((list = malloc(count * sizeof(nvlist_t *))) == NULL) {
+		error = true;
+		reason = "cannot allocate memory";
+		goto ret;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!nvlist_exists_string(cmds[i], "command") ||
+		    (cmd = nvlist_get_string(cmds[i], "command")) == NULL ||
+		    (ent = get_command_entry(cmd)) == NULL ||
+		    ent->func == &batch_command ||
+		    ent->func == &diffconfig_command || ent->stream) {
+			r = nvlist_create(0);
+			nvlist_add_bool(r, "error", true);
+			nvlist_add_string(r, "reason", "unknown command");
+		} else {
+			r = (*ent->func)(s, cmds[i], ucred);
+			if (nvlist_exists_number(r, FD_KEY))
+				close(nvlist_take_number(r, FD_KEY));
+		}
+		list[i] = r;
+	}
+	nvlist_move_nvlist_array(res, "results", list, count);
+ret:
+	nvlist_add_bool(res, "error", error);
+	if (error)
+		nvlist_add_string(res, "reason", reason);
+	return res;
+}
+
+static void
+free_res_cache(struct res_cache *rc)
+{
+	TAILQ_REMOVE(&res_caches, rc, next);
+	nres_caches--;
+	free(rc->req);
+	free(rc->res);
+	free(rc);
+}
+
+void
+free_res_caches(void)
+{
+	while (!TAILQ_EMPTY(&res_caches))
+		free_res_cache(TAILQ_FIRST(&res_caches));
+}
+
+/*
+  The other groups don't matter for root, who can see all VMs.
+ */
+static int
+cred_groups(const struct xucred *cred)
+{
+	return (cred->cr_uid == 0) ? 0 : cred->cr_ngroups;
+}
 
-	return ((p != NULL) ? p->func : NULL);
+/*
+  Returns the cached response to the request in 'sb'.
+ */
+static struct res_cache *
+lookup_res_cache(struct sock_buf *sb)
+{
+	struct res_cache *rc;
+	uint64_t db_gen = userdb_generation();
+	int ngroups = cred_groups(&sb->peer);
+
+	if (res_cache_vm_gen != vm_generation || res_cache_db_gen != db_gen) {
+		free_res_caches();
+		res_cache_vm_gen = vm_generation;
+		res_cache_db_gen = db_gen;
+	}
+	TAILQ_FOREACH (rc, &res_caches, next)
+		if (rc->uid == sb->peer.cr_uid && rc->ngroups == ngroups &&
+		    memcmp(rc->groups, sb->peer.cr_groups,
+			ngroups * sizeof(gid_t)) == 0 &&
+		    rc->req_size == sb->buf_size &&
+		    memcmp(rc->req, sb->buf, sb->buf_size) == 0) {
+			TAILQ_REMOVE(&res_caches, rc, next);
+			TAILQ_INSERT_HEAD(&res_caches, rc, next);
+			return rc;
+		}
+	return NULL;
+}
+
+/*
+  Cache the response in 'sb'. The least recently used one is dropped if
+  the cache is full.
+ */
+static void
+add_res_cache(struct sock_buf *sb)
+{
+	struct res_cache *rc;
+
+	if ((rc = calloc(1, sizeof(*rc))) == NULL)
+		return;
+	rc->uid = sb->peer.cr_uid;
+	rc->ngroups = cred_groups(&sb->peer);
+	memcpy(rc->groups, sb->peer.cr_groups, rc->ngroups * sizeof(gid_t));
+	rc->req_size = sb->buf_size;
+	rc->res_size = sb->res_size;
+	if ((rc->req = malloc(rc->req_size)) == NULL ||
+	    (rc->res = malloc(rc->res_size)) == NULL) {
+		free(rc->req);
+		free(rc);
+		return;
+	}
+	memcpy(rc->req, sb->buf, rc->req_size);
+	memcpy(rc->res, sb->res_buf, rc->res_size);
+	if (nres_caches >= RES_CACHE_MAX)
+		free_res_cache(TAILQ_LAST(&res_caches, res_cache_head));
+	TAILQ_INSERT_HEAD(&res_caches, rc, next);
+	nres_caches++;
 }
 
 int
@@ -824,7 +1777,8 @@ recv_command(struct sock_buf *sb)
 	const char *cmd;
 	const char *reason = "unknown command";
 	nvlist_t *nv, *res = NULL;
-	cfunc func;
+	struct command_entry *ent;
+	struct res_cache *rc;
 
 	if ((nv = nvlist_unpack(sb->buf, sb->buf_size, 0)) == NULL)
 		return -1;
@@ -832,10 +1786,27 @@ recv_command(struct sock_buf *sb)
 	if ((cmd = nvlist_get_string(nv, "command")) == NULL)
 		goto err;
 
-	if ((func = get_command_function(cmd)) == NULL)
+	if ((ent = get_command_entry(cmd)) == NULL)
 		goto err;
 
-	res = (*func)(sb->fd, nv, &sb->peer);
+	if (ent->cache && (rc = lookup_res_cache(sb)) != NULL &&
+	    (sb->res_buf = malloc(rc->res_size)) != NULL) {
+		memcpy(sb->res_buf, rc->res, rc->res_size);
+		sb->res_size = rc->res_size;
+		sb->res_bytes = 0;
+		sb->res_fd = -1;
+		nres_hits++;
+		nvlist_destroy(nv);
+		return 0;
+	}
+
+	res = (*ent->func)(sb->fd, nv, &sb->peer);
+
+	/* the response is sent by another process */
+	if (res == NULL) {
+		nvlist_destroy(nv);
+		return -1;
+	}
 
 	sb->res_fd = nvlist_exists_number(res, FD_KEY) ?
 		nvlist_take_number(res, FD_KEY) : -1;
@@ -846,6 +1817,18 @@ recv_command(struct sock_buf *sb)
 		goto err;
 	}
 	sb->res_bytes = 0;
+	if (ent->cache && sb->res_fd == -1 &&
+	    !nvlist_get_bool(res, "error")) {
+		add_res_cache(sb);
+		nres_misses++;
+	}
+	if (ent->stream && !nvlist_get_bool(res, "error") &&
+	    add_subscriber(sb, nv, ent->func == &wait_command) < 0) {
+		free(sb->res_buf);
+		sb->res_buf = NULL;
+		reason = "cannot subscribe";
+		goto err;
+	}
 
 	nvlist_destroy(res);
 	nvlist_destroy(nv);
@@ -7,6 +7,13 @@
  */
 #define DEFAULT_NMDM_OFFSET 200
 
+/*
+  Max number of the events queued for a subscriber. The following events
+  are dropped until the queue is drained, then a "lost" event tells the
+  number of them.
+ */
+#define SUBSCRIBER_QUEUE_MAX	256
+
 struct sock_buf;
 struct global_conf;
 
@@ -16,13 +23,14 @@ void clear_sock_buf(struct sock_buf *);
 int recv_sock_buf(struct sock_buf *);
 void clear_send_sock_buf(struct sock_buf *);
 int send_sock_buf(struct sock_buf *);
+int next_sock_buf_event(struct sock_buf *);
 
 int connect_to_server(const struct global_conf *);
 int create_command_server(const struct global_conf *);
 int accept_command_socket(int s0);
 int recv_command(struct sock_buf *);
-struct timespec *calc_timeout(int , struct timespec *);
-void close_timeout_sock_buf(int);
+void free_res_caches(void);
+void free_subscribers(void);
 
 int attach_console(int);
 
@@ -0,0 +1,206 @@
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/nv.h>
+
+#include <stdlib.h>
+
+#include "slab.h"
+
+/*
+  Alignment of objects and buffers.
+ */
+#define SLAB_ALIGN (sizeof(void *) * 2)
+
+/*
+  Size classes of buffers, from 256 bytes to 1 MiB.
+ */
+#define SLAB_BUF_MIN_SHIFT 8
+#define SLAB_BUF_MAX_SHIFT 20
+
+/*
+  Maximum bytes of free buffers kept for each size class. The buffers of
+  the larger classes are not kept.
+ */
+#define SLAB_BUF_CACHE_SIZE (256 * 1024)
+#define SLAB_BUF_CACHE_MAX  32
+
+/*
+  Free object or buffer. It overlays the unused memory.
+ */
+struct slab_free {
+	SLIST_ENTRY(slab_free) next;
+};
+
+struct slab_chunk {
+	SLIST_ENTRY(slab_chunk) next;
+};
+
+struct slab_buf_class {
+	SLIST_HEAD(, slab_free) free;
+	size_t nfree;
+};
+
+static SLIST_HEAD(, slab) slab_list = SLIST_HEAD_INITIALIZER();
+
+static struct slab_buf_class
+	buf_classes[SLAB_BUF_MAX_SHIFT - SLAB_BUF_MIN_SHIFT + 1];
+static uint64_t buf_hits, buf_misses;
+
+static size_t
+slab_obj_size(struct slab *s)
+{
+	return roundup2(MAX(s->size, sizeof(struct slab_free)), SLAB_ALIGN);
+}
+
+static int
+slab_grow(struct slab *s)
+{
+	size_t i, sz = slab_obj_size(s);
+	size_t hdr = roundup2(sizeof(struct slab_chunk), SLAB_ALIGN);
+	struct slab_chunk *c;
+	struct slab_free *f;
+
+	if ((c = malloc(hdr + sz * s->count)) == NULL)
+		return -1;
+	SLIST_INSERT_HEAD(&s->chunks, c, next);
+
+	for (i = 0; i < s->count; i++) {
+		f = (struct slab_free *)((char *)c + hdr + sz * i);
+		SLIST_INSERT_HEAD(&s->free, f, next);
+	}
+	return 0;
+}
+
+void *
+slab_alloc(struct slab *s)
+{
+	struct slab_free *f;
+
+	if (! s->registered) {
+		SLIST_INSERT_HEAD(&slab_list, s, next);
+		s->registered = true;
+	}
+
+	if (SLIST_EMPTY(&s->free)) {
+		if (slab_grow(s) < 0)
+			return NULL;
+		s->misses++;
+	} else
+		s->hits++;
+
+	f = SLIST_FIRST(&s->free);
+	SLIST_REMOVE_HEAD(&s->free, next);
+	s->inuse++;
+	return f;
+}
+
+void
+slab_free(struct slab *s, void *p)
+{
+	struct slab_free *f = p;
+
+	if (f == NULL)
+		return;
+	SLIST_INSERT_HEAD(&s->free, f, next);
+	s->inuse--;
+}
+
+/*
+  Free all objects of the slab at once.
+ */
+void
+slab_destroy(struct slab *s)
+{
+	struct slab_chunk *c, *cn;
+
+	SLIST_FOREACH_SAFE (c, &s->chunks, next, cn)
+		free(c);
+	SLIST_INIT(&s->chunks);
+	SLIST_INIT(&s->free);
+	s->inuse = 0;
+}
+
+static int
+buf_class(size_t size)
+{
+	int c;
+
+	for (c = 0; c <= SLAB_BUF_MAX_SHIFT - SLAB_BUF_MIN_SHIFT; c++)
+		if (size <= (1UL << (SLAB_BUF_MIN_SHIFT + c)))
+			return c;
+	return -1;
+}
+
+/*
+  Allocate a buffer from the free list of its size class.
+  The same size must be passed to slab_buf_free().
+ */
+void *
+slab_buf_alloc(size_t size)
+{
+	int c;
+	struct slab_free *f;
+
+	if ((c = buf_class(size)) < 0)
+		return malloc(size);
+
+	if ((f = SLIST_FIRST(&buf_classes[c].free)) != NULL) {
+		SLIST_REMOVE_HEAD(&buf_classes[c].free, next);
+		buf_classes[c].nfree--;
+		buf_hits++;
+		return f;
+	}
+
+	buf_misses++;
+	return malloc(1UL << (SLAB_BUF_MIN_SHIFT + c));
+}
+
+void
+slab_buf_free(void *p, size_t size)
+{
+	int c;
+	struct slab_free *f = p;
+
+	if (f == NULL)
+		return;
+
+	if ((c = buf_class(size)) < 0 ||
+	    buf_classes[c].nfree >=
+	    MIN(SLAB_BUF_CACHE_SIZE >> (SLAB_BUF_MIN_SHIFT + c),
+		SLAB_BUF_CACHE_MAX)) {
+		free(p);
+		return;
+	}
+
+	SLIST_INSERT_HEAD(&buf_classes[c].free, f, next);
+	buf_classes[c].nfree++;
+}
+
+/*
+  Add pool counters to 'nvl'.
+ */
+void
+slab_stats(nvlist_t *nvl)
+{
+	int c;
+	size_t cached = 0;
+	struct slab *s;
+	nvlist_t *p;
+
+	SLIST_FOREACH (s, &slab_list, next) {
+		p = nvlist_create(0);
+		nvlist_add_number(p, "hits", s->hits);
+		nvlist_add_number(p, "misses", s->misses);
+		nvlist_add_number(p, "inuse", s->inuse);
+		nvlist_move_nvlist(nvl, s->name, p);
+	}
+
+	for (c = 0; c <= SLAB_BUF_MAX_SHIFT - SLAB_BUF_MIN_SHIFT; c++)
+		cached += buf_classes[c].nfree << (SLAB_BUF_MIN_SHIFT + c);
+
+	p = nvlist_create(0);
+	nvlist_add_number(p, "hits", buf_hits);
+	nvlist_add_number(p, "misses", buf_misses);
+	nvlist_add_number(p, "cached_bytes", cached);
+	nvlist_move_nvlist(nvl, "buffer", p);
+}
@@ -0,0 +1,43 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <sys/queue.h>
+#include <sys/nv.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct slab_free;
+struct slab_chunk;
+
+/*
+  Pool of fixed size objects.
+  Objects are allocated by chunks and never returned to the heap.
+ */
+struct slab {
+	const char *name;
+	size_t size;
+	size_t count;
+	SLIST_HEAD(, slab_free) free;
+	SLIST_HEAD(, slab_chunk) chunks;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t inuse;
+	bool registered;
+	SLIST_ENTRY(slab) next;
+};
+
+#define SLAB_INITIALIZER(n, s, c)                                      \
+	{                                                              \
+		.name = (n), .size = (s), .count = (c),                \
+		.free = { NULL }, .chunks = { NULL }                   \
+	}
+
+/* Implemented in slab.c */
+void *slab_alloc(struct slab *);
+void slab_free(struct slab *, void *);
+void slab_destroy(struct slab *);
+void *slab_buf_alloc(size_t);
+void slab_buf_free(void *, size_t);
+void slab_stats(nvlist_t *);
+
+#endif
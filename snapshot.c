@@ -0,0 +1,973 @@
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bmd.h"
+#include "conf.h"
+#include "log.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "BMDSNAP"
+#define NO_STRING UINT32_MAX
+
+/*
+  The snapshot file starts with this header. 'sources', 'globals', 'vms'
+  and 'index' are offsets from the top of the file. The index is an array of
+  the offsets of vm records sorted by name. 'hash' is of the rest of the
+  file after the header.
+ */
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nsources;
+	uint32_t nvms;
+	uint32_t pad;
+	uint64_t size;
+	uint64_t hash;
+	uint64_t sources;
+	uint64_t globals;
+	uint64_t vms;
+	uint64_t index;
+};
+
+enum source_type { SOURCE_FILE, SOURCE_DIR, SOURCE_MISSING };
+
+/*
+  File or directory that the configuration is made from.
+  The snapshot is stale if any of them is changed. SOURCE_MISSING is a
+  file that didn't exist, the snapshot is stale if it's created.
+ */
+struct config_source {
+	char *path;
+	enum source_type type;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+};
+
+static struct config_source *sources = NULL;
+static size_t nsources = 0, sources_size = 0;
+
+static char *snapshot_path = NULL;
+static bool snapshot_writable = false;
+
+/*
+  Growing buffer to build a snapshot.
+ */
+struct snap_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+	bool error;
+};
+
+/*
+  Cursor to read a mapped snapshot. 'error' is set on any overrun.
+ */
+struct snap_reader {
+	const char *p;
+	const char *end;
+	bool error;
+};
+
+#define FIELD(p, off, type) ((type *)((char *)(p) + (off)))
+
+static const size_t vm_strings[] = {
+	offsetof(struct vm_conf, keymap),
+	offsetof(struct vm_conf, backend),
+	offsetof(struct vm_conf, debug_port),
+	offsetof(struct vm_conf, ncpu),
+	offsetof(struct vm_conf, memory),
+	offsetof(struct vm_conf, comport),
+	offsetof(struct vm_conf, loader),
+	offsetof(struct vm_conf, loadcmd),
+	offsetof(struct vm_conf, installcmd),
+	offsetof(struct vm_conf, err_logfile),
+	offsetof(struct vm_conf, grub_run_partition),
+	offsetof(struct vm_conf, bhyveload_loader),
+};
+
+static const size_t vm_ints[] = {
+	offsetof(struct vm_conf, boot_delay),
+	offsetof(struct vm_conf, boot_priority),
+	offsetof(struct vm_conf, loader_timeout),
+	offsetof(struct vm_conf, stop_timeout),
+};
+
+static const size_t vm_bools[] = {
+	offsetof(struct vm_conf, mouse),
+	offsetof(struct vm_conf, wired_memory),
+	offsetof(struct vm_conf, utctime),
+	offsetof(struct vm_conf, reboot_on_change),
+	offsetof(struct vm_conf, ready_signal),
+	offsetof(struct vm_conf, single_user),
+	offsetof(struct vm_conf, install),
+};
+
+static const size_t fbuf_strings[] = {
+	offsetof(struct fbuf, ipaddr),
+	offsetof(struct fbuf, vgaconf),
+	offsetof(struct fbuf, password),
+};
+
+static const size_t fbuf_ints[] = {
+	offsetof(struct fbuf, enable),
+	offsetof(struct fbuf, port),
+	offsetof(struct fbuf, width),
+	offsetof(struct fbuf, height),
+	offsetof(struct fbuf, wait),
+};
+
+static const size_t gc_strings[] = {
+	offsetof(struct global_conf, config_file),
+	offsetof(struct global_conf, plugin_dir),
+	offsetof(struct global_conf, vars_dir),
+	offsetof(struct global_conf, pid_path),
+	offsetof(struct global_conf, cmd_sock_path),
+	offsetof(struct global_conf, unix_domain_socket_mode),
+};
+
+static const size_t gc_ints[] = {
+	offsetof(struct global_conf, nmdm_offset),
+	offsetof(struct global_conf, boot_concurrency),
+	offsetof(struct global_conf, boot_rate),
+	offsetof(struct global_conf, foreground),
+};
+
+/*
+  Set the path of the snapshot, NULL for the default.
+  Only the writer saves the snapshot after loading the config files.
+ */
+void
+set_config_snapshot(const char *path, bool writable)
+{
+	free(snapshot_path);
+	snapshot_path = path ? strdup(path) : NULL;
+	snapshot_writable = writable;
+}
+
+static const char *
+get_snapshot_path(void)
+{
+	static char path[PATH_MAX];
+
+	if (snapshot_path != NULL)
+		return snapshot_path;
+	snprintf(path, sizeof(path), "%s/%s", gl_conf->vars_dir,
+	    CONFIG_SNAPSHOT_FILE);
+	return path;
+}
+
+void
+clear_config_sources(void)
+{
+	size_t i;
+
+	for (i = 0; i < nsources; i++)
+		free(sources[i].path);
+	nsources = 0;
+}
+
+static struct config_source *
+new_config_source(const char *path)
+{
+	size_t sz;
+	struct config_source *s;
+
+	if (nsources >= sources_size) {
+		sz = sources_size ? sources_size * 2 : 16;
+		if ((s = realloc(sources, sz * sizeof(*s))) == NULL)
+			return NULL;
+		sources = s;
+		sources_size = sz;
+	}
+	s = &sources[nsources];
+	memset(s, 0, sizeof(*s));
+	if ((s->path = strdup(path)) == NULL)
+		return NULL;
+	nsources++;
+	return s;
+}
+
+/*
+  Record a file of the configuration with 'st' taken before reading it.
+ */
+int
+add_config_source(const char *path, const struct stat *st)
+{
+	struct config_source *s;
+
+	if ((s = new_config_source(path)) == NULL)
+		return -1;
+	s->type = S_ISDIR(st->st_mode) ? SOURCE_DIR : SOURCE_FILE;
+	s->dev = st->st_dev;
+	s->ino = st->st_ino;
+	s->size = st->st_size;
+	s->mtime = st->st_mtim;
+	s->ctime = st->st_ctim;
+	return 0;
+}
+
+/*
+  Record a file that doesn't exist.
+ */
+int
+add_config_source_missing(const char *path)
+{
+	struct config_source *s;
+
+	if ((s = new_config_source(path)) == NULL)
+		return -1;
+	s->type = SOURCE_MISSING;
+	return 0;
+}
+
+/*
+  Record a directory globbed by .include macro.
+ */
+int
+add_config_source_dir(const char *path, dev_t dev, ino_t ino,
+    const struct timespec *mtime)
+{
+	struct config_source *s;
+
+	if ((s = new_config_source(path)) == NULL)
+		return -1;
+	s->type = SOURCE_DIR;
+	s->dev = dev;
+	s->ino = ino;
+	s->mtime = *mtime;
+	return 0;
+}
+
+static void
+put(struct snap_buf *b, const void *p, size_t len)
+{
+	size_t sz;
+	char *n;
+
+	if (b->error)
+		return;
+	if (b->len + len > b->size) {
+		sz = MAX(MAX(b->size * 2, b->len + len), 4096);
+		if ((n = realloc(b->buf, sz)) == NULL) {
+			b->error = true;
+			return;
+		}
+		b->buf = n;
+		b->size = sz;
+	}
+	memcpy(b->buf + b->len, p, len);
+	b->len += len;
+}
+
+static void
+put_u32(struct snap_buf *b, uint32_t v)
+{
+	put(b, &v, sizeof(v));
+}
+
+static void
+put_u64(struct snap_buf *b, uint64_t v)
+{
+	put(b, &v, sizeof(v));
+}
+
+static void
+put_str(struct snap_buf *b, const char *s)
+{
+	uint32_t len = s ? strlen(s) : NO_STRING;
+
+	put_u32(b, len);
+	if (s != NULL)
+		put(b, s, len + 1);
+}
+
+static void
+put_timespec(struct snap_buf *b, const struct timespec *ts)
+{
+	put_u64(b, ts->tv_sec);
+	put_u64(b, ts->tv_nsec);
+}
+
+static const void *
+get(struct snap_reader *r, size_t len)
+{
+	const char *p = r->p;
+
+	if (r->error || (size_t)(r->end - r->p) < len) {
+		r->error = true;
+		return NULL;
+	}
+	r->p += len;
+	return p;
+}
+
+static uint32_t
+get_u32(struct snap_reader *r)
+{
+	uint32_t v = 0;
+	const void *p;
+
+	if ((p = get(r, sizeof(v))) != NULL)
+		memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t
+get_u64(struct snap_reader *r)
+{
+	uint64_t v = 0;
+	const void *p;
+
+	if ((p = get(r, sizeof(v))) != NULL)
+		memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+  Returns the string in the mapped snapshot. NULL is also a valid value,
+  check 'r->error'.
+ */
+static const char *
+get_str(struct snap_reader *r)
+{
+	uint32_t len = get_u32(r);
+	const char *s;
+
+	if (r->error || len == NO_STRING)
+		return NULL;
+	if ((s = get(r, (size_t)len + 1)) == NULL || s[len] != '\0') {
+		r->error = true;
+		return NULL;
+	}
+	return s;
+}
+
+static void
+get_timespec(struct snap_reader *r, struct timespec *ts)
+{
+	ts->tv_sec = get_u64(r);
+	ts->tv_nsec = get_u64(r);
+}
+
+static int
+count_var(const char *key __unused, const char *val __unused, void *data)
+{
+	(*(uint32_t *)data)++;
+	return 0;
+}
+
+static int
+put_var(const char *key, const char *val, void *data)
+{
+	put_str(data, key);
+	put_str(data, val);
+	return 0;
+}
+
+static void
+put_vartree(struct snap_buf *b, struct vartree *vars)
+{
+	uint32_t n = 0;
+
+	walk_vartree(vars, count_var, &n);
+	put_u32(b, n);
+	walk_vartree(vars, put_var, b);
+}
+
+static int
+get_vartree(struct snap_reader *r, struct vartree *vars)
+{
+	uint32_t i, n = get_u32(r);
+	const char *k, *v;
+
+	for (i = 0; i < n && ! r->error; i++) {
+		k = get_str(r);
+		v = get_str(r);
+		if (r->error || set_var0(vars, k, v) < 0)
+			return -1;
+	}
+	return r->error ? -1 : 0;
+}
+
+static void
+put_plugin_data(struct snap_buf *b, struct plugin_data_head *head)
+{
+	uint32_t n = 0;
+	struct plugin_data *pld;
+	void *p;
+	size_t len;
+
+	SLIST_FOREACH (pld, head, next)
+		n++;
+	put_u32(b, n);
+	SLIST_FOREACH (pld, head, next) {
+		put_str(b, pld->ent->desc.name);
+		if ((p = nvlist_pack(pld->pl_conf, &len)) == NULL) {
+			b->error = true;
+			return;
+		}
+		put_u64(b, len);
+		put(b, p, len);
+		free(p);
+	}
+}
+
+static int
+get_plugin_data(struct snap_reader *r, struct plugin_data_head *head)
+{
+	uint32_t i, n = get_u32(r);
+	uint64_t len;
+	const char *name;
+	const void *p;
+	struct plugin_data *pld;
+	nvlist_t *nvl;
+
+	for (i = 0; i < n && ! r->error; i++) {
+		name = get_str(r);
+		len = get_u64(r);
+		if ((p = get(r, len)) == NULL || name == NULL)
+			return -1;
+		/* The plugin may not be loaded in this process. */
+		SLIST_FOREACH (pld, head, next)
+			if (strcmp(pld->ent->desc.name, name) == 0)
+				break;
+		if (pld == NULL)
+			continue;
+		if ((nvl = nvlist_unpack(p, len, 0)) == NULL)
+			return -1;
+		nvlist_destroy(pld->pl_conf);
+		pld->pl_conf = nvl;
+	}
+	return r->error ? -1 : 0;
+}
+
+static void
+put_vm(struct snap_buf *b, struct vm_conf_entry *conf_ent)
+{
+	struct vm_conf *conf = &conf_ent->conf;
+	const size_t *off;
+	uint32_t n;
+	struct disk_conf *dc;
+	struct iso_conf *ic;
+	struct net_conf *nc;
+	struct passthru_conf *pc;
+	struct depend_conf *de;
+	struct bhyveload_env *be;
+	struct bhyve_env *ev;
+
+	put_str(b, conf->name);
+	put_str(b, get_var0(conf->vars.local, "ID"));
+	put_u64(b, conf->owner);
+	put_u64(b, conf->group);
+	put_u32(b, conf->boot);
+	put_u32(b, conf->hostbridge);
+	ARRAY_FOREACH (off, vm_strings)
+		put_str(b, *FIELD(conf, *off, char *));
+	ARRAY_FOREACH (off, vm_ints)
+		put_u32(b, *FIELD(conf, *off, int));
+	ARRAY_FOREACH (off, vm_bools)
+		put_u32(b, *FIELD(conf, *off, bool));
+	ARRAY_FOREACH (off, fbuf_strings)
+		put_str(b, *FIELD(conf->fbuf, *off, char *));
+	ARRAY_FOREACH (off, fbuf_ints)
+		put_u32(b, *FIELD(conf->fbuf, *off, int));
+
+#define PUT_LIST(head, var, ...)                 \
+	n = 0;                                   \
+	STAILQ_FOREACH (var, head, next)         \
+		n++;                             \
+	put_u32(b, n);                           \
+	STAILQ_FOREACH (var, head, next) {       \
+		__VA_ARGS__;                     \
+	}
+
+	PUT_LIST(&conf->disks, dc, put_str(b, dc->type); put_str(b, dc->path));
+	PUT_LIST(&conf->isoes, ic, put_str(b, ic->type); put_str(b, ic->path));
+	PUT_LIST(&conf->nets, nc, put_str(b, nc->type); put_str(b, nc->bridge));
+	PUT_LIST(&conf->passthrues, pc, put_str(b, pc->devid));
+	PUT_LIST(&conf->depends, de, put_str(b, de->name));
+	PUT_LIST(&conf->bhyveload_envs, be, put_str(b, be->env));
+	PUT_LIST(&conf->bhyve_envs, ev, put_str(b, ev->env));
+#undef PUT_LIST
+
+	put_vartree(b, conf->vars.local);
+	put_plugin_data(b, &conf_ent->pl_data);
+}
+
+static int
+get_string_field(struct snap_reader *r, char **field)
+{
+	const char *s = get_str(r);
+
+	if (r->error)
+		return -1;
+	if (s == NULL) {
+		free(*field);
+		*field = NULL;
+		return 0;
+	}
+	return set_string(field, s);
+}
+
+/*
+  Build a vm_conf_entry from the record at 'r'.
+ */
+static struct vm_conf_entry *
+get_vm(struct snap_reader *r, struct vartree *gv)
+{
+	struct vm_conf *conf;
+	struct vm_conf_entry *conf_ent = NULL;
+	struct plugin_data_head head;
+	const size_t *off;
+	const char *name, *id, *s, *t;
+	uint32_t i, n;
+
+	name = get_str(r);
+	id = get_str(r);
+	if (r->error || name == NULL)
+		return NULL;
+	/* Keep the same $ID as the daemon. */
+	if (id != NULL && register_id(name, strtoul(id, NULL, 10)) < 0)
+		return NULL;
+	if (create_plugin_data(&head) < 0)
+		return NULL;
+	if ((conf = create_vm_conf(name)) == NULL) {
+		free_plugin_data(&head);
+		return NULL;
+	}
+	if ((conf_ent = realloc(conf, sizeof(*conf_ent))) == NULL) {
+		free_plugin_data(&head);
+		free_vm_conf(conf);
+		return NULL;
+	}
+	conf_ent->pl_data = head;
+	conf = &conf_ent->conf;
+	conf->vars.global = gv;
+	/* The empty lists point to the old address. */
+	STAILQ_INIT(&conf->disks);
+	STAILQ_INIT(&conf->isoes);
+	STAILQ_INIT(&conf->nets);
+	STAILQ_INIT(&conf->passthrues);
+	STAILQ_INIT(&conf->depends);
+	STAILQ_INIT(&conf->bhyveload_envs);
+	STAILQ_INIT(&conf->bhyve_envs);
+
+	conf->owner = get_u64(r);
+	conf->group = get_u64(r);
+	conf->boot = get_u32(r);
+	conf->hostbridge = get_u32(r);
+	ARRAY_FOREACH (off, vm_strings)
+		if (get_string_field(r, FIELD(conf, *off, char *)) < 0)
+			goto err;
+	ARRAY_FOREACH (off, vm_ints)
+		*FIELD(conf, *off, int) = get_u32(r);
+	ARRAY_FOREACH (off, vm_bools)
+		*FIELD(conf, *off, bool) = get_u32(r);
+	ARRAY_FOREACH (off, fbuf_strings)
+		if (get_string_field(r, FIELD(conf->fbuf, *off, char *)) < 0)
+			goto err;
+	ARRAY_FOREACH (off, fbuf_ints)
+		*FIELD(conf->fbuf, *off, int) = get_u32(r);
+
+#define GET_PAIRS(add)                                            \
+	n = get_u32(r);                                           \
+	for (i = 0; i < n; i++) {                                 \
+		s = get_str(r);                                   \
+		t = get_str(r);                                   \
+		if (r->error || s == NULL || t == NULL || (add) < 0) \
+			goto err;                                 \
+	}
+#define GET_LIST(add)                                             \
+	n = get_u32(r);                                           \
+	for (i = 0; i < n; i++) {                                 \
+		s = get_str(r);                                   \
+		if (r->error || s == NULL || (add) < 0)           \
+			goto err;                                 \
+	}
+
+	GET_PAIRS(add_disk_conf(conf, s, t));
+	GET_PAIRS(add_iso_conf(conf, s, t));
+	GET_PAIRS(add_net_conf(conf, s, t));
+	GET_LIST(add_passthru_conf(conf, s));
+	GET_LIST(add_depend_conf(conf, s));
+	GET_LIST(add_bhyveload_env(conf, s));
+	GET_LIST(add_bhyve_env(conf, s));
+#undef GET_LIST
+#undef GET_PAIRS
+
+	if (get_vartree(r, conf->vars.local) < 0 ||
+	    get_plugin_data(r, &conf_ent->pl_data) < 0 || r->error ||
+	    finalize_vm_conf(conf) < 0)
+		goto err;
+	hash_plugin_data(conf_ent);
+	return conf_ent;
+err:
+	free_vm_conf_entry(conf_ent);
+	return NULL;
+}
+
+struct vm_order {
+	const char *name;
+	uint64_t offset;
+};
+
+static int
+compare_vm_order(const void *a, const void *b)
+{
+	return strcmp(((const struct vm_order *)a)->name,
+	    ((const struct vm_order *)b)->name);
+}
+
+static int
+write_snapshot_file(const char *path, const void *buf, size_t len)
+{
+	int fd;
+	ssize_t n;
+	size_t done = 0;
+	char *tmp;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+		return -1;
+	if ((fd = mkstemp(tmp)) < 0) {
+		free(tmp);
+		return -1;
+	}
+	while (done < len) {
+		if ((n = write(fd, (const char *)buf + done, len - done)) < 0) {
+			if (errno == EINTR)
+				continue;
+			goto err;
+		}
+		done += n;
+	}
+	if (fchmod(fd, 0600) < 0 || close(fd) < 0) {
+		fd = -1;
+		goto err;
+	}
+	/* Readers see either the old or the new one. */
+	if (rename(tmp, path) < 0) {
+		fd = -1;
+		goto err;
+	}
+	free(tmp);
+	return 0;
+err:
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+	free(tmp);
+	return -1;
+}
+
+/*
+  Write the loaded configuration to the snapshot file.
+  'gc' is the global configuration in the config files.
+ */
+int
+save_config_snapshot(const char *config_file, struct vm_conf_head *list,
+    struct global_conf *gc, struct vartree *gv)
+{
+	struct snap_buf b = { NULL, 0, 0, false };
+	struct snapshot_header h;
+	struct vm_conf_entry *conf_ent;
+	struct vm_order *order = NULL;
+	const size_t *off;
+	size_t i;
+	uint32_t nvms = 0;
+	int rc = -1;
+
+	if (! snapshot_writable)
+		return 0;
+
+	memset(&h, 0, sizeof(h));
+	put(&b, &h, sizeof(h));
+
+	h.sources = b.len;
+	put_str(&b, config_file);
+	for (i = 0; i < nsources; i++) {
+		put_str(&b, sources[i].path);
+		put_u32(&b, sources[i].type);
+		put_u64(&b, sources[i].dev);
+		put_u64(&b, sources[i].ino);
+		put_u64(&b, sources[i].size);
+		put_timespec(&b, &sources[i].mtime);
+		put_timespec(&b, &sources[i].ctime);
+	}
+
+	h.globals = b.len;
+	ARRAY_FOREACH (off, gc_strings)
+		put_str(&b, *FIELD(gc, *off, char *));
+	ARRAY_FOREACH (off, gc_ints)
+		put_u32(&b, *FIELD(gc, *off, int));
+	put_vartree(&b, gv);
+
+	h.vms = b.len;
+	LIST_FOREACH (conf_ent, list, next)
+		nvms++;
+	if (nvms > 0 && (order = calloc(nvms, sizeof(*order))) == NULL)
+		goto ret;
+	i = 0;
+	LIST_FOREACH (conf_ent, list, next) {
+		order[i].name = conf_ent->conf.name;
+		order[i++].offset = b.len;
+		put_vm(&b, conf_ent);
+	}
+
+	qsort(order, nvms, sizeof(*order), compare_vm_order);
+	h.index = b.len;
+	for (i = 0; i < nvms; i++)
+		put_u64(&b, order[i].offset);
+	if (b.error)
+		goto ret;
+
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = CONFIG_SNAPSHOT_VERSION;
+	h.nsources = nsources;
+	h.nvms = nvms;
+	h.size = b.len;
+	h.hash = hash_bytes(HASH_INIT, b.buf + sizeof(h), b.len - sizeof(h));
+	memcpy(b.buf, &h, sizeof(h));
+
+	if ((rc = write_snapshot_file(get_snapshot_path(), b.buf, b.len)) < 0)
+		WARN("failed to write config snapshot %s (%s)\n",
+		    get_snapshot_path(), strerror(errno));
+ret:
+	free(order);
+	free(b.buf);
+	return rc;
+}
+
+static bool
+timespec_equal(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/*
+  Returns true if all of the source files are unchanged.
+ */
+static bool
+is_snapshot_fresh(struct snap_reader *r, uint32_t n, const char *config_file)
+{
+	uint32_t i;
+	const char *path, *fn;
+	struct stat st;
+	struct config_source s;
+
+	/* The snapshot is of the other config file. */
+	fn = get_str(r);
+	if (r->error || fn == NULL || strcmp(fn, config_file) != 0)
+		return false;
+
+	for (i = 0; i < n; i++) {
+		path = get_str(r);
+		s.type = get_u32(r);
+		s.dev = get_u64(r);
+		s.ino = get_u64(r);
+		s.size = get_u64(r);
+		get_timespec(r, &s.mtime);
+		get_timespec(r, &s.ctime);
+		if (s.type == SOURCE_MISSING) {
+			if (r->error || path == NULL || stat(path, &st) == 0)
+				return false;
+			continue;
+		}
+		if (r->error || path == NULL || stat(path, &st) < 0 ||
+		    st.st_dev != s.dev || st.st_ino != s.ino ||
+		    ! timespec_equal(&st.st_mtim, &s.mtime))
+			return false;
+		if (s.type == SOURCE_FILE &&
+		    (st.st_size != s.size || ! timespec_equal(&st.st_ctim, &s.ctime)))
+			return false;
+	}
+	return true;
+}
+
+/*
+  Map the snapshot. Returns NULL if it doesn't exist, is broken or is
+  older than any of the config files.
+ */
+struct config_snapshot *
+open_config_snapshot(const char *config_file)
+{
+	int fd;
+	struct stat st;
+	struct snapshot_header h;
+	struct config_snapshot *snap = NULL;
+	struct snap_reader r;
+	void *p;
+
+	if ((fd = open(get_snapshot_path(), O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || ! S_ISREG(st.st_mode) ||
+	    (size_t)st.st_size < sizeof(h) ||
+	    (p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+		MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	memcpy(&h, p, sizeof(h));
+	if (memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0 ||
+	    h.version != CONFIG_SNAPSHOT_VERSION ||
+	    h.size != (uint64_t)st.st_size || h.sources > h.size ||
+	    h.globals > h.size || h.vms > h.size || h.index > h.size ||
+	    (h.size - h.index) / sizeof(uint64_t) < h.nvms ||
+	    hash_bytes(HASH_INIT, (char *)p + sizeof(h), h.size - sizeof(h)) !=
+		h.hash)
+		goto err;
+
+	r.p = (char *)p + h.sources;
+	r.end = (char *)p + h.size;
+	r.error = false;
+	if (! is_snapshot_fresh(&r, h.nsources, config_file))
+		goto err;
+
+	if ((snap = malloc(sizeof(*snap))) == NULL)
+		goto err;
+	snap->base = p;
+	snap->size = h.size;
+	snap->hash = h.hash;
+	snap->nvms = h.nvms;
+	snap->globals = h.globals;
+	snap->vms = h.vms;
+	snap->index = h.index;
+	return snap;
+err:
+	munmap(p, st.st_size);
+	return NULL;
+}
+
+void
+close_config_snapshot(struct config_snapshot *snap)
+{
+	if (snap == NULL)
+		return;
+	munmap((void *)snap->base, snap->size);
+	free(snap);
+}
+
+static void
+init_reader(struct config_snapshot *snap, struct snap_reader *r,
+    uint64_t offset)
+{
+	r->p = snap->base + offset;
+	r->end = snap->base + snap->size;
+	r->error = offset > snap->size;
+}
+
+/*
+  Get the global configuration and variables.
+ */
+int
+snapshot_get_globals(struct config_snapshot *snap, struct global_conf **gcp,
+    struct vartree **gvp)
+{
+	struct snap_reader r;
+	struct global_conf *gc;
+	struct vartree *gv;
+	const size_t *off;
+
+	gc = calloc(1, sizeof(*gc));
+	gv = create_vartree();
+	if (gc == NULL || gv == NULL) {
+		free(gc);
+		free_vartree(gv);
+		return -1;
+	}
+
+	init_reader(snap, &r, snap->globals);
+	ARRAY_FOREACH (off, gc_strings)
+		if (get_string_field(&r, FIELD(gc, *off, char *)) < 0)
+			goto err;
+	ARRAY_FOREACH (off, gc_ints)
+		*FIELD(gc, *off, int) = get_u32(&r);
+	if (get_vartree(&r, gv) < 0)
+		goto err;
+
+	*gcp = gc;
+	*gvp = gv;
+	return 0;
+err:
+	free_global_conf(gc);
+	free_vartree(gv);
+	return -1;
+}
+
+static uint64_t
+get_vm_offset(struct config_snapshot *snap, uint32_t i)
+{
+	uint64_t v;
+
+	memcpy(&v, snap->base + snap->index + i * sizeof(v), sizeof(v));
+	return v;
+}
+
+/*
+  Build all vm_confs in the same order as they were saved.
+ */
+int
+snapshot_get_vms(struct config_snapshot *snap, struct vm_conf_head *list,
+    struct vartree *gv)
+{
+	struct snap_reader r;
+	struct vm_conf_entry *conf_ent, *last = NULL;
+	uint32_t i;
+
+	init_reader(snap, &r, snap->vms);
+	for (i = 0; i < snap->nvms; i++) {
+		if ((conf_ent = get_vm(&r, gv)) == NULL)
+			return -1;
+		if (last == NULL)
+			LIST_INSERT_HEAD(list, conf_ent, next);
+		else
+			LIST_INSERT_AFTER(last, conf_ent, next);
+		last = conf_ent;
+	}
+	return 0;
+}
+
+/*
+  Look up the vm by binary search and build only its vm_conf.
+  Returns 1 if found, 0 if not found, -1 on error.
+ */
+int
+snapshot_lookup_vm(struct config_snapshot *snap, const char *name,
+    struct vartree *gv, struct vm_conf_entry **conf_entp)
+{
+	struct snap_reader r;
+	const char *s;
+	uint32_t lo = 0, hi = snap->nvms, mid;
+	int rc;
+
+	*conf_entp = NULL;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		init_reader(snap, &r, get_vm_offset(snap, mid));
+		if ((s = get_str(&r)) == NULL)
+			return -1;
+		if ((rc = strcmp(name, s)) == 0) {
+			init_reader(snap, &r, get_vm_offset(snap, mid));
+			return (*conf_entp = get_vm(&r, gv)) ? 1 : -1;
+		}
+		if (rc < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return 0;
+}
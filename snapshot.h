@@ -0,0 +1,55 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "conf.h"
+
+/*
+  The snapshot is written in the vars directory.
+ */
+#define CONFIG_SNAPSHOT_FILE "config.snap"
+
+/*
+  Bump it if the format is changed.
+ */
+#define CONFIG_SNAPSHOT_VERSION 2
+
+struct vm_conf_head;
+struct vm_conf_entry;
+
+/*
+  Compiled configuration mapped from the snapshot file. 'hash' identifies
+  the content of the file.
+ */
+struct config_snapshot {
+	const char *base;
+	size_t size;
+	uint64_t hash;
+	uint32_t nvms;
+	uint64_t globals;
+	uint64_t vms;
+	uint64_t index;
+};
+
+/* Implemented in snapshot.c */
+void set_config_snapshot(const char *, bool);
+void clear_config_sources(void);
+int add_config_source(const char *, const struct stat *);
+int add_config_source_missing(const char *);
+int add_config_source_dir(const char *, dev_t, ino_t, const struct timespec *);
+int save_config_snapshot(const char *, struct vm_conf_head *,
+    struct global_conf *, struct vartree *);
+struct config_snapshot *open_config_snapshot(const char *);
+void close_config_snapshot(struct config_snapshot *);
+int snapshot_get_globals(struct config_snapshot *, struct global_conf **,
+    struct vartree **);
+int snapshot_get_vms(struct config_snapshot *, struct vm_conf_head *,
+    struct vartree *);
+int snapshot_lookup_vm(struct config_snapshot *, const char *,
+    struct vartree *, struct vm_conf_entry **);
+
+#endif
@@ -0,0 +1,477 @@
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/tree.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bmd.h"
+#include "log.h"
+#include "statetab.h"
+
+/*
+  Initial number of the entries of a shard, doubled when it's full.
+ */
+#define STATE_TABLE_MIN		64
+
+/*
+  Times to retry reading an entry being updated.
+ */
+#define STATE_READ_RETRY	10000
+
+#define TABLE_SIZE(n) \
+	(sizeof(struct state_table_header) + \
+	    (size_t)(n) * sizeof(struct state_table_entry))
+#define TABLE_ENTRY(h, i) \
+	((struct state_table_entry *)((struct state_table_header *)(h) + 1) + \
+	    (i))
+
+/*
+  State table file of an owner. 'slots' is the stack of the free entries.
+ */
+struct state_shard {
+	RB_ENTRY(state_shard) entry;
+	uid_t uid;
+	int fd;
+	size_t size;
+	struct state_table_header *hdr;
+	uint32_t nslots;
+	uint32_t *slots;
+};
+
+static int
+compare_state_shard(struct state_shard *a, struct state_shard *b)
+{
+	return (a->uid < b->uid) ? -1 : (a->uid > b->uid);
+}
+
+RB_HEAD(state_shard_tree, state_shard);
+RB_GENERATE_STATIC(state_shard_tree, state_shard, entry, compare_state_shard);
+
+static struct state_shard_tree shards = RB_INITIALIZER(&shards);
+
+/*
+  The state table is disabled while it's NULL.
+ */
+static char *state_dir = NULL;
+
+static uint64_t nshards = 0, nupdates = 0;
+
+static int
+remove_state_files(const char *dir)
+{
+	DIR *d;
+	struct dirent *e;
+
+	if ((d = opendir(dir)) == NULL)
+		return -1;
+	while ((e = readdir(d)) != NULL)
+		if (strncmp(e->d_name, STATE_TABLE_PREFIX,
+			sizeof(STATE_TABLE_PREFIX) - 1) == 0)
+			unlinkat(dirfd(d), e->d_name, 0);
+	closedir(d);
+	return 0;
+}
+
+/*
+  Start publishing the state table in 'dir'.
+  The files left by the previous bmd are removed.
+ */
+int
+init_state_table(const char *dir)
+{
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+	if (remove_state_files(dir) < 0)
+		return -1;
+	free(state_dir);
+	if ((state_dir = strdup(dir)) == NULL)
+		return -1;
+	return 0;
+}
+
+static void
+free_state_shard(struct state_shard *sh)
+{
+	char path[MAXPATHLEN];
+
+	munmap(sh->hdr, sh->size);
+	close(sh->fd);
+	snprintf(path, sizeof(path), "%s/" STATE_TABLE_PREFIX "%u", state_dir,
+	    (unsigned int)sh->uid);
+	unlink(path);
+	free(sh->slots);
+	free(sh);
+}
+
+void
+free_state_table(void)
+{
+	struct state_shard *sh, *shn;
+
+	if (state_dir == NULL)
+		return;
+	RB_FOREACH_SAFE (sh, state_shard_tree, &shards, shn) {
+		RB_REMOVE(state_shard_tree, &shards, sh);
+		free_state_shard(sh);
+	}
+	nshards = 0;
+	free(state_dir);
+	state_dir = NULL;
+}
+
+/*
+  Extend the file and the free slots of 'sh' to 'n' entries.
+ */
+static int
+grow_state_shard(struct state_shard *sh, uint32_t n)
+{
+	uint32_t i, old = sh->hdr ? atomic_load(&sh->hdr->nentries) : 0;
+	uint32_t *slots;
+	void *p;
+
+	if ((slots = realloc(sh->slots, n * sizeof(*slots))) == NULL)
+		return -1;
+	sh->slots = slots;
+	if (ftruncate(sh->fd, TABLE_SIZE(n)) < 0 ||
+	    (p = mmap(NULL, TABLE_SIZE(n), PROT_READ | PROT_WRITE, MAP_SHARED,
+		 sh->fd, 0)) == MAP_FAILED)
+		return -1;
+	if (sh->hdr != NULL)
+		munmap(sh->hdr, sh->size);
+	sh->hdr = p;
+	sh->size = TABLE_SIZE(n);
+	for (i = n; i > old; i--)
+		sh->slots[sh->nslots++] = i - 1;
+	atomic_store_explicit(&sh->hdr->nentries, n, memory_order_release);
+	return 0;
+}
+
+static struct state_shard *
+get_state_shard(uid_t uid)
+{
+	struct state_shard *sh, key;
+	char path[MAXPATHLEN];
+
+	key.uid = uid;
+	if ((sh = RB_FIND(state_shard_tree, &shards, &key)) != NULL)
+		return sh;
+
+	if ((sh = calloc(1, sizeof(*sh))) == NULL)
+		return NULL;
+	sh->uid = uid;
+	snprintf(path, sizeof(path), "%s/" STATE_TABLE_PREFIX "%u", state_dir,
+	    (unsigned int)uid);
+	if ((sh->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+		 0400)) < 0) {
+		free(sh);
+		return NULL;
+	}
+	if (grow_state_shard(sh, STATE_TABLE_MIN) < 0) {
+		ERR("failed to create state table %s (%s)\n", path,
+		    strerror(errno));
+		close(sh->fd);
+		unlink(path);
+		free(sh->slots);
+		free(sh);
+		return NULL;
+	}
+	sh->hdr->magic = STATE_TABLE_MAGIC;
+	sh->hdr->version = STATE_TABLE_VERSION;
+	sh->hdr->entry_size = sizeof(struct state_table_entry);
+	sh->hdr->pid = getpid();
+	sh->hdr->started = time(NULL);
+	RB_INSERT(state_shard_tree, &shards, sh);
+	nshards++;
+	return sh;
+}
+
+/*
+  Open the state table of 'uid' to read. The files are kept owned by
+  root, bmd passes the descriptor to the owner instead.
+ */
+int
+open_state_shard(uid_t uid)
+{
+	struct state_shard key;
+	char path[MAXPATHLEN];
+
+	key.uid = uid;
+	if (state_dir == NULL ||
+	    RB_FIND(state_shard_tree, &shards, &key) == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/" STATE_TABLE_PREFIX "%u", state_dir,
+	    (unsigned int)uid);
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/*
+  Make the entry odd to tell readers it's being updated.
+ */
+static struct state_table_entry *
+begin_update(struct state_shard *sh, uint32_t i)
+{
+	struct state_table_entry *e = TABLE_ENTRY(sh->hdr, i);
+
+	atomic_store_explicit(&e->version,
+	    atomic_load_explicit(&e->version, memory_order_relaxed) + 1,
+	    memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	return e;
+}
+
+static void
+end_update(struct state_shard *sh, struct state_table_entry *e)
+{
+	atomic_store_explicit(&e->version,
+	    atomic_load_explicit(&e->version, memory_order_relaxed) + 1,
+	    memory_order_release);
+	atomic_fetch_add_explicit(&sh->hdr->generation, 1,
+	    memory_order_release);
+	nupdates++;
+}
+
+static void
+release_state_entry(struct vm_entry *vm_ent)
+{
+	struct state_shard *sh = VM_SHARD(vm_ent);
+	struct state_table_entry *e;
+
+	e = begin_update(sh, VM_SLOT(vm_ent));
+	e->used = 0;
+	end_update(sh, e);
+	sh->slots[sh->nslots++] = VM_SLOT(vm_ent);
+	VM_SHARD(vm_ent) = NULL;
+}
+
+static struct state_table_entry *
+alloc_state_entry(struct vm_entry *vm_ent, uid_t uid)
+{
+	struct state_shard *sh;
+	struct state_table_entry *e;
+
+	if ((sh = get_state_shard(uid)) == NULL ||
+	    (sh->nslots == 0 &&
+		grow_state_shard(sh, atomic_load(&sh->hdr->nentries) * 2) < 0))
+		return NULL;
+	VM_SHARD(vm_ent) = sh;
+	VM_SLOT(vm_ent) = sh->slots[--sh->nslots];
+	e = begin_update(sh, VM_SLOT(vm_ent));
+	memset((char *)e + offsetof(struct state_table_entry, used), 0,
+	    sizeof(*e) - offsetof(struct state_table_entry, used));
+	e->state = -1;
+	e->exit_status = -1;
+	e->created = time(NULL);
+	return e;
+}
+
+/*
+  Update the entry of 'vm_ent' for the event 'type' of enum VM_EVENT.
+  'status' is the exit status of VM_EVENT_EXIT.
+ */
+void
+update_state_table(struct vm_entry *vm_ent, int type, int status)
+{
+	struct vm_conf *conf = VM_CONF(vm_ent);
+	struct state_table_entry *e, old;
+	const char *comport;
+	uid_t uid = (conf->owner < 0) ? 0 : conf->owner;
+	time_t now;
+	bool moved = false;
+
+	if (state_dir == NULL)
+		return;
+
+	if (type == VM_EVENT_REMOVE) {
+		if (VM_SHARD(vm_ent) != NULL)
+			release_state_entry(vm_ent);
+		return;
+	}
+
+	/* the owner is changed by reloading, move it to the new shard */
+	if (VM_SHARD(vm_ent) != NULL && VM_SHARD(vm_ent)->uid != uid) {
+		memcpy(&old, TABLE_ENTRY(VM_SHARD(vm_ent)->hdr,
+				 VM_SLOT(vm_ent)), sizeof(old));
+		release_state_entry(vm_ent);
+		moved = true;
+	}
+
+	if (VM_SHARD(vm_ent) == NULL) {
+		if ((e = alloc_state_entry(vm_ent, uid)) == NULL) {
+			ERR("failed to allocate state table for vm %s\n",
+			    conf->name);
+			return;
+		}
+		if (moved) {
+			e->state = old.state;
+			e->exit_status = old.exit_status;
+			e->nboots = old.nboots;
+			e->created = old.created;
+			e->started = old.started;
+			e->exited = old.exited;
+		}
+	} else
+		e = begin_update(VM_SHARD(vm_ent), VM_SLOT(vm_ent));
+
+	now = time(NULL);
+	if (type == VM_EVENT_EXIT) {
+		e->exit_status = status;
+		e->exited = now;
+	}
+	if (VM_STATE(vm_ent) != e->state &&
+	    (VM_STATE(vm_ent) == LOAD ||
+		(VM_STATE(vm_ent) == RUN && e->state != LOAD))) {
+		e->nboots++;
+		e->started = now;
+	}
+	comport = VM_ASCOMPORT(vm_ent) ? VM_ASCOMPORT(vm_ent) : conf->comport;
+	e->used = 1;
+	e->state = VM_STATE(vm_ent);
+	e->pid = VM_PID(vm_ent);
+	e->owner = conf->owner;
+	e->changed = now;
+	strlcpy(e->name, conf->name, sizeof(e->name));
+	strlcpy(e->comport, comport ? comport : "", sizeof(e->comport));
+	end_update(VM_SHARD(vm_ent), e);
+}
+
+void
+state_table_stats(nvlist_t *nvl)
+{
+	nvlist_t *p;
+
+	p = nvlist_create(0);
+	nvlist_add_number(p, "shards", nshards);
+	nvlist_add_number(p, "updates", nupdates);
+	nvlist_move_nvlist(nvl, "state_table", p);
+}
+
+static int
+map_state_table(struct state_table *t)
+{
+	struct stat st;
+	void *p;
+
+	if (fstat(t->fd, &st) < 0)
+		return -1;
+	if (st.st_size < (off_t)TABLE_SIZE(0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, t->fd, 0)) ==
+	    MAP_FAILED)
+		return -1;
+	if (t->hdr != NULL)
+		munmap(t->hdr, t->size);
+	t->hdr = p;
+	t->size = st.st_size;
+	return 0;
+}
+
+/*
+  Map the state table file 'path' to read.
+ */
+struct state_table *
+open_state_table(const char *path)
+{
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+	return fdopen_state_table(fd);
+}
+
+/*
+  Map the state table opened as 'fd' to read. 'fd' is closed by
+  close_state_table, or on error.
+ */
+struct state_table *
+fdopen_state_table(int fd)
+{
+	struct state_table *t;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	t->fd = fd;
+	if (map_state_table(t) < 0)
+		goto err;
+	if (t->hdr->magic != STATE_TABLE_MAGIC ||
+	    t->hdr->version != STATE_TABLE_VERSION ||
+	    t->hdr->entry_size != sizeof(struct state_table_entry)) {
+		errno = EINVAL;
+		goto err;
+	}
+	return t;
+err:
+	close_state_table(t);
+	return NULL;
+}
+
+void
+close_state_table(struct state_table *t)
+{
+	if (t == NULL)
+		return;
+	if (t->hdr != NULL)
+		munmap(t->hdr, t->size);
+	if (t->fd >= 0)
+		close(t->fd);
+	free(t);
+}
+
+/*
+  Returns the number of the entries, the file is remapped if it's grown.
+ */
+uint32_t
+state_table_size(struct state_table *t)
+{
+	uint32_t n;
+
+	n = atomic_load_explicit(&t->hdr->nentries, memory_order_acquire);
+	if (TABLE_SIZE(n) > t->size)
+		map_state_table(t);
+	if (TABLE_SIZE(n) > t->size)
+		n = (t->size - TABLE_SIZE(0)) /
+		    sizeof(struct state_table_entry);
+	return n;
+}
+
+/*
+  Copy the 'i'th entry to 'ent' without locking.
+  Returns 1 if it's used, 0 if not, or -1 if it's kept being updated.
+ */
+int
+read_state_entry(struct state_table *t, uint32_t i,
+    struct state_table_entry *ent)
+{
+	struct state_table_entry *e = TABLE_ENTRY(t->hdr, i);
+	uint64_t v;
+	int retry;
+
+	for (retry = 0; retry < STATE_READ_RETRY; retry++) {
+		v = atomic_load_explicit(&e->version, memory_order_acquire);
+		if (v & 1)
+			continue;
+		memcpy(ent, e, sizeof(*ent));
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&e->version,
+			memory_order_relaxed) != v)
+			continue;
+		ent->name[sizeof(ent->name) - 1] = '\0';
+		ent->comport[sizeof(ent->comport) - 1] = '\0';
+		return ent->used ? 1 : 0;
+	}
+	return -1;
+}
@@ -0,0 +1,91 @@
+#ifndef _STATETAB_H_
+#define _STATETAB_H_
+
+#include <sys/types.h>
+#include <sys/nv.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+  Directory of the state table files. The table is sharded by the owner
+  of VMs. The files "state.<uid>" are readable only by root, the owner
+  gets a read-only descriptor of its own file by the statetab command.
+ */
+#define STATE_TABLE_DIR "/var/run/bmd"
+#define STATE_TABLE_PREFIX "state."
+
+#define STATE_TABLE_MAGIC 0x53444d42	/* "BMDS" */
+
+/*
+  Bump it if the format is changed.
+ */
+#define STATE_TABLE_VERSION 1
+
+#define STATE_NAME_MAX		64
+#define STATE_COMPORT_MAX	64
+
+/*
+  The state table file starts with this header followed by 'nentries'
+  entries. The file only grows while bmd is running, a reader remaps it
+  if 'nentries' exceeds the mapped ones. 'generation' is bumped after
+  every update of the entries.
+ */
+struct state_table_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entry_size;
+	_Atomic uint32_t nentries;
+	_Atomic uint64_t generation;
+	int64_t pid;
+	int64_t started;
+};
+
+/*
+  VM state. 'version' is odd while the entry is being updated, readers
+  retry if it's odd or changed during reading. 'state' is enum STATE and
+  'exit_status' is a wait(2) status, -1 if not exited yet. The times are
+  seconds since the Epoch.
+ */
+struct state_table_entry {
+	_Atomic uint64_t version;
+	uint32_t used;
+	int32_t state;
+	int32_t pid;
+	int32_t exit_status;
+	int64_t owner;
+	uint64_t nboots;
+	int64_t created;
+	int64_t changed;
+	int64_t started;
+	int64_t exited;
+	char name[STATE_NAME_MAX];
+	char comport[STATE_COMPORT_MAX];
+};
+
+/*
+  State table mapped by readers.
+ */
+struct state_table {
+	int fd;
+	size_t size;
+	struct state_table_header *hdr;
+};
+
+struct vm_entry;
+
+/* Implemented in statetab.c */
+int init_state_table(const char *);
+void free_state_table(void);
+void update_state_table(struct vm_entry *, int, int);
+void state_table_stats(nvlist_t *);
+int open_state_shard(uid_t);
+
+struct state_table *open_state_table(const char *);
+struct state_table *fdopen_state_table(int);
+void close_state_table(struct state_table *);
+uint32_t state_table_size(struct state_table *);
+int read_state_entry(struct state_table *, uint32_t,
+    struct state_table_entry *);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "../bmd.h"
+
+/*
+  Seconds since 's'.
+ */
+static inline double
+elapsed(struct timespec *s)
+{
+	struct timespec e;
+
+	clock_gettime(CLOCK_MONOTONIC, &e);
+	return (e.tv_sec - s->tv_sec) + (e.tv_nsec - s->tv_nsec) / 1e9;
+}
+
+/*
+  Make the temporary directory 'dir' from its template and bmd.conf in it
+  that includes the files in "d". 'prologue' writes the lines before the
+  include if it's not NULL. The global configuration is reset to read it.
+ */
+static inline void
+init_bench_dir(char *dir, void (*prologue)(FILE *))
+{
+	FILE *fp;
+	char fn[128];
+
+	assert(mkdtemp(dir) != NULL);
+	snprintf(fn, sizeof(fn), "%s/d", dir);
+	assert(mkdir(fn, 0755) == 0);
+	snprintf(fn, sizeof(fn), "%s/bmd.conf", dir);
+	assert((fp = fopen(fn, "w")) != NULL);
+	if (prologue != NULL)
+		(*prologue)(fp);
+	fprintf(fp, ".include \"%s/d/*.conf\";\n", dir);
+	fclose(fp);
+
+	init_gl_conf();
+	free(gl_conf->config_file);
+	gl_conf->config_file = strdup(fn);
+}
+
+static inline void
+remove_bench_dir(const char *dir)
+{
+	char cmd[128];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	system(cmd);
+}
+
+#endif
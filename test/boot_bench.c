@@ -0,0 +1,183 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "../bmd.h"
+#include "../boot.h"
+#include "../timer.h"
+#include "bench.h"
+
+#define NVMS		500
+
+/*
+  Simulated loader. It takes LOADER_MSEC if at most LOADER_CAPACITY loaders
+  run at once. More loaders share the capacity and each of them over the
+  capacity costs 1/LOADER_THRASH more by the contention.
+ */
+#define LOADER_MSEC	5
+#define LOADER_CAPACITY	8
+#define LOADER_THRASH	64
+
+struct bench_vm {
+	struct vm vm;
+	struct boot_req *boot;
+};
+
+static struct bench_vm *vms;
+static int nloading, nrunning;
+static int order[NVMS], norder;
+
+static int
+on_loaded(int ident __unused, void *data)
+{
+	struct bench_vm *v = data;
+
+	v->vm.state = RUN;
+	boot_finished(v->boot);
+	nloading--;
+	nrunning++;
+	return 0;
+}
+
+static int
+stub_start(struct vm *vm, nvlist_t *pl_conf __unused)
+{
+	double msec;
+	int n = ++nloading;
+
+	msec = LOADER_MSEC * MAX(1.0, (double)n / LOADER_CAPACITY) *
+	       (1.0 + (double)MAX(n - LOADER_CAPACITY, 0) / LOADER_THRASH);
+	vm->state = LOAD;
+	return add_timer((int64_t)msec, on_loaded, vm);
+}
+
+static int
+stub_nop(struct vm *vm __unused, nvlist_t *pl_conf __unused)
+{
+	return 0;
+}
+
+static struct vm_method stub_method = {
+	"stub", stub_start, stub_nop, stub_nop, stub_nop, NULL
+};
+
+static int
+on_boot(void *data)
+{
+	struct bench_vm *v = data;
+
+	order[norder++] = v - vms;
+	if (stub_method.vm_start(&v->vm, NULL) < 0)
+		return -1;
+	return (v->vm.state == LOAD) ? 1 : 0;
+}
+
+static void
+init_vms(int n)
+{
+	int i;
+
+	norder = nloading = nrunning = 0;
+	for (i = 0; i < n; i++) {
+		memset(&vms[i].vm, 0, sizeof(vms[i].vm));
+		vms[i].vm.state = TERMINATE;
+		vms[i].boot = create_boot_req(&vms[i]);
+		assert(vms[i].boot != NULL);
+	}
+}
+
+static void
+fini_vms(int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		destroy_boot_req(vms[i].boot);
+}
+
+static void
+run_until_running(int n)
+{
+	int64_t msec;
+	struct timespec ts;
+
+	while (nrunning < n) {
+		run_boot_queue();
+		if ((msec = next_timer_expire()) > 0) {
+			ts.tv_sec = msec / 1000;
+			ts.tv_nsec = (msec % 1000) * 1000000;
+			nanosleep(&ts, NULL);
+		}
+		assert(msec >= 0);
+		run_timers();
+	}
+}
+
+/*
+  Boot NVMS VMs and return the time until all of them are running.
+ */
+static double
+bench_boot(int concurrency, int rate)
+{
+	int i;
+	struct timespec s;
+
+	init_vms(NVMS);
+	set_boot_limits(concurrency, rate);
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (i = 0; i < NVMS; i++)
+		enqueue_boot(vms[i].boot, 0);
+	run_until_running(NVMS);
+	fini_vms(NVMS);
+	return elapsed(&s);
+}
+
+static void
+check_order(void)
+{
+	int i;
+	static const int prio[] = { 0, 5, 0, 10, 5 };
+	static const int expect[] = { 3, 1, 4, 0, 2 };
+
+	init_vms(nitems(prio));
+	set_boot_limits(1, 0);
+	for (i = 0; i < (int)nitems(prio); i++)
+		enqueue_boot(vms[i].boot, prio[i]);
+	dequeue_boot(vms[4].boot);
+	enqueue_boot(vms[4].boot, prio[4]);
+	run_boot_queue();
+	assert(norder == 1 && nloading == 1);
+	run_until_running(nitems(prio));
+	for (i = 0; i < (int)nitems(prio); i++)
+		assert(order[i] == expect[i]);
+	fini_vms(nitems(prio));
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i;
+	double t;
+	static const int limits[][2] = {
+		{ 0, 0 }, { 4, 0 }, { 8, 0 }, { 16, 0 }, { 32, 0 }, { 8, 500 }
+	};
+
+	vms = calloc(NVMS, sizeof(struct bench_vm));
+	assert(vms != NULL);
+	set_boot_call_back(on_boot);
+
+	check_order();
+	for (i = 0; i < (int)nitems(limits); i++) {
+		t = bench_boot(limits[i][0], limits[i][1]);
+		printf("boot %d vms: concurrency %d, rate %d/s: %.3f sec\n",
+		       NVMS, limits[i][0], limits[i][1], t);
+	}
+
+	free_boot_queue();
+	free_timers();
+	free(vms);
+	return 0;
+}
@@ -2,6 +2,8 @@
 #include <sys/fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "../conf.h"
@@ -823,6 +825,174 @@ nvarr8(nvlist_t *a, nvlist_t *b)
 		nvlist_destroy((nvlist_t *)da[i]);
 }
 
+static void
+hash0(nvlist_t *a, nvlist_t *b)
+{
+	struct conf_hash ha = CONF_HASH_INIT, hb = CONF_HASH_INIT;
+
+	nvlist_add_number(a, "key0", 10);
+	nvlist_add_string(a, "key1", "val");
+	nvlist_add_string(b, "key1", "val");
+	nvlist_add_number(b, "key0", 10);
+	hash_nvlist(&ha, a);
+	hash_nvlist(&hb, b);
+	assert(conf_hash_equal(&ha, &hb));
+}
+
+static void
+hash1(nvlist_t *a, nvlist_t *b)
+{
+	struct conf_hash ha = CONF_HASH_INIT, hb = CONF_HASH_INIT;
+
+	nvlist_add_number(a, "key0", 10);
+	nvlist_add_number(b, "key0", 11);
+	hash_nvlist(&ha, a);
+	hash_nvlist(&hb, b);
+	assert(! conf_hash_equal(&ha, &hb));
+}
+
+static void
+diff0(nvlist_t *a __unused, nvlist_t *b __unused)
+{
+	struct vm_conf *ca, *cb;
+	const nvlist_t *p;
+	nvlist_t *diff;
+	int type;
+	void *cookie = NULL;
+
+	ca = create_vm_conf("vm0");
+	cb = create_vm_conf("vm0");
+	set_memory_size(ca, "1G");
+	set_memory_size(cb, "2G");
+	add_disk_conf(ca, "virtio-blk", "/dev/null");
+	add_disk_conf(cb, "virtio-blk", "/dev/null");
+	set_loader(ca, "bhyveload");
+	set_loader(cb, "bhyveload");
+	finalize_vm_conf(ca);
+	finalize_vm_conf(cb);
+	assert(! conf_hash_equal(&ca->hash, &cb->hash));
+
+	diff = diff_vm_conf(ca, cb);
+	assert(strcmp(nvlist_next(diff, &type, &cookie), "memory") == 0);
+	assert(nvlist_next(diff, &type, &cookie) == NULL);
+	p = nvlist_get_nvlist(diff, "memory");
+	assert(strcmp(nvlist_get_string(p, "old"), "1G") == 0);
+	assert(strcmp(nvlist_get_string(p, "new"), "2G") == 0);
+	nvlist_destroy(diff);
+
+	set_memory_size(cb, "1G");
+	finalize_vm_conf(cb);
+	assert(conf_hash_equal(&ca->hash, &cb->hash));
+
+	/* applied without restart */
+	set_stop_timeout(cb, 60);
+	finalize_vm_conf(cb);
+	assert(! conf_hash_equal(&ca->hash, &cb->hash));
+	assert(conf_hash_equal(&ca->restart_hash, &cb->restart_hash));
+	set_owner(cb, 1001);
+	set_group(cb, 1001);
+	set_boot(cb, ALWAYS);
+	set_err_logfile(cb, "/var/log/vm0.log");
+	set_reboot_on_change(cb, true);
+	finalize_vm_conf(cb);
+	assert(! conf_hash_equal(&ca->hash, &cb->hash));
+	assert(conf_hash_equal(&ca->restart_hash, &cb->restart_hash));
+
+	/* need to restart */
+	set_loader(cb, "uefi");
+	finalize_vm_conf(cb);
+	assert(! conf_hash_equal(&ca->restart_hash, &cb->restart_hash));
+	set_loader(cb, "bhyveload");
+	finalize_vm_conf(cb);
+	assert(conf_hash_equal(&ca->restart_hash, &cb->restart_hash));
+	set_installcmd(cb, "auto");
+	finalize_vm_conf(cb);
+	assert(! conf_hash_equal(&ca->restart_hash, &cb->restart_hash));
+	free_vm_conf(ca);
+	free_vm_conf(cb);
+}
+
+static int
+cat_var(const char *k, const char *v, void *data)
+{
+	strlcat(data, k, 64);
+	strlcat(data, "=", 64);
+	strlcat(data, v, 64);
+	strlcat(data, " ", 64);
+	return 0;
+}
+
+static void
+var0(nvlist_t *a __unused, nvlist_t *b __unused)
+{
+	struct vartree *ta, *tb;
+	struct variables vars;
+	char buf[64] = "", big[1024];
+
+	ta = create_vartree();
+	tb = create_vartree();
+	vars.global = ta;
+	vars.local = tb;
+	vars.args = NULL;
+	assert(get_var(&vars, "V0") == NULL);
+
+	assert(set_var0(ta, "V0", "global") == 0);
+	assert(strcmp(get_var(&vars, "V0"), "global") == 0);
+	assert(set_var(&vars, "V0", "local") == 0);
+	assert(strcmp(get_var(&vars, "V0"), "local") == 0);
+	assert(strcmp(get_var0(ta, "V0"), "global") == 0);
+	assert(set_var0(tb, "V0", "again") == 0);
+	assert(strcmp(get_var0(tb, "V0"), "again") == 0);
+
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	assert(set_var0(tb, "V1", big) == 0);
+	assert(set_var0(tb, "V2", "small") == 0);
+	assert(strcmp(get_var0(tb, "V1"), big) == 0);
+	assert(strcmp(get_var0(tb, "V2"), "small") == 0);
+
+	/* the order of the assignments doesn't matter */
+	free_vartree(ta);
+	ta = create_vartree();
+	assert(set_var0(ta, "V2", "small") == 0);
+	assert(set_var0(ta, "V1", big) == 0);
+	assert(set_var0(ta, "V0", "again") == 0);
+	assert(hash_vartree(ta) == hash_vartree(tb));
+
+	free_vartree(ta);
+	ta = create_vartree();
+	assert(set_var0(ta, "b", "2") == 0);
+	assert(set_var0(ta, "a", "1") == 0);
+	assert(walk_vartree(ta, cat_var, buf) == 0);
+	assert(strcmp(buf, "a=1 b=2 ") == 0);
+	free_vartree(ta);
+	free_vartree(tb);
+}
+
+static void
+id0(nvlist_t *a __unused, nvlist_t *b __unused)
+{
+	struct vm_conf *c0, *c1, *c2;
+
+	assert(register_id("id0-b", 100) == 0);
+	assert(register_id("id0-b", 100) == 0);
+	assert(register_id("id0-b", 101) < 0);
+	assert(register_id("id0-c", 100) < 0);
+
+	/* new identifiers don't conflict with the registered ones */
+	c0 = create_vm_conf("id0-a");
+	c1 = create_vm_conf("id0-b");
+	c2 = create_vm_conf("id0-a");
+	assert(strcmp(get_var0(c1->vars.local, "ID"), "100") == 0);
+	assert(atoi(get_var0(c0->vars.local, "ID")) > 100);
+	assert(strcmp(get_var0(c0->vars.local, "ID"),
+		   get_var0(c2->vars.local, "ID")) == 0);
+	free_vm_conf(c0);
+	free_vm_conf(c1);
+	free_vm_conf(c2);
+	free_id_list();
+}
+
 typedef void (*test_func)(nvlist_t *, nvlist_t *);
 int
 main(int argc, char *argv[])
@@ -841,6 +1011,7 @@ main(int argc, char *argv[])
 		narr0,narr1,narr2,narr3,narr4,narr5,narr6, narr7, narr8,
 		sarr0, sarr1,sarr2,sarr3,sarr4,sarr5,sarr6, sarr7, sarr8,
 		nvarr0, nvarr1, nvarr2, nvarr3, nvarr4, nvarr5, nvarr6, nvarr7, nvarr8,
+		hash0, hash1, diff0, var0, id0,
 	};
 	for (i = 0; i < sizeof(func_list)/ sizeof(func_list[0]); i++) {
 		a = nvlist_create(0);
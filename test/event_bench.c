@@ -0,0 +1,121 @@
+#include <sys/types.h>
+#include <sys/event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "../bmd.h"
+#include "bench.h"
+
+#define NOWNERS		10000
+#define NEVENTS		4	/* process, timer, stdout and stderr */
+
+static struct event *events;
+
+static void
+init_events(void)
+{
+	int i, j;
+	struct event *ev;
+	static const short filters[NEVENTS] = {
+		EVFILT_PROC, EVFILT_TIMER, EVFILT_READ, EVFILT_READ
+	};
+
+	for (i = 0; i < NOWNERS; i++)
+		for (j = 0; j < NEVENTS; j++) {
+			ev = &events[i * NEVENTS + j];
+			memset(ev, 0, sizeof(*ev));
+			EV_SET(&ev->kev, i * NEVENTS + j, filters[j], EV_ADD,
+			       0, 0, ev);
+			ev->data = &events[i * NEVENTS];
+		}
+}
+
+/*
+  Stop waiting for all owners by scanning one list of all events.
+ */
+static double
+bench_list(void)
+{
+	int i, n = 0;
+	struct event *ev, *evn;
+	struct event_head list = LIST_HEAD_INITIALIZER();
+	struct timespec s;
+
+	init_events();
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (i = 0; i < NOWNERS * NEVENTS; i++)
+		LIST_INSERT_HEAD(&list, &events[i], next);
+	for (i = 0; i < NOWNERS; i++)
+		LIST_FOREACH_SAFE (ev, &list, next, evn)
+			if (ev->data == &events[i * NEVENTS]) {
+				LIST_REMOVE(ev, next);
+				n++;
+			}
+	assert(n == NOWNERS * NEVENTS && LIST_EMPTY(&list));
+	return elapsed(&s);
+}
+
+/*
+  Stop waiting for all owners by looking up the owner index.
+ */
+static double
+bench_index(void)
+{
+	int i, n = 0;
+	struct event *ev, *evn;
+	struct event_head *head;
+	struct timespec s;
+
+	init_events();
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (i = 0; i < NOWNERS * NEVENTS; i++)
+		assert(event_index_add(&events[i]) == 0);
+	for (i = 0; i < NOWNERS; i++) {
+		head = event_index_owner(&events[i * NEVENTS]);
+		assert(head != NULL);
+		LIST_FOREACH_SAFE (ev, head, next, evn) {
+			event_index_remove(ev);
+			n++;
+		}
+	}
+	assert(n == NOWNERS * NEVENTS);
+	return elapsed(&s);
+}
+
+static void
+check_lookup(void)
+{
+	int i;
+
+	init_events();
+	for (i = 0; i < NOWNERS * NEVENTS; i++)
+		assert(event_index_add(&events[i]) == 0);
+	for (i = 0; i < NOWNERS * NEVENTS; i++)
+		assert(event_index_lookup(events[i].kev.ident,
+					  events[i].kev.filter) == &events[i]);
+	assert(event_index_lookup(NOWNERS * NEVENTS, EVFILT_READ) == NULL);
+	for (i = 0; i < NOWNERS * NEVENTS; i++)
+		event_index_remove(&events[i]);
+	assert(event_index_owner(&events[0]) == NULL);
+}
+
+int
+main(int argc, char *argv[])
+{
+	double l, x;
+
+	events = calloc(NOWNERS * NEVENTS, sizeof(struct event));
+	assert(events != NULL);
+
+	check_lookup();
+	l = bench_list();
+	x = bench_index();
+	printf("event %d owners: list %.3f sec, index %.3f sec (x%.1f)\n",
+	       NOWNERS, l, x, l / x);
+
+	free(events);
+	return 0;
+}
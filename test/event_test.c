@@ -0,0 +1,158 @@
+#include <sys/types.h>
+#include <sys/event.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "../bmd.h"
+
+#define NPIPES		(EVENT_BATCH_SIZE + 8)
+
+/*
+  Failed changes of events, deletions carry no udata and are not counted.
+ */
+static int nerrors = 0;
+static struct kevent last_error;
+
+static void
+on_error(struct kevent *kev)
+{
+	if (kev->udata == NULL)
+		return;
+	nerrors++;
+	last_error = *kev;
+}
+
+static struct event *
+read_event(int fd)
+{
+	struct event *ev;
+
+	assert((ev = create_event()) != NULL);
+	memset(ev, 0, sizeof(*ev));
+	EV_SET(&ev->kev, fd, EVFILT_READ, EV_ADD, 0, 0, ev);
+	return ev;
+}
+
+/*
+  More changes than a batch are flushed on the way, all of them are
+  registered and each event is harvested once.
+ */
+static void
+test_batch(void)
+{
+	int i, j, n, p[NPIPES][2];
+	struct event *ev[NPIPES];
+	struct kevent kev[EVENT_BATCH_SIZE];
+	bool seen[NPIPES];
+
+	for (i = 0; i < NPIPES; i++) {
+		assert(pipe(p[i]) == 0);
+		ev[i] = read_event(p[i][0]);
+		event_changes_queue(&ev[i]->kev, 1);
+		assert(write(p[i][1], "x", 1) == 1);
+	}
+
+	memset(seen, 0, sizeof(seen));
+	for (n = 0; n < NPIPES;) {
+		assert((i = harvest_events(kev, nitems(kev), NULL)) > 0);
+		while (--i >= 0) {
+			assert(!(kev[i].flags & EV_ERROR));
+			for (j = 0; ev[j] != kev[i].udata; j++)
+				assert(j < NPIPES - 1);
+			assert((int)kev[i].ident == p[j][0] && !seen[j]);
+			seen[j] = true;
+			/* level triggered, don't see it again */
+			kev[i].flags = EV_DELETE;
+			kev[i].udata = NULL;
+			event_changes_queue(&kev[i], 1);
+			n++;
+		}
+	}
+	assert(event_changes_flush() == 0);
+	assert(nerrors == 0);
+
+	for (i = 0; i < NPIPES; i++) {
+		close(p[i][0]);
+		close(p[i][1]);
+		destroy_event(ev[i]);
+	}
+	printf("event %s: ok\n", __func__);
+}
+
+/*
+  The queued changes of a removed event are not submitted after its fd
+  is closed. The deletion fails silently.
+ */
+static void
+test_drop(void)
+{
+	int p[2];
+	struct event *ev;
+	struct kevent kev;
+
+	assert(pipe(p) == 0);
+	ev = read_event(p[0]);
+	event_changes_queue(&ev->kev, 1);
+	assert(event_changes_flush() == 0);
+
+	kev = ev->kev;
+	kev.flags = EV_DISABLE;
+	event_changes_queue(&kev, 1);
+	kev.flags = EV_ENABLE;
+	event_changes_queue(&kev, 1);
+
+	event_changes_drop(ev);
+	kev.flags = EV_DELETE;
+	kev.udata = NULL;
+	event_changes_queue(&kev, 1);
+	destroy_event(ev);
+	close(p[0]);
+	close(p[1]);
+
+	assert(event_changes_flush() == 0);
+	assert(nerrors == 0);
+	printf("event %s: ok\n", __func__);
+}
+
+/*
+  A registration that fails is reported with its event.
+ */
+static void
+test_error(void)
+{
+	int p[2];
+	struct event *ev;
+
+	assert(pipe(p) == 0);
+	close(p[0]);
+	close(p[1]);
+	ev = read_event(p[0]);
+	event_changes_queue(&ev->kev, 1);
+	assert(event_changes_flush() == 0);
+	assert(nerrors == 1);
+	assert(last_error.udata == ev && last_error.data == EBADF);
+	destroy_event(ev);
+	nerrors = 0;
+	printf("event %s: ok\n", __func__);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int kq;
+
+	assert((kq = kqueue()) >= 0);
+	event_changes_init(kq, on_error);
+
+	test_batch();
+	test_drop();
+	test_error();
+
+	close(kq);
+	free_event_index();
+	return 0;
+}
@@ -0,0 +1,108 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "../bmd.h"
+#include "bench.h"
+
+#define NVMS		5000
+#define VMS_PER_FILE	100
+#define NEXPRS		32
+
+static char dir[] = "/tmp/expr_bench.XXXXXX";
+
+/*
+  The template sets NEXPRS variables by arithmetic expressions.
+  Half of them are constants and the others depend on the VM.
+ */
+static void
+write_template(FILE *fp)
+{
+	int i;
+
+	fprintf(fp, "template calc {\n");
+	for (i = 0; i < NEXPRS; i++)
+		if (i % 2)
+			fprintf(fp, "   $E%d = $(((%d + 3) * 1024 / 4 - %d %% 7));\n",
+			    i, i, i);
+		else
+			fprintf(fp, "   $E%d = $((${ID} * %d + (${ID} %% 13) - "
+				    "-(%d)));\n", i, i + 1, i);
+	fprintf(fp, "   graphics_port = $((5900 + ${ID} %% 1000));\n}\n");
+}
+
+static void
+write_files(int round)
+{
+	int i;
+	FILE *fp = NULL;
+	char fn[128];
+
+	for (i = 0; i < NVMS; i++) {
+		if (i % VMS_PER_FILE == 0) {
+			if (fp != NULL)
+				fclose(fp);
+			snprintf(fn, sizeof(fn), "%s/d/vm%05d.conf", dir, i);
+			assert((fp = fopen(fn, "w")) != NULL);
+			fprintf(fp, "# round %d\n", round);
+		}
+		fprintf(fp, "vm vm%05d {\n   ncpu = 1;\n   memory = 512M;\n"
+			    "   disk = /dev/null;\n   loader = bhyveload;\n"
+			    "   boot = no;\n   .apply calc;\n}\n", i);
+	}
+	if (fp != NULL)
+		fclose(fp);
+}
+
+static void
+free_list(struct vm_conf_head *list)
+{
+	struct vm_conf_entry *e, *en;
+
+	LIST_FOREACH_SAFE (e, list, next, en)
+		free_vm_conf_entry(e);
+	LIST_INIT(list);
+}
+
+static double
+bench_expand(int round)
+{
+	int n = 0;
+	struct timespec s;
+	struct vm_conf_entry *e;
+	struct vm_conf_head list = LIST_HEAD_INITIALIZER();
+
+	write_files(round);
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	assert(load_config_file(&list, false, NULL) == 0);
+	LIST_FOREACH (e, &list, next) {
+		assert(get_var0(e->conf.vars.local, "E1") != NULL);
+		n++;
+	}
+	assert(n == NVMS);
+	free_list(&list);
+	return elapsed(&s);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int round;
+	double t;
+
+	init_bench_dir(dir, write_template);
+
+	for (round = 0; round < 3; round++) {
+		t = bench_expand(round);
+		printf("expand %d exprs in %d vms: %.3f sec (%.2f usec/expr)\n",
+		       NEXPRS + 1, NVMS, t, t * 1e6 / (NVMS * (NEXPRS + 1)));
+	}
+
+	remove_bench_dir(dir);
+	return 0;
+}
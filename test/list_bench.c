@@ -0,0 +1,221 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "../bmd.h"
+#include "../server.h"
+#include "../statetab.h"
+#include "bench.h"
+
+#define NVMS		10000
+#define VMS_PER_FILE	100
+#define ROUNDS		20
+#define LIST_PAGE	100
+
+static char dir[] = "/tmp/list_bench.XXXXXX";
+
+static void
+write_files(int nvms)
+{
+	int i;
+	FILE *fp = NULL;
+	char fn[128];
+
+	for (i = 0; i < nvms; i++) {
+		if (i % VMS_PER_FILE == 0) {
+			if (fp != NULL)
+				fclose(fp);
+			snprintf(fn, sizeof(fn), "%s/d/vm%05d.conf", dir, i);
+			assert((fp = fopen(fn, "w")) != NULL);
+		}
+		fprintf(fp, "vm vm%05d {\n   ncpu = %d;\n   memory = %dM;\n"
+			    "   disk = /dev/null;\n   loader = %s;\n"
+			    "   boot = no;\n}\n", i, i % 4 + 1, (i % 8 + 1) * 256,
+			    (i % 2) ? "uefi" : "bhyveload");
+	}
+	if (fp != NULL)
+		fclose(fp);
+}
+
+/*
+  Send 'req' to the list command as root, returns the size of the
+  response and the unpacked response in 'res' if it's not NULL.
+ */
+static size_t
+request(nvlist_t *req, nvlist_t **res)
+{
+	struct sock_buf sb;
+	size_t size;
+
+	memset(&sb, 0, sizeof(sb));
+	sb.fd = -1;
+	sb.res_fd = -1;
+	assert((sb.buf = nvlist_pack(req, &sb.buf_size)) != NULL);
+	assert(recv_command(&sb) == 0);
+	assert(sb.res_fd == -1);
+	size = sb.res_size;
+	if (res != NULL)
+		assert((*res = nvlist_unpack(sb.res_buf, sb.res_size, 0)) !=
+		    NULL);
+	free(sb.res_buf);
+	free(sb.buf);
+	return size;
+}
+
+static nvlist_t *
+list_request(void)
+{
+	nvlist_t *req = nvlist_create(0);
+
+	nvlist_add_string(req, "command", "list");
+	return req;
+}
+
+/*
+  Time 'req' with and without the response cache.
+ */
+static void
+bench(const char *label, nvlist_t *req)
+{
+	struct timespec s;
+	double miss, hit;
+	size_t size = 0;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (i = 0; i < ROUNDS; i++) {
+		vm_generation++;
+		size = request(req, NULL);
+	}
+	miss = elapsed(&s) / ROUNDS;
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (i = 0; i < ROUNDS; i++)
+		request(req, NULL);
+	hit = elapsed(&s) / ROUNDS;
+	printf("%-24s %9zu bytes, %8.3f msec, cached %8.3f msec\n", label,
+	    size, miss * 1e3, hit * 1e3);
+	nvlist_destroy(req);
+}
+
+/*
+  Walk all VMs by pages of LIST_PAGE following the cursor.
+ */
+static void
+bench_pages(void)
+{
+	struct timespec s;
+	nvlist_t *req, *res, *cursor = NULL;
+	size_t size = 0, n = 0, count;
+	int pages = 0;
+
+	vm_generation++;
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	do {
+		req = list_request();
+		nvlist_add_number(req, "limit", LIST_PAGE);
+		if (cursor != NULL)
+			nvlist_move_nvlist(req, "cursor", cursor);
+		cursor = NULL;
+		size += request(req, &res);
+		nvlist_destroy(req);
+		assert(!nvlist_get_bool(res, "error"));
+		nvlist_get_nvlist_array(res, "vm_list", &count);
+		n += count;
+		pages++;
+		if (nvlist_exists_nvlist(res, "next"))
+			cursor = nvlist_take_nvlist(res, "next");
+		nvlist_destroy(res);
+	} while (cursor != NULL);
+	assert(n == NVMS);
+	printf("pages of %-15d %9zu bytes, %8.3f msec in %d pages\n",
+	    LIST_PAGE, size, elapsed(&s) * 1e3, pages);
+}
+
+/*
+  Read all VMs from the state table without asking bmd.
+ */
+static void
+bench_state_table(const char *stdir)
+{
+	struct timespec s;
+	struct state_table *t;
+	struct state_table_entry e;
+	DIR *d;
+	struct dirent *de;
+	char fn[MAXPATHLEN];
+	size_t size = 0, n = 0;
+	uint32_t i, count;
+
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	assert((d = opendir(stdir)) != NULL);
+	while ((de = readdir(d)) != NULL) {
+		if (strncmp(de->d_name, STATE_TABLE_PREFIX,
+			sizeof(STATE_TABLE_PREFIX) - 1) != 0)
+			continue;
+		snprintf(fn, sizeof(fn), "%s/%s", stdir, de->d_name);
+		assert((t = open_state_table(fn)) != NULL);
+		count = state_table_size(t);
+		for (i = 0; i < count; i++)
+			if (read_state_entry(t, i, &e) == 1)
+				n++;
+		size += t->size;
+		close_state_table(t);
+	}
+	closedir(d);
+	assert(n == NVMS);
+	printf("%-24s %9zu bytes, %8.3f msec\n", "state table", size,
+	    elapsed(&s) * 1e3);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char fn[128];
+	nvlist_t *req;
+	const char *fields[] = { "name", "state" };
+
+	init_bench_dir(dir, NULL);
+	write_files(NVMS);
+	snprintf(fn, sizeof(fn), "%s/st", dir);
+	assert(init_state_table(fn) == 0);
+	assert(reload_virtual_machines() == 0);
+
+	/*
+	  Compare the response size and latency of the whole list with
+	  the filtered, projected and paginated ones.
+	 */
+	bench("full list", list_request());
+
+	req = list_request();
+	nvlist_add_string(req, "name", "vm001*");
+	bench("name vm001*", req);
+
+	req = list_request();
+	nvlist_add_string(req, "loader", "uefi");
+	nvlist_add_string(req, "sort", "memory");
+	nvlist_add_bool(req, "reverse", true);
+	bench("loader uefi by memory", req);
+
+	req = list_request();
+	nvlist_add_string_array(req, "fields", fields, nitems(fields));
+	bench("fields name,state", req);
+
+	req = list_request();
+	nvlist_add_number(req, "limit", LIST_PAGE);
+	bench("first page", req);
+
+	bench_pages();
+
+	snprintf(fn, sizeof(fn), "%s/st", dir);
+	bench_state_table(fn);
+	free_state_table();
+
+	remove_bench_dir(dir);
+	return 0;
+}
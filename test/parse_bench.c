@@ -0,0 +1,82 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "../bmd.h"
+#include "bench.h"
+
+#define NFILES		2000
+
+static char dir[] = "/tmp/parse_bench.XXXXXX";
+
+/*
+  Write the included files. 'round' changes their content to miss the
+  parse cache.
+ */
+static void
+write_files(int round)
+{
+	int i;
+	FILE *fp;
+	char fn[128];
+
+	for (i = 0; i < NFILES; i++) {
+		snprintf(fn, sizeof(fn), "%s/d/vm%04d.conf", dir, i);
+		assert((fp = fopen(fn, "w")) != NULL);
+		fprintf(fp, "# round %d\n", round);
+		fprintf(fp, "vm vm%04d {\n   ncpu = 1;\n   memory = 512M;\n"
+			    "   disk = /dev/null;\n   loader = bhyveload;\n"
+			    "   boot = no;\n}\n", i);
+		fclose(fp);
+	}
+}
+
+static void
+free_list(struct vm_conf_head *list)
+{
+	struct vm_conf_entry *e, *en;
+
+	LIST_FOREACH_SAFE (e, list, next, en)
+		free_vm_conf_entry(e);
+	LIST_INIT(list);
+}
+
+static double
+bench_parse(int nworkers, int round)
+{
+	int n = 0;
+	struct timespec s;
+	struct vm_conf_entry *e;
+	struct vm_conf_head list = LIST_HEAD_INITIALIZER();
+
+	write_files(round);
+	set_parser_workers(nworkers);
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	assert(load_config_file(&list, false, NULL) == 0);
+	LIST_FOREACH (e, &list, next)
+		n++;
+	assert(n == NFILES);
+	free_list(&list);
+	return elapsed(&s);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int n, ncpu, round = 0;
+
+	init_bench_dir(dir, NULL);
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	for (n = 1; n <= MAX(ncpu, 1); n *= 2)
+		printf("parse %d files: %d workers: %.3f sec\n", NFILES, n,
+		       bench_parse(n, round++));
+
+	remove_bench_dir(dir);
+	return 0;
+}
@@ -6,6 +6,7 @@
 #include <assert.h>
 
 #include "../bmd.h"
+#include "../snapshot.h"
 
 void
 test0()
@@ -14,7 +15,7 @@ test0()
 	init_gl_conf();
 	free(gl_conf->config_file);
 	gl_conf->config_file = strdup("./test0.conf");
-	assert(load_config_file(&list, true) == 0);
+	assert(load_config_file(&list, true, NULL) == 0);
 	printf("parser %s: ok\n", __func__);
 }
 
@@ -27,7 +28,7 @@ test1()
 	init_gl_conf();
 	free(gl_conf->config_file);
 	gl_conf->config_file = strdup("./test1.conf");
-	assert(load_config_file(&list, true) == 0);
+	assert(load_config_file(&list, true, NULL) == 0);
 	LIST_FOREACH (e, &list, next) {
 		conf = &e->conf;
 		if (strcmp(conf->name, "test") == 0) {
@@ -37,10 +38,297 @@ test1()
 	printf("parser %s: ok\n", __func__);
 }
 
+void
+test2()
+{
+	struct vm_conf *conf;
+	struct vm_conf_entry *e;
+	struct depend_conf *dc;
+	struct vm_conf_head list = LIST_HEAD_INITIALIZER();
+	init_gl_conf();
+	free(gl_conf->config_file);
+	gl_conf->config_file = strdup("./test2.conf");
+	assert(load_config_file(&list, true, NULL) == 0);
+	LIST_FOREACH (e, &list, next) {
+		conf = &e->conf;
+		if (strcmp(conf->name, "router") == 0) {
+			assert(conf->ready_signal == true);
+			assert(conf->ndepends == 0);
+		}
+		if (strcmp(conf->name, "db") == 0) {
+			assert(conf->ready_signal == false);
+			assert(conf->ndepends == 2);
+			dc = STAILQ_FIRST(&conf->depends);
+			assert(strcmp(dc->name, "router") == 0);
+		}
+	}
+	printf("parser %s: ok\n", __func__);
+}
+
+void
+test3()
+{
+	struct vm_conf_head list = LIST_HEAD_INITIALIZER();
+	init_gl_conf();
+	free(gl_conf->config_file);
+	gl_conf->config_file = strdup("./test3.conf");
+	/* cyclic dependency */
+	assert(load_config_file(&list, true, NULL) < 0);
+	assert(LIST_EMPTY(&list));
+	printf("parser %s: ok\n", __func__);
+}
+
+static void
+write_test4_conf(const char *fn, const char *web_memory)
+{
+	FILE *fp;
+
+	assert((fp = fopen(fn, "w")) != NULL);
+	fprintf(fp, "template common {\n   ncpu = 1;\n   disk = /dev/null;\n"
+		    "   loader = bhyveload;\n}\n");
+	fprintf(fp, "vm router {\n   template = common;\n   memory = 512M;\n}\n");
+	fprintf(fp, "vm web {\n   template = common;\n   memory = %s;\n}\n",
+	    web_memory);
+	fclose(fp);
+}
+
+static struct vm_conf_entry *
+find_conf(struct vm_conf_head *list, const char *name)
+{
+	struct vm_conf_entry *e;
+
+	LIST_FOREACH (e, list, next)
+		if (strcmp(e->conf.name, name) == 0)
+			return e;
+	return NULL;
+}
+
+void
+test4()
+{
+	struct vm_conf_entry *router, *web, *e, *en;
+	struct vm_conf_head list = LIST_HEAD_INITIALIZER();
+	struct vm_conf_head prev = LIST_HEAD_INITIALIZER();
+	const char *fn = "./test4.conf";
+
+	write_test4_conf(fn, "1G");
+	init_gl_conf();
+	free(gl_conf->config_file);
+	gl_conf->config_file = strdup(fn);
+	assert(load_config_file(&prev, true, NULL) == 0);
+	assert((router = find_conf(&prev, "router")) != NULL);
+	assert((web = find_conf(&prev, "web")) != NULL);
+
+	/* nothing is changed, all of vm_confs are reused */
+	assert(load_config_file(&list, false, &prev) == 0);
+	assert(LIST_EMPTY(&prev));
+	assert(find_conf(&list, "router") == router);
+	assert(find_conf(&list, "web") == web);
+	LIST_CONCAT(&prev, &list, vm_conf_entry, next);
+
+	/* only web is rebuilt */
+	write_test4_conf(fn, "2048M");
+	assert(load_config_file(&list, false, &prev) == 0);
+	assert(find_conf(&list, "router") == router);
+	assert((e = find_conf(&list, "web")) != NULL && e != web);
+	assert(strcmp(e->conf.memory, "2048M") == 0);
+	assert(find_conf(&prev, "web") == web);
+
+	LIST_FOREACH_SAFE (e, &prev, next, en)
+		free_vm_conf_entry(e);
+	LIST_FOREACH_SAFE (e, &list, next, en)
+		free_vm_conf_entry(e);
+	unlink(fn);
+	printf("parser %s: ok\n", __func__);
+}
+
+void
+test5()
+{
+	struct vm_conf_entry *e, *en, *s;
+	struct vm_conf_head list = LIST_HEAD_INITIALIZER();
+	struct vm_conf_head snap = LIST_HEAD_INITIALIZER();
+	const char *fn = "./test5.conf", *sn = "./test5.snap";
+
+	write_test4_conf(fn, "1G");
+	init_gl_conf();
+	free(gl_conf->config_file);
+	gl_conf->config_file = strdup(fn);
+	set_config_snapshot(sn, true);
+	assert(load_config_file(&list, false, NULL) == 0);
+
+	/* the same vm_confs are built from the snapshot */
+	set_config_snapshot(sn, false);
+	assert(load_config_file(&snap, false, NULL) == 0);
+	for (e = LIST_FIRST(&list), s = LIST_FIRST(&snap); e && s;
+	     e = LIST_NEXT(e, next), s = LIST_NEXT(s, next))
+		assert(compare_vm_conf(&e->conf, &s->conf) == 0);
+	assert(e == NULL && s == NULL);
+	assert(lookup_config_snapshot("web", &e) == 1);
+	assert(strcmp(e->conf.memory, "1G") == 0);
+	free_vm_conf_entry(e);
+	assert(lookup_config_snapshot("mail", &e) == 0);
+
+	/* the snapshot is stale */
+	write_test4_conf(fn, "2048M");
+	assert(lookup_config_snapshot("web", &e) < 0);
+
+	LIST_FOREACH_SAFE (e, &snap, next, en)
+		free_vm_conf_entry(e);
+	LIST_FOREACH_SAFE (e, &list, next, en)
+		free_vm_conf_entry(e);
+	set_config_snapshot(NULL, false);
+	unlink(fn);
+	unlink(sn);
+	printf("parser %s: ok\n", __func__);
+}
+
+static void
+write_test6_conf(const char *fn, int stop_timeout, const char *memory)
+{
+	FILE *fp;
+
+	assert((fp = fopen(fn, "w")) != NULL);
+	if (memory != NULL)
+		fprintf(fp, "vm web {\n   ncpu = 1;\n   memory = %s;\n"
+			    "   disk = /dev/null;\n   loader = bhyveload;\n"
+			    "   boot = yes;\n   reboot_on_change = yes;\n"
+			    "   stop_timeout = %d;\n}\n", memory, stop_timeout);
+	fclose(fp);
+}
+
+void
+test6()
+{
+	struct vm_entry *vm_ent;
+	struct vm_conf *conf;
+	const char *fn = "./test6.conf";
+
+	write_test6_conf(fn, 30, "1G");
+	init_gl_conf();
+	free(gl_conf->config_file);
+	gl_conf->config_file = strdup(fn);
+	assert(reload_virtual_machines() == 0);
+	assert((vm_ent = lookup_vm_by_name("web")) != NULL);
+	VM_STATE(vm_ent) = RUN;
+
+	/* stop_timeout is applied to the running vm without restart */
+	conf = VM_CONF(vm_ent);
+	write_test6_conf(fn, 120, "1G");
+	assert(reload_virtual_machines() == 0);
+	assert(lookup_vm_by_name("web") == vm_ent);
+	assert(VM_STATE(vm_ent) == RUN);
+	assert(VM_CONF(vm_ent) != conf && VM_CONF(vm_ent)->stop_timeout == 120);
+
+	/* memory needs to restart */
+	VM_STATE(vm_ent) = STOP;
+	write_test6_conf(fn, 120, "2048M");
+	assert(reload_virtual_machines() == 0);
+	assert(VM_STATE(vm_ent) == RESTART);
+	assert(strcmp(VM_CONF(vm_ent)->memory, "2048M") == 0);
+
+	VM_STATE(vm_ent) = TERMINATE;
+	write_test6_conf(fn, 0, NULL);
+	assert(reload_virtual_machines() == 0);
+	assert(lookup_vm_by_name("web") == NULL);
+	unlink(fn);
+	printf("parser %s: ok\n", __func__);
+}
+
+void
+test7()
+{
+	struct vm_conf_entry *e, *en;
+	struct vm_conf_head list = LIST_HEAD_INITIALIZER();
+	const char *fn = "./test7.conf";
+	FILE *fp;
+
+	assert((fp = fopen(fn, "w")) != NULL);
+	fprintf(fp, "template common {\n   ncpu = 1;\n"
+		    "   loader = bhyveload;\n}\n");
+	fprintf(fp, "vm web {\n   template = common;\n   memory = 1G;\n}\n");
+	fprintf(fp, "vm db {\n   template = common;\n   memory = 2G;\n}\n");
+	fprintf(fp, "vm web {\n   template = common;\n   memory = 4G;\n}\n");
+	fclose(fp);
+	init_gl_conf();
+	free(gl_conf->config_file);
+	gl_conf->config_file = strdup(fn);
+
+	/* the second web is ignored, the VMs are in the config order */
+	assert(load_config_file(&list, false, NULL) == 0);
+	assert((e = LIST_FIRST(&list)) != NULL);
+	assert(strcmp(e->conf.name, "web") == 0);
+	assert(strcmp(e->conf.memory, "1G") == 0);
+	assert((e = LIST_NEXT(e, next)) != NULL);
+	assert(strcmp(e->conf.name, "db") == 0);
+	assert(LIST_NEXT(e, next) == NULL);
+
+	LIST_FOREACH_SAFE (e, &list, next, en)
+		free_vm_conf_entry(e);
+	unlink(fn);
+	printf("parser %s: ok\n", __func__);
+}
+
+void
+test8()
+{
+	struct vm_conf_entry *e, *en;
+	struct vm_conf_head list = LIST_HEAD_INITIALIZER();
+	const char *fn = "./test8.conf";
+	nvlist_t *nvl;
+	char name[8], path[32];
+	int i;
+	FILE *fp;
+
+	assert((fp = fopen(fn, "w")) != NULL);
+	fprintf(fp, "template disk(size = 1G) {\n   disk = /dev/md-${size};\n}\n");
+	fprintf(fp, "template common(ncpu = 1) {\n   ncpu = ${ncpu};\n"
+		    "   loader = bhyveload;\n   .apply disk;\n}\n");
+	fprintf(fp, "template port {\n   $PORT = $((5900 + ${ID}));\n"
+		    "   graphics_port = ${PORT};\n}\n");
+	for (i = 0; i < 4; i++)
+		fprintf(fp, "vm vm%d {\n   memory = 512M;\n"
+			    "   .apply common(%d), port;\n}\n", i, i % 2 + 1);
+	fclose(fp);
+	init_gl_conf();
+	free(gl_conf->config_file);
+	gl_conf->config_file = strdup(fn);
+
+	/* the cached templates give the same result as applying them */
+	assert(load_config_file(&list, false, NULL) == 0);
+	for (i = 0; i < 4; i++) {
+		snprintf(name, sizeof(name), "vm%d", i);
+		assert((e = find_conf(&list, name)) != NULL);
+		assert(atoi(e->conf.ncpu) == i % 2 + 1);
+		assert(strcmp(STAILQ_FIRST(&e->conf.disks)->path,
+			   "/dev/md-1G") == 0);
+		snprintf(path, sizeof(path), "%d", e->conf.fbuf->port);
+		assert(strcmp(get_var(&e->conf.vars, "PORT"), path) == 0);
+	}
+	/* common is replayed for the same argument, port refers ${ID} */
+	assert((nvl = nvlist_create(0)) != NULL);
+	parser_stats(nvl);
+	assert(nvlist_get_number(nvl, "apply_hits") == 2);
+	assert(nvlist_get_number(nvl, "apply_misses") == 6);
+	nvlist_destroy(nvl);
+
+	LIST_FOREACH_SAFE (e, &list, next, en)
+		free_vm_conf_entry(e);
+	unlink(fn);
+	printf("parser %s: ok\n", __func__);
+}
+
 int
 main(int argc, char *argv[])
 {
 	test0();
 	test1();
+	test2();
+	test3();
+	test4();
+	test5();
+	test6();
+	test7();
+	test8();
 	return 0;
 }
@@ -0,0 +1,99 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "../bmd.h"
+#include "bench.h"
+
+#define MAXVMS		10000
+#define VMS_PER_FILE	100
+
+extern STAILQ_HEAD(vm_list_t, vm_entry) vm_list;
+
+static char dir[] = "/tmp/reload_bench.XXXXXX";
+
+/*
+  Write 'nvms' VMs to the included files. 'round' changes their content
+  to miss the parse cache.
+ */
+static void
+write_files(int nvms, int round)
+{
+	int i;
+	FILE *fp = NULL;
+	char fn[128];
+
+	snprintf(fn, sizeof(fn), "rm -f %s/d/*.conf", dir);
+	system(fn);
+	for (i = 0; i < nvms; i++) {
+		if (i % VMS_PER_FILE == 0) {
+			if (fp != NULL)
+				fclose(fp);
+			snprintf(fn, sizeof(fn), "%s/d/vm%05d.conf", dir, i);
+			assert((fp = fopen(fn, "w")) != NULL);
+			fprintf(fp, "# round %d\n", round);
+		}
+		fprintf(fp, "vm vm%05d {\n   ncpu = 1;\n   memory = 512M;\n"
+			    "   disk = /dev/null;\n   loader = bhyveload;\n"
+			    "   boot = no;\n}\n", i);
+	}
+	if (fp != NULL)
+		fclose(fp);
+}
+
+static int
+count_vms(void)
+{
+	int n = 0;
+	struct vm_entry *vm_ent;
+
+	STAILQ_FOREACH (vm_ent, &vm_list, next)
+		n++;
+	return n;
+}
+
+static double
+bench_reload(int nvms, int round)
+{
+	struct timespec s;
+
+	write_files(nvms, round);
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	assert(reload_virtual_machines() == 0);
+	assert(count_vms() == nvms);
+	assert(lookup_vm_by_name("vm00000") != NULL);
+	return elapsed(&s);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int n, round = 0;
+	double t0, t1, t2;
+
+	init_bench_dir(dir, NULL);
+
+	/*
+	  Create the VMs, then reload them with changed and unchanged
+	  files. Time per VM should stay flat as the number of VMs grows.
+	 */
+	for (n = MAXVMS / 8; n <= MAXVMS; n *= 2) {
+		t0 = bench_reload(n, round++);
+		t1 = bench_reload(n, round++);
+		t2 = bench_reload(n, round - 1);
+		printf("reload %d vms: create %.3f sec, changed %.3f sec, "
+		       "unchanged %.3f sec (%.2f usec/vm)\n",
+		       n, t0, t1, t2, t1 * 1e6 / n);
+		write_files(0, round);
+		assert(reload_virtual_machines() == 0);
+		assert(count_vms() == 0);
+	}
+
+	remove_bench_dir(dir);
+	return 0;
+}
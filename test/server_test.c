@@ -0,0 +1,562 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "../bmd.h"
+#include "../server.h"
+#include "../statetab.h"
+#include "bench.h"
+
+#define NVMS		20
+#define NUPDATES	100000
+
+static char dir[] = "/tmp/server_test.XXXXXX";
+
+/*
+  The memory sizes repeat and mix the units, the names don't sort as
+  numbers.
+ */
+static void
+write_vms(void)
+{
+	static const char *mem[] = { "512M", "1G", "256M", "1024M", "2G" };
+	FILE *fp;
+	char fn[128];
+	int i;
+
+	snprintf(fn, sizeof(fn), "%s/d/vms.conf", dir);
+	assert((fp = fopen(fn, "w")) != NULL);
+	for (i = 0; i < NVMS; i++)
+		fprintf(fp, "vm vm%d {\n   ncpu = %d;\n   memory = %s;\n"
+			    "   disk = /dev/null;\n   loader = bhyveload;\n"
+			    "   boot = no;\n}\n", i, i % 3 + 1,
+			    mem[i % nitems(mem)]);
+	fclose(fp);
+}
+
+/*
+  Run 'req' as root and return the unpacked response.
+ */
+static nvlist_t *
+request(struct sock_buf *sb, nvlist_t *req)
+{
+	nvlist_t *res;
+
+	assert((sb->buf = nvlist_pack(req, &sb->buf_size)) != NULL);
+	assert(recv_command(sb) == 0);
+	assert((res = nvlist_unpack(sb->res_buf, sb->res_size, 0)) != NULL);
+	free(sb->buf);
+	sb->buf = NULL;
+	nvlist_destroy(req);
+	return res;
+}
+
+static void
+init_sock_buf(struct sock_buf *sb)
+{
+	memset(sb, 0, sizeof(*sb));
+	sb->fd = -1;
+	sb->res_fd = -1;
+}
+
+/*
+  Returns the hits and misses of the response cache.
+ */
+static void
+cache_stats(uint64_t *hits, uint64_t *misses)
+{
+	struct sock_buf sb;
+	nvlist_t *req, *res;
+	const nvlist_t *p;
+
+	init_sock_buf(&sb);
+	req = nvlist_create(0);
+	nvlist_add_string(req, "command", "stats");
+	res = request(&sb, req);
+	free(sb.res_buf);
+	p = nvlist_get_nvlist(res, "res_cache");
+	*hits = nvlist_get_number(p, "hits");
+	*misses = nvlist_get_number(p, "misses");
+	nvlist_destroy(res);
+}
+
+/*
+  Run list as 'uid' and return the packed response of 'size' bytes.
+ */
+static char *
+list_as(uid_t uid, size_t *size)
+{
+	struct sock_buf sb;
+	nvlist_t *req;
+
+	init_sock_buf(&sb);
+	sb.peer.cr_uid = uid;
+	req = nvlist_create(0);
+	nvlist_add_string(req, "command", "list");
+	assert((sb.buf = nvlist_pack(req, &sb.buf_size)) != NULL);
+	nvlist_destroy(req);
+	assert(recv_command(&sb) == 0);
+	free(sb.buf);
+	*size = sb.res_size;
+	return sb.res_buf;
+}
+
+/*
+  The same request of the same user is answered from the cache until a
+  VM is changed.
+ */
+static void
+test_list_cache(void)
+{
+	uint64_t h0, m0, h, m;
+	size_t na, nb;
+	char *a, *b;
+
+	cache_stats(&h0, &m0);
+	a = list_as(0, &na);
+	b = list_as(0, &nb);
+	cache_stats(&h, &m);
+	assert(h == h0 + 1 && m == m0 + 1);
+	assert(na == nb && memcmp(a, b, na) == 0);
+	free(b);
+
+	/* not shared with another user */
+	b = list_as(1001, &nb);
+	cache_stats(&h, &m);
+	assert(h == h0 + 1 && m == m0 + 2);
+	free(b);
+
+	/* dropped when a VM is changed */
+	vm_generation++;
+	b = list_as(0, &nb);
+	cache_stats(&h, &m);
+	assert(h == h0 + 1 && m == m0 + 3);
+	free(a);
+	free(b);
+	printf("server %s: ok\n", __func__);
+}
+
+static nvlist_t *
+list_request(const char *sort, bool reverse)
+{
+	nvlist_t *req = nvlist_create(0);
+
+	nvlist_add_string(req, "command", "list");
+	nvlist_add_string(req, "sort", sort);
+	nvlist_add_bool(req, "reverse", reverse);
+	return req;
+}
+
+/*
+  Collect the names of the VMs by pages of 'limit' following the cursor.
+  Returns the number of the names.
+ */
+static size_t
+list_pages(const char *sort, bool reverse, int limit, char **names)
+{
+	struct sock_buf sb;
+	nvlist_t *req, *res, *cursor = NULL;
+	const nvlist_t *const *list;
+	size_t i, count, n = 0;
+
+	do {
+		init_sock_buf(&sb);
+		req = list_request(sort, reverse);
+		if (limit > 0)
+			nvlist_add_number(req, "limit", limit);
+		if (cursor != NULL)
+			nvlist_move_nvlist(req, "cursor", cursor);
+		cursor = NULL;
+		res = request(&sb, req);
+		free(sb.res_buf);
+		assert(!nvlist_get_bool(res, "error"));
+		assert(nvlist_get_number(res, "total") == NVMS);
+		if (nvlist_exists_nvlist_array(res, "vm_list")) {
+			list = nvlist_get_nvlist_array(res, "vm_list", &count);
+			assert(limit == 0 || count <= (size_t)limit);
+			for (i = 0; i < count; i++)
+				names[n++] = strdup(
+				    nvlist_get_string(list[i], "name"));
+		}
+		if (nvlist_exists_nvlist(res, "next"))
+			cursor = nvlist_take_nvlist(res, "next");
+		nvlist_destroy(res);
+	} while (cursor != NULL);
+	return n;
+}
+
+/*
+  Paging by any sort field returns each VM once in the order of the
+  whole list.
+ */
+static void
+test_list_pages(void)
+{
+	static const char *sorts[] = { "name", "ncpu", "memory" };
+	struct sock_buf sb;
+	nvlist_t *req, *res;
+	char *all[NVMS], *paged[NVMS];
+	size_t i, j;
+	int r, limit;
+
+	for (i = 0; i < nitems(sorts); i++)
+		for (r = 0; r < 2; r++)
+			for (limit = 1; limit <= 7; limit += 3) {
+				assert(list_pages(sorts[i], r, 0, all) ==
+				    NVMS);
+				assert(list_pages(sorts[i], r, limit,
+					   paged) == NVMS);
+				for (j = 0; j < NVMS; j++) {
+					assert(strcmp(all[j], paged[j]) == 0);
+					free(all[j]);
+					free(paged[j]);
+				}
+			}
+
+	/* names are compared as strings */
+	assert(list_pages("name", false, 3, all) == NVMS);
+	assert(strcmp(all[0], "vm0") == 0 && strcmp(all[1], "vm1") == 0 &&
+	    strcmp(all[2], "vm10") == 0);
+	for (j = 0; j < NVMS; j++)
+		free(all[j]);
+
+	/* 1G and 1024M are equal, ties are sorted by name */
+	assert(list_pages("memory", false, 4, all) == NVMS);
+	assert(strcmp(all[0], "vm12") == 0 && strcmp(all[3], "vm7") == 0);
+	assert(strcmp(all[8], "vm1") == 0 && strcmp(all[9], "vm11") == 0 &&
+	    strcmp(all[10], "vm13") == 0);
+	for (j = 0; j < NVMS; j++)
+		free(all[j]);
+
+	init_sock_buf(&sb);
+	req = list_request("name", false);
+	nvlist_add_string(req, "owner", "no-such-user-of-bmd");
+	res = request(&sb, req);
+	free(sb.res_buf);
+	assert(nvlist_get_bool(res, "error"));
+	assert(strcmp(nvlist_get_string(res, "reason"), "unknown owner") ==
+	    0);
+	nvlist_destroy(res);
+	printf("server %s: ok\n", __func__);
+}
+
+static nvlist_t *
+command(const char *cmd, const char *name)
+{
+	nvlist_t *nv = nvlist_create(0);
+
+	nvlist_add_string(nv, "command", cmd);
+	if (name != NULL)
+		nvlist_add_string(nv, "name", name);
+	return nv;
+}
+
+/*
+  The sub-commands run in order and each has its own result. Nested
+  batches and streams are not run.
+ */
+static void
+test_batch(void)
+{
+	struct sock_buf sb;
+	nvlist_t *req, *res, *cmds[5];
+	const nvlist_t *const *results;
+	size_t i, count;
+
+	cmds[0] = command("list", NULL);
+	cmds[1] = command("boot", "no-such-vm");
+	cmds[2] = command("batch", NULL);
+	cmds[3] = command("watch", NULL);
+	cmds[4] = command("no-such-command", NULL);
+	req = command("batch", NULL);
+	nvlist_add_nvlist_array(req, "commands",
+	    (const nvlist_t *const *)cmds, nitems(cmds));
+	init_sock_buf(&sb);
+	res = request(&sb, req);
+	free(sb.res_buf);
+	assert(!nvlist_get_bool(res, "error"));
+	results = nvlist_get_nvlist_array(res, "results", &count);
+	assert(count == nitems(cmds));
+	assert(!nvlist_get_bool(results[0], "error"));
+	assert(nvlist_get_number(results[0], "total") == NVMS);
+	assert(strcmp(nvlist_get_string(results[1], "reason"),
+		   "VM not found") == 0);
+	for (i = 2; i < count; i++)
+		assert(strcmp(nvlist_get_string(results[i], "reason"),
+			   "unknown command") == 0);
+	nvlist_destroy(res);
+	for (i = 0; i < nitems(cmds); i++)
+		nvlist_destroy(cmds[i]);
+
+	init_sock_buf(&sb);
+	res = request(&sb, command("batch", NULL));
+	free(sb.res_buf);
+	assert(nvlist_get_bool(res, "error"));
+	assert(strcmp(nvlist_get_string(res, "reason"), "no commands") == 0);
+	nvlist_destroy(res);
+	printf("server %s: ok\n", __func__);
+}
+
+/*
+  Take the next event queued to 'sb'. Returns NULL if nothing is queued,
+  the response to the request stays in 'sb' until the first call.
+ */
+static nvlist_t *
+next_event(struct sock_buf *sb, int *rc)
+{
+	nvlist_t *ev;
+
+	free(sb->res_buf);
+	sb->res_buf = NULL;
+	if ((*rc = next_sock_buf_event(sb)) != 1)
+		return NULL;
+	assert((ev = nvlist_unpack(sb->res_buf, sb->res_size, 0)) != NULL);
+	return ev;
+}
+
+/*
+  The events over the queue limit are reported by a "lost" event before
+  the next queued one.
+ */
+static void
+test_watch(void)
+{
+	struct sock_buf sb;
+	struct vm_entry *vm_ent;
+	nvlist_t *req, *res, *ev;
+	uint64_t gen;
+	int i, n, rc;
+
+	assert((vm_ent = lookup_vm_by_name("vm3")) != NULL);
+	init_sock_buf(&sb);
+	req = nvlist_create(0);
+	nvlist_add_string(req, "command", "watch");
+	nvlist_add_string(req, "name", "vm3");
+	res = request(&sb, req);
+	assert(!nvlist_get_bool(res, "error"));
+	nvlist_destroy(res);
+	assert(sb.sub != NULL);
+
+	/* events of other VMs are not queued */
+	set_vm_state(lookup_vm_by_name("vm4"), LOAD);
+	for (i = 0; i < SUBSCRIBER_QUEUE_MAX + 10; i++)
+		set_vm_state(vm_ent, (i % 2) ? RUN : LOAD);
+	gen = vm_generation;
+
+	/* dequeue one to make a room for the lost event and the next */
+	ev = next_event(&sb, &rc);
+	assert(strcmp(nvlist_get_string(ev, "event"), "state") == 0);
+	assert(strcmp(nvlist_get_string(ev, "name"), "vm3") == 0);
+	assert(strcmp(nvlist_get_string(ev, "state"), "LOAD") == 0);
+	nvlist_destroy(ev);
+	set_vm_state(vm_ent, TERMINATE);
+
+	for (n = 1; (ev = next_event(&sb, &rc)) != NULL; n++) {
+		if (n < SUBSCRIBER_QUEUE_MAX) {
+			assert(strcmp(nvlist_get_string(ev, "event"),
+				   "state") == 0);
+			assert(strcmp(nvlist_get_string(ev, "state"),
+				   (n % 2) ? "RUN" : "LOAD") == 0);
+		} else if (n == SUBSCRIBER_QUEUE_MAX) {
+			assert(strcmp(nvlist_get_string(ev, "event"),
+				   "lost") == 0);
+			assert(nvlist_get_number(ev, "count") == 10);
+		} else {
+			assert(strcmp(nvlist_get_string(ev, "state"),
+				   "STOP") == 0);
+			assert(nvlist_get_number(ev, "generation") ==
+			    gen + 1);
+		}
+		nvlist_destroy(ev);
+	}
+	assert(rc == 0 && n == SUBSCRIBER_QUEUE_MAX + 2);
+	free_subscribers();
+	assert(sb.sub == NULL);
+	set_vm_state(lookup_vm_by_name("vm4"), TERMINATE);
+	printf("server %s: ok\n", __func__);
+}
+
+/*
+  A wait returns the current state, then a single event of the state to
+  wait and the connection is closed.
+ */
+static void
+test_wait(void)
+{
+	struct sock_buf sb;
+	struct vm_entry *vm_ent;
+	nvlist_t *req, *res, *ev;
+	int rc;
+
+	assert((vm_ent = lookup_vm_by_name("vm5")) != NULL);
+	init_sock_buf(&sb);
+	req = nvlist_create(0);
+	nvlist_add_string(req, "command", "wait");
+	nvlist_add_string(req, "name", "vm5");
+	nvlist_add_string(req, "state", "run");
+	res = request(&sb, req);
+	assert(!nvlist_get_bool(res, "error"));
+	assert(strcmp(nvlist_get_string(res, "state"), "STOP") == 0);
+	nvlist_destroy(res);
+	assert(sb.sub != NULL);
+
+	set_vm_state(vm_ent, LOAD);
+	set_vm_state(vm_ent, RUN);
+	set_vm_state(vm_ent, STOP);
+	ev = next_event(&sb, &rc);
+	assert(strcmp(nvlist_get_string(ev, "event"), "state") == 0);
+	assert(strcmp(nvlist_get_string(ev, "state"), "RUN") == 0);
+	nvlist_destroy(ev);
+	assert(next_event(&sb, &rc) == NULL && rc == -1);
+	free_subscribers();
+	set_vm_state(vm_ent, TERMINATE);
+
+	/* nothing is subscribed if it's already in the state */
+	init_sock_buf(&sb);
+	req = nvlist_create(0);
+	nvlist_add_string(req, "command", "wait");
+	nvlist_add_string(req, "name", "vm5");
+	nvlist_add_string(req, "state", "stop");
+	res = request(&sb, req);
+	assert(strcmp(nvlist_get_string(res, "state"), "STOP") == 0);
+	nvlist_destroy(res);
+	free(sb.res_buf);
+	assert(sb.sub == NULL);
+	printf("server %s: ok\n", __func__);
+}
+
+static struct state_table *
+open_first_table(const char *stdir)
+{
+	DIR *d;
+	struct dirent *de;
+	struct state_table *t = NULL;
+	char fn[MAXPATHLEN];
+
+	assert((d = opendir(stdir)) != NULL);
+	while (t == NULL && (de = readdir(d)) != NULL) {
+		if (strncmp(de->d_name, STATE_TABLE_PREFIX,
+			sizeof(STATE_TABLE_PREFIX) - 1) != 0)
+			continue;
+		snprintf(fn, sizeof(fn), "%s/%s", stdir, de->d_name);
+		t = open_state_table(fn);
+	}
+	closedir(d);
+	return t;
+}
+
+/*
+  Returns the index of the entry of 'name' read into 'e', or -1.
+ */
+static int
+find_entry(struct state_table *t, const char *name,
+    struct state_table_entry *e)
+{
+	uint32_t i, n;
+
+	n = state_table_size(t);
+	for (i = 0; i < n; i++)
+		if (read_state_entry(t, i, e) == 1 &&
+		    strcmp(e->name, name) == 0)
+			return i;
+	return -1;
+}
+
+/*
+  A reader never sees a half updated entry. The writer keeps
+  pid % 3 == state, the reader in the child process checks it.
+ */
+static void
+test_state_table(const char *stdir)
+{
+	struct vm_entry *vm_ent;
+	struct state_table *t;
+	struct state_table_entry e;
+	pid_t pid;
+	int i, slot, rc, status, fd;
+	char fn[MAXPATHLEN];
+	struct {
+		struct state_table_header hdr;
+		struct state_table_entry ent;
+	} odd;
+
+	assert((vm_ent = lookup_vm_by_name("vm6")) != NULL);
+	assert((t = open_first_table(stdir)) != NULL);
+	assert(state_table_size(t) >= NVMS);
+	assert((slot = find_entry(t, "vm6", &e)) >= 0);
+	assert(e.state == TERMINATE && e.exit_status == -1);
+
+	set_vm_state(vm_ent, LOAD);
+	assert(read_state_entry(t, slot, &e) == 1);
+	assert(e.state == LOAD && e.nboots == 1);
+
+	/* the reader may give up on a busy entry, but never reads it torn */
+	if ((pid = fork()) == 0) {
+		do {
+			if ((rc = read_state_entry(t, slot, &e)) < 0)
+				continue;
+			if (rc == 0 || strcmp(e.name, "vm6") != 0 ||
+			    (e.pid >= 0 && e.pid % 3 != e.state))
+				_exit(1);
+		} while (rc < 0 || e.pid < NUPDATES - 1);
+		_exit(0);
+	}
+	assert(pid > 0);
+	for (i = 0; i < NUPDATES; i++) {
+		VM_PID(vm_ent) = i;
+		set_vm_state(vm_ent, i % 3);
+	}
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	VM_PID(vm_ent) = -1;
+	set_vm_state(vm_ent, TERMINATE);
+	close_state_table(t);
+
+	/* an entry kept odd is reported as being updated */
+	memset(&odd, 0, sizeof(odd));
+	odd.hdr.magic = STATE_TABLE_MAGIC;
+	odd.hdr.version = STATE_TABLE_VERSION;
+	odd.hdr.entry_size = sizeof(struct state_table_entry);
+	odd.hdr.nentries = 1;
+	odd.ent.version = 1;
+	odd.ent.used = 1;
+	snprintf(fn, sizeof(fn), "%s/odd", dir);
+	assert((fd = open(fn, O_WRONLY | O_CREAT, 0600)) >= 0);
+	assert(write(fd, &odd, sizeof(odd)) == sizeof(odd));
+	close(fd);
+	assert((t = open_state_table(fn)) != NULL);
+	assert(state_table_size(t) == 1);
+	assert(read_state_entry(t, 0, &e) == -1);
+	close_state_table(t);
+	printf("server %s: ok\n", __func__);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char fn[128];
+
+	init_bench_dir(dir, NULL);
+	write_vms();
+	snprintf(fn, sizeof(fn), "%s/st", dir);
+	assert(init_state_table(fn) == 0);
+	assert(reload_virtual_machines() == 0);
+
+	test_list_cache();
+	test_list_pages();
+	test_batch();
+	test_watch();
+	test_wait();
+	test_state_table(fn);
+
+	free_state_table();
+	remove_bench_dir(dir);
+	return 0;
+}
@@ -0,0 +1,126 @@
+#include <sys/param.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "../slab.h"
+
+#define NCHUNK	8
+#define NOBJS	(NCHUNK * 3 + 1)
+
+struct obj {
+	char name[21];
+	int id;
+};
+
+static struct slab obj_slab =
+	SLAB_INITIALIZER("obj", sizeof(struct obj), NCHUNK);
+
+/*
+  Objects are aligned and don't overlap. Freed objects are reused before
+  the slab grows again.
+ */
+static void
+test_objects(void)
+{
+	int i, j;
+	struct obj *o[NOBJS], *p[NOBJS];
+
+	for (i = 0; i < NOBJS; i++) {
+		assert((o[i] = slab_alloc(&obj_slab)) != NULL);
+		assert(((uintptr_t)o[i] & (sizeof(void *) * 2 - 1)) == 0);
+		memset(o[i]->name, 'a' + i % 26, sizeof(o[i]->name));
+		o[i]->id = i;
+	}
+	for (i = 0; i < NOBJS; i++) {
+		assert(o[i]->id == i && o[i]->name[20] == 'a' + i % 26);
+		for (j = 0; j < i; j++)
+			assert(o[i] != o[j]);
+	}
+	assert(obj_slab.misses == 4 && obj_slab.hits == NOBJS - 4);
+	assert(obj_slab.inuse == NOBJS);
+
+	/* the last freed one comes first */
+	for (i = 0; i < NOBJS; i++)
+		slab_free(&obj_slab, o[i]);
+	assert(obj_slab.inuse == 0);
+	for (i = 0; i < NOBJS; i++)
+		assert((p[i] = slab_alloc(&obj_slab)) == o[NOBJS - 1 - i]);
+	assert(obj_slab.misses == 4 && obj_slab.hits == NOBJS * 2 - 4);
+
+	slab_free(&obj_slab, NULL);
+	slab_destroy(&obj_slab);
+	assert(obj_slab.inuse == 0);
+	assert(slab_alloc(&obj_slab) != NULL && obj_slab.misses == 5);
+	slab_destroy(&obj_slab);
+	printf("slab %s: ok\n", __func__);
+}
+
+/*
+  An object smaller than a pointer still holds the free list.
+ */
+static void
+test_small(void)
+{
+	struct slab s = SLAB_INITIALIZER("small", 1, 2);
+	char *a, *b, *c;
+
+	assert((a = slab_alloc(&s)) != NULL && (b = slab_alloc(&s)) != NULL);
+	assert(b - a >= (ptrdiff_t)sizeof(void *) ||
+	    a - b >= (ptrdiff_t)sizeof(void *));
+	*a = 'a';
+	*b = 'b';
+	assert((c = slab_alloc(&s)) != NULL && s.misses == 2);
+	slab_free(&s, a);
+	assert(*b == 'b');
+	assert(slab_alloc(&s) == a);
+	slab_destroy(&s);
+	printf("slab %s: ok\n", __func__);
+}
+
+/*
+  Buffers are shared by the sizes of the same class. Each class keeps
+  up to 256KiB of freed buffers, the ones over it go back to the heap.
+ */
+static void
+test_buffers(void)
+{
+	int i;
+	char *a, *b, *big[5];
+
+	assert((a = slab_buf_alloc(1)) != NULL);
+	memset(a, 0, 256);
+	slab_buf_free(a, 1);
+	assert((b = slab_buf_alloc(256)) == a);
+	slab_buf_free(b, 256);
+	assert((b = slab_buf_alloc(257)) != a);
+	memset(b, 0, 512);
+	slab_buf_free(b, 257);
+
+	/* 4 buffers of 64KiB are kept */
+	for (i = 0; i < 5; i++)
+		assert((big[i] = slab_buf_alloc(60 * 1024)) != NULL);
+	for (i = 0; i < 5; i++)
+		slab_buf_free(big[i], 60 * 1024);
+	for (i = 3; i >= 0; i--)
+		assert(slab_buf_alloc(64 * 1024) == big[i]);
+	for (i = 0; i < 4; i++)
+		slab_buf_free(big[i], 64 * 1024);
+
+	/* over 1MiB is not pooled */
+	assert((a = slab_buf_alloc(2 * 1024 * 1024)) != NULL);
+	memset(a, 0, 2 * 1024 * 1024);
+	slab_buf_free(a, 2 * 1024 * 1024);
+	printf("slab %s: ok\n", __func__);
+}
+
+int
+main(int argc, char *argv[])
+{
+	test_objects();
+	test_small();
+	test_buffers();
+	return 0;
+}
@@ -0,0 +1,132 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "../launcher.h"
+#include "bench.h"
+
+#define NSPAWNS		500
+#define NARGS		32
+#define HEAP_MB		512	/* simulated daemon heap */
+
+#define TRUE_PATH	"/usr/bin/true"
+
+static void
+wait_child(pid_t pid)
+{
+	int status;
+
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/*
+  The former way: fork, write the arguments to a memstream in the child,
+  split them and execv.
+ */
+static double
+bench_fork(void)
+{
+	int i, j, n;
+	pid_t pid;
+	struct timespec s;
+
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (i = 0; i < NSPAWNS; i++) {
+		if ((pid = fork()) == 0) {
+			char *argv[NARGS + 2], *bp, *p;
+			FILE *fp;
+			size_t len;
+
+			fp = open_memstream(&bp, &len);
+			fprintf(fp, "%s\n", TRUE_PATH);
+			for (j = 0; j < NARGS; j++)
+				fprintf(fp, "%d,virtio-blk,/dev/zvol/vm%d\n", j, i);
+			fclose(fp);
+			for (n = 0, p = bp; n < NARGS + 1; n++) {
+				argv[n] = p;
+				p = strchr(p, '\n');
+				*p++ = '\0';
+			}
+			argv[n] = NULL;
+			execv(TRUE_PATH, argv);
+			_exit(1);
+		}
+		assert(pid > 0);
+		wait_child(pid);
+	}
+	return elapsed(&s);
+}
+
+/*
+  The arguments are built once and cached like vm_args.
+ */
+static double
+bench_spawn(void)
+{
+	int i, j;
+	pid_t pid;
+	struct timespec s;
+	struct spawn_args sa = SPAWN_ARGS_INITIALIZER;
+
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	spawn_args_add(&sa, TRUE_PATH);
+	for (j = 0; j < NARGS; j++)
+		spawn_args_addf(&sa, "%d,virtio-blk,/dev/zvol/vm%d", j, 0);
+	assert(sa.error == false);
+	for (i = 0; i < NSPAWNS; i++) {
+		assert(spawn_process(&sa, -1, -1, -1, &pid) == 0);
+		wait_child(pid);
+	}
+	spawn_args_clear(&sa);
+	return elapsed(&s);
+}
+
+static void
+check_args(void)
+{
+	char *s;
+	struct spawn_args sa = SPAWN_ARGS_INITIALIZER;
+
+	assert(spawn_process(&sa, -1, -1, -1, NULL) < 0);
+	spawn_args_add(&sa, "bhyve");
+	spawn_args_addf(&sa, "com1,%s", "/dev/nmdm0A");
+	assert(spawn_args_setenv(&sa, "BMD_TEST=1") == 0);
+	assert(spawn_args_setenv(&sa, "BMD_TEST=2") == 0);
+	assert(spawn_args_setenv(&sa, "invalid") < 0);
+	assert(sa.argc == 2 && sa.argv[2] == NULL);
+	assert(sa.envp[sa.envc] == NULL);
+	assert(strcmp(sa.envp[sa.envc - 1], "BMD_TEST=2") == 0);
+	assert((s = spawn_args_join(&sa)) != NULL);
+	assert(strcmp(s, "bhyve com1,/dev/nmdm0A") == 0);
+	free(s);
+	spawn_args_clear(&sa);
+	assert(sa.argv == NULL && sa.envp == NULL && sa.argc == 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	double f, s;
+	char *heap;
+
+	/* fork copies the page tables of the big heap */
+	heap = malloc((size_t)HEAP_MB << 20);
+	assert(heap != NULL);
+	memset(heap, 1, (size_t)HEAP_MB << 20);
+
+	check_args();
+	f = bench_fork();
+	s = bench_spawn();
+	printf("spawn %d processes with %dMB heap: fork %.3f sec, "
+	       "posix_spawn %.3f sec (x%.1f)\n",
+	       NSPAWNS, HEAP_MB, f, s, f / s);
+
+	free(heap);
+	return 0;
+}
@@ -0,0 +1,163 @@
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "../timer.h"
+
+#define NTIMERS		1000
+
+static struct timer *timers[NTIMERS];
+static int called[NTIMERS];
+static uint64_t last_expire;
+static int ncalls;
+
+static int
+on_expire(int ident __unused, void *data __unused)
+{
+	ncalls++;
+	return 0;
+}
+
+/*
+  Timers are called back in the order of the expire time.
+ */
+static int
+on_ordered(int ident __unused, void *data)
+{
+	int i = (intptr_t)data;
+
+	assert(timers[i]->index == 0);
+	assert(timers[i]->expire >= last_expire);
+	last_expire = timers[i]->expire;
+	called[i]++;
+	ncalls++;
+	return 0;
+}
+
+static void
+wait_msec(int msec)
+{
+	struct timespec ts = { msec / 1000, (msec % 1000) * 1000000 };
+
+	while (nanosleep(&ts, &ts) < 0)
+		;
+}
+
+/*
+  Insert, cancel and re-arm timers in random order.
+ */
+static void
+test_order(void)
+{
+	int i, n = 0;
+	uint64_t first = 0;
+
+	assert(next_timer_expire() == -1 && first_timer_expire() == 0);
+
+	srandom(1);
+	for (i = 0; i < NTIMERS; i++) {
+		assert((timers[i] = create_timer(on_ordered,
+			    (void *)(intptr_t)i)) != NULL);
+		assert(schedule_timer(timers[i], random() % 40) == 0);
+	}
+	assert(next_timer_expire() <= 40);
+
+	for (i = 0; i < NTIMERS; i += 7)
+		cancel_timer(timers[i]);
+	/* re-armed after the others, and far away */
+	for (i = 0; i < NTIMERS; i += 5)
+		assert(schedule_timer(timers[i], 60000 + i) == 0);
+	for (i = 0; i < NTIMERS; i += 5)
+		if (first == 0 || timers[i]->expire < first)
+			first = timers[i]->expire;
+
+	wait_msec(50);
+	last_expire = 0;
+	run_timers();
+	for (i = 0; i < NTIMERS; i++) {
+		if (i % 5 == 0)
+			assert(called[i] == 0 && timers[i]->index > 0);
+		else if (i % 7 == 0)
+			assert(called[i] == 0 && timers[i]->index == 0);
+		else {
+			assert(called[i] == 1);
+			n++;
+		}
+	}
+	assert(ncalls == n);
+	assert(first_timer_expire() == first);
+	assert(next_timer_expire() > 59000);
+
+	for (i = 0; i < NTIMERS; i++)
+		destroy_timer(timers[i]);
+	assert(next_timer_expire() == -1 && first_timer_expire() == 0);
+	printf("timer %s: ok\n", __func__);
+}
+
+static struct timer *victim;
+static int nself;
+
+/*
+  A callback destroys another expired timer and reschedules itself.
+ */
+static int
+on_self(int ident __unused, void *data)
+{
+	struct timer *t = data;
+
+	if (victim != NULL) {
+		destroy_timer(victim);
+		victim = NULL;
+	}
+	if (++nself < 3)
+		assert(schedule_timer(t, 0) == 0);
+	return 0;
+}
+
+static int
+on_victim(int ident __unused, void *data __unused)
+{
+	assert(0);
+	return 0;
+}
+
+static void
+test_callback(void)
+{
+	struct timer *t;
+	int i;
+
+	assert((t = create_timer(on_self, NULL)) != NULL);
+	t->data = t;
+	assert(schedule_timer(t, 0) == 0);
+	assert((victim = create_timer(on_victim, NULL)) != NULL);
+	assert(schedule_timer(victim, 1) == 0);
+	wait_msec(2);
+	/* rescheduled ones may expire after the run started */
+	while (nself < 3)
+		run_timers();
+	assert(nself == 3 && victim == NULL && t->index == 0);
+	destroy_timer(t);
+
+	/* added timers are freed after the callback */
+	ncalls = 0;
+	for (i = 0; i < 10; i++)
+		assert(add_timer(0, on_expire, NULL) == 0);
+	while (next_timer_expire() >= 0)
+		run_timers();
+	assert(ncalls == 10);
+	free_timers();
+	printf("timer %s: ok\n", __func__);
+}
+
+int
+main(int argc, char *argv[])
+{
+	test_order();
+	test_callback();
+	return 0;
+}
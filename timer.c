@@ -0,0 +1,214 @@
+#include <sys/param.h>
+#include <sys/queue.h>
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "slab.h"
+#include "timer.h"
+
+/*
+  Min-heap of the scheduled timers ordered by the expire time.
+ */
+static struct timer **heap = NULL;
+static size_t heap_len = 0, heap_size = 0;
+
+static struct slab timer_slab =
+	SLAB_INITIALIZER("timer", sizeof(struct timer), 64);
+
+/*
+  Last timer ID
+ */
+static int timer_id = 0;
+
+static uint64_t
+now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+heap_set(size_t i, struct timer *t)
+{
+	heap[i] = t;
+	t->index = i + 1;
+}
+
+static void
+heap_up(size_t i)
+{
+	size_t p;
+	struct timer *t = heap[i];
+
+	while (i > 0 && heap[p = (i - 1) / 2]->expire > t->expire) {
+		heap_set(i, heap[p]);
+		i = p;
+	}
+	heap_set(i, t);
+}
+
+static void
+heap_down(size_t i)
+{
+	size_t c;
+	struct timer *t = heap[i];
+
+	while ((c = i * 2 + 1) < heap_len) {
+		if (c + 1 < heap_len && heap[c + 1]->expire < heap[c]->expire)
+			c++;
+		if (heap[c]->expire >= t->expire)
+			break;
+		heap_set(i, heap[c]);
+		i = c;
+	}
+	heap_set(i, t);
+}
+
+static void
+heap_remove(struct timer *t)
+{
+	size_t i = t->index - 1;
+	struct timer *last = heap[--heap_len];
+
+	t->index = 0;
+	if (last == t)
+		return;
+	heap_set(i, last);
+	if (i > 0 && heap[(i - 1) / 2]->expire > last->expire)
+		heap_up(i);
+	else
+		heap_down(i);
+}
+
+struct timer *
+create_timer(timer_call_back cb, void *data)
+{
+	struct timer *t;
+
+	if ((t = slab_alloc(&timer_slab)) == NULL)
+		return NULL;
+	t->expire = 0;
+	t->index = 0;
+	t->ident = ++timer_id;
+	t->autofree = false;
+	t->cb = cb;
+	t->data = data;
+	return t;
+}
+
+void
+destroy_timer(struct timer *t)
+{
+	if (t == NULL)
+		return;
+	cancel_timer(t);
+	slab_free(&timer_slab, t);
+}
+
+/*
+  Schedule the timer to expire after 'msec' milliseconds.
+  A scheduled timer is rescheduled.
+ */
+int
+schedule_timer(struct timer *t, int64_t msec)
+{
+	struct timer **h;
+	size_t sz;
+
+	t->expire = now_msec() + MAX(msec, 0);
+	if (t->index > 0) {
+		heap_remove(t);
+	} else if (heap_len >= heap_size) {
+		sz = heap_size ? heap_size * 2 : 64;
+		if ((h = realloc(heap, sz * sizeof(*h))) == NULL)
+			return -1;
+		heap = h;
+		heap_size = sz;
+	}
+	heap_set(heap_len++, t);
+	heap_up(heap_len - 1);
+	return 0;
+}
+
+void
+cancel_timer(struct timer *t)
+{
+	if (t != NULL && t->index > 0)
+		heap_remove(t);
+}
+
+/*
+  Add a timer without a handle. It's freed after the callback.
+ */
+int
+add_timer(int64_t msec, timer_call_back cb, void *data)
+{
+	struct timer *t;
+
+	if ((t = create_timer(cb, data)) == NULL)
+		return -1;
+	t->autofree = true;
+	if (schedule_timer(t, msec) < 0) {
+		destroy_timer(t);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  Returns milliseconds until the first timer expires, -1 if no timer is
+  scheduled.
+ */
+int64_t
+next_timer_expire(void)
+{
+	uint64_t now;
+
+	if (heap_len == 0)
+		return -1;
+	now = now_msec();
+	return heap[0]->expire > now ? (int64_t)(heap[0]->expire - now) : 0;
+}
+
+/*
+  Returns the expire time of the first timer, 0 if no timer is scheduled.
+ */
+uint64_t
+first_timer_expire(void)
+{
+	return heap_len > 0 ? heap[0]->expire : 0;
+}
+
+/*
+  Call back all expired timers.
+  A callback may schedule, cancel or destroy any timer including its own.
+ */
+void
+run_timers(void)
+{
+	struct timer *t;
+	uint64_t now = now_msec();
+	bool autofree;
+
+	while (heap_len > 0 && heap[0]->expire <= now) {
+		t = heap[0];
+		heap_remove(t);
+		/* 't' may be freed by the callback */
+		autofree = t->autofree;
+		(*t->cb)(t->ident, t->data);
+		if (autofree)
+			destroy_timer(t);
+	}
+}
+
+void
+free_timers(void)
+{
+	free(heap);
+	heap = NULL;
+	heap_len = heap_size = 0;
+	slab_destroy(&timer_slab);
+}
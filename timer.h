@@ -0,0 +1,34 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef int (*timer_call_back)(int ident, void *data);
+
+/*
+  Timer handle.
+  'expire' is in milliseconds of the monotonic clock.
+  'index' is the position in the timer heap plus 1, 0 if not scheduled.
+ */
+struct timer {
+	uint64_t expire;
+	size_t index;
+	int ident;
+	bool autofree;
+	timer_call_back cb;
+	void *data;
+};
+
+/* Implemented in timer.c */
+struct timer *create_timer(timer_call_back, void *);
+void destroy_timer(struct timer *);
+int schedule_timer(struct timer *, int64_t);
+void cancel_timer(struct timer *);
+int add_timer(int64_t, timer_call_back, void *);
+int64_t next_timer_expire(void);
+uint64_t first_timer_expire(void);
+void run_timers(void);
+void free_timers(void);
+
+#endif
@@ -0,0 +1,342 @@
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/tree.h>
+
+#include <grp.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "userdb.h"
+
+/*
+  Seconds to keep the cached entries. The databases may be served by NSS
+  sources whose changes are not seen in the local files.
+ */
+#define USERDB_TTL		300
+
+/*
+  Interval seconds to check the modification of the local databases.
+ */
+#define USERDB_CHECK_INTERVAL	1
+
+/*
+  Cached passwd entry. 'found' is false for the name or uid that doesn't
+  exist, such an entry is in only one of the trees.
+  'ngroups' is -1 until the group list is fetched.
+ */
+struct user_entry {
+	RB_ENTRY(user_entry) by_name;
+	RB_ENTRY(user_entry) by_uid;
+	SLIST_ENTRY(user_entry) next;
+	bool found;
+	uid_t uid;
+	gid_t gid;
+	int ngroups;
+	gid_t *groups;
+	char *name;
+	char buf[0];
+};
+
+struct group_entry {
+	RB_ENTRY(group_entry) by_name;
+	bool found;
+	gid_t gid;
+	char *name;
+	char buf[0];
+};
+
+static int
+compare_user_name(struct user_entry *a, struct user_entry *b)
+{
+	return strcmp(a->name, b->name);
+}
+
+static int
+compare_user_uid(struct user_entry *a, struct user_entry *b)
+{
+	return (a->uid < b->uid) ? -1 : (a->uid > b->uid);
+}
+
+static int
+compare_group_name(struct group_entry *a, struct group_entry *b)
+{
+	return strcmp(a->name, b->name);
+}
+
+RB_HEAD(user_name_tree, user_entry);
+RB_HEAD(user_uid_tree, user_entry);
+RB_HEAD(group_name_tree, group_entry);
+RB_GENERATE_STATIC(user_name_tree, user_entry, by_name, compare_user_name);
+RB_GENERATE_STATIC(user_uid_tree, user_entry, by_uid, compare_user_uid);
+RB_GENERATE_STATIC(group_name_tree, group_entry, by_name, compare_group_name);
+
+static struct user_name_tree user_names = RB_INITIALIZER(&user_names);
+static struct user_uid_tree user_uids = RB_INITIALIZER(&user_uids);
+static struct group_name_tree group_names = RB_INITIALIZER(&group_names);
+
+/*
+  All user entries to free them.
+ */
+static SLIST_HEAD(, user_entry) users = SLIST_HEAD_INITIALIZER();
+
+static const char *userdbs[] = { "/etc/pwd.db", "/etc/group" };
+static struct timespec userdb_mtim[nitems(userdbs)];
+static time_t userdb_loaded = 0, userdb_checked = 0;
+static bool userdb_valid = false;
+
+static uint64_t nhits = 0, nmisses = 0, nflushes = 0;
+
+/*
+  Bumped when the cache is flushed, the results of lookups may change.
+ */
+static uint64_t userdb_gen = 0;
+
+static time_t
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+void
+free_userdb(void)
+{
+	struct user_entry *ue, *un;
+	struct group_entry *ge, *gn;
+
+	SLIST_FOREACH_SAFE (ue, &users, next, un) {
+		free(ue->groups);
+		free(ue);
+	}
+	SLIST_INIT(&users);
+	RB_INIT(&user_names);
+	RB_INIT(&user_uids);
+	RB_FOREACH_SAFE (ge, group_name_tree, &group_names, gn) {
+		RB_REMOVE(group_name_tree, &group_names, ge);
+		free(ge);
+	}
+	userdb_valid = false;
+}
+
+/*
+  Flush the cache if the databases are modified or the entries are expired.
+ */
+static void
+check_userdb(void)
+{
+	struct stat st;
+	struct timespec mtim;
+	time_t now = now_sec();
+	bool changed = false;
+	size_t i;
+
+	if (userdb_valid && now - userdb_checked < USERDB_CHECK_INTERVAL)
+		return;
+	userdb_checked = now;
+	for (i = 0; i < nitems(userdbs); i++) {
+		if (stat(userdbs[i], &st) == 0)
+			mtim = st.st_mtim;
+		else
+			mtim.tv_sec = mtim.tv_nsec = 0;
+		if (mtim.tv_sec != userdb_mtim[i].tv_sec ||
+		    mtim.tv_nsec != userdb_mtim[i].tv_nsec) {
+			userdb_mtim[i] = mtim;
+			changed = true;
+		}
+	}
+	if (userdb_valid && !changed && now - userdb_loaded < USERDB_TTL)
+		return;
+	if (userdb_valid)
+		nflushes++;
+	free_userdb();
+	userdb_valid = true;
+	userdb_loaded = now;
+	userdb_gen++;
+}
+
+/*
+  Returns the generation of the cache after checking its validity.
+ */
+uint64_t
+userdb_generation(void)
+{
+	check_userdb();
+	return userdb_gen;
+}
+
+static struct user_entry *
+create_user_entry(const char *name, struct passwd *pwd)
+{
+	struct user_entry *ue;
+
+	if ((ue = calloc(1, sizeof(*ue) + strlen(name) + 1)) == NULL)
+		return NULL;
+	ue->name = strcpy(ue->buf, name);
+	ue->ngroups = -1;
+	if (pwd != NULL) {
+		ue->found = true;
+		ue->uid = pwd->pw_uid;
+		ue->gid = pwd->pw_gid;
+	}
+	SLIST_INSERT_HEAD(&users, ue, next);
+	return ue;
+}
+
+static struct user_entry *
+get_user_by_name(const char *name)
+{
+	struct user_entry *ue, key;
+	struct passwd *pwd;
+
+	check_userdb();
+	key.name = (char *)name;
+	if ((ue = RB_FIND(user_name_tree, &user_names, &key)) != NULL) {
+		nhits++;
+		return ue;
+	}
+	nmisses++;
+	pwd = getpwnam(name);
+	if ((ue = create_user_entry(name, pwd)) == NULL)
+		return NULL;
+	RB_INSERT(user_name_tree, &user_names, ue);
+	if (ue->found)
+		RB_INSERT(user_uid_tree, &user_uids, ue);
+	return ue;
+}
+
+static struct user_entry *
+get_user_by_uid(uid_t uid)
+{
+	struct user_entry *ue, key;
+	struct passwd *pwd;
+
+	check_userdb();
+	key.uid = uid;
+	if ((ue = RB_FIND(user_uid_tree, &user_uids, &key)) != NULL) {
+		nhits++;
+		return ue;
+	}
+	nmisses++;
+	pwd = getpwuid(uid);
+	if ((ue = create_user_entry(pwd ? pwd->pw_name : "", pwd)) == NULL)
+		return NULL;
+	ue->uid = uid;
+	RB_INSERT(user_uid_tree, &user_uids, ue);
+	if (ue->found)
+		RB_INSERT(user_name_tree, &user_names, ue);
+	return ue;
+}
+
+/*
+  Lookup the user 'name'. Returns -1 if not found.
+ */
+int
+lookup_user(const char *name, uid_t *uid, gid_t *gid)
+{
+	struct user_entry *ue;
+
+	if ((ue = get_user_by_name(name)) == NULL || !ue->found)
+		return -1;
+	if (uid != NULL)
+		*uid = ue->uid;
+	if (gid != NULL)
+		*gid = ue->gid;
+	return 0;
+}
+
+/*
+  Returns the name of 'uid', or NULL if not found. The name is valid until
+  the next lookup.
+ */
+const char *
+lookup_user_name(uid_t uid, gid_t *gid)
+{
+	struct user_entry *ue;
+
+	if ((ue = get_user_by_uid(uid)) == NULL || !ue->found)
+		return NULL;
+	if (gid != NULL)
+		*gid = ue->gid;
+	return ue->name;
+}
+
+/*
+  Lookup the group 'name'. Returns -1 if not found.
+ */
+int
+lookup_group(const char *name, gid_t *gid)
+{
+	struct group_entry *ge, key;
+	struct group *grp;
+
+	check_userdb();
+	key.name = (char *)name;
+	if ((ge = RB_FIND(group_name_tree, &group_names, &key)) != NULL) {
+		nhits++;
+		goto found;
+	}
+	nmisses++;
+	grp = getgrnam(name);
+	if ((ge = calloc(1, sizeof(*ge) + strlen(name) + 1)) == NULL)
+		return -1;
+	ge->name = strcpy(ge->buf, name);
+	if (grp != NULL) {
+		ge->found = true;
+		ge->gid = grp->gr_gid;
+	}
+	RB_INSERT(group_name_tree, &group_names, ge);
+found:
+	if (!ge->found)
+		return -1;
+	*gid = ge->gid;
+	return 0;
+}
+
+/*
+  Returns 0 if 'user' is a member of group 'target', otherwise -1.
+ */
+int
+is_in_group(const char *user, gid_t target)
+{
+	struct user_entry *ue;
+	gid_t *grlist;
+	int i, ngroups;
+
+	if ((ue = get_user_by_name(user)) == NULL || !ue->found)
+		return -1;
+	if (ue->ngroups < 0) {
+		ngroups = sysconf(_SC_NGROUPS_MAX) + 1;
+		if ((grlist = malloc(sizeof(gid_t) * ngroups)) == NULL)
+			return -1;
+		if (getgrouplist(ue->name, ue->gid, grlist, &ngroups) < 0) {
+			free(grlist);
+			return -1;
+		}
+		ue->groups = grlist;
+		ue->ngroups = ngroups;
+	}
+
+	for (i = 0; i < ue->ngroups; i++)
+		if (ue->groups[i] == target)
+			return 0;
+	return -1;
+}
+
+void
+userdb_stats(nvlist_t *nvl)
+{
+	nvlist_t *p;
+
+	p = nvlist_create(0);
+	nvlist_add_number(p, "hits", nhits);
+	nvlist_add_number(p, "misses", nmisses);
+	nvlist_add_number(p, "flushes", nflushes);
+	nvlist_move_nvlist(nvl, "userdb", p);
+}
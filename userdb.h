@@ -0,0 +1,17 @@
+#ifndef _USERDB_H_
+#define _USERDB_H_
+
+#include <sys/types.h>
+#include <sys/nv.h>
+#include <stdint.h>
+
+/* Implemented in userdb.c */
+int lookup_user(const char *, uid_t *, gid_t *);
+const char *lookup_user_name(uid_t, gid_t *);
+int lookup_group(const char *, gid_t *);
+int is_in_group(const char *, gid_t);
+uint64_t userdb_generation(void);
+void free_userdb(void);
+void userdb_stats(nvlist_t *);
+
+#endif
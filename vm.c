@@ -21,6 +21,7 @@
 #include <unistd.h>
 
 #include "conf.h"
+#include "launcher.h"
 #include "log.h"
 #include "vm.h"
 #include "inspect.h"
@@ -29,18 +30,23 @@
 #define UEFI_FIRMWARE       LOCALBASE"/share/uefi-firmware/BHYVE_UEFI.fd"
 #define UEFI_FIRMWARE_VARS  LOCALBASE"/share/uefi-firmware/BHYVE_UEFI_VARS.fd"
 
-#define WRITE_STR(fp, str) \
-	fwrite_unlocked(&(const char *[]) { (str) }[0], sizeof(const char *), 1, (fp))
-
-#define WRITE_FMT(fp, fmt, ...)                               \
-	do {                                                  \
-		char *p;                                      \
-		asprintf(&p, (fmt), __VA_ARGS__);             \
-		fwrite_unlocked(&p, sizeof(char *), 1, (fp)); \
-	} while (0)
+/*
+  Arguments of bhyve and bhyveload built for a config generation.
+  They are reused while the VM reboots and freed on cleanup.
+ */
+struct vm_args {
+	uint64_t generation;
+	bool install;
+	bool single_user;
+	struct spawn_args bhyve;
+	struct spawn_args bhyveload;
+};
 
+/*
+  Open the com port to redirect the standard descriptors of the loader.
+ */
 static int
-redirect_to_com(struct vm *vm, bool redirect_stdin)
+open_com(struct vm *vm, bool redirect_stdin)
 {
 	int fd, flag;
 	const char *com;
@@ -56,19 +62,46 @@ redirect_to_com(struct vm *vm, bool redirect_stdin)
 	  Basically the nmdm device is automatically created, I'm not sure why
 	  ENOENT is returned.
 	 */
-	while ((fd = open(com, flag | O_NONBLOCK)) < 0)
+	while ((fd = open(com, flag | O_NONBLOCK | O_CLOEXEC)) < 0)
 		if (errno != EINTR && errno != ENOENT)
 			break;
-	if (fd < 0) {
+	if (fd < 0)
 		ERR("can't open %s (%s)\n", com, strerror(errno));
-		return -1;
-	}
-	if (redirect_stdin)
-		dup2(fd, 0);
-	dup2(fd, 1);
-	dup2(fd, 2);
 
-	return 0;
+	return fd;
+}
+
+static struct vm_args *
+get_vm_args(struct vm *vm)
+{
+	struct vm_conf *conf = vm->conf;
+	struct vm_args *va = vm->args;
+
+	if (va != NULL && va->generation == conf->generation &&
+	    va->install == conf->install &&
+	    va->single_user == conf->single_user)
+		return va;
+
+	if (va == NULL && (va = calloc(1, sizeof(*va))) == NULL)
+		return NULL;
+	spawn_args_clear(&va->bhyve);
+	spawn_args_clear(&va->bhyveload);
+	va->generation = conf->generation;
+	va->install = conf->install;
+	va->single_user = conf->single_user;
+	vm->args = va;
+	return va;
+}
+
+static void
+free_vm_args(struct vm *vm)
+{
+	if (vm->args == NULL)
+		return;
+	spawn_args_clear(&vm->args->bhyve);
+	spawn_args_clear(&vm->args->bhyveload);
+	free(vm->args);
+	vm->args = NULL;
 }
 
 static char *
@@ -247,45 +280,36 @@ end:
 	return cmd;
 }
 
-/*
- * split_args() separates an buffer that contains '\n' as the delimiter.
- * The results will be an array of pointers to portions of the buffer,
- * and the '\n' characters will be replaced with '\0'.  The array itself
- * will be allocated by malloc().
- */
-char **
-split_args(char *buf)
+static void
+build_grub_args(struct vm *vm, struct spawn_args *sa)
 {
-	char **ap0, **ap;
-	char *p;
-	int n;
-
-	/* Scan '\n' in the buffer. */
-	n = 0;
-	p = buf;
-	while ((p = strchr(p, '\n')) != NULL) {
-		n++;
-		p++;
-	}
-
-	/* The last component is always NULL. */
-	ap0 = calloc(n + 1, sizeof(*ap0));
-	if (ap0 == NULL)
-		return (NULL);
-	p = buf;
-	for (ap = ap0; (*ap = strsep(&p, "\n")) != NULL; )
-		if (**ap != '\0' && ++ap >= &ap0[n])
-			break;
+	struct vm_conf *conf = vm->conf;
 
-	return (ap0);
+	spawn_args_setenv(sa, "TERM=vt100");
+	spawn_args_add(sa, LOCALBASE"/sbin/grub-bhyve");
+	if (conf->wired_memory == true)
+		spawn_args_add(sa, "-S");
+	spawn_args_add(sa, "-r");
+	if (conf->install)
+		spawn_args_add(sa, "cd0");
+	else if (conf->grub_run_partition)
+		spawn_args_addf(sa, "hd0,%s", conf->grub_run_partition);
+	else
+		spawn_args_add(sa, "hd0,1");
+	spawn_args_add(sa, "-M");
+	spawn_args_add(sa, conf->memory);
+	spawn_args_add(sa, "-m");
+	spawn_args_add(sa, vm->mapfile);
+	spawn_args_add(sa, conf->name);
 }
 
 static int
 grub_load(struct vm *vm)
 {
-	int ifd[2];
+	int rc, ifd[2], comfd = -1;
 	pid_t pid;
 	struct vm_conf *conf = vm->conf;
+	struct spawn_args sa = SPAWN_ARGS_INITIALIZER;
 	size_t len;
 	char *cmd;
 	bool doredirect = (vm->assigned_comport == NULL) ||
@@ -293,97 +317,108 @@ grub_load(struct vm *vm)
 
 	cmd = create_load_command(conf, &len);
 
-	if (cmd != NULL && pipe(ifd) < 0) {
+	if (cmd != NULL && pipe2(ifd, O_CLOEXEC) < 0) {
 		ERR("cannot create pipe (%s)\n", strerror(errno));
 		free(cmd);
 		return -1;
 	}
 
-	pid = fork();
-	if (pid > 0) {
-		vm->pid = pid;
-		vm->state = LOAD;
-		if (cmd != NULL) {
-			close(ifd[1]);
-			vm->infd = ifd[0];
-		} else
-			vm->infd = -1;
-		vm->outfd = -1;
-		vm->errfd = -1;
-		if (cmd != NULL) {
-			write(ifd[0], cmd, len + 1);
-			free(cmd);
-		}
-	} else if (pid == 0) {
-		FILE *fp;
-		char **argv, *bp;
-
-		if (cmd != NULL) {
+	/*
+	  The mapfile is created for each loading.
+	  The arguments are not cached.
+	 */
+	build_grub_args(vm, &sa);
+	if (doredirect)
+		comfd = open_com(vm, (cmd == NULL));
+
+	rc = spawn_process(&sa, (cmd != NULL) ? ifd[1] : comfd, comfd, comfd,
+			   &pid);
+	if (rc < 0)
+		ERR("cannot spawn %s (%s)\n", sa.argv ? sa.argv[0] : "grub",
+		    strerror(errno));
+	spawn_args_clear(&sa);
+	if (comfd >= 0)
+		close(comfd);
+	if (cmd != NULL)
+		close(ifd[1]);
+
+	if (rc < 0) {
+		if (cmd != NULL)
 			close(ifd[0]);
-			dup2(ifd[1], 0);
-		}
-		if (doredirect)
-			redirect_to_com(vm, (cmd == NULL));
-
-		fp = open_memstream(&bp, &len);
-		if (fp == NULL) {
-			ERR("cannot open memstrem (%s)\n", strerror(errno));
-			exit(1);
-		}
-		flockfile(fp);
-
-		setenv("TERM", "vt100", 1);
-		fprintf(fp, LOCALBASE"/sbin/grub-bhyve\n");
-		if (conf->wired_memory == true)
-			fprintf(fp, "-S\n");
-		fprintf(fp, "-r\n");
-		if (conf->install)
-			fprintf(fp, "cd0\n");
-		else if (conf->grub_run_partition)
-			fprintf(fp, "hd0,%s\n", conf->grub_run_partition);
-		else
-			fprintf(fp, "hd0,1\n");
-		fprintf(fp, "-M\n");
-		fprintf(fp, "%s\n", conf->memory);
-		fprintf(fp, "-m\n");
-		fprintf(fp, "%s\n", vm->mapfile);
-		fprintf(fp, "%s\n", conf->name);
-		funlockfile(fp);
-		fclose(fp);
-
-		argv = split_args(bp);
-		if (argv == NULL) {
-			ERR("malloc: %s\n", strerror(errno));
-			exit(1);
-		}
-		execv(argv[0], argv);
-		ERR("cannot exec %s\n", argv[0]);
-		exit(1);
-	} else {
-		ERR("cannot fork (%s)\n", strerror(errno));
+		free(cmd);
 		return -1;
 	}
 
+	vm->pid = pid;
+	vm->state = LOAD;
+	vm->infd = (cmd != NULL) ? ifd[0] : -1;
+	vm->outfd = -1;
+	vm->errfd = -1;
+	if (cmd != NULL) {
+		write(ifd[0], cmd, len + 1);
+		free(cmd);
+	}
+
 	return 0;
 }
 
+static void
+build_bhyveload_args(struct vm *vm, struct spawn_args *sa)
+{
+	struct bhyveload_env *be;
+	struct vm_conf *conf = vm->conf;
+
+	spawn_args_add(sa, "/usr/sbin/bhyveload");
+	if (conf->wired_memory == true)
+		spawn_args_add(sa, "-S");
+	if (conf->single_user) {
+		spawn_args_add(sa, "-e");
+		spawn_args_add(sa, "boot_single=YES");
+	}
+	STAILQ_FOREACH (be, &conf->bhyveload_envs, next) {
+		spawn_args_add(sa, "-e");
+		spawn_args_add(sa, &be->env[0]);
+	}
+	if (conf->bhyveload_loader) {
+		spawn_args_add(sa, "-l");
+		spawn_args_add(sa, conf->bhyveload_loader);
+	}
+	spawn_args_add(sa, "-c");
+	spawn_args_add(sa, (vm->assigned_comport != NULL)
+	    ? vm->assigned_comport
+	    : "stdio");
+	spawn_args_add(sa, "-m");
+	spawn_args_add(sa, conf->memory);
+	spawn_args_add(sa, "-d");
+	spawn_args_add(sa, (conf->install)
+	    ? STAILQ_FIRST(&conf->isoes)->path
+	    : STAILQ_FIRST(&conf->disks)->path);
+	spawn_args_add(sa, conf->name);
+}
+
 static int
 bhyve_load(struct vm *vm)
 {
 	pid_t pid;
 	int outfd[2], errfd[2];
-	struct bhyveload_env *be;
-	struct vm_conf *conf = vm->conf;
+	struct vm_args *va;
 	bool dopipe = (vm->assigned_comport == NULL) ||
 	    (strcasecmp(vm->assigned_comport, "stdio") != 0);
 
+	if ((va = get_vm_args(vm)) == NULL) {
+		ERR("%s\n", "cannot allocate memory");
+		return -1;
+	}
+	if (va->bhyveload.argc == 0)
+		build_bhyveload_args(vm, &va->bhyveload);
+
 	if (dopipe) {
-		if (pipe(outfd) < 0) {
+		if (pipe2(outfd, O_CLOEXEC) < 0) {
 			ERR("cannot create pipe (%s)\n", strerror(errno));
 			return (-1);
 		}
 
-		if (pipe(errfd) < 0) {
+		if (pipe2(errfd, O_CLOEXEC) < 0) {
 			ERR("cannot create pipe (%s)\n", strerror(errno));
 			close(outfd[0]);
 			close(outfd[1]);
@@ -391,83 +426,29 @@ bhyve_load(struct vm *vm)
 		}
 	}
 
-	pid = fork();
-	if (pid > 0) {
-		if (dopipe) {
-			close(outfd[1]);
-			close(errfd[1]);
-			vm->outfd = outfd[0];
-			vm->errfd = errfd[0];
-		}
-		vm->pid = pid;
-		vm->state = LOAD;
-		return 0;
-	} else if (pid == 0) {
-		char **argv;
-		FILE *fp;
-		char *bp;
-		size_t len;
-
-		if (dopipe) {
-			close(outfd[0]);
-			close(errfd[0]);
-			dup2(outfd[1], 1);
-			dup2(errfd[1], 2);
-		}
-		fp = open_memstream(&bp, &len);
-		if (fp == NULL) {
-			ERR("cannot open memstrem (%s)\n", strerror(errno));
-			exit(1);
-		}
-		flockfile(fp);
-
-		fprintf(fp, "/usr/sbin/bhyveload\n");
-		if (conf->wired_memory == true)
-			fprintf(fp, "-S\n");
-		if (conf->single_user) {
-			fprintf(fp, "-e\n");
-			fprintf(fp, "boot_single=YES\n");
-		}
-		STAILQ_FOREACH (be, &conf->bhyveload_envs, next) {
-			fprintf(fp, "-e\n");
-			fprintf(fp, "%s\n", &be->env[0]);
-		}
-		if (conf->bhyveload_loader) {
-			fprintf(fp, "-l\n");
-			fprintf(fp, "%s\n", conf->bhyveload_loader);
-		}
-		fprintf(fp, "-c\n");
-		fprintf(fp, "%s\n", (vm->assigned_comport != NULL)
-		    ? vm->assigned_comport
-		    : "stdio");
-		fprintf(fp, "-m\n");
-		fprintf(fp, "%s\n", conf->memory);
-		fprintf(fp, "-d\n");
-		fprintf(fp, "%s\n", (conf->install)
-		    ? STAILQ_FIRST(&conf->isoes)->path
-		    : STAILQ_FIRST(&conf->disks)->path);
-		fprintf(fp, "%s\n", conf->name);
-		funlockfile(fp);
-		fclose(fp);
-
-		argv = split_args(bp);
-		if (argv == NULL) {
-			ERR("malloc %s\n", strerror(errno));
-			exit(1);
-		}
-		execv(argv[0], argv);
-		ERR("cannot exec %s\n", argv[0]);
-		exit(1);
-	} else {
-		ERR("cannot fork (%s)\n", strerror(errno));
+	if (spawn_process(&va->bhyveload, -1, dopipe ? outfd[1] : -1,
+			  dopipe ? errfd[1] : -1, &pid) < 0) {
+		ERR("cannot spawn bhyveload (%s)\n", strerror(errno));
 		if (dopipe) {
 			close(outfd[0]);
 			close(outfd[1]);
 			close(errfd[0]);
 			close(errfd[1]);
 		}
+		/* build again on the next try */
+		spawn_args_clear(&va->bhyveload);
 		return (-1);
 	}
+
+	if (dopipe) {
+		close(outfd[1]);
+		close(errfd[1]);
+		vm->outfd = outfd[0];
+		vm->errfd = errfd[0];
+	}
+	vm->pid = pid;
+	vm->state = LOAD;
+	return 0;
 }
 
 int
@@ -554,8 +535,8 @@ err:
 	return -1;
 }
 
-static int
-exec_bhyve(struct vm *vm)
+static void
+build_bhyve_args(struct vm *vm, struct spawn_args *sa)
 {
 	struct vm_conf *conf = vm->conf;
 	struct passthru_conf *pc;
@@ -563,158 +544,155 @@ exec_bhyve(struct vm *vm)
 	struct iso_conf *ic;
 	struct net_conf *nc;
 	struct bhyve_env *be;
-	pid_t pid;
 	int pcid;
+	char *fbuf;
+
+	STAILQ_FOREACH (be, &conf->bhyve_envs, next)
+		if (spawn_args_setenv(sa, be->env) < 0 && ! sa->error)
+			ERR("invalid environment: %s\n", be->env);
+
+	spawn_args_add(sa, "/usr/sbin/bhyve");
+	spawn_args_add(sa, "-A");
+	spawn_args_add(sa, "-H");
+	spawn_args_add(sa, "-w");
+	if (conf->utctime == true)
+		spawn_args_add(sa, "-u");
+	if (conf->wired_memory == true)
+		spawn_args_add(sa, "-S");
+	if (conf->debug_port != NULL) {
+		spawn_args_add(sa, "-G");
+		spawn_args_add(sa, conf->debug_port);
+	}
+	spawn_args_add(sa, "-c");
+	spawn_args_add(sa, conf->ncpu);
+	spawn_args_add(sa, "-m");
+	spawn_args_add(sa, conf->memory);
+	if (vm->assigned_comport != NULL) {
+		spawn_args_add(sa, "-l");
+		spawn_args_addf(sa, "com1,%s", vm->assigned_comport);
+	}
+
+	if (conf->keymap != NULL) {
+		spawn_args_add(sa, "-K");
+		spawn_args_add(sa, conf->keymap);
+	}
+	if (strcasecmp(conf->loader, "uefi") == 0) {
+		spawn_args_add(sa, "-l");
+		if (vm->varsfile)
+			spawn_args_addf(sa, "bootrom,"UEFI_FIRMWARE",%s",
+					vm->varsfile);
+		else
+			spawn_args_add(sa, "bootrom,"UEFI_FIRMWARE);
+
+	} else if (strcasecmp(conf->loader, "csm") == 0) {
+		spawn_args_add(sa, "-l");
+		spawn_args_add(sa, "bootrom,"UEFI_CSM_FIRMWARE);
+	}
+	spawn_args_add(sa, "-s");
+	switch (conf->hostbridge) {
+	case NONE:
+		break;
+	case INTEL:
+		spawn_args_add(sa, "0,hostbridge");
+		break;
+	case AMD:
+		spawn_args_add(sa, "0,amd_hostbridge");
+		break;
+	}
+	spawn_args_add(sa, "-s");
+	spawn_args_add(sa, "1,lpc");
+
+	pcid = 2;
+	STAILQ_FOREACH (dc, &conf->disks, next) {
+		spawn_args_add(sa, "-s");
+		spawn_args_addf(sa, "%d,%s,%s", pcid++, dc->type, dc->path);
+	}
+	STAILQ_FOREACH (ic, &conf->isoes, next) {
+		spawn_args_add(sa, "-s");
+		spawn_args_addf(sa, "%d,%s,%s", pcid++, ic->type, ic->path);
+	}
+	STAILQ_FOREACH (nc, &vm->taps, next) {
+		spawn_args_add(sa, "-s");
+		spawn_args_addf(sa, "%d,%s,%s", pcid++, nc->type, nc->tap);
+	}
+	STAILQ_FOREACH (pc, &conf->passthrues, next) {
+		spawn_args_add(sa, "-s");
+		spawn_args_addf(sa, "%d,passthru,%s", pcid++, pc->devid);
+	}
+	if (conf->fbuf->enable) {
+		spawn_args_add(sa, "-s");
+		if ((fbuf = get_fbuf_option(pcid++, conf->fbuf)) == NULL)
+			sa->error = true;
+		else
+			spawn_args_add(sa, fbuf);
+		free(fbuf);
+	}
+	if (conf->mouse) {
+		spawn_args_add(sa, "-s");
+		spawn_args_addf(sa, "%d,xhci,tablet", pcid++);
+	}
+	spawn_args_add(sa, conf->name);
+}
+
+static int
+exec_bhyve(struct vm *vm)
+{
+	pid_t pid;
 	int outfd[2], errfd[2];
-	char **args;
-	char *buf = NULL;
-	size_t buf_size;
-	FILE *fp;
+	struct vm_args *va;
+	char *cmdline;
 	bool dopipe = ((vm->assigned_comport == NULL) ||
 	    (strcasecmp(vm->assigned_comport, "stdio") != 0));
 
+	if ((va = get_vm_args(vm)) == NULL) {
+		ERR("%s\n", "cannot allocate memory");
+		return -1;
+	}
+	if (va->bhyve.argc == 0)
+		build_bhyve_args(vm, &va->bhyve);
+
 	if (dopipe) {
-		if (pipe(outfd) < 0) {
+		if (pipe2(outfd, O_CLOEXEC) < 0) {
 			ERR("cannot create pipe (%s)\n", strerror(errno));
 			return -1;
 		}
 
-		if (pipe(errfd) < 0) {
+		if (pipe2(errfd, O_CLOEXEC) < 0) {
 			ERR("cannot create pipe (%s)\n", strerror(errno));
 			close(outfd[0]);
 			close(outfd[1]);
 			return -1;
 		}
-	}
 
-	pid = fork();
-	if (pid > 0) {
-		/* parent process */
-		if (dopipe) {
-			close(outfd[1]);
-			close(errfd[1]);
-			vm->outfd = outfd[0];
-			vm->errfd = errfd[0];
+		/* XXX */
+		if ((cmdline = spawn_args_join(&va->bhyve)) != NULL) {
+			dprintf(outfd[1], "%s\n", cmdline);
+			free(cmdline);
 		}
-		vm->pid = pid;
-		vm->state = RUN;
-	} else if (pid == 0) {
-		/* child process */
+	}
+
+	if (spawn_process(&va->bhyve, -1, dopipe ? outfd[1] : -1,
+			  dopipe ? errfd[1] : -1, &pid) < 0) {
+		ERR("cannot spawn bhyve (%s)\n", strerror(errno));
 		if (dopipe) {
 			close(outfd[0]);
+			close(outfd[1]);
 			close(errfd[0]);
-			dup2(outfd[1], 1);
-			dup2(errfd[1], 2);
-		}
-
-		STAILQ_FOREACH (be, &conf->bhyve_envs, next)
-			if (putenv(be->env) < 0)
-				ERR("invalid environment: %s", be->env);
-
-		fp = open_memstream(&buf, &buf_size);
-		if (fp == NULL) {
-			ERR("cannot open memstrem (%s)\n", strerror(errno));
-			exit(1);
-		}
-		flockfile(fp);
-
-		WRITE_STR(fp, "/usr/sbin/bhyve");
-		WRITE_STR(fp, "-A");
-		WRITE_STR(fp, "-H");
-		WRITE_STR(fp, "-w");
-		if (conf->utctime == true)
-			WRITE_STR(fp, "-u");
-		if (conf->wired_memory == true)
-			WRITE_STR(fp, "-S");
-		if (conf->debug_port != NULL) {
-			WRITE_STR(fp, "-G");
-			WRITE_STR(fp, conf->debug_port);
-		}
-		WRITE_STR(fp, "-c");
-		WRITE_STR(fp, conf->ncpu);
-		WRITE_STR(fp, "-m");
-		WRITE_STR(fp, conf->memory);
-		if (vm->assigned_comport != NULL) {
-			WRITE_STR(fp, "-l");
-			WRITE_FMT(fp, "com1,%s", vm->assigned_comport);
-		}
-
-		if (conf->keymap != NULL) {
-			WRITE_STR(fp, "-K");
-			WRITE_STR(fp, conf->keymap);
-		}
-		if (strcasecmp(conf->loader, "uefi") == 0) {
-			WRITE_STR(fp, "-l");
-			if (vm->varsfile)
-				WRITE_FMT(fp, "bootrom,"UEFI_FIRMWARE",%s",
-					  vm->varsfile);
-			else
-				WRITE_STR(fp, "bootrom,"UEFI_FIRMWARE);
-
-		} else if (strcasecmp(conf->loader, "csm") == 0) {
-			WRITE_STR(fp, "-l");
-			WRITE_STR(fp, "bootrom,"UEFI_CSM_FIRMWARE);
-		}
-		WRITE_STR(fp, "-s");
-		switch (conf->hostbridge) {
-		case NONE:
-			break;
-		case INTEL:
-			WRITE_STR(fp, "0,hostbridge");
-			break;
-		case AMD:
-			WRITE_STR(fp, "0,amd_hostbridge");
-			break;
-		}
-		WRITE_STR(fp, "-s");
-		WRITE_STR(fp, "1,lpc");
-
-		pcid = 2;
-		STAILQ_FOREACH (dc, &conf->disks, next) {
-			WRITE_STR(fp, "-s");
-			WRITE_FMT(fp, "%d,%s,%s", pcid++, dc->type, dc->path);
-		}
-		STAILQ_FOREACH (ic, &conf->isoes, next) {
-			WRITE_STR(fp, "-s");
-			WRITE_FMT(fp, "%d,%s,%s", pcid++, ic->type, ic->path);
-		}
-		STAILQ_FOREACH (nc, &vm->taps, next) {
-			WRITE_STR(fp, "-s");
-			WRITE_FMT(fp, "%d,%s,%s", pcid++, nc->type, nc->tap);
-		}
-		STAILQ_FOREACH (pc, &conf->passthrues, next) {
-			WRITE_STR(fp, "-s");
-			WRITE_FMT(fp, "%d,passthru,%s", pcid++, pc->devid);
-		}
-		if (conf->fbuf->enable) {
-			WRITE_STR(fp, "-s");
-			WRITE_STR(fp, get_fbuf_option(pcid++, conf->fbuf));
-		}
-		if (conf->mouse) {
-			WRITE_STR(fp, "-s");
-			WRITE_FMT(fp, "%d,xhci,tablet", pcid++);
+			close(errfd[1]);
 		}
-		WRITE_STR(fp, conf->name);
-		WRITE_STR(fp, NULL);
+		/* build again on the next try */
+		spawn_args_clear(&va->bhyve);
+		return -1;
+	}
 
-		funlockfile(fp);
-		fclose(fp);
-		if (dopipe) {
-			/* XXX */
-			for (args = (char**)(void *)buf; *args != NULL; args++)
-				printf("%s ", *args);
-			printf("\n");
-			fflush(stdout);
-		}
-		/* XXX */
-		args = (char **)(void *)buf;
-		execv(args[0], args);
-		ERR("cannot exec %s\n", args[0]);
-		exit(1);
-	} else {
-		ERR("cannot fork (%s)\n", strerror(errno));
-		exit(1);
+	if (dopipe) {
+		close(outfd[1]);
+		close(errfd[1]);
+		vm->outfd = outfd[0];
+		vm->errfd = errfd[0];
 	}
+	vm->pid = pid;
+	vm->state = RUN;
 
 	return 0;
 }
@@ -821,6 +799,7 @@ cleanup_bhyve(struct vm *vm, nvlist_t *pl_conf __unused)
 	VM_CLOSE_FD(logfd);
 #undef VM_CLOSE_FD
 	destroy_bhyve(vm);
+	free_vm_args(vm);
 	if (vm->mapfile) {
 		unlink(vm->mapfile);
 		free(vm->mapfile);
@@ -11,7 +11,6 @@ int activate_taps(struct vm *);
 int assign_taps(struct vm *);
 int write_err_log(int , struct vm *);
 int write_mapfile(struct vm_conf *, char **);
-char **split_args(char *);
 
 /* Implemented in tap.c */
 int add_to_bridge(int , const char *, const char *);